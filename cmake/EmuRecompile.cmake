@@ -0,0 +1,31 @@
+# emu_add_recompiled_rom(<target> <rom> [ENTRY <hex address>])
+#
+# Statically recompile a raw ROM image with emu_recompile and build the generated code into a dedicated executable
+# named <target>. The generated code and Recompiled::tick() also go into a static library, <target>_code, that links
+# against the emulator core like any other program, so that tests can run the recompiled image too.
+#
+# The generated code is built optimised. Its calls to Cpu::execute() with constant opcodes are only specialised if the
+# core is built with link time optimisation as well, as with CMAKE_INTERPROCEDURAL_OPTIMIZATION.
+function(emu_add_recompiled_rom target rom)
+    cmake_parse_arguments(ARG "" "ENTRY" "" ${ARGN})
+    if(NOT ARG_ENTRY)
+        set(ARG_ENTRY 0)
+    endif()
+
+    set(generated ${CMAKE_CURRENT_BINARY_DIR}/${target}_blocks.cpp)
+    add_custom_command(
+        OUTPUT ${generated}
+        COMMAND emu_recompile -r ${rom} -o ${generated} -ip ${ARG_ENTRY}
+        DEPENDS emu_recompile ${rom}
+        COMMENT "Recompiling ${rom}"
+        VERBATIM)
+
+    add_library(${target}_code STATIC ${generated} ${PROJECT_SOURCE_DIR}/src/recompiled.cpp)
+    target_compile_definitions(${target}_code PRIVATE DEBUG=0)
+    target_compile_options(${target}_code PRIVATE -Wall -O2 -Wextra -Werror -Wshadow -Wpedantic -Wconversion)
+    target_link_libraries(${target}_code PUBLIC ${PROJECT_NAME}_lib)
+
+    add_executable(${target} ${PROJECT_SOURCE_DIR}/src/recompiled_main.cpp)
+    target_compile_options(${target} PRIVATE -Wall -O2 -Wextra -Werror -Wshadow -Wpedantic -Wconversion)
+    target_link_libraries(${target} ${target}_code)
+endfunction()
@@ -0,0 +1,158 @@
+#ifndef APU_H
+#define APU_H
+
+#include <array>
+#include <cstdint>
+
+#include "apu_synth.hpp"
+#include "spsc_queue.hpp"
+
+/** The NES audio processing unit (2A03): two pulse channels, a triangle, noise, the delta modulation channel (DMC)
+ * and the frame counter, at $4000-$4017. Sprite DMA ($4014) and the controller ports ($4016, $4017) share the page, as
+ * they do the chip.
+ *
+ * Like the PPU it runs lazily, caught up to the CPU when one of its registers is accessed and at each frame counter
+ * step. Channels aren't stepped cycle by cycle: the APU jumps from one timer expiry to the next, and every change of
+ * the mixed output goes into a band-limited step buffer at its exact time. That buffer produces 48 kHz samples, which
+ * go into a lock-free ring for an audio device or a WAV file writer to consume.
+ */
+namespace Apu
+{
+    constexpr int sample_rate = 48000;
+
+    /** IRQ lines, as passed to Cpu::set_irq(). */
+    constexpr uint32_t frame_irq_line = 0x02;
+    constexpr uint32_t dmc_irq_line = 0x04;
+
+    /** CPU cycles that sprite DMA ($4014) stalls the CPU for, one more if it starts on an odd cycle. */
+    constexpr int dma_cycles = 513;
+
+    /** Volume envelope shared by the pulse and noise channels. */
+    struct Envelope
+    {
+        bool start = false;
+        bool loop = false;
+        bool constant = false;
+        uint8_t volume = 0;
+        uint8_t divider = 0;
+        uint8_t decay = 0;
+    };
+
+    struct Pulse
+    {
+        Envelope envelope;
+        uint8_t duty = 0;
+        /** Position in the 8-step duty sequence. */
+        uint8_t step = 0;
+        uint16_t period = 0;
+        uint8_t length = 0;
+        bool halt = false;
+
+        bool sweep_enabled = false;
+        bool sweep_negate = false;
+        bool sweep_reload = false;
+        uint8_t sweep_period = 0;
+        uint8_t sweep_shift = 0;
+        uint8_t sweep_divider = 0;
+
+        /** CPU cycle at which the timer next expires. */
+        uint64_t next = 0;
+    };
+
+    struct Triangle
+    {
+        uint8_t step = 0;
+        uint16_t period = 0;
+        uint8_t length = 0;
+        /** Also the linear counter's control flag. */
+        bool halt = false;
+        uint8_t linear_reload = 0;
+        uint8_t linear = 0;
+        bool linear_reload_flag = false;
+        uint64_t next = 0;
+    };
+
+    struct Noise
+    {
+        Envelope envelope;
+        bool mode = false;
+        uint16_t shift = 1;
+        uint8_t period_index = 0;
+        uint8_t length = 0;
+        bool halt = false;
+        uint64_t next = 0;
+    };
+
+    struct Dmc
+    {
+        bool irq_enabled = false;
+        bool loop = false;
+        uint8_t rate_index = 0;
+        uint8_t level = 0;
+        uint16_t sample_address = 0xC000;
+        uint16_t sample_length = 1;
+
+        uint16_t address = 0xC000;
+        uint16_t bytes_remaining = 0;
+        uint8_t buffer = 0;
+        bool buffer_full = false;
+        uint8_t shift = 0;
+        uint8_t bits_remaining = 8;
+        bool silence = true;
+        uint64_t next = 0;
+    };
+
+    struct State
+    {
+        std::array<Pulse, 2> pulse;
+        Triangle triangle;
+        Noise noise;
+        Dmc dmc;
+
+        /** Channels enabled through $4015. */
+        uint8_t enabled = 0;
+        bool five_step = false;
+        bool irq_inhibit = false;
+        bool frame_irq = false;
+        bool dmc_irq = false;
+
+        /** CPU cycle the APU has been run up to. */
+        uint64_t time = 0;
+        /** CPU cycle at which the current frame counter sequence started, and the step it is at. */
+        uint64_t sequence_start = 0;
+        int sequence_step = 0;
+    };
+
+    inline State state;
+
+    /** Everything about the APU that running it changes, as saved by snapshot(). */
+    struct Snapshot
+    {
+        State state;
+        float output = 0.0f;
+        uint64_t pending = 0;
+        Synth::Snapshot synth;
+    };
+
+    /** Output samples, signed 16-bit mono at sample_rate. */
+    using SampleQueue = SpscQueue<int16_t, 1 << 16>;
+    inline SampleQueue samples;
+    /** Samples dropped because the queue was full. */
+    inline uint64_t dropped_samples = 0;
+    /** While set, samples are made as usual but thrown away instead of queued, as for frames that are run and then
+     * undone. */
+    inline bool muted = false;
+
+    uint8_t read_register(const uint16_t address);
+    void write_register(const uint16_t address, const uint8_t data);
+    void catch_up(const uint64_t cycle);
+    void oam_dma(const uint8_t page);
+    void attach();
+    void detach();
+    void snapshot(Snapshot &into);
+    bool valid(const Snapshot &snapshot);
+    void restore(const Snapshot &snapshot);
+    void reschedule();
+}
+
+#endif
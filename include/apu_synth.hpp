@@ -0,0 +1,31 @@
+#ifndef APU_SYNTH_H
+#define APU_SYNTH_H
+
+#include <cstdint>
+#include <vector>
+
+/** Band-limited synthesis of the APU's output. Each change of the output level is added as a windowed-sinc step at its
+ * exact time, in fractions of a 48 kHz sample, so the result has no aliasing and costs nothing between changes.
+ * Finished samples go into Apu::samples.
+ */
+namespace Apu::Synth
+{
+    /** Output not produced yet and the filters' memory, as saved by snapshot(). */
+    struct Snapshot
+    {
+        std::vector<float> buffer;
+        uint64_t origin_cycle = 0;
+        uint64_t origin_fraction = 0;
+        float level = 0.0f;
+        float highpass_input = 0.0f;
+        float highpass_output = 0.0f;
+    };
+
+    void reset(const uint64_t cycle, const float level);
+    void add_step(const uint64_t cycle, const float delta);
+    void end_samples(const uint64_t cycle);
+    void snapshot(Snapshot &into);
+    void restore(const Snapshot &snapshot);
+}
+
+#endif
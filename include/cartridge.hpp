@@ -0,0 +1,86 @@
+#ifndef CARTRIDGE_H
+#define CARTRIDGE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ppu.hpp"
+
+/** NES cartridges in iNES and NES 2.0 files, with mappers 0-4 (NROM, MMC1, UxROM, CNROM and MMC3).
+ *
+ * PRG ROM is never copied into the address space. $8000-$FFFF is backed directly by the ROM through Memory::pages,
+ * and a bank switch only points those pages at another part of it, so reads stay plain memory reads. The pages are
+ * attached to the mapper as a device with their read pointers left in place: only writes, which go to the mapper's
+ * registers, take the device path. CHR banks are switched the same way, through Ppu::switch_chr_bank().
+ */
+namespace Cartridge
+{
+    /** What a file's header says about the cartridge. */
+    struct Header
+    {
+        bool nes2 = false;
+        int mapper = 0;
+        int submapper = 0;
+        size_t prg_rom_size = 0;
+        /** 0 for a cartridge with CHR RAM instead. */
+        size_t chr_rom_size = 0;
+        /** RAM at $6000-$7FFF. */
+        size_t prg_ram_size = 0;
+        size_t chr_ram_size = 0;
+        /** Whether PRG RAM is kept by a battery, so it should be saved. */
+        bool battery = false;
+        /** Whether 512 bytes for $7000-$71FF come before PRG ROM. */
+        bool trainer = false;
+        Ppu::Mirroring mirroring = Ppu::Mirroring::HORIZONTAL;
+    };
+
+    /** Mapper registers. Each mapper uses the ones it has. */
+    struct Registers
+    {
+        /** MMC1 serial port: the bits shifted in so far, behind a 1 that marks when five have been. */
+        uint8_t shift = 0x10;
+        uint8_t control = 0x0C;
+        std::array<uint8_t, 2> chr_select{};
+        /** The selected PRG bank, for every mapper that has one. */
+        uint8_t prg_select = 0;
+
+        /** MMC3 bank select ($8000) and the eight bank registers. */
+        uint8_t bank_select = 0;
+        std::array<uint8_t, 8> banks{0, 2, 4, 5, 6, 7, 0, 1};
+        uint8_t irq_latch = 0;
+        uint8_t irq_counter = 0;
+        bool irq_reload = false;
+        bool irq_enabled = false;
+    };
+
+    inline Header header;
+    inline Registers registers;
+
+    /** The mapper's state, as saved by snapshot(). PRG RAM is ordinary memory and isn't part of it. */
+    struct Snapshot
+    {
+        Registers registers;
+        Ppu::Mirroring mirroring = Ppu::Mirroring::HORIZONTAL;
+    };
+    inline std::vector<uint8_t> prg_rom;
+    inline std::vector<uint8_t> prg_ram;
+
+    /** File battery-backed RAM is loaded from and saved to. */
+    inline std::string save_file;
+
+    /** IRQ line of the MMC3, as passed to Cpu::set_irq(). */
+    constexpr uint32_t irq_line = 0x08;
+
+    bool parse_header(const std::vector<uint8_t> &image, Header &result);
+    bool load(const std::vector<uint8_t> &image);
+    bool load_file(const std::string &filename);
+    void unload();
+    void snapshot(Snapshot &into);
+    bool valid(const Snapshot &snapshot);
+    void restore(const Snapshot &snapshot);
+}
+
+#endif
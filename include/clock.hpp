@@ -0,0 +1,51 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "input_parser.hpp"
+
+/** Clock profiles. Frequencies and frame rates are exact rationals, and the end of frame k is always computed from k
+ * itself rather than by adding up per-frame amounts, so neither emulated nor wall-clock time drifts however long the
+ * emulator runs. Frames get a whole number of cycles each, with the fractions spread evenly across frames.
+ */
+namespace Clock
+{
+    /** A non-negative rational number. */
+    struct Rational
+    {
+        uint64_t numerator;
+        uint64_t denominator;
+
+        bool operator==(const Rational &) const = default;
+    };
+
+    struct Profile
+    {
+        std::string name;
+        /** CPU cycles per second. */
+        Rational cpu_frequency;
+        /** Frames per second. */
+        Rational frame_rate;
+    };
+
+    /** NTSC: 236.25 / 11 MHz master clock divided by 12, 29780.5 CPU cycles per frame on average (about 60.0988 Hz). */
+    inline const Profile ntsc{"ntsc", {39375000, 22}, {39375000, 655171}};
+
+    /** PAL: 26.601712 MHz master clock divided by 16, 33247.5 CPU cycles per frame (about 50.007 Hz). */
+    inline const Profile pal{"pal", {53203425, 32}, {53203425, 1063920}};
+
+    /** The profile Bus::run() paces itself by. */
+    inline Profile active = ntsc;
+
+    Rational reduce(const Rational &value);
+    Rational cycles_per_frame(const Profile &profile);
+    uint64_t frame_end(const Profile &profile, const uint64_t frame);
+    std::chrono::nanoseconds frame_time(const Profile &profile, const uint64_t frame);
+    bool parse_decimal(const std::string &text, Rational &value);
+    bool from_options(const InputParser &input, Profile &profile);
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <array>
+#include <cstdint>
+
+#include "spsc_queue.hpp"
+
+/** The two standard NES controllers, read a bit at a time through $4016 and $4017.
+ *
+ * A frontend doesn't set the buttons directly, since it usually runs on another thread than the emulation. It pushes
+ * an Event whenever a controller's buttons change, and the emulation thread calls sample() at the start of every
+ * frame, so the buttons only ever change between frames.
+ */
+namespace Controller
+{
+    /** Button bits, in the order the controller reports them. */
+    constexpr uint8_t button_a = 0x01;
+    constexpr uint8_t button_b = 0x02;
+    constexpr uint8_t button_select = 0x04;
+    constexpr uint8_t button_start = 0x08;
+    constexpr uint8_t button_up = 0x10;
+    constexpr uint8_t button_down = 0x20;
+    constexpr uint8_t button_left = 0x40;
+    constexpr uint8_t button_right = 0x80;
+
+    /** New state of all of one controller's buttons. */
+    struct Event
+    {
+        uint8_t port;
+        uint8_t buttons;
+    };
+
+    using EventQueue = SpscQueue<Event, 256>;
+    /** Written by the frontend, read by sample(). */
+    inline EventQueue events;
+
+    /** Buttons held on each controller, as of the last sample(). */
+    inline std::array<uint8_t, 2> buttons{};
+
+    /** Buttons and the shift registers, as saved by snapshot(). Queued events aren't part of it. */
+    struct Snapshot
+    {
+        std::array<uint8_t, 2> buttons{};
+        std::array<uint8_t, 2> shift{};
+        bool strobe = false;
+    };
+
+    void sample();
+    uint8_t read(const int port);
+    void write(const uint8_t data);
+    void snapshot(Snapshot &into);
+    void restore(const Snapshot &snapshot);
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "rewrite.hpp"
+
+/** Code coverage of the guest program: which bytes ran as opcodes and as operands, and which ways each conditional
+ * branch went, a bit per address in each of four bitmaps.
+ *
+ * Cpu::tick() fills the map Cpu::code_coverage points to, in a loop of its own that it only enters when the pointer is
+ * set, so without a map nothing is paid per instruction. Maps only ever gain bits, so maps from any number of runs
+ * merge by or-ing them, and merge_file() does that with a file under a lock, so that parallel runs of a test suite can
+ * share one file. report() prints an annotated disassembly.
+ */
+namespace Coverage
+{
+    struct Map
+    {
+        std::array<uint8_t, 8192> opcodes{};
+        std::array<uint8_t, 8192> operands{};
+        /** For conditional branches, at the opcode's address. */
+        std::array<uint8_t, 8192> taken{};
+        std::array<uint8_t, 8192> not_taken{};
+    };
+
+    /** Length of each instruction, as instruction_length() gives it, to look up once per instruction. */
+    inline constexpr std::array<uint8_t, 256> lengths = []()
+    {
+        std::array<uint8_t, 256> table{};
+        for (size_t opcode = 0; opcode < table.size(); opcode++)
+        {
+            table[opcode] = static_cast<uint8_t>(instruction_length(static_cast<uint8_t>(opcode)));
+        }
+        return table;
+    }();
+
+    /** \brief Check an address's bit in a bitmap. */
+    inline bool test(const std::array<uint8_t, 8192> &bits, const uint16_t address)
+    {
+        return bits[address >> 3] & (1 << (address & 7));
+    }
+
+    inline void set(std::array<uint8_t, 8192> &bits, const uint16_t address)
+    {
+        bits[address >> 3] |= static_cast<uint8_t>(1 << (address & 7));
+    }
+
+    /** \brief Note an instruction that has run.
+     * \param map The map.
+     * \param address Where it started.
+     * \param opcode Its opcode.
+     * \param next The instruction pointer after it ran.
+     */
+    inline void record(Map &map, const uint16_t address, const uint8_t opcode, const uint16_t next)
+    {
+        // Most instructions have run before, so the bitmaps are mostly only read.
+        if (!test(map.opcodes, address)) [[unlikely]]
+        {
+            set(map.opcodes, address);
+            for (uint16_t offset = 1; offset < lengths[opcode]; offset++)
+            {
+                set(map.operands, static_cast<uint16_t>(address + offset));
+            }
+        }
+        // BPL, BMI, BVC, BVS, BCC, BCS, BNE and BEQ. A branch to the next instruction counts as not taken.
+        if ((opcode & 0x1F) == 0x10)
+        {
+            set(next != static_cast<uint16_t>(address + 2) ? map.taken : map.not_taken, address);
+        }
+    }
+
+    void merge(Map &into, const Map &from);
+    bool merge_file(const std::string &filename, const Map &map);
+    bool read_file(const std::string &filename, Map &map);
+    void report(const Map &map, const std::array<uint8_t, 256 * 256> &memory, std::ostream &out);
+}
+
+#endif
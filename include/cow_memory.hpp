@@ -0,0 +1,79 @@
+#ifndef COW_MEMORY_H
+#define COW_MEMORY_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/** Copy-on-write address spaces. A space reads its pages from an immutable page table it may share with other spaces,
+ * its base, except for the pages it has written since it was last forked, which it keeps in sparse overrides of its
+ * own. Pages in neither read as zero from a single shared page.
+ *
+ * Forking a space that has overrides first folds them into a new base, which the parent and the fork then share, so a
+ * page is only copied, into an override, when a space writes to it. Forking a space that has none, such as a machine
+ * loaded once and forked many times, only takes another reference to its base. Many machines started from the same
+ * image therefore cost little more than the pages each of them has changed.
+ */
+namespace CowMemory
+{
+    using Page = std::array<uint8_t, 256>;
+
+    /** A page present in a space. */
+    struct Entry
+    {
+        uint8_t number;
+        std::shared_ptr<Page> data;
+    };
+
+    /** Pages shared by spaces, sorted by page number. Never changed once a space refers to it. */
+    struct Base
+    {
+        std::vector<Entry> entries;
+    };
+
+    /** An address space. */
+    struct Space
+    {
+        /** Pages shared with other spaces. May be null. */
+        std::shared_ptr<const Base> base;
+        /** Pages written since the space was last forked, sorted by page number. Only this space refers to them. */
+        std::vector<Entry> overrides;
+    };
+
+    /** Memory used by a space. */
+    struct Usage
+    {
+        /** Pages only this space refers to. */
+        size_t private_pages = 0;
+        /** Pages shared with at least one other space. */
+        size_t shared_pages = 0;
+        /** Bytes owned by this space: its bookkeeping plus its private pages. Shared pages aren't counted. */
+        size_t bytes = 0;
+    };
+
+    /** Totals over all spaces. */
+    struct Stats
+    {
+        uint64_t forks = 0;
+        /** Wall-clock time spent in fork(). */
+        uint64_t fork_nanoseconds = 0;
+        /** Pages copied because a shared page was written. */
+        uint64_t page_copies = 0;
+    };
+
+    inline Stats stats;
+
+    /** The space currently mapped into Memory, if any. */
+    inline Space *mapped = nullptr;
+
+    Space fork(Space &space);
+    uint8_t read(const Space &space, const uint16_t address);
+    void write(Space &space, const uint16_t address, const uint8_t data);
+    void map(Space &space);
+    void unmap();
+    Usage usage(const Space &space);
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <array>
+#include <cstdint>
+
+#include "rewrite.hpp"
+
+/** Breakpoints and watchpoints, marked a bit per address in a bitmap for each page, with a count per page of the marks
+ * in it.
+ *
+ * A breakpoint stops Cpu::tick() with ReturnCode::BREAKPOINT before the instruction at its address runs. tick() only
+ * looks for breakpoints while there are any, in a loop of its own like the one for code coverage, and even then only
+ * reads a bitmap for instructions in pages that have breakpoints. Recompiled code checks once per block, when it enters
+ * it, whether any address in the block has one. A run that starts at the breakpoint it last stopped at runs the
+ * instruction there instead of stopping again, so a stopped program can be resumed.
+ *
+ * A watchpoint stops tick() with ReturnCode::WATCHPOINT after the instruction that writes its address. Bus::write()
+ * tests the written page's count, so writes to other pages cost what they did before. A hit ends the slice as an
+ * interrupt does, by taking the CPU's cycles; finish() gives them back when the run returns. Only runs through tick(),
+ * run_block() and the embedding API stop; other callers of Cpu::step() must not leave watchpoints set.
+ */
+namespace Debugger
+{
+    /** Where a run stopped, and for a watchpoint what was written. */
+    struct Hit
+    {
+        /** Address of the breakpoint, or address written. */
+        uint16_t address = 0;
+        uint8_t data = 0;
+    };
+
+    inline std::array<std::array<uint8_t, 32>, 256> breakpoints{};
+    inline std::array<std::array<uint8_t, 32>, 256> watchpoints{};
+    /** Marks in each page. */
+    inline std::array<uint16_t, 256> breakpoint_pages{};
+    inline std::array<uint16_t, 256> watched_pages{};
+    inline int breakpoint_count = 0;
+
+    inline Hit last_hit;
+    /** Breakpoint the last run stopped at, or -1. */
+    inline int resume_address = -1;
+    /** Set when a watched address is written, with the cycles taken from the CPU to end the slice. */
+    inline bool watch_hit = false;
+    inline int held_cycles = 0;
+
+    inline bool test(const std::array<uint8_t, 32> &bits, const uint16_t address)
+    {
+        return bits[(address & 0xFF) >> 3] & (1 << (address & 7));
+    }
+
+    /** \brief Forget the breakpoint the last run stopped at, unless the run about to start is there. */
+    inline void start_run()
+    {
+        if (Cpu::instruction_pointer != resume_address)
+        {
+            resume_address = -1;
+        }
+    }
+
+    /** \brief Check for a breakpoint before an instruction in a page that has some.
+     * \param address Address of the instruction.
+     * \return True if the run should stop there.
+     */
+    inline bool stop_at(const uint16_t address)
+    {
+        if (!test(breakpoints[address >> 8], address))
+        {
+            return false;
+        }
+        if (address == resume_address)
+        {
+            resume_address = -1;
+            return false;
+        }
+        resume_address = address;
+        last_hit = Hit{address, 0};
+        return true;
+    }
+
+    /** \brief Check for a breakpoint anywhere in a block of code before running it.
+     * \param first Address of the block's first byte.
+     * \param last Address of its last byte.
+     */
+    inline bool in_block(const uint16_t first, const uint16_t last)
+    {
+        for (uint16_t address = first;; address++)
+        {
+            if (breakpoint_pages[address >> 8] != 0 && test(breakpoints[address >> 8], address))
+            {
+                return true;
+            }
+            if (address == last)
+            {
+                return false;
+            }
+        }
+    }
+
+    /** \brief Run one instruction through Cpu::step(), stopping first if there is a breakpoint at it. */
+    inline ReturnCode step()
+    {
+        const uint16_t address = Cpu::instruction_pointer;
+        if (breakpoint_pages[address >> 8] != 0 && stop_at(address))
+        {
+            return ReturnCode::BREAKPOINT;
+        }
+        return Cpu::step();
+    }
+
+    /** \brief Called by Bus::write() for a write to a page with watchpoints. */
+    inline void written(const uint16_t address, const uint8_t data)
+    {
+        if (test(watchpoints[address >> 8], address) && !watch_hit)
+        {
+            watch_hit = true;
+            last_hit = Hit{address, data};
+            held_cycles = Cpu::cycles_available;
+            Cpu::cycles_available = 0;
+        }
+    }
+
+    /** \brief Give back the cycles a watchpoint hit took, after the run it ended.
+     * \param code What the run returned.
+     * \return ReturnCode::WATCHPOINT if a watchpoint was hit and the run would otherwise have gone on, else code.
+     */
+    inline ReturnCode finish(const ReturnCode code)
+    {
+        if (!watch_hit)
+        {
+            return code;
+        }
+        watch_hit = false;
+        Cpu::cycles_available += held_cycles;
+        held_cycles = 0;
+        return code == ReturnCode::CONTINUE ? ReturnCode::WATCHPOINT : code;
+    }
+
+    bool set_breakpoint(const uint16_t address, const bool set = true);
+    bool set_watchpoint(const uint16_t address, const bool set = true);
+    void clear();
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef DIFFERENTIAL_H
+#define DIFFERENTIAL_H
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "rewrite.hpp"
+
+/** Differential testing of an execution engine against the reference interpreter, Cpu::tick().
+ *
+ * Both engines start from the same memory image and CPU state and are run in lockstep, a slice of a few cycles each
+ * in turn, and their registers and the memory pages either wrote are compared after every slice. The run stops at the
+ * first slice after which they differ, with both states and the slices that led up to it, so a fast path that breaks
+ * is found at the instruction that breaks it rather than frames later.
+ *
+ * Engines in this tree share the CPU's registers and Memory's page tables, so the two take turns on one thread rather
+ * than running on two. The candidate is run second and must leave the reference's state as it found it, as
+ * SoaEngine::tick() does. Memory is plain: no devices may be attached.
+ */
+namespace Differential
+{
+    /** An engine to compare with the reference. */
+    struct Engine
+    {
+        const char *name;
+        /** Set the machine up with a memory image and a CPU state. */
+        void (*load)(const std::vector<uint8_t> &image, const Cpu::State &state);
+        /** Add cycles to the machine's supply and run until it is spent, as Cpu::tick() does. */
+        ReturnCode (*tick)(const int cycles_to_add);
+        Cpu::State (*state)();
+        /** The machine's 64KB of memory. Pages it writes must be marked in Memory::written_generation, as Bus::write() does. */
+        const uint8_t *(*memory)();
+    };
+
+    /** SoaEngine, with two identical lanes so that its vector kernels run. */
+    extern const Engine soa_engine;
+
+    /** Number of slices kept for the report of a divergence. */
+    constexpr size_t history_length = 32;
+
+    /** A slice the reference ran: its state before, and the instruction it started at. */
+    struct Slice
+    {
+        Cpu::State state;
+        std::array<uint8_t, 3> instruction;
+    };
+
+    struct Result
+    {
+        bool diverged = false;
+        /** Slices run by both engines, including the one they differ after. */
+        uint64_t slices = 0;
+        /** Why each engine stopped, or ReturnCode::CONTINUE if the run hit its limit. */
+        ReturnCode reference_code = ReturnCode::CONTINUE;
+        ReturnCode candidate_code = ReturnCode::CONTINUE;
+        Cpu::State reference{};
+        Cpu::State candidate{};
+        /** First address whose contents differ, or -1. */
+        int address = -1;
+        uint8_t reference_byte = 0;
+        uint8_t candidate_byte = 0;
+        /** The slices leading up to the end of the run, oldest first. */
+        std::vector<Slice> history;
+    };
+
+    Result run(const Engine &candidate, const std::vector<uint8_t> &image, const Cpu::State &state, const uint64_t max_slices,
+               const int slice_cycles = 1);
+    void report(const Result &result, const Engine &candidate, std::ostream &out);
+}
+
+#endif
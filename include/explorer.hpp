@@ -0,0 +1,98 @@
+#ifndef EXPLORER_H
+#define EXPLORER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "rewrite.hpp"
+
+/** Exploration of every way a program can go under a set of input choices, to generate tests from.
+ *
+ * A target reads its input from a port. Every read of the port is a decision point: the machine is snapshotted just
+ * before the instruction that reads it, and the snapshot is run on once for each value the port may return. Paths end
+ * when the program stops with BRK or an unknown opcode, or has run a path's budget of cycles, and each way of ending
+ * is reported with the shortest inputs found that lead to it.
+ *
+ * Snapshots are hashed, registers and memory, and a state seen before isn't explored again, so that programs which
+ * forget their input, or poll for it in a loop, don't multiply their paths. The cycles a state has left aren't part
+ * of the hash: whichever path reaches a state first explores it. A snapshot keeps only the pages that differ from the
+ * target's image, a few for most programs, and knows its parent, so the inputs leading to it needn't be stored.
+ *
+ * As with the fuzzer, the CPU and memory are process-wide, so workers after the first are processes forked at the
+ * start. Snapshots go into an arena of memory shared by all of them, bounded by Options::memory, and each worker runs
+ * the newest of its own snapshots first while idle workers steal the oldest from the others, from Chase-Lev deques in
+ * the same memory. Workers share nothing else but the table of states seen, so exploration scales with cores.
+ */
+namespace Explorer
+{
+    /** Most values the port can be given a choice of. */
+    constexpr size_t max_choices = 255;
+    /** Most inputs kept for each way of ending. Longer paths keep their first inputs. */
+    constexpr size_t max_path = 256;
+
+    struct Target
+    {
+        /** Memory at the start. Shorter images are padded with zeros. */
+        std::vector<uint8_t> image;
+        Cpu::State state{};
+        /** Address of the input port. Its page may not hold anything the program reads through the stack. */
+        uint16_t input_address = 0;
+        /** Values a read of the port may return. */
+        std::vector<uint8_t> choices;
+        /** Cycles a path may take from the start before it is cut off. */
+        int max_cycles = 100000;
+    };
+
+    enum class Outcome
+    {
+        /** Stopped with BRK. */
+        EXIT,
+        UNKNOWN_INSTRUCTION,
+        /** Still running when the path's cycles ran out. */
+        CUTOFF
+    };
+
+    struct Options
+    {
+        /** Worker processes, or 0 for one per core. */
+        unsigned workers = 1;
+        /** Bytes of snapshots kept. States that don't fit aren't explored. */
+        size_t memory = size_t{64} << 20;
+    };
+
+    /** A way the program ended, told apart by outcome and address, with the shortest inputs found that lead to it. */
+    struct Ending
+    {
+        Outcome outcome;
+        /** Address of the BRK or unknown opcode. 0 for paths cut off. */
+        uint16_t address;
+        /** Inputs read on the way, in order. */
+        std::vector<uint8_t> inputs;
+        /** Number of inputs read, which may be more than inputs holds. */
+        uint32_t depth;
+    };
+
+    struct Result
+    {
+        /** Decision points explored, and reached again in a state already explored. */
+        uint64_t states = 0;
+        uint64_t duplicates = 0;
+        /** Paths that ended. */
+        uint64_t paths = 0;
+        /** States not explored because the memory or a worker's deque was full. */
+        uint64_t dropped = 0;
+        /** Snapshots taken from another worker's deque. */
+        uint64_t steals = 0;
+        uint64_t memory_used = 0;
+        unsigned workers = 0;
+        uint64_t nanoseconds = 0;
+        std::vector<Ending> endings;
+    };
+
+    bool run(const Target &target, const Options &options, Result &result);
+    void report(const Result &result, std::ostream &out);
+}
+
+#endif
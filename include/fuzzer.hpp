@@ -0,0 +1,92 @@
+#ifndef FUZZER_H
+#define FUZZER_H
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "rewrite.hpp"
+
+/** Coverage-guided fuzzing of 6502 routines, in the manner of AFL.
+ *
+ * A target is a memory image with an input buffer in it. Each execution resets memory, places a mutated input in the
+ * buffer and runs the routine until it stops or runs out of cycles. Branches, jumps, calls and returns count edges in
+ * Cpu::coverage while it runs, and an input that reaches an edge, or an edge count bucket, that no input reached before
+ * is kept in the corpus to mutate further. Executions that hit an unknown opcode, stop with BRK outside the target's
+ * code or never stop are reported with the input that caused them.
+ *
+ * Memory isn't reloaded between executions: only the pages Memory::written_generation says the last execution wrote are copied
+ * back from the image, so small routines run well over 100k times a second. Since the CPU and memory are process-wide,
+ * workers after the first run in processes of their own, forked once at the start, and share the map of edges seen so
+ * that none of them keeps inputs another already has covered.
+ */
+namespace Fuzzer
+{
+    /** Number of edge counters. */
+    constexpr size_t map_size = 1 << 16;
+    /** Largest input a target can take. */
+    constexpr size_t max_input_size = 1024;
+
+    struct Target
+    {
+        /** Memory at the start of every execution. Shorter images are padded with zeros. */
+        std::vector<uint8_t> image;
+        Cpu::State state{};
+        /** Where the input is placed, and its size. */
+        uint16_t input_address = 0;
+        uint16_t input_size = 0;
+        /** The routine's code. Stopping with BRK outside it means the instruction pointer ran away. */
+        uint16_t code_first = 0;
+        uint16_t code_last = 0xFFFF;
+        /** Cycles an execution may take before it counts as a hang. */
+        int max_cycles = 100000;
+    };
+
+    enum class Outcome
+    {
+        /** Stopped with BRK in the routine's code. */
+        EXIT,
+        UNKNOWN_INSTRUCTION,
+        /** Stopped with BRK outside the routine's code, having run off into data. */
+        RUNAWAY,
+        /** Still running after max_cycles. */
+        HANG
+    };
+
+    struct Options
+    {
+        /** Worker processes, or 0 for one per core. */
+        unsigned workers = 1;
+        /** Executions per worker. */
+        uint64_t executions = 100000;
+        uint64_t seed = 1;
+        /** Inputs to start from, besides all zeros. */
+        std::vector<std::vector<uint8_t>> seeds;
+    };
+
+    /** An input that made the routine fail, with where it stopped. Failures are told apart by outcome and address. */
+    struct Crash
+    {
+        Outcome outcome;
+        uint16_t address;
+        std::vector<uint8_t> input;
+    };
+
+    struct Result
+    {
+        uint64_t executions = 0;
+        /** Inputs kept for new coverage, by all workers. */
+        uint64_t corpus = 0;
+        /** Edge counter buckets seen. */
+        uint64_t coverage = 0;
+        uint64_t failures = 0;
+        unsigned workers = 0;
+        uint64_t nanoseconds = 0;
+        std::vector<Crash> crashes;
+    };
+
+    bool run(const Target &target, const Options &options, Result &result);
+    void report(const Result &result, std::ostream &out);
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef HLE_H
+#define HLE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "rewrite.hpp"
+
+/** High level emulation of guest subroutines. A hook binds the address of a subroutine to a native implementation,
+ * which runs in place of the guest code whenever a JSR targets that address. */
+namespace Hle
+{
+    /** A native implementation of a guest subroutine. It operates directly on Cpu and Memory state and must leave the
+     * machine as the guest subroutine would on return, except for the stack and the cycle count, which are handled by
+     * the caller. */
+    using Routine = void (*)();
+
+    /** A registered hook. */
+    struct Hook
+    {
+        /** The native implementation. */
+        Routine routine;
+        /** Cycles charged for the whole call, from the JSR up to and including the RTS. */
+        int cycles;
+    };
+
+    /** Record of a hooked call whose native and guest results differed in verification mode. */
+    struct Mismatch
+    {
+        /** Address of the hooked subroutine. */
+        uint16_t address;
+        /** CPU state after the native routine. */
+        Cpu::State native;
+        /** CPU state after the guest subroutine. */
+        Cpu::State guest;
+        /** Cycles declared for the hook. */
+        int native_cycles;
+        /** Cycles actually taken by the guest subroutine. */
+        int guest_cycles;
+        /** Addresses whose contents differed after the call. */
+        std::vector<uint16_t> memory_differences;
+        /** False if the guest subroutine did not return within the instruction limit. */
+        bool returned;
+    };
+
+    /** Number of registered hooks. The JSR handler only looks hooks up when this is non-zero. */
+    inline int hook_count = 0;
+
+    /** When true, each hooked call runs both the native routine and the guest subroutine, keeps the guest result, and
+     * records a Mismatch if the two differ. */
+    inline bool verify = false;
+
+    /** Maximum number of guest instructions run for one verified call before giving up on it returning. */
+    inline int verify_instruction_limit = 1000000;
+
+    void register_hook(const uint16_t address, const Routine routine, const int cycles);
+    void unregister_hook(const uint16_t address);
+    void clear();
+    bool call(const uint16_t target_address);
+    const std::vector<Mismatch> &mismatches();
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef LIBEMU_H
+#define LIBEMU_H
+
+/* Plain C binding of the embedding API in libemu.hpp. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef struct emu_machine emu_machine;
+
+    /** Reason a run call returned. Values match Emu::StopReason. */
+    typedef enum emu_stop_reason
+    {
+        EMU_STOP_CYCLES,
+        EMU_STOP_INSTRUCTIONS,
+        EMU_STOP_PC_REACHED,
+        EMU_STOP_WRITE_REACHED,
+        EMU_STOP_CYCLE_LIMIT,
+        EMU_STOP_BREAK,
+        EMU_STOP_UNKNOWN_INSTRUCTION,
+        EMU_STOP_BREAKPOINT,
+        EMU_STOP_WATCHPOINT
+    } emu_stop_reason;
+
+    /** CPU registers and flags. Flags are 0 or 1. */
+    typedef struct emu_registers
+    {
+        uint8_t a, x, y;
+        uint16_t sp, pc;
+        uint8_t c, z, i, d, b, v, n;
+    } emu_registers;
+
+    /** Memory used by one machine. Shared pages aren't counted in bytes. */
+    typedef struct emu_memory_usage_info
+    {
+        size_t private_pages;
+        size_t shared_pages;
+        size_t bytes;
+    } emu_memory_usage_info;
+
+    emu_machine *emu_create(void);
+    emu_machine *emu_fork(emu_machine *machine);
+    void emu_destroy(emu_machine *machine);
+    void emu_memory_usage(const emu_machine *machine, emu_memory_usage_info *usage);
+
+    int emu_load_image(emu_machine *machine, const uint8_t *data, size_t size, uint16_t address);
+    void emu_get_registers(emu_machine *machine, emu_registers *registers);
+    void emu_set_registers(emu_machine *machine, const emu_registers *registers);
+    uint8_t emu_peek(emu_machine *machine, uint16_t address);
+    void emu_poke(emu_machine *machine, uint16_t address, uint8_t data);
+    uint64_t emu_cycles(const emu_machine *machine);
+
+    emu_stop_reason emu_run_cycles(emu_machine *machine, uint64_t cycles);
+    emu_stop_reason emu_run_instructions(emu_machine *machine, uint64_t count);
+    emu_stop_reason emu_run_until_pc(emu_machine *machine, uint16_t address, uint64_t max_cycles);
+    emu_stop_reason emu_run_until_write(emu_machine *machine, uint16_t address, uint64_t max_cycles);
+
+    void emu_set_breakpoint(emu_machine *machine, uint16_t address, int set);
+    void emu_set_watchpoint(emu_machine *machine, uint16_t address, int set);
+    /** Breakpoint last stopped at, or address and byte written at the last watchpoint stopped at. */
+    void emu_last_hit(const emu_machine *machine, uint16_t *address, uint8_t *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef LIBEMU_H_CPP
+#define LIBEMU_H_CPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "debugger.hpp"
+#include "rewrite.hpp"
+
+/** Embedding API. A Machine is a complete CPU and memory that can be loaded and run in short, precisely bounded
+ * bursts. Nothing in this API writes to stdout.
+ *
+ * The interpreter works on the global Cpu and Memory state, so only one machine is active at a time. Running a machine
+ * other than the active one swaps its registers in and maps its memory, which costs a walk over its page list; running
+ * the same machine repeatedly costs nothing extra.
+ *
+ * Machine memory is copy-on-write (see cow_memory.hpp). fork() makes a machine that shares every page with the
+ * original, so many machines started from one loaded image only pay for the pages each of them changes.
+ *
+ * Each machine has its own breakpoints and watchpoints, which every run call stops at (see debugger.hpp). A fork starts
+ * with copies of its original's.
+ */
+namespace Emu
+{
+    struct Machine;
+
+    /** Reason a run call returned. */
+    enum class StopReason
+    {
+        /** run_cycles() used up its cycles. */
+        CYCLES,
+        /** run_instructions() executed its instructions. */
+        INSTRUCTIONS,
+        /** run_until_pc() reached its address. */
+        PC_REACHED,
+        /** run_until_write() saw its address written. */
+        WRITE_REACHED,
+        /** A run_until call used up its cycle limit first. */
+        CYCLE_LIMIT,
+        /** The CPU executed a BRK. */
+        BREAK,
+        /** The CPU reached an opcode it doesn't implement. */
+        UNKNOWN_INSTRUCTION,
+        /** The CPU reached a breakpoint set with set_breakpoint(). */
+        BREAKPOINT,
+        /** An instruction wrote to an address set with set_watchpoint(). last_hit() tells which. */
+        WATCHPOINT
+    };
+
+    /** Memory used by one machine. */
+    struct MemoryUsage
+    {
+        /** 256-byte pages only this machine refers to. */
+        size_t private_pages;
+        /** Pages shared with other machines. */
+        size_t shared_pages;
+        /** Bytes owned by this machine, including its private pages but not its shared ones. */
+        size_t bytes;
+    };
+
+    Machine *create();
+    Machine *fork(Machine &machine);
+    void destroy(Machine *machine);
+    MemoryUsage memory_usage(const Machine &machine);
+
+    bool load_image(Machine &machine, const uint8_t *data, const size_t size, const uint16_t address = 0);
+    Cpu::State get_state(Machine &machine);
+    void set_state(Machine &machine, const Cpu::State &state);
+    uint8_t peek(Machine &machine, const uint16_t address);
+    void poke(Machine &machine, const uint16_t address, const uint8_t data);
+    uint64_t cycles(const Machine &machine);
+
+    StopReason run_cycles(Machine &machine, const uint64_t cycles);
+    StopReason run_instructions(Machine &machine, const uint64_t count);
+    StopReason run_until_pc(Machine &machine, const uint16_t address, const uint64_t max_cycles = std::numeric_limits<uint64_t>::max());
+    StopReason run_until_write(Machine &machine, const uint16_t address, const uint64_t max_cycles = std::numeric_limits<uint64_t>::max());
+
+    void set_breakpoint(Machine &machine, const uint16_t address, const bool set = true);
+    void set_watchpoint(Machine &machine, const uint16_t address, const bool set = true);
+    Debugger::Hit last_hit(const Machine &machine);
+}
+
+#endif
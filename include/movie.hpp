@@ -0,0 +1,40 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/** Input movies: a recording of everything that came into a run from outside, from which the run can be replayed
+ * exactly. The only input from outside the machine is the controllers, and their buttons only change between frames,
+ * in Controller::sample(). A movie is the machine state the run started from, as Savestate::write() writes it, then
+ * every change of buttons with the frame and cycle it was applied at, and a hash of the machine after every frame.
+ *
+ * Playback loads the state, applies the same changes at the same frames and checks the hash after every frame, so a
+ * replay that isn't identical to the recording is caught at the first frame that differs. It ignores live input.
+ * Bus::run() calls start_frame() and end_frame() around every frame it runs.
+ */
+namespace Movie
+{
+    enum class Mode
+    {
+        OFF,
+        RECORDING,
+        PLAYING
+    };
+
+    inline Mode mode = Mode::OFF;
+    /** Frames recorded, or played back and found to match, since record() or play(). */
+    inline uint64_t frames = 0;
+    /** The frame at which playback stopped matching the recording, or 0. */
+    inline uint64_t diverged_frame = 0;
+
+    bool record(const std::string &filename);
+    bool play(const std::string &filename);
+    void start_frame();
+    bool end_frame();
+    void stop();
+    void report(std::ostream &out);
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+/** Frame pacing. The pacer sleeps until shortly before each frame deadline and spin-waits the rest of the way, which
+ * avoids most of the scheduler overshoot of a plain sleep at the cost of some CPU time. Every frame is also recorded in
+ * telemetry histograms, which use only relaxed atomics so they can be read from another thread while the emulator
+ * runs.
+ */
+namespace Pacer
+{
+    using Clock = std::chrono::steady_clock;
+
+    /** Histogram of durations in nanoseconds. Buckets are logarithmic with eight steps per power of two, so a reported
+     * percentile is within 12.5% of the true value. */
+    struct Histogram
+    {
+        static constexpr size_t bucket_count = 16 + 60 * 8;
+
+        std::array<std::atomic<uint64_t>, bucket_count> buckets{};
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> max{0};
+    };
+
+    /** Timing of every paced frame. */
+    struct Telemetry
+    {
+        /** Time spent emulating each frame. */
+        Histogram emulation;
+        /** How long after its deadline each frame was released. */
+        Histogram lateness;
+        std::atomic<uint64_t> frames{0};
+        /** Frames whose emulation finished after their deadline. */
+        std::atomic<uint64_t> missed{0};
+        /** Frame periods dropped from the schedule because emulation fell more than max_lag_frames behind. */
+        std::atomic<uint64_t> skipped{0};
+    };
+
+    /** Time before a deadline at which the pacer stops sleeping and starts spinning. Zero means sleep only. */
+    inline std::chrono::nanoseconds spin_budget = std::chrono::microseconds{2000};
+
+    inline Telemetry telemetry;
+
+    /** How many frame periods emulation may fall behind its deadlines, as after a stall, and still catch up by running
+     * the frames after it unthrottled. Past that, end_frame() moves the schedule forward by whole frame periods
+     * instead, so that pacing resumes at once. */
+    inline uint64_t max_lag_frames = 2;
+
+    /** When set, end_frame() doesn't wait for deadlines, so frames run as fast as they can, as for replaying a movie.
+     * Their emulation time is still recorded. */
+    inline bool unthrottled = false;
+
+    void record(Histogram &histogram, const uint64_t nanoseconds);
+    uint64_t percentile(const Histogram &histogram, const double fraction);
+    void reset(Histogram &histogram);
+    void wait_until(const Clock::time_point deadline);
+    Clock::duration end_frame(const Clock::time_point frame_start, const Clock::time_point deadline, const Clock::duration frame_period);
+    void report(std::ostream &out);
+}
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef PPU_H
+#define PPU_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+/** The NES picture processing unit (2C02). Its eight registers appear at $2000-$2007 and are mirrored every eight
+ * bytes up to $3FFF. Rendering is done a scanline at a time into a framebuffer of NES colour indices; nothing here
+ * needs a display.
+ *
+ * The PPU keeps its own position in the frame and only runs when the CPU touches one of its registers, or when
+ * something it does must be seen on time (vertical blank and NMI); catch_up() brings it up to date on demand.
+ *
+ * Everything the renderer depends on is in a State, so a second copy of the PPU can be kept and fed the same register
+ * accesses. start_render_thread() does that on another thread: the bus-side PPU then only keeps the registers and
+ * status flags up to date, and queues every access and frame event for the render thread to replay into its copy.
+ */
+namespace Ppu
+{
+    constexpr int width = 256;
+    constexpr int height = 240;
+    constexpr int dots_per_scanline = 341;
+    constexpr int scanlines_per_frame = 262;
+
+    /** How the four logical nametables map onto 1KB banks of nametable memory. */
+    enum class Mirroring
+    {
+        HORIZONTAL,
+        VERTICAL,
+        SINGLE_LOW,
+        SINGLE_HIGH,
+        FOUR_SCREEN
+    };
+
+    struct State
+    {
+        /** $2000, $2001 and the flags in $2002. */
+        uint8_t control = 0;
+        uint8_t mask = 0;
+        uint8_t status = 0;
+        uint8_t oam_address = 0;
+
+        /** Current and temporary VRAM addresses, fine X scroll and the shared write toggle of $2005/$2006. */
+        uint16_t v = 0;
+        uint16_t t = 0;
+        uint8_t fine_x = 0;
+        bool w = false;
+
+        /** Delayed result of $2007 reads. */
+        uint8_t read_buffer = 0;
+        /** Last value written to any register, returned for unreadable bits. */
+        uint8_t open_bus = 0;
+
+        /** Pattern memory. Each 1KB window of $0000-$1FFF reads chr from the offset in chr_banks. */
+        std::vector<uint8_t> chr = std::vector<uint8_t>(0x2000, 0);
+        std::array<uint32_t, 8> chr_banks{0x0000, 0x0400, 0x0800, 0x0C00, 0x1000, 0x1400, 0x1800, 0x1C00};
+        bool chr_writable = true;
+
+        /** Nametable memory, and the 1KB bank of it that each of the four nametables uses. */
+        std::array<uint8_t, 0x1000> vram{};
+        std::array<uint8_t, 4> nametable_banks{0, 0, 1, 1};
+
+        std::array<uint8_t, 32> palette{};
+        std::array<uint8_t, 256> oam{};
+
+        /** NES colour index (0-63) of every pixel of the frame being rendered. */
+        std::array<uint8_t, width * height> framebuffer{};
+    };
+
+    /** A finished frame. */
+    struct Frame
+    {
+        /** Number of the frame, counting from 1 for the first frame the render thread finished. */
+        uint64_t number = 0;
+        std::array<uint8_t, width * height> pixels{};
+    };
+
+    /** Something the bus-side PPU tells the render thread, in the order it happened. */
+    struct Command
+    {
+        enum class Kind : uint8_t
+        {
+            /** A register write of data to address. */
+            WRITE,
+            /** A register read from address, for its side effects. */
+            READ,
+            /** Horizontal blank of the visible scanline in address. */
+            SCANLINE,
+            /** End of the pre-render scanline. */
+            START_FRAME,
+            /** Start of vertical blank. */
+            END_FRAME,
+            /** The 1KB window of pattern memory in data now shows 1KB bank address of chr. */
+            CHR_BANK,
+            /** The nametables are mirrored as data, a Mirroring. */
+            MIRRORING
+        };
+
+        /** CPU cycle at which it happened. */
+        uint64_t cycle;
+        Kind kind;
+        uint16_t address;
+        uint8_t data;
+    };
+
+    /** Everything about the PPU that running it changes, as saved by snapshot(). */
+    struct Snapshot
+    {
+        /** The state, without the framebuffer, and with pattern memory only if it is RAM. */
+        State state;
+        uint64_t frame_origin = 0;
+        size_t next_event = 0;
+        uint64_t pending = 0;
+        uint64_t frame_count = 0;
+    };
+
+    /** The PPU attached to the bus. */
+    inline State state;
+
+    /** Number of frames that have reached vertical blank since attach(). */
+    inline uint64_t frame_count = 0;
+
+    /** Whether the PPU runs lazily: it is caught up to the CPU when one of its registers is accessed and at the start of
+     * vertical blank, instead of running an event at every scanline. Set before attach(). */
+    inline bool lazy = true;
+
+    /** Whether frames are being drawn by the render thread. While they are, the framebuffer of state isn't drawn. */
+    inline bool threaded = false;
+
+    /** Whether the bus-side PPU draws the framebuffer. While clear, as for frames that won't be shown, scanlines only
+     * have their effects on the PPU's state, with advance_scanline(), which costs much less. */
+    inline bool drawing = true;
+
+    /** Called at the start of vertical blank, when the framebuffer holds a complete frame. With the render thread
+     * running it is called on that thread instead, with its copy of the PPU. */
+    inline void (*frame_ready)(const State &frame) = nullptr;
+
+    /** Called where a cartridge watching the PPU's address bus sees a new scanline start being fetched (the MMC3's
+     * scanline counter): at dot 260 of every visible scanline and of the pre-render scanline, while rendering is
+     * enabled. Set with set_scanline_hook(). */
+    inline void (*scanline_hook)(const uint64_t cycle) = nullptr;
+
+    /** RGB value of each NES colour index, as 0x00RRGGBB. */
+    extern const std::array<uint32_t, 64> rgb_palette;
+
+    void set_mirroring(State &ppu, const Mirroring mirroring);
+    uint8_t read_register(State &ppu, const uint16_t address);
+    void write_register(State &ppu, const uint16_t address, const uint8_t data);
+    uint8_t read_vram(const State &ppu, const uint16_t address);
+    void write_vram(State &ppu, const uint16_t address, const uint8_t data);
+    void write_oam(const std::array<uint8_t, 256> &data);
+    void switch_chr_bank(const int window, const uint32_t offset);
+    void switch_mirroring(const Mirroring mirroring);
+    void set_scanline_hook(void (*hook)(const uint64_t cycle), const bool on_time);
+    void render_scanline(State &ppu, const int line);
+    void advance_scanline(State &ppu, const int line);
+    void start_frame(State &ppu);
+    void catch_up(const uint64_t cycle);
+    void attach();
+    void detach();
+    void start_render_thread();
+    void stop_render_thread();
+    void record(const uint64_t cycle, const Command::Kind kind, const uint16_t address = 0, const uint8_t data = 0);
+    const Frame &latest_frame();
+    void snapshot(Snapshot &into);
+    bool valid(const Snapshot &snapshot);
+    void restore(const Snapshot &snapshot);
+    void reschedule();
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef RECOMPILED_H
+#define RECOMPILED_H
+
+#include <cstdint>
+
+#include "rewrite.hpp"
+
+/** Interface to a ROM image that has been statically recompiled into C++ by emu_recompile. The functions in this
+ * namespace other than tick() are defined by the generated translation unit. */
+namespace Recompiled
+{
+    /** Address at which execution of the recompiled image starts. */
+    extern const uint16_t entry_point;
+
+    void load();
+    ReturnCode run_block();
+    ReturnCode tick(const int cycles_to_add);
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef RECOMPILER_H
+#define RECOMPILER_H
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace Recompiler
+{
+    /** A straight-line run of instructions with a single entry point. Control only leaves a block after its last
+     * instruction. */
+    struct Block
+    {
+        /** Address of the first instruction in the block. */
+        uint16_t start = 0;
+        /** Address of every instruction in the block, in execution order. */
+        std::vector<uint16_t> instructions;
+        /** Number of bytes covered by the block, including operands. */
+        uint16_t size = 0;
+    };
+
+    std::map<uint16_t, Block> discover_blocks(const std::vector<uint8_t> &image, const uint16_t entry);
+    void generate(std::ostream &out, const std::vector<uint8_t> &image, const uint16_t entry, const std::string &source_name);
+}
+
+#endif
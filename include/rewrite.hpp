@@ -1,4 +1,10 @@
+#ifndef REWRITE_H
+#define REWRITE_H
+
 #include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
 
 /** CPU return codes. The CPU will generally run until it exhausts the supply of cycles, but under
  * certain conditions will return one of these codes. */
@@ -7,18 +13,137 @@ enum class ReturnCode
     /** Instructs the CPU to stop. */
     BREAK,
     /** Instructs the CPU to continue. */
-    CONTINUE
+    CONTINUE,
+    /** The CPU stopped at an opcode it doesn't implement. */
+    UNKNOWN_INSTRUCTION,
+    /** The CPU stopped before an instruction with a breakpoint. See debugger.hpp. */
+    BREAKPOINT,
+    /** The CPU stopped after an instruction wrote to an address with a watchpoint. */
+    WATCHPOINT
 };
 
+/** Name of every return code, for messages, indexed by return code. */
+inline constexpr std::array<std::string_view, 5> return_code_names = {"BRK", "running", "unknown instruction", "breakpoint",
+                                                                       "watchpoint"};
+
+/** Mnemonic and addressing mode of every opcode, indexed by opcode. Unimplemented opcodes are named "---". */
+inline constexpr std::array<std::string_view, 256> instruction_names = {
+    "BRK impl", "ORA X,ind", "---", "---", "---", "ORA zpg", "ASL zpg", "---", "PHP impl", "ORA #", "ASL A", "---", "---", "ORA abs", "ASL abs", "---",
+    "BPL rel", "ORA ind,Y", "---", "---", "---", "ORA zpg,X", "ASL zpg,X", "---", "CLC impl", "ORA abs,Y", "---", "---", "---", "ORA abs,X", "ASL abs,X", "---",
+    "JSR abs ", "AND X,ind", "---", "---", "BIT zpg", "AND zpg", "ROL zpg", "---", "PLP impl", "AND #", "ROL A", "---", "BIT abs", "AND abs", "ROL abs", "---",
+    "BMI rel", "AND ind,Y", "---", "---", "---", "AND zpg,X", "ROL zpg,X", "---", "SEC impl", "AND abs,Y", "---", "---", "---", "AND abs,X", "ROL abs,X", "---",
+    "RTI impl", "EOR X,ind", "---", "---", "---", "EOR zpg", "LSR zpg", "---", "PHA impl", "EOR #", "LSR A", "---", "JMP abs", "EOR abs", "LSR abs", "---",
+    "BVC rel", "EOR ind,Y", "---", "---", "---", "EOR zpg,X", "LSR zpg,X", "---", "CLI impl", "EOR abs,Y", "---", "---", "---", "EOR abs,X", "LSR abs,X", "---",
+    "RTS impl", "ADC X,ind", "---", "---", "---", "ADC zpg", "ROR zpg", "---", "PLA impl", "ADC #", "ROR A", "---", "JMP ind", "ADC abs", "ROR abs", "---",
+    "BVS rel", "ADC ind,Y", "---", "---", "---", "ADC zpg,X", "ROR zpg,X", "---", "SEI impl", "ADC abs,Y", "---", "---", "---", "ADC abs,X", "ROR abs,X", "---",
+    "---", "STA X,ind", "---", "---", "STY zpg", "STA zpg", "STX zpg", "---", "DEY impl", "---", "TXA impl", "---", "STY abs", "STA abs", "STX abs", "---",
+    "BCC rel", "STA ind,Y", "---", "---", "STY zpg,X", "STA zpg,X", "STX zpg,Y", "---", "TYA impl", "STA abs,Y", "TXS impl", "---", "---", "STA abs,X", "---", "---",
+    "LDY #", "LDA X,ind", "LDX #", "---", "LDY zpg", "LDA zpg", "LDX zpg", "---", "TAY impl", "LDA #", "TAX impl", "---", "LDY abs", "LDA abs", "LDX abs", "---",
+    "BCS rel", "LDA ind,Y", "---", "---", "LDY zpg,X", "LDA zpg,X", "LDX zpg,Y", "---", "CLV impl", "LDA abs,Y", "TSX impl", "---", "LDY abs,X", "LDA abs,X", "LDX abs,Y", "---",
+    "CPY #", "CMP X,ind", "---", "---", "CPY zpg", "CMP zpg", "DEC zpg", "---", "INY impl", "CMP #", "DEX impl", "---", "CPY abs", "CMP abs", "DEC abs", "---",
+    "BNE rel", "CMP ind,Y", "---", "---", "---", "CMP zpg,X", "DEC zpg,X", "---", "CLD impl", "CMP abs,Y", "---", "---", "---", "CMP abs,X", "DEC abs,X", "---",
+    "CPX #", "SBC X,ind", "---", "---", "CPX zpg", "SBC zpg", "INC zpg", "---", "INX impl", "SBC #", "NOP impl", "---", "CPX abs", "SBC abs", "INC abs", "---",
+    "BEQ rel", "SBC ind,Y", "---", "---", "---", "SBC zpg,X", "INC zpg,X", "---", "SED impl", "SBC abs,Y", "---", "---", "---", "SBC abs,X", "INC abs,X", "---"};
+
+/** \brief Get the length in bytes of an instruction, including its operands.
+ * \param opcode The opcode of the instruction.
+ * \return Number of bytes occupied by the instruction, or 1 for unimplemented opcodes.
+ *
+ * The length is derived from the addressing mode in instruction_names.
+ */
+constexpr int instruction_length(const uint8_t opcode)
+{
+    std::string_view name = instruction_names[opcode];
+    if (name.size() < 4)
+    {
+        return 1;
+    }
+
+    std::string_view mode = name.substr(4);
+    if (mode.starts_with("abs") || mode == "ind")
+    {
+        return 3;
+    }
+    if (mode.starts_with("impl") || mode == "A")
+    {
+        return 1;
+    }
+    return 2;
+}
+
 namespace Memory
 {
     inline std::array<uint8_t, 256 * 256> main_memory{0};
+
+    /** Host address of each 256-byte page of the address space. Bus::read() and Bus::write() go through this table, so
+     * any page can be backed by any host memory. By default the pages are backed by main_memory. */
+    inline std::array<uint8_t *, 256> pages = []()
+    {
+        std::array<uint8_t *, 256> table;
+        for (size_t page = 0; page < table.size(); page++)
+        {
+            table[page] = main_memory.data() + page * 256;
+        }
+        return table;
+    }();
+
+    /** Host address Bus::write() stores to for each page. A null entry marks a page that may not be written in place,
+     * for example one shared with another machine; writes to it go through write_fault first. */
+    inline std::array<uint8_t *, 256> write_pages = pages;
+
+    /** Called for a write to a page whose write_pages entry is null. Must return host memory for the page that the
+     * write can go to, and normally updates pages and write_pages to match. */
+    inline uint8_t *(*write_fault)(const uint8_t page) = nullptr;
+
+    /** The current write generation. Each thing that wants to know which pages are written from some point on, such
+     * as Savestate::hash(), takes a checkpoint() there and keeps it; the pages written since are those whose
+     * written_generation is greater. Checkpoints don't disturb one another. */
+    inline uint64_t generation = 1;
+
+    /** Generation in which each page was last written, set by Bus::write() and writable_page(). Anything that writes
+     * a page's host memory directly must call mark_written() too. */
+    inline std::array<uint64_t, 256> written_generation = []()
+    {
+        std::array<uint64_t, 256> all;
+        all.fill(1);
+        return all;
+    }();
+
+    /** Handlers for memory-mapped I/O. */
+    struct Device
+    {
+        uint8_t (*read)(const uint16_t address);
+        void (*write)(const uint16_t address, const uint8_t data);
+        /** Optional. Called with the current cycle before every read or write, so a device that runs lazily can
+         * catch up with the CPU first. */
+        void (*catch_up)(const uint64_t cycle);
+    };
+
+    /** Device attached to each page, or nullptr. Device pages have null entries in pages and write_pages, so ordinary
+     * memory accesses pay nothing for them. A device may point its pages entries back at memory after attaching, so
+     * that reads are plain memory reads and only writes reach it, as a cartridge's ROM with mapper registers does. */
+    inline std::array<const Device *, 256> devices{};
+
+    void clear();
+    void map(uint8_t *memory);
+    void attach(const uint8_t first_page, const uint8_t last_page, const Device *device);
+    uint8_t *writable_page(const uint8_t page);
+    uint64_t checkpoint();
+    void mark_written(const uint8_t first_page, const uint8_t last_page);
+    std::array<uint8_t, 256 * 256> snapshot();
+    void restore(const std::array<uint8_t, 256 * 256> &memory);
 }
 
 namespace Bus
 {
+    /** Called by run() at the end of every frame, and once more when it stops. */
+    inline void (*frame_end)() = nullptr;
+
     bool load_rom(const std::string &filename);
-    void run();
+    ReturnCode run();
+    void write(const uint8_t data, const uint16_t address);
+    uint8_t read(const uint16_t address);
+    void read_page(const uint8_t page, uint8_t *destination);
 }
 
 namespace Cpu
@@ -35,10 +160,64 @@ namespace Cpu
 
 namespace Cpu
 {
-    constexpr static int CPU_frequency = 1790000; // Hz
-    constexpr static int frame_rate = 60;
-    constexpr static int cycles_per_frame = CPU_frequency / frame_rate;
-    constexpr static int microseconds_per_frame = 1000000 / frame_rate;
+    /** A copy of the CPU registers and flags, used to save and restore CPU state. */
+    struct State
+    {
+        bool C, Z, I, D, B, V, N;
+        int cycles_available;
+        uint16_t stack_pointer;
+        uint16_t instruction_pointer;
+        uint8_t A;
+        uint8_t X;
+        uint8_t Y;
+
+        bool operator==(const State &) const = default;
+    };
+
+    State save_state();
+    void load_state(const State &state);
+}
+
+namespace Coverage
+{
+    struct Map;
+}
+
+namespace Cpu
+{
+    /** What BRK does. */
+    enum class BrkPolicy
+    {
+        /** Push the return address and flags, then stop with ReturnCode::BREAK. Test programs end this way. */
+        HALT,
+        /** Take the interrupt through the vector at $FFFE, as the real CPU does. */
+        VECTOR
+    };
+
+    inline BrkPolicy brk_policy = BrkPolicy::HALT;
+
+    constexpr static uint16_t nmi_vector = 0xFFFA;
+    constexpr static uint16_t reset_vector = 0xFFFC;
+    constexpr static uint16_t irq_vector = 0xFFFE;
+
+    /** Set by nmi() and cleared when the NMI is taken. */
+    inline bool nmi_pending = false;
+    /** One bit for each device asserting IRQ. */
+    inline uint32_t irq_lines = 0;
+
+    /** Edge coverage map for fuzzing, 64KB, or nullptr. While set, every branch, jump, call and return adds one to the
+     * counter of the edge from the previous one's target to its own, indexed as AFL does: the previous target shifted
+     * right by one, exclusive-or the new one. */
+    inline uint8_t *coverage = nullptr;
+    inline uint16_t previous_location = 0;
+
+    /** Code coverage map filled by tick() while set. See coverage.hpp. */
+    inline Coverage::Map *code_coverage = nullptr;
+
+    void reset();
+    void nmi();
+    void set_irq(const uint32_t line, const bool asserted);
+    void service_interrupts();
 }
 
 namespace Cpu
@@ -47,5 +226,9 @@ namespace Cpu
     uint16_t get_word_zpg_wrap(const uint8_t address);
     void LDX_set_CPU_flags();
     uint8_t add_with_carry(const uint8_t data);
+    ReturnCode execute(const uint8_t instruction);
+    ReturnCode step();
     ReturnCode tick(const int cycles_to_add);
-}
\ No newline at end of file
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef RUN_AHEAD_H
+#define RUN_AHEAD_H
+
+#include <cstdint>
+#include <ostream>
+
+#include "clock.hpp"
+#include "rewrite.hpp"
+
+/** Run-ahead, which hides a program's own input lag. After each frame the machine is saved, run on for a few more
+ * frames with the same input, and what the last of them draws is what is shown; then the saved state is put back. A
+ * program that reacts to input a frame or two late therefore appears to react at once.
+ *
+ * The frames run ahead are thrown away, so they cost time but change nothing: their samples are muted, Ppu::frame_ready
+ * is only called for the one shown, and the frame's real outcome is what carries on. Saving is cheap because of
+ * Savestate's dirty-page tracking. It needs the PPU to draw on the emulation thread, without the render thread.
+ */
+namespace RunAhead
+{
+    /** Frames to run ahead, 0 for none. Used by Bus::run(). */
+    inline int frames = 0;
+
+    struct Stats
+    {
+        uint64_t frames = 0;
+        /** Wall-clock time spent running the real frames, and in everything run-ahead adds to them. */
+        uint64_t real_nanoseconds = 0;
+        uint64_t ahead_nanoseconds = 0;
+    };
+
+    inline Stats stats;
+
+    ReturnCode run_frame(const Clock::Profile &profile, const uint64_t start_cycle, const uint64_t frame);
+    void report(std::ostream &out);
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+/** A quick save of the whole machine, to run on from and then undo, as run-ahead does every frame.
+ *
+ * Memory isn't copied when the state is saved. Every writable page is made to fault on its first write instead, and
+ * only the pages written are copied, so saving and restoring cost about as much as the pages a frame changes: a few,
+ * for most programs. The CPU, scheduler, PPU, APU, controllers and mapper are small and are copied whole.
+ *
+ * There is one saved state at a time. Between save() and restore() nothing may remap memory with Memory::map(),
+ * attach or detach devices, or install another write fault handler.
+ *
+ * The machine can also be written to a stream and read back later, into a machine set up the same way: the same
+ * cartridge, and the same devices attached. Scheduled events aren't written. Reading resets the scheduler, and the PPU
+ * and APU schedule their events anew, so events anything else had scheduled are lost.
+ *
+ * hash() sums up memory and the CPU's registers for comparing runs. It keeps a hash of every page and only hashes
+ * again the pages written since the last hash, by Memory::written_generation, so hashing every frame costs about a microsecond.
+ */
+namespace Savestate
+{
+    struct Stats
+    {
+        uint64_t saves = 0;
+        /** Pages copied because they were written after a save. */
+        uint64_t pages_copied = 0;
+        /** Wall-clock time spent in save() and restore(), including the copies made by write faults. */
+        uint64_t nanoseconds = 0;
+        /** Pages hashed by hash(), and the time it took. */
+        uint64_t pages_hashed = 0;
+        uint64_t hash_nanoseconds = 0;
+    };
+
+    inline Stats stats;
+
+    void save();
+    void restore();
+    bool saved();
+    void write(std::ostream &out);
+    bool read(std::istream &in);
+    uint64_t hash();
+    uint64_t mix(uint64_t hash, const uint8_t *data, const size_t size);
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <unordered_set>
+#include <vector>
+
+#include "rewrite.hpp"
+
+/** Cycle-driven event scheduler. Time is a 64-bit count of CPU cycles since reset. Devices schedule callbacks at
+ * absolute cycle times, and run_until() runs the CPU uninterrupted up to the earliest pending event, dispatches the
+ * events that are due, and carries on. The CPU only ever checks Cpu::cycles_available, so scheduled work costs nothing
+ * per instruction.
+ *
+ * The last instruction of a slice may overshoot the deadline, so an event runs at the end of the instruction during
+ * which it fell due; now() tells the callback how late that is.
+ */
+namespace Scheduler
+{
+    /** Called when an event falls due. */
+    using Callback = std::function<void()>;
+
+    /** A pending callback. Events due at the same cycle run in the order they were scheduled. */
+    struct Event
+    {
+        uint64_t time;
+        uint64_t id;
+        Callback callback;
+
+        bool operator>(const Event &other) const
+        {
+            return time != other.time ? time > other.time : id > other.id;
+        }
+    };
+
+    using EventQueue = std::priority_queue<Event, std::vector<Event>, std::greater<Event>>;
+
+    /** Pending events and the master cycle count, as saved by snapshot(). */
+    struct Snapshot
+    {
+        EventQueue events;
+        std::unordered_set<uint64_t> live;
+        std::unordered_set<uint64_t> cancelled;
+        uint64_t next_id = 1;
+        uint64_t slice_end = 0;
+    };
+
+    /** Master cycle count at which the current slice ends. now() is this minus Cpu::cycles_available. */
+    inline uint64_t slice_end = 0;
+
+    /** True while run_until() is executing instructions. */
+    inline bool running = false;
+
+    /** Number of slices run_until() has handed to the CPU. */
+    inline uint64_t slices = 0;
+
+    uint64_t now();
+    uint64_t schedule(const uint64_t time, Callback callback);
+    uint64_t schedule_in(const uint64_t delay, Callback callback);
+    void cancel(const uint64_t id);
+    uint64_t next_event_time();
+    void end_slice();
+    ReturnCode run_until(const uint64_t time);
+    ReturnCode run_for(const uint64_t cycles);
+    void reset();
+    void snapshot(Snapshot &into);
+    void restore(const Snapshot &snapshot);
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef SOA_ENGINE_H
+#define SOA_ENGINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "rewrite.hpp"
+
+/** Experimental engine that runs many copies of a machine in lockstep. The registers of all machines ("lanes") are
+ * stored in structure-of-arrays form. While lanes agree on the instruction pointer and the instruction bytes there,
+ * one decoded instruction is applied to all of them at once: register-only and immediate ALU instructions with SSE2 or
+ * AVX2 kernels, and branches with a plain loop over the group, since they update 16-bit instruction pointers and
+ * cycle counts. Lanes that diverge, and instructions without a kernel, run one lane at a time through Cpu::step().
+ *
+ * Each lane behaves exactly like a machine driven by Cpu::tick().
+ */
+namespace SoaEngine
+{
+    /** Counts of lane-instructions executed by each path. */
+    struct Stats
+    {
+        /** Lane-instructions executed by vector kernels. */
+        uint64_t vector_instructions = 0;
+        /** Lane-instructions executed one lane at a time. */
+        uint64_t scalar_instructions = 0;
+        /** Number of times a group of lanes was stepped together. */
+        uint64_t group_steps = 0;
+        /** Number of times a lane's memory was mapped into Memory for the interpreter. */
+        uint64_t remaps = 0;
+    };
+
+    /** State of all lanes. Register arrays are padded to a whole number of vectors; padding lanes never run. */
+    struct Lanes
+    {
+        size_t count = 0;
+
+        std::vector<uint8_t> A, X, Y;
+        std::vector<uint8_t> C, Z, I, D, B, V, N;
+        std::vector<uint16_t> stack_pointer;
+        std::vector<uint16_t> instruction_pointer;
+        std::vector<int32_t> cycles_available;
+
+        /** 0xFF while a lane can run, 0 once it has stopped. */
+        std::vector<uint8_t> running;
+        /** Code returned when a lane stopped, or ReturnCode::CONTINUE while it is running. */
+        std::vector<ReturnCode> result;
+
+        /** 64KB of memory per lane, one lane after another. */
+        std::vector<uint8_t> memory;
+
+        Stats stats;
+    };
+
+    void init(Lanes &lanes, const size_t count, const std::vector<uint8_t> &image, const Cpu::State &state);
+    uint8_t *lane_memory(Lanes &lanes, const size_t lane);
+    Cpu::State get_lane_state(const Lanes &lanes, const size_t lane);
+    void set_lane_state(Lanes &lanes, const size_t lane, const Cpu::State &state);
+    bool tick(Lanes &lanes, const int cycles_to_add);
+}
+
+#endif
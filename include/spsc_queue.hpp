@@ -0,0 +1,123 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <thread>
+
+/** A bounded lock-free queue between exactly one producer thread and one consumer thread. Each side only writes its
+ * own index, and keeps a cached copy of the other side's so it rarely has to touch the shared cache line.
+ */
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+    static_assert(std::has_single_bit(Capacity), "Capacity must be a power of two");
+
+private:
+    /** Index of the next item to pop. Written by the consumer only. */
+    alignas(64) std::atomic<size_t> head{0};
+    /** The producer's view of head. */
+    size_t producer_head = 0;
+
+    /** Index one past the last item pushed. Written by the producer only. */
+    alignas(64) std::atomic<size_t> tail{0};
+    /** The consumer's view of tail. */
+    size_t consumer_tail = 0;
+
+    alignas(64) std::array<T, Capacity> items;
+
+public:
+    /** \brief Add an item, unless the queue is full. Producer only.
+     * \return False if the queue was full.
+     */
+    bool try_push(const T &item)
+    {
+        const size_t position = this->tail.load(std::memory_order_relaxed);
+        if (position - this->producer_head == Capacity)
+        {
+            this->producer_head = this->head.load(std::memory_order_acquire);
+            if (position - this->producer_head == Capacity)
+            {
+                return false;
+            }
+        }
+        this->items[position & (Capacity - 1)] = item;
+        this->tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** \brief Add an item, waiting for the consumer while the queue is full. Producer only. */
+    void push(const T &item)
+    {
+        while (!this->try_push(item))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    /** \brief Take the oldest item, if there is one. Consumer only.
+     * \return False if the queue was empty.
+     */
+    bool try_pop(T &item)
+    {
+        const size_t position = this->head.load(std::memory_order_relaxed);
+        if (position == this->consumer_tail)
+        {
+            this->consumer_tail = this->tail.load(std::memory_order_acquire);
+            if (position == this->consumer_tail)
+            {
+                return false;
+            }
+        }
+        item = this->items[position & (Capacity - 1)];
+        this->head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** \brief Add as many items as fit. Producer only.
+     * \param source Items to add.
+     * \param count Number of items.
+     * \return Number of items added, from the start of source.
+     */
+    size_t try_push(const T *source, const size_t count)
+    {
+        const size_t position = this->tail.load(std::memory_order_relaxed);
+        this->producer_head = this->head.load(std::memory_order_acquire);
+        const size_t added = std::min(count, Capacity - (position - this->producer_head));
+        for (size_t i = 0; i < added; i++)
+        {
+            this->items[(position + i) & (Capacity - 1)] = source[i];
+        }
+        this->tail.store(position + added, std::memory_order_release);
+        return added;
+    }
+
+    /** \brief Take up to count of the oldest items. Consumer only.
+     * \param destination Receives the items.
+     * \param count Maximum number of items.
+     * \return Number of items taken.
+     */
+    size_t try_pop(T *destination, const size_t count)
+    {
+        const size_t position = this->head.load(std::memory_order_relaxed);
+        this->consumer_tail = this->tail.load(std::memory_order_acquire);
+        const size_t taken = std::min(count, this->consumer_tail - position);
+        for (size_t i = 0; i < taken; i++)
+        {
+            destination[i] = this->items[(position + i) & (Capacity - 1)];
+        }
+        this->head.store(position + taken, std::memory_order_release);
+        return taken;
+    }
+
+    /** \brief Check whether everything pushed so far has been popped. Either thread may call it. */
+    bool empty() const
+    {
+        return this->head.load(std::memory_order_acquire) == this->tail.load(std::memory_order_acquire);
+    }
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/** Hands complete values from one producer thread to one consumer thread without either waiting for the other. The
+ * producer fills a back buffer and publishes it; the consumer always gets the most recently published one. Values the
+ * consumer was too slow to pick up are dropped.
+ */
+template <typename T>
+class TripleBuffer
+{
+private:
+    /** Set in the shared slot when it holds a buffer the consumer hasn't seen yet. */
+    static constexpr uint8_t fresh = 4;
+
+    std::array<T, 3> buffers{};
+    /** Index of the buffer between the two threads, plus the fresh flag. */
+    alignas(64) std::atomic<uint8_t> shared{1};
+    /** Index of the buffer the producer writes. */
+    alignas(64) uint8_t back = 0;
+    /** Index of the buffer the consumer reads. */
+    alignas(64) uint8_t front = 2;
+
+public:
+    /** \brief Get the buffer to fill. Producer only. */
+    T &write_buffer()
+    {
+        return this->buffers[this->back];
+    }
+
+    /** \brief Publish the buffer just filled and start on another. Producer only. */
+    void publish()
+    {
+        this->back = this->shared.exchange(static_cast<uint8_t>(this->back | fresh), std::memory_order_acq_rel) & 3;
+    }
+
+    /** \brief Switch to the most recently published buffer, if there is a new one. Consumer only.
+     * \return True if a new buffer was picked up.
+     */
+    bool update()
+    {
+        if (!(this->shared.load(std::memory_order_relaxed) & fresh))
+        {
+            return false;
+        }
+        this->front = this->shared.exchange(this->front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+
+    /** \brief Get the buffer picked up by the last update(). Consumer only. */
+    const T &read_buffer() const
+    {
+        return this->buffers[this->front];
+    }
+};
+
+#endif
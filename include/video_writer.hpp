@@ -0,0 +1,61 @@
+#ifndef VIDEO_WRITER_H
+#define VIDEO_WRITER_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+#include "ppu.hpp"
+
+/** Records what the machine draws to a video file, for running without a display. Frames are captured as NES colour
+ * indices, either from the PPU or from a region of CPU memory treated as one byte per pixel, and queued for a thread
+ * of its own, which converts them and writes them out. The queue holds a few frames; when the writer falls behind,
+ * new frames are dropped rather than making the emulation wait for the disk.
+ */
+namespace VideoWriter
+{
+    enum class Format
+    {
+        /** YUV4MPEG2, 4:4:4, which most video tools read. */
+        Y4M,
+        /** Headerless 24-bit RGB, one frame after another. */
+        RAW
+    };
+
+    /** A region of CPU memory drawn as pixels: one NES colour index per byte, row after row. */
+    struct Region
+    {
+        uint16_t address = 0;
+        int width = 0;
+        int height = 0;
+    };
+
+    struct Options
+    {
+        std::string filename;
+        Format format = Format::Y4M;
+        /** Where frames come from: the PPU if this is empty, otherwise the region. */
+        Region region;
+    };
+
+    /** A captured frame. */
+    struct Frame
+    {
+        int width = 0;
+        int height = 0;
+        std::array<uint8_t, Ppu::width * Ppu::height> pixels{};
+    };
+
+    /** Frames queued at once before new ones are dropped. */
+    constexpr size_t queue_frames = 8;
+
+    inline uint64_t frames_written = 0;
+    inline uint64_t frames_dropped = 0;
+
+    bool parse_region(const std::string &text, Region &region);
+    bool start(const Options &options);
+    void capture_region();
+    void stop();
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef WAV_WRITER_H
+#define WAV_WRITER_H
+
+#include <string>
+
+/** Writes the APU's output to a WAV file from a thread of its own, for running without an audio device. */
+namespace WavWriter
+{
+    bool start(const std::string &filename);
+    void stop();
+}
+
+#endif
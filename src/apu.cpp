@@ -0,0 +1,869 @@
+#include <algorithm>
+#include <memory>
+
+#include "apu.hpp"
+#include "apu_synth.hpp"
+#include "controller.hpp"
+#include "ppu.hpp"
+#include "rewrite.hpp"
+#include "scheduler.hpp"
+
+namespace Apu
+{
+    const std::array<uint8_t, 32> length_table = {10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+                                                  12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30};
+
+    /** Pulse waveforms, one bit per step of the sequence, first step in bit 7. */
+    const std::array<uint8_t, 4> duty_table = {0b01000000, 0b01100000, 0b01111000, 0b10011111};
+
+    /** Noise and DMC timer periods in CPU cycles (NTSC). */
+    const std::array<uint16_t, 16> noise_periods = {4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068};
+    const std::array<uint16_t, 16> dmc_periods = {428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54};
+
+    /** CPU cycles from the start of a frame counter sequence to each of its steps, for the 4-step and 5-step modes.
+     * The last entry is where the sequence starts again. */
+    const std::array<uint64_t, 5> four_step_times = {7457, 14913, 22371, 29829, 29830};
+    const std::array<uint64_t, 6> five_step_times = {7457, 14913, 22371, 29829, 37281, 37282};
+
+    /** The mixer's non-linear response: output for the sum of the pulse levels, and for 3 * triangle + 2 * noise +
+     * DMC. */
+    const std::array<float, 31> pulse_mix = []()
+    {
+        std::array<float, 31> table{};
+        for (size_t n = 1; n < table.size(); n++)
+        {
+            table[n] = 95.52f / (8128.0f / static_cast<float>(n) + 100.0f);
+        }
+        return table;
+    }();
+    const std::array<float, 203> tnd_mix = []()
+    {
+        std::array<float, 203> table{};
+        for (size_t n = 1; n < table.size(); n++)
+        {
+            table[n] = 163.67f / (24329.0f / static_cast<float>(n) + 100.0f);
+        }
+        return table;
+    }();
+
+    /** Mixed output as last passed to the synthesiser. */
+    float output = 0.0f;
+    /** Id of the pending scheduler event. */
+    uint64_t pending = 0;
+    bool attached = false;
+
+    uint8_t envelope_volume(const Envelope &envelope)
+    {
+        return envelope.constant ? envelope.volume : envelope.decay;
+    }
+
+    void clock_envelope(Envelope &envelope)
+    {
+        if (envelope.start)
+        {
+            envelope.start = false;
+            envelope.decay = 15;
+            envelope.divider = envelope.volume;
+        }
+        else if (envelope.divider == 0)
+        {
+            envelope.divider = envelope.volume;
+            if (envelope.decay > 0)
+            {
+                envelope.decay--;
+            }
+            else if (envelope.loop)
+            {
+                envelope.decay = 15;
+            }
+        }
+        else
+        {
+            envelope.divider--;
+        }
+    }
+
+    /** \brief Get the period the sweep unit would set a pulse channel to. Pulse 1 negates in ones' complement. */
+    uint16_t sweep_target(const Pulse &pulse, const int channel)
+    {
+        const uint16_t change = static_cast<uint16_t>(pulse.period >> pulse.sweep_shift);
+        if (pulse.sweep_negate)
+        {
+            return static_cast<uint16_t>(std::max(0, pulse.period - change - (channel == 0 ? 1 : 0)));
+        }
+        return static_cast<uint16_t>(pulse.period + change);
+    }
+
+    /** \brief Check whether the sweep unit silences a pulse channel, which it does whether or not it is enabled. */
+    bool sweep_muted(const Pulse &pulse, const int channel)
+    {
+        return pulse.period < 8 || (!pulse.sweep_negate && sweep_target(pulse, channel) > 0x7FF);
+    }
+
+    bool pulse_silent(const Pulse &pulse, const int channel)
+    {
+        return pulse.length == 0 || envelope_volume(pulse.envelope) == 0 || sweep_muted(pulse, channel);
+    }
+
+    uint8_t pulse_level(const Pulse &pulse, const int channel)
+    {
+        if (pulse_silent(pulse, channel) || !((duty_table[pulse.duty] << pulse.step) & 0x80))
+        {
+            return 0;
+        }
+        return envelope_volume(pulse.envelope);
+    }
+
+    uint8_t triangle_level(const Triangle &triangle)
+    {
+        return static_cast<uint8_t>(triangle.step < 16 ? 15 - triangle.step : triangle.step - 16);
+    }
+
+    /** \brief Check whether the triangle's sequencer is stopped. Periods below 2 are ultrasonic and are held too. */
+    bool triangle_stopped(const Triangle &triangle)
+    {
+        return triangle.length == 0 || triangle.linear == 0 || triangle.period < 2;
+    }
+
+    bool noise_silent(const Noise &noise)
+    {
+        return noise.length == 0 || envelope_volume(noise.envelope) == 0;
+    }
+
+    uint8_t noise_level(const Noise &noise)
+    {
+        return noise_silent(noise) || (noise.shift & 1) ? 0 : envelope_volume(noise.envelope);
+    }
+
+    float mix()
+    {
+        const int pulses = pulse_level(state.pulse[0], 0) + pulse_level(state.pulse[1], 1);
+        const int tnd = 3 * triangle_level(state.triangle) + 2 * noise_level(state.noise) + state.dmc.level;
+        return pulse_mix[static_cast<size_t>(pulses)] + tnd_mix[static_cast<size_t>(tnd)];
+    }
+
+    /** \brief Pass a change of the mixed output to the synthesiser. */
+    void update_output(const uint64_t cycle)
+    {
+        const float level = mix();
+        if (level != output)
+        {
+            Synth::add_step(cycle, level - output);
+            output = level;
+        }
+    }
+
+    uint64_t pulse_period(const Pulse &pulse)
+    {
+        return (pulse.period + 1u) * 2u;
+    }
+
+    uint64_t triangle_period(const Triangle &triangle)
+    {
+        return triangle.period + 1u;
+    }
+
+    uint64_t noise_period(const Noise &noise)
+    {
+        return noise_periods[noise.period_index];
+    }
+
+    uint64_t dmc_period(const Dmc &dmc)
+    {
+        return dmc_periods[dmc.rate_index];
+    }
+
+    void restart_sample(Dmc &dmc)
+    {
+        dmc.address = dmc.sample_address;
+        dmc.bytes_remaining = dmc.sample_length;
+    }
+
+    /** \brief Fill the DMC's sample buffer from memory if it is empty and the sample isn't finished. */
+    void fetch_sample(Dmc &dmc)
+    {
+        if (dmc.buffer_full || dmc.bytes_remaining == 0)
+        {
+            return;
+        }
+        dmc.buffer = Bus::read(dmc.address);
+        dmc.buffer_full = true;
+        dmc.address = dmc.address == 0xFFFF ? 0x8000 : static_cast<uint16_t>(dmc.address + 1);
+        if (--dmc.bytes_remaining == 0)
+        {
+            if (dmc.loop)
+            {
+                restart_sample(dmc);
+            }
+            else if (dmc.irq_enabled)
+            {
+                state.dmc_irq = true;
+                Cpu::set_irq(dmc_irq_line, true);
+            }
+        }
+    }
+
+    void clock_dmc(Dmc &dmc)
+    {
+        if (!dmc.silence)
+        {
+            if (dmc.shift & 1)
+            {
+                dmc.level = dmc.level <= 125 ? static_cast<uint8_t>(dmc.level + 2) : dmc.level;
+            }
+            else
+            {
+                dmc.level = dmc.level >= 2 ? static_cast<uint8_t>(dmc.level - 2) : dmc.level;
+            }
+        }
+        dmc.shift >>= 1;
+        if (--dmc.bits_remaining == 0)
+        {
+            dmc.bits_remaining = 8;
+            dmc.silence = !dmc.buffer_full;
+            if (dmc.buffer_full)
+            {
+                dmc.shift = dmc.buffer;
+                dmc.buffer_full = false;
+                fetch_sample(dmc);
+            }
+        }
+    }
+
+    bool dmc_idle(const Dmc &dmc)
+    {
+        return dmc.silence && !dmc.buffer_full && dmc.bytes_remaining == 0;
+    }
+
+    void clock_noise(Noise &noise)
+    {
+        const uint16_t feedback = (noise.shift ^ (noise.shift >> (noise.mode ? 6 : 1))) & 1;
+        noise.shift = static_cast<uint16_t>((noise.shift >> 1) | (feedback << 14));
+    }
+
+    /** In its long mode the noise shift register goes through every non-zero 15-bit value before repeating. */
+    constexpr size_t long_noise_period = 32767;
+    /** In its short mode it repeats after 93 clocks, or 31 from some values. */
+    constexpr uint64_t short_noise_period = 93;
+
+    /** The values of the shift register in long mode, in order, and where each one is in that order. */
+    struct NoiseSequence
+    {
+        std::array<uint16_t, long_noise_period> values;
+        std::array<uint16_t, long_noise_period + 1> positions;
+    };
+
+    const std::unique_ptr<const NoiseSequence> long_noise = []()
+    {
+        auto sequence = std::make_unique<NoiseSequence>();
+        Noise noise;
+        for (size_t n = 0; n < long_noise_period; n++)
+        {
+            sequence->values[n] = noise.shift;
+            sequence->positions[noise.shift] = static_cast<uint16_t>(n);
+            clock_noise(noise);
+        }
+        return sequence;
+    }();
+
+    /** \brief Clock the noise shift register many times over. */
+    void skip_noise(Noise &noise, uint64_t clocks)
+    {
+        if (!noise.mode)
+        {
+            noise.shift = long_noise->values[(long_noise->positions[noise.shift] + clocks) % long_noise_period];
+            return;
+        }
+        for (clocks %= short_noise_period; clocks > 0; clocks--)
+        {
+            clock_noise(noise);
+        }
+    }
+
+    void clock_quarter_frame()
+    {
+        clock_envelope(state.pulse[0].envelope);
+        clock_envelope(state.pulse[1].envelope);
+        clock_envelope(state.noise.envelope);
+
+        Triangle &triangle = state.triangle;
+        if (triangle.linear_reload_flag)
+        {
+            triangle.linear = triangle.linear_reload;
+        }
+        else if (triangle.linear > 0)
+        {
+            triangle.linear--;
+        }
+        if (!triangle.halt)
+        {
+            triangle.linear_reload_flag = false;
+        }
+    }
+
+    void clock_half_frame()
+    {
+        for (int channel = 0; channel < 2; channel++)
+        {
+            Pulse &pulse = state.pulse[static_cast<size_t>(channel)];
+            if (!pulse.halt && pulse.length > 0)
+            {
+                pulse.length--;
+            }
+            if (pulse.sweep_divider == 0 && pulse.sweep_enabled && pulse.sweep_shift > 0 && !sweep_muted(pulse, channel))
+            {
+                pulse.period = sweep_target(pulse, channel);
+            }
+            if (pulse.sweep_divider == 0 || pulse.sweep_reload)
+            {
+                pulse.sweep_divider = pulse.sweep_period;
+                pulse.sweep_reload = false;
+            }
+            else
+            {
+                pulse.sweep_divider--;
+            }
+        }
+        if (!state.triangle.halt && state.triangle.length > 0)
+        {
+            state.triangle.length--;
+        }
+        if (!state.noise.halt && state.noise.length > 0)
+        {
+            state.noise.length--;
+        }
+    }
+
+    /** \brief Get the CPU cycle of the next frame counter step. */
+    uint64_t next_step_time()
+    {
+        const uint64_t offset = state.five_step ? five_step_times[static_cast<size_t>(state.sequence_step)] : four_step_times[static_cast<size_t>(state.sequence_step)];
+        return state.sequence_start + offset;
+    }
+
+    /** \brief Run the frame counter step that is due. */
+    void clock_frame_counter()
+    {
+        const int step = state.sequence_step;
+        const int last = state.five_step ? 5 : 4;
+        if (step == last)
+        {
+            // The end of the sequence: start it again.
+            state.sequence_start = next_step_time();
+            state.sequence_step = 0;
+            return;
+        }
+
+        if (step != 3 || !state.five_step)
+        {
+            clock_quarter_frame();
+        }
+        if (step == 1 || (step == 3 && !state.five_step) || step == 4)
+        {
+            clock_half_frame();
+        }
+        if (step == 3 && !state.five_step && !state.irq_inhibit)
+        {
+            state.frame_irq = true;
+            Cpu::set_irq(frame_irq_line, true);
+        }
+        state.sequence_step++;
+    }
+
+    /** \brief Advance the timer of a channel whose output can't change, up to a cycle, without visiting each expiry.
+     * \return Number of expiries skipped.
+     */
+    uint64_t skip_timer(uint64_t &next, const uint64_t period, const uint64_t horizon)
+    {
+        if (next > horizon)
+        {
+            return 0;
+        }
+        const uint64_t expiries = (horizon - next) / period + 1;
+        next += expiries * period;
+        return expiries;
+    }
+
+    /** \brief Fast-forward every channel that is silent, or otherwise can't change the output, up to a cycle before
+     * which nothing else changes their state. */
+    void skip_quiet_channels(const uint64_t horizon)
+    {
+        for (int channel = 0; channel < 2; channel++)
+        {
+            Pulse &pulse = state.pulse[static_cast<size_t>(channel)];
+            if (pulse_silent(pulse, channel))
+            {
+                pulse.step = static_cast<uint8_t>((pulse.step + skip_timer(pulse.next, pulse_period(pulse), horizon)) & 7);
+            }
+        }
+        if (triangle_stopped(state.triangle))
+        {
+            skip_timer(state.triangle.next, triangle_period(state.triangle), horizon);
+        }
+        if (noise_silent(state.noise))
+        {
+            // The shift register still has to be stepped, but without going through the event loop.
+            skip_noise(state.noise, skip_timer(state.noise.next, noise_period(state.noise), horizon));
+        }
+        if (dmc_idle(state.dmc))
+        {
+            const uint64_t ticks = skip_timer(state.dmc.next, dmc_period(state.dmc), horizon);
+            state.dmc.bits_remaining = static_cast<uint8_t>((state.dmc.bits_remaining + 7 - ticks % 8) % 8 + 1);
+            state.dmc.shift = 0;
+        }
+    }
+
+    /** \brief Run the channel timers up to a cycle, jumping from one expiry to the next. Nothing but the timers may
+     * change the channels before that cycle, so everything else about them is looked up once. Whichever channel is
+     * due first runs on its own until another one is due, which keeps the loops short and their branches predictable
+     * when one channel runs much faster than the others.
+     * \param end The cycle. Expiries due at or before it are run.
+     */
+    void run_channels(const uint64_t end)
+    {
+        skip_quiet_channels(end);
+
+        Pulse &pulse0 = state.pulse[0];
+        Pulse &pulse1 = state.pulse[1];
+        Triangle &triangle = state.triangle;
+        Noise &noise = state.noise;
+        Dmc &dmc = state.dmc;
+
+        const uint64_t pulse0_period = pulse_period(pulse0);
+        const uint64_t pulse1_period = pulse_period(pulse1);
+        const uint8_t pulse0_volume = pulse_silent(pulse0, 0) ? 0 : envelope_volume(pulse0.envelope);
+        const uint8_t pulse1_volume = pulse_silent(pulse1, 1) ? 0 : envelope_volume(pulse1.envelope);
+        const uint8_t pulse0_duty = duty_table[pulse0.duty];
+        const uint8_t pulse1_duty = duty_table[pulse1.duty];
+        const uint64_t triangle_step_period = triangle_period(triangle);
+        const int triangle_steps = triangle_stopped(triangle) ? 0 : 1;
+        const uint64_t noise_step_period = noise_period(noise);
+        const uint8_t noise_volume = noise_silent(noise) ? 0 : envelope_volume(noise.envelope);
+        const uint64_t dmc_step_period = dmc_period(dmc);
+
+        // Each channel's share of the mixer inputs.
+        int pulse0_level = pulse_level(pulse0, 0);
+        int pulse1_level = pulse_level(pulse1, 1);
+        int triangle_part = 3 * triangle_level(triangle);
+        int noise_part = 2 * noise_level(noise);
+
+        auto emit = [&](const uint64_t time)
+        {
+            const float level = pulse_mix[static_cast<size_t>(pulse0_level + pulse1_level)] + tnd_mix[static_cast<size_t>(triangle_part + noise_part + dmc.level)];
+            if (level != output)
+            {
+                Synth::add_step(time, level - output);
+                output = level;
+            }
+        };
+
+        while (true)
+        {
+            const std::array<uint64_t, 5> next = {pulse0.next, pulse1.next, triangle.next, noise.next, dmc.next};
+            const size_t channel = static_cast<size_t>(std::min_element(next.begin(), next.end()) - next.begin());
+            if (next[channel] > end)
+            {
+                break;
+            }
+            // The channel runs alone up to and including this cycle.
+            uint64_t limit = end;
+            for (size_t other = 0; other < next.size(); other++)
+            {
+                limit = other != channel ? std::min(limit, next[other]) : limit;
+            }
+
+            switch (channel)
+            {
+            case 0:
+                do
+                {
+                    pulse0.step = (pulse0.step + 1) & 7;
+                    pulse0_level = ((pulse0_duty << pulse0.step) & 0x80) ? pulse0_volume : 0;
+                    emit(pulse0.next);
+                    pulse0.next += pulse0_period;
+                } while (pulse0.next <= limit);
+                break;
+            case 1:
+                do
+                {
+                    pulse1.step = (pulse1.step + 1) & 7;
+                    pulse1_level = ((pulse1_duty << pulse1.step) & 0x80) ? pulse1_volume : 0;
+                    emit(pulse1.next);
+                    pulse1.next += pulse1_period;
+                } while (pulse1.next <= limit);
+                break;
+            case 2:
+                do
+                {
+                    triangle.step = static_cast<uint8_t>((triangle.step + triangle_steps) & 31);
+                    triangle_part = 3 * triangle_level(triangle);
+                    emit(triangle.next);
+                    triangle.next += triangle_step_period;
+                } while (triangle.next <= limit);
+                break;
+            case 3:
+                do
+                {
+                    clock_noise(noise);
+                    noise_part = (noise.shift & 1) ? 0 : 2 * noise_volume;
+                    emit(noise.next);
+                    noise.next += noise_step_period;
+                } while (noise.next <= limit);
+                break;
+            default:
+                do
+                {
+                    clock_dmc(dmc);
+                    emit(dmc.next);
+                    dmc.next += dmc_step_period;
+                } while (dmc.next <= limit);
+                break;
+            }
+        }
+    }
+
+    /** \brief Run the APU up to a CPU cycle.
+     * \param cycle The cycle. Everything due at or before it is run.
+     */
+    void catch_up(const uint64_t cycle)
+    {
+        if (cycle < state.time)
+        {
+            return;
+        }
+
+        // Channels only go quiet or loud, or change period, at frame counter steps and register writes.
+        uint64_t step_time;
+        while ((step_time = next_step_time()) <= cycle)
+        {
+            run_channels(step_time - 1);
+            clock_frame_counter();
+            update_output(step_time);
+        }
+        run_channels(cycle);
+
+        state.time = cycle;
+        Synth::end_samples(cycle);
+    }
+
+    /** \brief Read an APU register. Only $4015 is readable.
+     * \param address Any address in $4000-$40FF.
+     * \return The value read. Other addresses read as the high byte of the address, like an open bus usually does.
+     */
+    uint8_t read_register(const uint16_t address)
+    {
+        if (address != 0x4015)
+        {
+            return static_cast<uint8_t>(address >> 8);
+        }
+
+        const uint8_t result = static_cast<uint8_t>((state.pulse[0].length > 0 ? 0x01 : 0) |
+                                                    (state.pulse[1].length > 0 ? 0x02 : 0) |
+                                                    (state.triangle.length > 0 ? 0x04 : 0) |
+                                                    (state.noise.length > 0 ? 0x08 : 0) |
+                                                    (state.dmc.bytes_remaining > 0 ? 0x10 : 0) |
+                                                    (state.frame_irq ? 0x40 : 0) |
+                                                    (state.dmc_irq ? 0x80 : 0));
+
+        state.frame_irq = false;
+        Cpu::set_irq(frame_irq_line, false);
+        return result;
+    }
+
+    void write_envelope(Envelope &envelope, const uint8_t data)
+    {
+        envelope.loop = data & 0x20;
+        envelope.constant = data & 0x10;
+        envelope.volume = data & 0x0F;
+    }
+
+    /** \brief Write an APU register.
+     * \param address Any address in $4000-$40FF. Addresses without an APU register are ignored.
+     * \param data The value written.
+     */
+    void write_register(const uint16_t address, const uint8_t data)
+    {
+        const uint64_t now = state.time;
+        Pulse &pulse = state.pulse[(address >> 2) & 1];
+        switch (address)
+        {
+        case 0x4000:
+        case 0x4004:
+            pulse.duty = data >> 6;
+            pulse.halt = data & 0x20;
+            write_envelope(pulse.envelope, data);
+            break;
+        case 0x4001:
+        case 0x4005:
+            pulse.sweep_enabled = data & 0x80;
+            pulse.sweep_period = (data >> 4) & 7;
+            pulse.sweep_negate = data & 0x08;
+            pulse.sweep_shift = data & 7;
+            pulse.sweep_reload = true;
+            break;
+        case 0x4002:
+        case 0x4006:
+            pulse.period = static_cast<uint16_t>((pulse.period & 0x700) | data);
+            break;
+        case 0x4003:
+        case 0x4007:
+            pulse.period = static_cast<uint16_t>((pulse.period & 0xFF) | ((data & 7) << 8));
+            if (state.enabled & (1 << ((address >> 2) & 1)))
+            {
+                pulse.length = length_table[data >> 3];
+            }
+            pulse.step = 0;
+            pulse.envelope.start = true;
+            break;
+        case 0x4008:
+            state.triangle.halt = data & 0x80;
+            state.triangle.linear_reload = data & 0x7F;
+            break;
+        case 0x400A:
+            state.triangle.period = static_cast<uint16_t>((state.triangle.period & 0x700) | data);
+            break;
+        case 0x400B:
+            state.triangle.period = static_cast<uint16_t>((state.triangle.period & 0xFF) | ((data & 7) << 8));
+            if (state.enabled & 0x04)
+            {
+                state.triangle.length = length_table[data >> 3];
+            }
+            state.triangle.linear_reload_flag = true;
+            break;
+        case 0x400C:
+            state.noise.halt = data & 0x20;
+            write_envelope(state.noise.envelope, data);
+            break;
+        case 0x400E:
+            state.noise.mode = data & 0x80;
+            state.noise.period_index = data & 0x0F;
+            break;
+        case 0x400F:
+            if (state.enabled & 0x08)
+            {
+                state.noise.length = length_table[data >> 3];
+            }
+            state.noise.envelope.start = true;
+            break;
+        case 0x4010:
+            state.dmc.irq_enabled = data & 0x80;
+            state.dmc.loop = data & 0x40;
+            state.dmc.rate_index = data & 0x0F;
+            if (!state.dmc.irq_enabled)
+            {
+                state.dmc_irq = false;
+                Cpu::set_irq(dmc_irq_line, false);
+            }
+            break;
+        case 0x4011:
+            state.dmc.level = data & 0x7F;
+            break;
+        case 0x4012:
+            state.dmc.sample_address = static_cast<uint16_t>(0xC000 + data * 64);
+            break;
+        case 0x4013:
+            state.dmc.sample_length = static_cast<uint16_t>(data * 16 + 1);
+            break;
+        case 0x4015:
+            state.enabled = data & 0x1F;
+            state.pulse[0].length = (data & 0x01) ? state.pulse[0].length : 0;
+            state.pulse[1].length = (data & 0x02) ? state.pulse[1].length : 0;
+            state.triangle.length = (data & 0x04) ? state.triangle.length : 0;
+            state.noise.length = (data & 0x08) ? state.noise.length : 0;
+            if (!(data & 0x10))
+            {
+                state.dmc.bytes_remaining = 0;
+            }
+            else if (state.dmc.bytes_remaining == 0)
+            {
+                restart_sample(state.dmc);
+                fetch_sample(state.dmc);
+            }
+            state.dmc_irq = false;
+            Cpu::set_irq(dmc_irq_line, false);
+            break;
+        case 0x4017:
+            state.five_step = data & 0x80;
+            state.irq_inhibit = data & 0x40;
+            if (state.irq_inhibit)
+            {
+                state.frame_irq = false;
+                Cpu::set_irq(frame_irq_line, false);
+            }
+            state.sequence_start = now;
+            state.sequence_step = 0;
+            if (state.five_step)
+            {
+                clock_quarter_frame();
+                clock_half_frame();
+            }
+            break;
+        default:
+            return;
+        }
+        update_output(now);
+    }
+
+    void schedule_next();
+
+    /** \brief Scheduler callback: bring the APU up to date and schedule the next wake-up. */
+    void on_event()
+    {
+        catch_up(Scheduler::now());
+        schedule_next();
+    }
+
+    /** \brief Get the time of the next thing that has to happen on time: the next frame counter step, or the DMC
+     * fetching the last byte of a sample that raises IRQ when it ends. */
+    uint64_t next_wake()
+    {
+        uint64_t wake = next_step_time();
+        const Dmc &dmc = state.dmc;
+        if (dmc.irq_enabled && !dmc.loop && dmc.bytes_remaining > 0 && dmc.buffer_full)
+        {
+            const uint64_t last_fetch = dmc.next + (dmc.bits_remaining - 1u + (dmc.bytes_remaining - 1u) * 8u) * dmc_period(dmc);
+            wake = std::min(wake, last_fetch);
+        }
+        return wake;
+    }
+
+    /** \brief Schedule a wake-up at next_wake(), replacing the pending one. */
+    void schedule_next()
+    {
+        Scheduler::cancel(pending);
+        pending = Scheduler::schedule(next_wake(), on_event);
+    }
+
+    uint8_t device_read(const uint16_t address)
+    {
+        // The controller ports share the page, with the rest of the byte left as open bus.
+        if (address == 0x4016 || address == 0x4017)
+        {
+            return static_cast<uint8_t>(0x40 | Controller::read(address & 1));
+        }
+        return read_register(address);
+    }
+
+    /** \brief Copy a page of CPU memory to OAM, as a write to $4014 does, and stall the CPU for the time it takes.
+     * \param page The page.
+     */
+    void oam_dma(const uint8_t page)
+    {
+        std::array<uint8_t, 256> data;
+        Bus::read_page(page, data.data());
+        Ppu::write_oam(data);
+
+        // One cycle to let the write finish, one more to align on a read cycle if the write was on an odd one, then
+        // 256 reads and writes. The write is the last cycle of the instruction, taken to be a four-cycle STA abs.
+        const uint64_t write_cycle = Scheduler::now() + 3;
+        Cpu::cycles_available -= dma_cycles + static_cast<int>(write_cycle & 1);
+    }
+
+    void device_write(const uint16_t address, const uint8_t data)
+    {
+        if (address == 0x4014)
+        {
+            oam_dma(data);
+            return;
+        }
+        if (address == 0x4016)
+        {
+            Controller::write(data);
+            return;
+        }
+        write_register(address, data);
+        schedule_next();
+    }
+
+    const Memory::Device device{device_read, device_write, catch_up};
+
+    /** \brief Put the APU on the bus at $4000-$40FF and start it at the current cycle, with all channels silent. */
+    void attach()
+    {
+        detach();
+        const uint64_t now = Scheduler::now();
+        state = State{};
+        state.time = now;
+        state.sequence_start = now;
+        state.pulse[0].next = now + pulse_period(state.pulse[0]);
+        state.pulse[1].next = now + pulse_period(state.pulse[1]);
+        state.triangle.next = now + triangle_period(state.triangle);
+        state.noise.next = now + noise_period(state.noise);
+        state.dmc.next = now + dmc_period(state.dmc);
+        output = mix();
+        Synth::reset(now, output);
+
+        Memory::attach(0x40, 0x40, &device);
+        attached = true;
+        schedule_next();
+    }
+
+    /** \brief Take the APU off the bus, after bringing it and its output up to date. */
+    void detach()
+    {
+        if (attached)
+        {
+            catch_up(Scheduler::now());
+            Scheduler::cancel(pending);
+            Memory::attach(0x40, 0x40, nullptr);
+            Cpu::set_irq(frame_irq_line | dmc_irq_line, false);
+            attached = false;
+        }
+    }
+
+    /** \brief Save the APU and its unfinished output, for restore().
+     * \param into Where to save them. Storage it already has is reused.
+     */
+    void snapshot(Snapshot &into)
+    {
+        into.state = state;
+        into.output = output;
+        into.pending = pending;
+        Synth::snapshot(into.synth);
+    }
+
+    /** \brief Check that an envelope's volume and decay level are 4-bit, as the mixer tables need. */
+    bool valid(const Envelope &envelope)
+    {
+        return envelope.volume < 16 && envelope.decay < 16;
+    }
+
+    /** \brief Check that a snapshot from elsewhere, such as a file, is one restore() can take: every table index, step
+     * and shift in it is in range.
+     */
+    bool valid(const Snapshot &snapshot)
+    {
+        const State &saved = snapshot.state;
+        for (const Pulse &pulse : saved.pulse)
+        {
+            if (!valid(pulse.envelope) || pulse.duty >= duty_table.size() || pulse.step >= 8 || pulse.sweep_shift >= 8)
+            {
+                return false;
+            }
+        }
+        const int last_step = saved.five_step ? 5 : 4;
+        return saved.triangle.step < 32 && valid(saved.noise.envelope) && saved.noise.shift <= long_noise_period &&
+               saved.noise.period_index < noise_periods.size() && saved.dmc.rate_index < dmc_periods.size() &&
+               saved.dmc.level < 128 && saved.dmc.bits_remaining >= 1 && saved.dmc.bits_remaining <= 8 &&
+               saved.sequence_step >= 0 && saved.sequence_step <= last_step;
+    }
+
+    /** \brief Put the APU back as it was when a snapshot was taken. The scheduler must be restored along with it. */
+    void restore(const Snapshot &snapshot)
+    {
+        state = snapshot.state;
+        output = snapshot.output;
+        pending = snapshot.pending;
+        Synth::restore(snapshot.synth);
+    }
+
+    /** \brief Schedule the APU's next wake-up anew, after Scheduler::reset() dropped it, as when a saved state is
+     * loaded. Does nothing unless the APU is attached. */
+    void reschedule()
+    {
+        if (attached)
+        {
+            pending = Scheduler::schedule(next_wake(), on_event);
+        }
+    }
+}
@@ -0,0 +1,197 @@
+#include <cmath>
+#include <cstring>
+#include <numbers>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "apu.hpp"
+#include "apu_synth.hpp"
+#include "clock.hpp"
+
+namespace Apu::Synth
+{
+    /** Width of a step, in output samples. Each step is delayed by half of it. */
+    constexpr int kernel_size = 16;
+    /** Steps are placed to 1/32 of a sample. */
+    constexpr int phase_bits = 5;
+    constexpr int phases = 1 << phase_bits;
+    /** Output samples the buffer can hold. end_samples() is called at least every frame counter step, a few hundred
+     * samples apart. */
+    constexpr size_t buffer_size = 4096;
+    /** One-pole high-pass filter coefficient, about 90 Hz at 48 kHz, like the console's own output filter. */
+    constexpr float highpass = 0.988f;
+
+    /** Kernels are stored padded to this many taps, and shifted by each of the four positions a step can start at
+     * within a group of four samples, so that adding one only takes aligned four-float loads and stores. */
+    constexpr int padded_size = kernel_size + 4;
+
+    /** Differentiated band-limited step for each phase: a windowed sinc with its cutoff a little below the output
+     * Nyquist frequency, normalised so that each one adds up to exactly 1. */
+    struct Kernels
+    {
+        alignas(16) std::array<std::array<std::array<float, padded_size>, 4>, phases> taps;
+    };
+
+    const Kernels kernels = []()
+    {
+        constexpr double cutoff = 0.9;
+        Kernels result{};
+        for (int phase = 0; phase < phases; phase++)
+        {
+            std::array<double, kernel_size> taps;
+            double sum = 0.0;
+            for (int k = 0; k < kernel_size; k++)
+            {
+                const double t = k - (kernel_size / 2 - 1) - static_cast<double>(phase) / phases;
+                const double x = std::numbers::pi * cutoff * t;
+                const double sinc = x == 0.0 ? 1.0 : std::sin(x) / x;
+                const double angle = 2.0 * std::numbers::pi * t / kernel_size;
+                const double window = 0.42 + 0.5 * std::cos(angle) + 0.08 * std::cos(2.0 * angle);
+                taps[static_cast<size_t>(k)] = sinc * window;
+                sum += sinc * window;
+            }
+            for (size_t shift = 0; shift < 4; shift++)
+            {
+                for (size_t k = 0; k < kernel_size; k++)
+                {
+                    result.taps[static_cast<size_t>(phase)][shift][k + shift] = static_cast<float>(taps[k] / sum);
+                }
+            }
+        }
+        return result;
+    }();
+
+    /** Level changes for the samples not output yet, starting with the next one. */
+    alignas(16) std::array<float, buffer_size + padded_size> buffer{};
+    /** CPU cycle at which the next sample starts, less origin_fraction. */
+    uint64_t origin_cycle = 0;
+    /** Fractions of a sample, in 32.32 fixed point. */
+    uint64_t origin_fraction = 0;
+    uint64_t samples_per_cycle = 0;
+
+    float level = 0.0f;
+    float highpass_input = 0.0f;
+    float highpass_output = 0.0f;
+
+    /** \brief Get the position of a CPU cycle in samples from the next sample to be output, in 32.32 fixed point. */
+    uint64_t position(const uint64_t cycle)
+    {
+        return (cycle - origin_cycle) * samples_per_cycle + origin_fraction;
+    }
+
+    /** \brief Start again with an empty buffer.
+     * \param cycle CPU cycle of the first sample.
+     * \param initial_level Output level at that cycle. Output starts from silence whatever it is.
+     */
+    void reset(const uint64_t cycle, const float initial_level)
+    {
+        const Clock::Rational &frequency = Clock::active.cpu_frequency;
+        samples_per_cycle = static_cast<uint64_t>(std::llround(std::ldexp(static_cast<long double>(sample_rate) * frequency.denominator / frequency.numerator, 32)));
+        buffer.fill(0.0f);
+        origin_cycle = cycle;
+        origin_fraction = 0;
+        level = initial_level;
+        highpass_input = initial_level;
+        highpass_output = 0.0f;
+    }
+
+    /** \brief Add a change of the output level.
+     * \param cycle CPU cycle at which it happens. Not before the last end_samples().
+     * \param delta Change of level.
+     */
+    void add_step(const uint64_t cycle, const float delta)
+    {
+        const uint64_t at = position(cycle);
+        const size_t index = static_cast<size_t>(at >> 32);
+        if (index >= buffer_size) [[unlikely]]
+        {
+            return;
+        }
+        const float *taps = kernels.taps[static_cast<size_t>((at >> (32 - phase_bits)) & (phases - 1))][index & 3].data();
+        float *out = buffer.data() + (index & ~size_t{3});
+#if defined(__SSE2__)
+        const __m128 scale = _mm_set1_ps(delta);
+        for (int k = 0; k < padded_size; k += 4)
+        {
+            _mm_store_ps(out + k, _mm_add_ps(_mm_load_ps(out + k), _mm_mul_ps(scale, _mm_load_ps(taps + k))));
+        }
+#else
+        for (int k = 0; k < padded_size; k++)
+        {
+            out[k] += delta * taps[k];
+        }
+#endif
+    }
+
+    /** \brief Output every sample that no later step can change any more: those that start before a CPU cycle.
+     * \param cycle The cycle. The APU must have been run up to it.
+     */
+    void end_samples(const uint64_t cycle)
+    {
+        const uint64_t end = position(cycle);
+        const size_t count = std::min(static_cast<size_t>(end >> 32), buffer_size);
+        if (count == 0)
+        {
+            return;
+        }
+
+        // Integrate the steps and filter, one sample after another.
+        alignas(16) std::array<float, buffer_size> filtered;
+        for (size_t i = 0; i < count; i++)
+        {
+            level += buffer[i];
+            highpass_output = highpass * highpass_output + level - highpass_input;
+            highpass_input = level;
+            filtered[i] = highpass_output;
+        }
+
+        // Convert to 16-bit with saturation.
+        alignas(16) std::array<int16_t, buffer_size> pcm;
+        size_t i = 0;
+#if defined(__SSE2__)
+        const __m128 scale = _mm_set1_ps(32767.0f);
+        for (; i + 8 <= count; i += 8)
+        {
+            const __m128i low = _mm_cvtps_epi32(_mm_mul_ps(_mm_load_ps(&filtered[i]), scale));
+            const __m128i high = _mm_cvtps_epi32(_mm_mul_ps(_mm_load_ps(&filtered[i + 4]), scale));
+            _mm_store_si128(reinterpret_cast<__m128i *>(&pcm[i]), _mm_packs_epi32(low, high));
+        }
+#endif
+        for (; i < count; i++)
+        {
+            pcm[i] = static_cast<int16_t>(std::clamp(std::lround(filtered[i] * 32767.0f), -32768l, 32767l));
+        }
+        if (!muted)
+        {
+            dropped_samples += count - samples.try_push(pcm.data(), count);
+        }
+
+        // Steps only ever went in up to the end, so nothing lies further than a kernel past the samples output.
+        std::memmove(buffer.data(), buffer.data() + count, padded_size * sizeof(float));
+        std::fill_n(buffer.data() + padded_size, count, 0.0f);
+        origin_cycle = cycle;
+        origin_fraction = end - (static_cast<uint64_t>(count) << 32);
+    }
+
+    void snapshot(Snapshot &into)
+    {
+        into.buffer.assign(buffer.begin(), buffer.end());
+        into.origin_cycle = origin_cycle;
+        into.origin_fraction = origin_fraction;
+        into.level = level;
+        into.highpass_input = highpass_input;
+        into.highpass_output = highpass_output;
+    }
+
+    void restore(const Snapshot &snapshot)
+    {
+        std::copy(snapshot.buffer.begin(), snapshot.buffer.end(), buffer.begin());
+        origin_cycle = snapshot.origin_cycle;
+        origin_fraction = snapshot.origin_fraction;
+        level = snapshot.level;
+        highpass_input = snapshot.highpass_input;
+        highpass_output = snapshot.highpass_output;
+    }
+}
@@ -0,0 +1,488 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#include "cartridge.hpp"
+#include "rewrite.hpp"
+
+namespace Cartridge
+{
+    constexpr size_t header_size = 16;
+    constexpr size_t trainer_size = 512;
+    constexpr size_t prg_bank_size = 0x2000;
+    constexpr size_t chr_bank_size = 0x400;
+
+    bool loaded = false;
+    Ppu::Mirroring mirroring = Ppu::Mirroring::HORIZONTAL;
+
+    /** \brief Get the size of a ROM from a NES 2.0 header.
+     * \param low The size's low byte.
+     * \param high Its high nibble. 0xF means low holds an exponent and a multiplier instead.
+     * \param unit Size of a unit of the size.
+     */
+    size_t nes2_rom_size(const uint8_t low, const uint8_t high, const size_t unit)
+    {
+        if (high == 0x0F)
+        {
+            return (size_t{1} << (low >> 2)) * static_cast<size_t>((low & 3) * 2 + 1);
+        }
+        return (static_cast<size_t>(high) << 8 | low) * unit;
+    }
+
+    /** \brief Get the size of a RAM from a NES 2.0 header, from the shift count in a nibble. */
+    size_t nes2_ram_size(const uint8_t shift)
+    {
+        return shift == 0 ? 0 : size_t{64} << shift;
+    }
+
+    /** \brief Read the header of an iNES or NES 2.0 file.
+     * \param image The whole file.
+     * \param result Receives what the header says.
+     * \return False if it isn't such a file, or is shorter than its header says.
+     */
+    bool parse_header(const std::vector<uint8_t> &image, Header &result)
+    {
+        if (image.size() < header_size || std::memcmp(image.data(), "NES\x1A", 4) != 0)
+        {
+            return false;
+        }
+
+        const uint8_t flags6 = image[6];
+        const uint8_t flags7 = image[7];
+        result = Header{};
+        result.nes2 = (flags7 & 0x0C) == 0x08;
+        result.battery = flags6 & 0x02;
+        result.trainer = flags6 & 0x04;
+        if (flags6 & 0x08)
+        {
+            result.mirroring = Ppu::Mirroring::FOUR_SCREEN;
+        }
+        else
+        {
+            result.mirroring = (flags6 & 0x01) ? Ppu::Mirroring::VERTICAL : Ppu::Mirroring::HORIZONTAL;
+        }
+
+        if (result.nes2)
+        {
+            result.mapper = (flags6 >> 4) | (flags7 & 0xF0) | ((image[8] & 0x0F) << 8);
+            result.submapper = image[8] >> 4;
+            result.prg_rom_size = nes2_rom_size(image[4], image[9] & 0x0F, 0x4000);
+            result.chr_rom_size = nes2_rom_size(image[5], image[9] >> 4, 0x2000);
+            result.prg_ram_size = nes2_ram_size(image[10] & 0x0F) + nes2_ram_size(image[10] >> 4);
+            result.chr_ram_size = nes2_ram_size(image[11] & 0x0F) + nes2_ram_size(image[11] >> 4);
+        }
+        else
+        {
+            // Some old dumping tools wrote their name over bytes 7-15. The mapper's high nibble is garbage then.
+            const bool dirty = std::any_of(image.begin() + 12, image.begin() + 16, [](const uint8_t byte)
+                                           { return byte != 0; });
+            result.mapper = (flags6 >> 4) | (dirty ? 0 : (flags7 & 0xF0));
+            result.prg_rom_size = image[4] * size_t{0x4000};
+            result.chr_rom_size = image[5] * size_t{0x2000};
+            result.prg_ram_size = 0x2000;
+            result.chr_ram_size = result.chr_rom_size == 0 ? 0x2000 : 0;
+        }
+
+        return image.size() >= header_size + (result.trainer ? trainer_size : 0) + result.prg_rom_size + result.chr_rom_size;
+    }
+
+    /** \brief Point an 8KB slot of $8000-$FFFF at a bank of PRG ROM.
+     * \param slot Slot number, 0-3.
+     * \param bank Bank number in 8KB units, taken modulo the number of banks.
+     */
+    void map_prg(const int slot, const size_t bank)
+    {
+        uint8_t *memory = prg_rom.data() + (bank % (prg_rom.size() / prg_bank_size)) * prg_bank_size;
+        const size_t first = 0x80 + static_cast<size_t>(slot) * 0x20;
+        for (size_t page = 0; page < 0x20; page++)
+        {
+            // Only pages is set. Writes find write_pages null and go to the mapper.
+            Memory::pages[first + page] = memory + page * 256;
+        }
+    }
+
+    /** \brief Point a 1KB window of pattern memory at a bank of CHR ROM or RAM.
+     * \param window Window number, 0-7.
+     * \param bank Bank number in 1KB units.
+     */
+    void map_chr(const int window, const size_t bank)
+    {
+        const uint32_t offset = static_cast<uint32_t>((bank * chr_bank_size) % Ppu::state.chr.size());
+        if (Ppu::state.chr_banks[static_cast<size_t>(window)] != offset)
+        {
+            Ppu::switch_chr_bank(window, offset);
+        }
+    }
+
+    void map_mirroring(const Ppu::Mirroring new_mirroring)
+    {
+        // A cartridge with its own nametable memory can't change how it is mapped.
+        if (header.mirroring != Ppu::Mirroring::FOUR_SCREEN && new_mirroring != mirroring)
+        {
+            mirroring = new_mirroring;
+            Ppu::switch_mirroring(mirroring);
+        }
+    }
+
+    /** \brief Point PRG and CHR memory at the banks the mapper's registers select. */
+    void update_banks()
+    {
+        const size_t last = prg_rom.size() / prg_bank_size - 1;
+        switch (header.mapper)
+        {
+        case 1:
+        {
+            constexpr std::array<Ppu::Mirroring, 4> mirrorings = {Ppu::Mirroring::SINGLE_LOW, Ppu::Mirroring::SINGLE_HIGH,
+                                                                  Ppu::Mirroring::VERTICAL, Ppu::Mirroring::HORIZONTAL};
+            map_mirroring(mirrorings[registers.control & 3]);
+
+            // PRG banks are 16KB, or 32KB with the low bit ignored.
+            const size_t prg = (registers.prg_select & 0x0F) * size_t{2};
+            switch ((registers.control >> 2) & 3)
+            {
+            case 2:
+                map_prg(0, 0);
+                map_prg(1, 1);
+                map_prg(2, prg);
+                map_prg(3, prg + 1);
+                break;
+            case 3:
+                map_prg(0, prg);
+                map_prg(1, prg + 1);
+                map_prg(2, last - 1);
+                map_prg(3, last);
+                break;
+            default:
+                for (int slot = 0; slot < 4; slot++)
+                {
+                    map_prg(slot, (prg & ~size_t{2}) + static_cast<size_t>(slot));
+                }
+                break;
+            }
+
+            // CHR banks are 4KB, or 8KB with the low bit ignored.
+            const bool split = registers.control & 0x10;
+            for (int window = 0; window < 8; window++)
+            {
+                const size_t bank = split ? registers.chr_select[static_cast<size_t>(window / 4)] * size_t{4} + static_cast<size_t>(window % 4)
+                                          : (registers.chr_select[0] & 0x1E) * size_t{4} + static_cast<size_t>(window);
+                map_chr(window, bank);
+            }
+            break;
+        }
+        case 2:
+            map_prg(0, registers.prg_select * size_t{2});
+            map_prg(1, registers.prg_select * size_t{2} + 1);
+            map_prg(2, last - 1);
+            map_prg(3, last);
+            break;
+        case 3:
+            for (int window = 0; window < 8; window++)
+            {
+                map_chr(window, registers.chr_select[0] * size_t{8} + static_cast<size_t>(window));
+            }
+            [[fallthrough]];
+        case 0:
+            // 16KB of PRG ROM appears twice.
+            for (int slot = 0; slot < 4; slot++)
+            {
+                map_prg(slot, static_cast<size_t>(slot));
+            }
+            break;
+        case 4:
+        {
+            // Bit 6 of bank select swaps $8000 and $C000, bit 7 swaps the two halves of pattern memory.
+            const bool prg_swap = registers.bank_select & 0x40;
+            map_prg(prg_swap ? 2 : 0, registers.banks[6]);
+            map_prg(1, registers.banks[7]);
+            map_prg(prg_swap ? 0 : 2, last - 1);
+            map_prg(3, last);
+
+            const int flip = (registers.bank_select & 0x80) ? 4 : 0;
+            map_chr(0 ^ flip, registers.banks[0] & 0xFE);
+            map_chr(1 ^ flip, registers.banks[0] | 0x01);
+            map_chr(2 ^ flip, registers.banks[1] & 0xFE);
+            map_chr(3 ^ flip, registers.banks[1] | 0x01);
+            for (int window = 0; window < 4; window++)
+            {
+                map_chr((window + 4) ^ flip, registers.banks[static_cast<size_t>(window + 2)]);
+            }
+            break;
+        }
+        }
+    }
+
+    /** \brief The MMC3's scanline counter, clocked by the PPU. It raises IRQ when it reaches zero. */
+    void mmc3_scanline(const uint64_t)
+    {
+        if (registers.irq_counter == 0 || registers.irq_reload)
+        {
+            registers.irq_counter = registers.irq_latch;
+            registers.irq_reload = false;
+        }
+        else
+        {
+            registers.irq_counter--;
+        }
+        if (registers.irq_counter == 0 && registers.irq_enabled)
+        {
+            Cpu::set_irq(irq_line, true);
+        }
+    }
+
+    void write_mmc1(const uint16_t address, const uint8_t data)
+    {
+        if (data & 0x80)
+        {
+            registers.shift = 0x10;
+            registers.control |= 0x0C;
+            update_banks();
+            return;
+        }
+        const bool complete = registers.shift & 1;
+        registers.shift = static_cast<uint8_t>((registers.shift >> 1) | ((data & 1) << 4));
+        if (!complete)
+        {
+            return;
+        }
+
+        // The fifth write picks the register by its address.
+        switch ((address >> 13) & 3)
+        {
+        case 0:
+            registers.control = registers.shift;
+            break;
+        case 1:
+            registers.chr_select[0] = registers.shift;
+            break;
+        case 2:
+            registers.chr_select[1] = registers.shift;
+            break;
+        default:
+            registers.prg_select = registers.shift;
+            break;
+        }
+        registers.shift = 0x10;
+        update_banks();
+    }
+
+    void write_mmc3(const uint16_t address, const uint8_t data)
+    {
+        switch (address & 0xE001)
+        {
+        case 0x8000:
+            registers.bank_select = data;
+            update_banks();
+            break;
+        case 0x8001:
+            registers.banks[registers.bank_select & 7] = data;
+            update_banks();
+            break;
+        case 0xA000:
+            map_mirroring((data & 1) ? Ppu::Mirroring::HORIZONTAL : Ppu::Mirroring::VERTICAL);
+            break;
+        case 0xC000:
+            registers.irq_latch = data;
+            break;
+        case 0xC001:
+            registers.irq_counter = 0;
+            registers.irq_reload = true;
+            break;
+        case 0xE000:
+            registers.irq_enabled = false;
+            Cpu::set_irq(irq_line, false);
+            Ppu::set_scanline_hook(mmc3_scanline, false);
+            break;
+        case 0xE001:
+            // The counter can only raise IRQ on time if the PPU calls it on time.
+            registers.irq_enabled = true;
+            Ppu::set_scanline_hook(mmc3_scanline, true);
+            break;
+        default:
+            // $A001 write-protects PRG RAM, which isn't emulated.
+            break;
+        }
+    }
+
+    uint8_t device_read(const uint16_t address)
+    {
+        return Memory::pages[address >> 8][address & 0xFF];
+    }
+
+    void device_write(const uint16_t address, const uint8_t data)
+    {
+        switch (header.mapper)
+        {
+        case 1:
+            write_mmc1(address, data);
+            break;
+        case 2:
+            registers.prg_select = data;
+            update_banks();
+            break;
+        case 3:
+            registers.chr_select[0] = data;
+            update_banks();
+            break;
+        case 4:
+            write_mmc3(address, data);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /** Writes to $8000-$FFFF. Reads never get here: the pages stay pointed at PRG ROM. */
+    const Memory::Device device{device_read, device_write, nullptr};
+
+    /** \brief Insert a cartridge: map its PRG ROM and RAM into the address space and its CHR memory into the PPU.
+     * Must be done before the PPU's render thread is started.
+     * \param image The contents of an iNES or NES 2.0 file.
+     * \return False if the file isn't one, or needs a mapper other than 0-4.
+     */
+    bool load(const std::vector<uint8_t> &image)
+    {
+        Header parsed;
+        if (!parse_header(image, parsed) || parsed.mapper > 4 || parsed.prg_rom_size == 0 ||
+            parsed.prg_rom_size % prg_bank_size != 0 || parsed.chr_rom_size % chr_bank_size != 0)
+        {
+            return false;
+        }
+        unload();
+        header = parsed;
+        registers = Registers{};
+
+        auto data = image.begin() + static_cast<std::ptrdiff_t>(header_size);
+        const auto trainer = data;
+        if (header.trainer)
+        {
+            data += static_cast<std::ptrdiff_t>(trainer_size);
+        }
+        prg_rom.assign(data, data + static_cast<std::ptrdiff_t>(header.prg_rom_size));
+        data += static_cast<std::ptrdiff_t>(header.prg_rom_size);
+
+        Ppu::state.chr_banks = Ppu::State{}.chr_banks;
+        if (header.chr_rom_size > 0)
+        {
+            Ppu::state.chr.assign(data, data + static_cast<std::ptrdiff_t>(header.chr_rom_size));
+            Ppu::state.chr_writable = false;
+        }
+        else
+        {
+            Ppu::state.chr.assign(std::max<size_t>(header.chr_ram_size, 0x2000), 0);
+            Ppu::state.chr_writable = true;
+        }
+        mirroring = header.mirroring;
+        Ppu::set_mirroring(Ppu::state, mirroring);
+
+        // PRG RAM, if any, fills $6000-$7FFF, mirrored if it is smaller. NES 2.0 headers can give sizes under a page, or
+        // that aren't powers of two: rounded up to a power of two of at least a page and the trainer, every mirrored
+        // page and the trainer fit in it.
+        size_t ram_size = header.trainer ? std::max(header.prg_ram_size, trainer_size) : header.prg_ram_size;
+        if (ram_size != 0)
+        {
+            ram_size = std::bit_ceil(std::max<size_t>(ram_size, 256));
+        }
+        prg_ram.assign(ram_size, 0);
+        if (!prg_ram.empty())
+        {
+            if (header.trainer)
+            {
+                std::copy(trainer, trainer + static_cast<std::ptrdiff_t>(trainer_size), prg_ram.begin() + static_cast<std::ptrdiff_t>(0x1000 % prg_ram.size()));
+            }
+            for (size_t page = 0; page < 0x20; page++)
+            {
+                Memory::pages[0x60 + page] = prg_ram.data() + (page * 256) % prg_ram.size();
+                Memory::write_pages[0x60 + page] = Memory::pages[0x60 + page];
+            }
+        }
+
+        Memory::attach(0x80, 0xFF, &device);
+        update_banks();
+        if (header.mapper == 4)
+        {
+            Ppu::set_scanline_hook(mmc3_scanline, false);
+        }
+        loaded = true;
+        return true;
+    }
+
+    /** \brief Insert a cartridge from a file. Battery-backed RAM is loaded from a file next to it, with the extension
+     * .sav, if there is one.
+     * \param filename Path of an iNES or NES 2.0 file.
+     * \return False if it can't be read or loaded.
+     */
+    bool load_file(const std::string &filename)
+    {
+        std::ifstream input(filename, std::ios::binary);
+        if (!input.is_open())
+        {
+            return false;
+        }
+        const std::vector<uint8_t> image{std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+        if (input.bad() || !load(image))
+        {
+            return false;
+        }
+        if (header.battery)
+        {
+            save_file = std::filesystem::path(filename).replace_extension(".sav").string();
+            std::ifstream save(save_file, std::ios::binary);
+            save.read(reinterpret_cast<char *>(prg_ram.data()), static_cast<std::streamsize>(prg_ram.size()));
+        }
+        return true;
+    }
+
+    /** \brief Remove the cartridge, saving battery-backed RAM first, and map $6000-$FFFF back to main memory. Does
+     * nothing if there isn't one. */
+    void unload()
+    {
+        if (!loaded)
+        {
+            return;
+        }
+        if (header.battery && !save_file.empty())
+        {
+            std::ofstream save(save_file, std::ios::binary);
+            save.write(reinterpret_cast<const char *>(prg_ram.data()), static_cast<std::streamsize>(prg_ram.size()));
+        }
+        if (header.mapper == 4)
+        {
+            Ppu::set_scanline_hook(nullptr, false);
+            Cpu::set_irq(irq_line, false);
+        }
+        Memory::attach(0x60, 0xFF, nullptr);
+        prg_rom.clear();
+        prg_ram.clear();
+        save_file.clear();
+        loaded = false;
+    }
+
+    void snapshot(Snapshot &into)
+    {
+        into = Snapshot{registers, mirroring};
+    }
+
+    /** \brief Check that a snapshot from elsewhere, such as a file, is one restore() can take. Bank numbers needn't be
+     * checked: they are wrapped to the cartridge's size when mapped.
+     */
+    bool valid(const Snapshot &snapshot)
+    {
+        return snapshot.mirroring >= Ppu::Mirroring::HORIZONTAL && snapshot.mirroring <= Ppu::Mirroring::FOUR_SCREEN;
+    }
+
+    /** \brief Put the mapper's registers back and map the banks they select. Restore the PPU first: its pattern banks
+     * and mirroring are then already right, and only PRG pages are pointed anew. */
+    void restore(const Snapshot &snapshot)
+    {
+        registers = snapshot.registers;
+        mirroring = snapshot.mirroring;
+        if (loaded)
+        {
+            update_banks();
+        }
+    }
+}
@@ -0,0 +1,152 @@
+#include <numeric>
+
+#include "clock.hpp"
+
+namespace Clock
+{
+    /** Wide enough for the product of any two 64-bit numbers. */
+    __extension__ typedef unsigned __int128 uint128;
+
+    /** \brief Divide a rational by its greatest common divisor. */
+    Rational reduce(const Rational &value)
+    {
+        uint64_t divisor = std::gcd(value.numerator, value.denominator);
+        return divisor == 0 ? value : Rational{value.numerator / divisor, value.denominator / divisor};
+    }
+
+    /** \brief Compute floor(count * numerator / denominator) without overflowing for large counts.
+     *
+     * Splitting count into whole multiples of the denominator and a remainder keeps the remainder's product below
+     * numerator * denominator, which is done in 128 bits.
+     */
+    uint64_t scale(const uint64_t count, const Rational &ratio)
+    {
+        return (count / ratio.denominator) * ratio.numerator +
+               static_cast<uint64_t>(uint128{count % ratio.denominator} * ratio.numerator / ratio.denominator);
+    }
+
+    /** \brief Divide one rational by another, in lowest terms.
+     * \param result Receives the quotient.
+     * \return False if its numerator or denominator doesn't fit in 64 bits.
+     */
+    bool divide(const Rational &dividend, const Rational &divisor, Rational &result)
+    {
+        // Cancelling across first leaves the products in lowest terms, so they only overflow if the quotient can't be
+        // represented at all.
+        const Rational a = reduce(dividend);
+        const Rational b = reduce(divisor);
+        const uint64_t top = std::gcd(a.numerator, b.numerator);
+        const uint64_t bottom = std::gcd(a.denominator, b.denominator);
+        if (top == 0 || bottom == 0)
+        {
+            return false;
+        }
+        return !__builtin_mul_overflow(a.numerator / top, b.denominator / bottom, &result.numerator) &&
+               !__builtin_mul_overflow(a.denominator / bottom, b.numerator / top, &result.denominator);
+    }
+
+    /** \brief Get the length of a frame in nanoseconds. */
+    bool nanoseconds_per_frame(const Profile &profile, Rational &result)
+    {
+        return divide(Rational{1000000000, 1}, profile.frame_rate, result);
+    }
+
+    /** \brief Get the average number of CPU cycles in a frame. The profile must be one from_options() accepts. */
+    Rational cycles_per_frame(const Profile &profile)
+    {
+        Rational result{0, 1};
+        divide(profile.cpu_frequency, profile.frame_rate, result);
+        return result;
+    }
+
+    /** \brief Get the number of cycles from the start of emulation to the end of a frame.
+     * \param profile The clock profile.
+     * \param frame Number of frames completed; frame_end(profile, 0) is 0.
+     * \return The cycle at which the frame ends.
+     */
+    uint64_t frame_end(const Profile &profile, const uint64_t frame)
+    {
+        return scale(frame, cycles_per_frame(profile));
+    }
+
+    /** \brief Get the wall-clock time from the start of emulation to the end of a frame. */
+    std::chrono::nanoseconds frame_time(const Profile &profile, const uint64_t frame)
+    {
+        Rational nanoseconds{0, 1};
+        nanoseconds_per_frame(profile, nanoseconds);
+        return std::chrono::nanoseconds{static_cast<int64_t>(scale(frame, nanoseconds))};
+    }
+
+    /** \brief Parse a positive decimal number such as "50" or "1.662607" exactly.
+     * \param text The text to parse.
+     * \param value Receives the number.
+     * \return False if the text isn't a positive decimal number with at most 9 decimal places.
+     */
+    bool parse_decimal(const std::string &text, Rational &value)
+    {
+        uint64_t numerator = 0;
+        uint64_t denominator = 1;
+        bool point = false;
+        bool digits = false;
+        for (char c : text)
+        {
+            if (c == '.' && !point)
+            {
+                point = true;
+            }
+            else if (c >= '0' && c <= '9' && numerator < 1000000000000ull && denominator <= 100000000)
+            {
+                numerator = numerator * 10 + static_cast<uint64_t>(c - '0');
+                denominator *= point ? 10 : 1;
+                digits = true;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        if (!digits || numerator == 0)
+        {
+            return false;
+        }
+        value = reduce(Rational{numerator, denominator});
+        return true;
+    }
+
+    /** \brief Choose a clock profile from the command line.
+     * \param input The command line. "-clock ntsc" and "-clock pal" select the standard profiles; "-clock custom" takes
+     * the CPU frequency in Hz from "-cpu-hz" and the frame rate from "-fps", both as decimals.
+     * \param profile Receives the chosen profile. Left unchanged if no "-clock" option is given.
+     * \return False if the options are invalid, or give a profile whose frames can't be counted in 64-bit rationals.
+     */
+    bool from_options(const InputParser &input, Profile &profile)
+    {
+        if (!input.contains("-clock"))
+        {
+            return true;
+        }
+
+        const std::string &name = input.get_command_option("-clock");
+        if (name == ntsc.name || name == pal.name)
+        {
+            profile = name == ntsc.name ? ntsc : pal;
+            return true;
+        }
+
+        Profile custom{"custom", {}, {}};
+        if (name != custom.name ||
+            !parse_decimal(input.get_command_option("-cpu-hz"), custom.cpu_frequency) ||
+            !parse_decimal(input.get_command_option("-fps"), custom.frame_rate))
+        {
+            return false;
+        }
+        Rational cycles;
+        Rational nanoseconds;
+        if (!divide(custom.cpu_frequency, custom.frame_rate, cycles) || !nanoseconds_per_frame(custom, nanoseconds))
+        {
+            return false;
+        }
+        profile = custom;
+        return true;
+    }
+}
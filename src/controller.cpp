@@ -0,0 +1,56 @@
+#include "controller.hpp"
+
+namespace Controller
+{
+    /** Buttons latched by the last strobe, shifted out a bit per read. */
+    std::array<uint8_t, 2> shift{};
+    bool strobe = false;
+
+    /** \brief Apply every queued event. Called by the emulation thread between frames. */
+    void sample()
+    {
+        Event event;
+        while (events.try_pop(event))
+        {
+            buttons[event.port & 1] = event.buttons;
+        }
+    }
+
+    /** \brief Read the next button of a controller, as $4016 and $4017 do.
+     * \param port 0 or 1.
+     * \return The button in bit 0. After all eight, the controller returns 1s.
+     */
+    uint8_t read(const int port)
+    {
+        uint8_t &bits = shift[static_cast<size_t>(port & 1)];
+        if (strobe)
+        {
+            return buttons[static_cast<size_t>(port & 1)] & 1;
+        }
+        const uint8_t result = bits & 1;
+        bits = static_cast<uint8_t>((bits >> 1) | 0x80);
+        return result;
+    }
+
+    /** \brief Write $4016. While bit 0 is set, both controllers keep latching their buttons. */
+    void write(const uint8_t data)
+    {
+        strobe = data & 1;
+        if (strobe)
+        {
+            shift = buttons;
+        }
+    }
+
+    void snapshot(Snapshot &into)
+    {
+        into = Snapshot{buttons, shift, strobe};
+    }
+
+    void restore(const Snapshot &snapshot)
+    {
+        buttons = snapshot.buttons;
+        shift = snapshot.shift;
+        strobe = snapshot.strobe;
+    }
+}
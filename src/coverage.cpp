@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <iomanip>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "coverage.hpp"
+
+namespace Coverage
+{
+    /** Identifies a coverage file. The four bitmaps follow, in the order Map has them. */
+    constexpr std::array<char, 8> magic = {'E', 'M', 'U', 'C', 'O', 'V', 'E', 'R'};
+
+    /** \brief Add the bits of one map to another. */
+    void merge(Map &into, const Map &from)
+    {
+        for (auto [to, bits] : {std::pair{&into.opcodes, &from.opcodes}, std::pair{&into.operands, &from.operands},
+                                std::pair{&into.taken, &from.taken}, std::pair{&into.not_taken, &from.not_taken}})
+        {
+            std::transform(to->begin(), to->end(), bits->begin(), to->begin(), [](const uint8_t a, const uint8_t b)
+                           { return static_cast<uint8_t>(a | b); });
+        }
+    }
+
+    /** \brief Read a whole coverage file from a descriptor.
+     * \return False if it isn't one.
+     */
+    bool read_map(const int descriptor, Map &map)
+    {
+        std::array<char, 8> header;
+        return read(descriptor, header.data(), header.size()) == static_cast<ssize_t>(header.size()) && header == magic &&
+               read(descriptor, &map, sizeof(map)) == static_cast<ssize_t>(sizeof(map));
+    }
+
+    /** \brief Read a coverage file into a map, replacing what it had.
+     * \return False if the file can't be read or isn't a coverage file.
+     */
+    bool read_file(const std::string &filename, Map &map)
+    {
+        const int descriptor = open(filename.c_str(), O_RDONLY);
+        if (descriptor < 0)
+        {
+            return false;
+        }
+        flock(descriptor, LOCK_SH);
+        const bool ok = read_map(descriptor, map);
+        close(descriptor);
+        return ok;
+    }
+
+    /** \brief Merge a map into a coverage file, creating it if need be. The file is locked meanwhile, so runs in
+     * parallel can merge into the same file.
+     * \return False if the file can't be written, or exists and isn't a coverage file.
+     */
+    bool merge_file(const std::string &filename, const Map &map)
+    {
+        const int descriptor = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (descriptor < 0)
+        {
+            return false;
+        }
+        flock(descriptor, LOCK_EX);
+        Map merged = map;
+        Map existing;
+        bool ok = true;
+        if (lseek(descriptor, 0, SEEK_END) != 0)
+        {
+            lseek(descriptor, 0, SEEK_SET);
+            ok = read_map(descriptor, existing);
+            merge(merged, existing);
+        }
+        ok = ok && lseek(descriptor, 0, SEEK_SET) == 0 &&
+             write(descriptor, magic.data(), magic.size()) == static_cast<ssize_t>(magic.size()) &&
+             write(descriptor, &merged, sizeof(merged)) == static_cast<ssize_t>(sizeof(merged));
+        close(descriptor);
+        return ok;
+    }
+
+    /** \brief Print an instruction's operand, after a space, the way its addressing mode is written, e.g. ($12),Y.
+     * \param mode The addressing mode, as in instruction_names.
+     * \param address Address of the instruction.
+     * \param memory The program.
+     */
+    void print_operand(std::string_view mode, const uint16_t address, const std::array<uint8_t, 256 * 256> &memory, std::ostream &out)
+    {
+        const uint8_t low = memory[static_cast<uint16_t>(address + 1)];
+        const uint16_t word = static_cast<uint16_t>(low | memory[static_cast<uint16_t>(address + 2)] << 8);
+        while (mode.ends_with(' '))
+        {
+            mode.remove_suffix(1);
+        }
+        if (mode.empty() || mode == "impl")
+        {
+            return;
+        }
+        out << " " << std::hex << std::setfill('0');
+        if (mode == "#")
+        {
+            out << "#$" << std::setw(2) << static_cast<int>(low);
+        }
+        else if (mode == "rel")
+        {
+            out << "$" << std::setw(4) << static_cast<uint16_t>(address + 2 + static_cast<int8_t>(low));
+        }
+        else if (mode == "A")
+        {
+            out << "A";
+        }
+        else if (mode.starts_with("zpg") || mode.starts_with("abs"))
+        {
+            out << "$" << std::setw(mode.starts_with("zpg") ? 2 : 4) << (mode.starts_with("zpg") ? low : word) << mode.substr(3);
+        }
+        else if (mode == "ind")
+        {
+            out << "($" << std::setw(4) << word << ")";
+        }
+        else if (mode == "X,ind")
+        {
+            out << "($" << std::setw(2) << static_cast<int>(low) << ",X)";
+        }
+        else if (mode == "ind,Y")
+        {
+            out << "($" << std::setw(2) << static_cast<int>(low) << "),Y";
+        }
+        out << std::dec << std::setfill(' ');
+    }
+
+    /** \brief Print a disassembly of the program from the first address that ran to the last, marking what ran.
+     * \param map The coverage.
+     * \param memory The program, as Memory::snapshot() gives it.
+     * \param out Where to print it.
+     *
+     * Instructions that ran are marked with '*', and conditional branches say which ways they went. Between them the
+     * disassembly carries on through code that didn't run, so untested paths show up as unmarked instructions, and
+     * falls back to single bytes where that would overlap an instruction that ran.
+     */
+    void report(const Map &map, const std::array<uint8_t, 256 * 256> &memory, std::ostream &out)
+    {
+        int first = -1;
+        int last = -1;
+        for (int address = 0; address < 0x10000; address++)
+        {
+            if (test(map.opcodes, static_cast<uint16_t>(address)) || test(map.operands, static_cast<uint16_t>(address)))
+            {
+                first = first < 0 ? address : first;
+                last = address;
+            }
+        }
+        if (first < 0)
+        {
+            out << "Coverage: no instructions ran" << std::endl;
+            return;
+        }
+
+        int instructions = 0;
+        int ran = 0;
+        int branches = 0;
+        int both_ways = 0;
+        for (int address = first; address <= last;)
+        {
+            const uint16_t at = static_cast<uint16_t>(address);
+            const uint8_t opcode = memory[at];
+            const bool executed = test(map.opcodes, at);
+            int length = lengths[opcode];
+            for (int offset = 1; !executed && offset < length; offset++)
+            {
+                if (test(map.opcodes, static_cast<uint16_t>(at + offset)))
+                {
+                    length = 1;
+                }
+            }
+            const std::string_view name = instruction_names[opcode];
+            const bool data = !executed && ((length == 1 && lengths[opcode] != 1) || name == "---");
+
+            out << std::hex << std::setfill('0') << "$" << std::setw(4) << address << (executed ? " * " : "   ");
+            for (int offset = 0; offset < 3; offset++)
+            {
+                if (offset < (data ? 1 : length))
+                {
+                    out << std::setw(2) << static_cast<int>(memory[static_cast<uint16_t>(at + offset)]) << " ";
+                }
+                else
+                {
+                    out << "   ";
+                }
+            }
+            out << std::dec << std::setfill(' ') << " ";
+            if (data)
+            {
+                out << ".byte" << std::endl;
+                address++;
+                continue;
+            }
+
+            out << name.substr(0, 3);
+            print_operand(name.substr(std::min<size_t>(4, name.size())), at, memory, out);
+            instructions++;
+            ran += executed;
+            if ((opcode & 0x1F) == 0x10)
+            {
+                const bool taken = test(map.taken, at);
+                const bool not_taken = test(map.not_taken, at);
+                branches++;
+                both_ways += taken && not_taken;
+                out << (taken && not_taken ? "    ; both ways"
+                        : taken           ? "    ; always taken"
+                        : not_taken       ? "    ; never taken"
+                                          : "");
+            }
+            out << std::endl;
+            address += length;
+        }
+        out << "Coverage: " << ran << " of " << instructions << " instructions ran, " << both_ways << " of " << branches
+            << " branches went both ways" << std::endl;
+    }
+}
@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+
+#include "cow_memory.hpp"
+#include "rewrite.hpp"
+
+namespace CowMemory
+{
+    /** Page every space reads for pages it has no entry for. Never written. */
+    Page zero_page{0};
+
+    /** \brief Find the entry for a page in a sorted list of entries.
+     * \return The entry, or nullptr if there is none.
+     */
+    const Entry *find(const std::vector<Entry> &entries, const uint8_t page)
+    {
+        auto entry = std::lower_bound(entries.begin(), entries.end(), page, [](const Entry &e, const uint8_t number)
+                                      { return e.number < number; });
+        return entry != entries.end() && entry->number == page ? &*entry : nullptr;
+    }
+
+    /** \brief Find the entry a space reads a page from, its own or its base's.
+     * \return The entry, or nullptr if the page reads as zero.
+     */
+    const Entry *find(const Space &space, const uint8_t page)
+    {
+        const Entry *entry = find(space.overrides, page);
+        if (entry == nullptr && space.base != nullptr)
+        {
+            entry = find(space.base->entries, page);
+        }
+        return entry;
+    }
+
+    /** \brief Get a page that only this space refers to, copying the shared or zero page it overrides.
+     * \param space The space.
+     * \param page Number of the page.
+     * \return Host address of the private page.
+     */
+    uint8_t *private_page(Space &space, const uint8_t page)
+    {
+        auto entry = std::lower_bound(space.overrides.begin(), space.overrides.end(), page, [](const Entry &e, const uint8_t number)
+                                      { return e.number < number; });
+        if (entry == space.overrides.end() || entry->number != page)
+        {
+            const Entry *shared = space.base != nullptr ? find(space.base->entries, page) : nullptr;
+            entry = space.overrides.insert(entry, Entry{page, std::make_shared<Page>(shared != nullptr ? *shared->data : zero_page)});
+            stats.page_copies += shared != nullptr ? 1 : 0;
+        }
+        return entry->data->data();
+    }
+
+    /** \brief Point a page of Memory's tables at a space. The page is writable in place only if it is an override.
+     * \param space The mapped space.
+     * \param page Number of the page.
+     */
+    void map_page(const Space &space, const uint8_t page)
+    {
+        if (Memory::devices[page] != nullptr)
+        {
+            Memory::pages[page] = nullptr;
+            Memory::write_pages[page] = nullptr;
+            return;
+        }
+        const Entry *entry = find(space, page);
+        Memory::pages[page] = entry != nullptr ? entry->data->data() : zero_page.data();
+        Memory::write_pages[page] = entry != nullptr && find(space.overrides, page) == entry ? entry->data->data() : nullptr;
+    }
+
+    /** \brief Write fault handler for the mapped space. */
+    uint8_t *handle_write_fault(const uint8_t page)
+    {
+        uint8_t *memory = private_page(*mapped, page);
+        Memory::pages[page] = memory;
+        Memory::write_pages[page] = memory;
+        return memory;
+    }
+
+    /** \brief Make a space that shares every page with another.
+     * \param space The space to fork. If it has overrides they are folded into a new base that both spaces share.
+     * \return The new space. Writes to either space after this aren't seen by the other.
+     */
+    Space fork(Space &space)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        if (!space.overrides.empty())
+        {
+            auto base = std::make_shared<Base>();
+            const std::vector<Entry> empty;
+            const std::vector<Entry> &old = space.base != nullptr ? space.base->entries : empty;
+            base->entries.reserve(old.size() + space.overrides.size());
+            std::merge(std::make_move_iterator(space.overrides.begin()), std::make_move_iterator(space.overrides.end()), old.begin(),
+                       old.end(), std::back_inserter(base->entries),
+                       [](const Entry &a, const Entry &b)
+                       { return a.number < b.number; });
+            // A page in both is overridden: merge puts the override first, so drop the base's copy after it.
+            base->entries.erase(std::unique(base->entries.begin(), base->entries.end(), [](const Entry &a, const Entry &b)
+                                            { return a.number == b.number; }),
+                                base->entries.end());
+            space.base = std::move(base);
+            std::vector<Entry>().swap(space.overrides);
+
+            // The parent's pages are shared now, so if it is mapped it must fault on its next write to each of them.
+            if (mapped == &space)
+            {
+                std::fill(Memory::write_pages.begin(), Memory::write_pages.end(), nullptr);
+            }
+        }
+        Space child{space.base, {}};
+
+        stats.forks++;
+        stats.fork_nanoseconds += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        return child;
+    }
+
+    /** \brief Read a byte of a space, whether or not it is mapped. */
+    uint8_t read(const Space &space, const uint16_t address)
+    {
+        const Entry *entry = find(space, static_cast<uint8_t>(address >> 8));
+        return entry != nullptr ? (*entry->data)[address & 0xFF] : 0;
+    }
+
+    /** \brief Write a byte of a space, whether or not it is mapped. */
+    void write(Space &space, const uint16_t address, const uint8_t data)
+    {
+        const uint8_t page = static_cast<uint8_t>(address >> 8);
+        private_page(space, page)[address & 0xFF] = data;
+        if (mapped == &space)
+        {
+            map_page(space, page);
+        }
+    }
+
+    /** \brief Make a space the address space Bus::read() and Bus::write() work on.
+     * \param space The space. It must not move or be destroyed while it is mapped.
+     */
+    void map(Space &space)
+    {
+        mapped = &space;
+        Memory::write_fault = handle_write_fault;
+        for (size_t page = 0; page < Memory::pages.size(); page++)
+        {
+            map_page(space, static_cast<uint8_t>(page));
+        }
+    }
+
+    /** \brief Restore the default mapping of Memory::main_memory. */
+    void unmap()
+    {
+        mapped = nullptr;
+        Memory::write_fault = nullptr;
+        Memory::map(Memory::main_memory.data());
+    }
+
+    /** \brief Measure the memory a space uses. A base only this space refers to counts as its own, along with the pages
+     * in it that no other base shares. */
+    Usage usage(const Space &space)
+    {
+        Usage result;
+        result.private_pages = space.overrides.size();
+        result.bytes = sizeof(Space) + space.overrides.capacity() * sizeof(Entry);
+        if (space.base != nullptr)
+        {
+            const bool owned = space.base.use_count() == 1;
+            for (const Entry &entry : space.base->entries)
+            {
+                if (find(space.overrides, entry.number) == nullptr)
+                {
+                    (owned && entry.data.use_count() == 1 ? result.private_pages : result.shared_pages)++;
+                }
+            }
+            result.bytes += owned ? sizeof(Base) + space.base->entries.capacity() * sizeof(Entry) : 0;
+        }
+        result.bytes += result.private_pages * sizeof(Page);
+        return result;
+    }
+}
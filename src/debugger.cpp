@@ -0,0 +1,52 @@
+#include "debugger.hpp"
+
+namespace Debugger
+{
+    /** \brief Set or clear an address's bit in its page's bitmap, keeping the page's count of bits up to date.
+     * \return Whether the bit was set before.
+     */
+    bool mark(std::array<std::array<uint8_t, 32>, 256> &bitmaps, std::array<uint16_t, 256> &counts, const uint16_t address, const bool set)
+    {
+        const uint8_t page = static_cast<uint8_t>(address >> 8);
+        const bool was_set = test(bitmaps[page], address);
+        if (was_set != set)
+        {
+            bitmaps[page][(address & 0xFF) >> 3] ^= static_cast<uint8_t>(1 << (address & 7));
+            counts[page] = static_cast<uint16_t>(set ? counts[page] + 1 : counts[page] - 1);
+        }
+        return was_set;
+    }
+
+    /** \brief Set or clear a breakpoint.
+     * \param address Address of the instruction to stop at.
+     * \param set True to set it, false to clear it.
+     * \return Whether it was set before.
+     */
+    bool set_breakpoint(const uint16_t address, const bool set)
+    {
+        const bool was_set = mark(breakpoints, breakpoint_pages, address, set);
+        breakpoint_count += set - was_set;
+        return was_set;
+    }
+
+    /** \brief Set or clear a watchpoint.
+     * \param address Address whose writes stop the run.
+     * \param set True to set it, false to clear it.
+     * \return Whether it was set before.
+     */
+    bool set_watchpoint(const uint16_t address, const bool set)
+    {
+        return mark(watchpoints, watched_pages, address, set);
+    }
+
+    /** \brief Clear every breakpoint and watchpoint. */
+    void clear()
+    {
+        breakpoints = {};
+        watchpoints = {};
+        breakpoint_pages = {};
+        watched_pages = {};
+        breakpoint_count = 0;
+        resume_address = -1;
+    }
+}
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cctype>
+#include <iomanip>
+
+#include "differential.hpp"
+#include "soa_engine.hpp"
+
+namespace Differential
+{
+    SoaEngine::Lanes lanes;
+
+    const Engine soa_engine{
+        "SoA engine",
+        [](const std::vector<uint8_t> &image, const Cpu::State &state)
+        { SoaEngine::init(lanes, 2, image, state); },
+        [](const int cycles_to_add)
+        {
+            SoaEngine::tick(lanes, cycles_to_add);
+            return lanes.result[0];
+        },
+        []()
+        { return SoaEngine::get_lane_state(lanes, 0); },
+        []() -> const uint8_t *
+        { return SoaEngine::lane_memory(lanes, 0); }};
+
+    /** \brief Find the first byte in a range of addresses where the candidate's memory differs from the reference's.
+     * \return True if there is one, after noting it in the result.
+     */
+    bool find_difference(const uint8_t *memory, const size_t first, const size_t last, Result &result)
+    {
+        const uint8_t *reference = Memory::main_memory.data();
+        const auto [at, ignored] = std::mismatch(reference + first, reference + last, memory + first);
+        if (at == reference + last)
+        {
+            return false;
+        }
+        result.address = static_cast<int>(at - reference);
+        result.reference_byte = *at;
+        result.candidate_byte = memory[result.address];
+        return true;
+    }
+
+    /** \brief Run the reference and a candidate engine side by side until they differ or stop.
+     * \param candidate The engine to test.
+     * \param image Memory image both start from. Loaded into Memory::main_memory for the reference.
+     * \param state CPU state both start from.
+     * \param max_slices Most slices to run.
+     * \param slice_cycles Cycles added to each engine's supply per slice. With 1, every slice that runs anything runs
+     * exactly one instruction.
+     * \return How far they got, and where they differ if they do.
+     */
+    Result run(const Engine &candidate, const std::vector<uint8_t> &image, const Cpu::State &state, const uint64_t max_slices,
+               const int slice_cycles)
+    {
+        Memory::main_memory = {0};
+        std::copy(image.begin(), image.begin() + static_cast<long>(std::min(image.size(), Memory::main_memory.size())),
+                  Memory::main_memory.begin());
+        Memory::map(Memory::main_memory.data());
+        Cpu::load_state(state);
+        candidate.load(image, state);
+        Memory::mark_written(0x00, 0xFF);
+        uint64_t compared = Memory::checkpoint();
+
+        Result result;
+        // The slices that ran anything, as a ring buffer.
+        std::array<Slice, history_length> history;
+        uint64_t recorded = 0;
+        while (result.slices < max_slices)
+        {
+            if (Cpu::cycles_available + slice_cycles > 0)
+            {
+                Slice &slice = history[recorded++ % history_length];
+                slice.state = Cpu::save_state();
+                for (uint16_t offset = 0; offset < slice.instruction.size(); offset++)
+                {
+                    slice.instruction[offset] = Memory::main_memory[static_cast<uint16_t>(slice.state.instruction_pointer + offset)];
+                }
+            }
+            result.reference_code = Cpu::tick(slice_cycles);
+            result.candidate_code = candidate.tick(slice_cycles);
+            result.slices++;
+
+            // Only pages either engine wrote can differ.
+            const uint8_t *memory = candidate.memory();
+            for (size_t page = 0; page < Memory::written_generation.size() && !result.diverged; page++)
+            {
+                if (Memory::written_generation[page] > compared)
+                {
+                    result.diverged = find_difference(memory, page * 256, page * 256 + 256, result);
+                }
+            }
+            compared = Memory::checkpoint();
+            result.reference = Cpu::save_state();
+            result.candidate = candidate.state();
+            result.diverged = result.diverged || result.reference != result.candidate || result.reference_code != result.candidate_code;
+            if (result.diverged || result.reference_code != ReturnCode::CONTINUE)
+            {
+                break;
+            }
+        }
+        // A last full check, for engines that write memory without marking it.
+        result.diverged = result.diverged || find_difference(candidate.memory(), 0, Memory::main_memory.size(), result);
+
+        for (uint64_t slice = recorded - std::min<uint64_t>(recorded, history_length); slice < recorded; slice++)
+        {
+            result.history.push_back(history[slice % history_length]);
+        }
+        return result;
+    }
+
+    /** \brief Print registers and flags, with set flags in capitals. */
+    void print_state(const Cpu::State &state, std::ostream &out)
+    {
+        const bool flags[] = {state.N, state.V, false, state.B, state.D, state.I, state.Z, state.C};
+        const char *names = "nv-bdizc";
+        out << std::hex << std::setfill('0') << "A:" << std::setw(2) << static_cast<int>(state.A) << " X:" << std::setw(2)
+            << static_cast<int>(state.X) << " Y:" << std::setw(2) << static_cast<int>(state.Y) << " SP:" << std::setw(4)
+            << state.stack_pointer << " PC:" << std::setw(4) << state.instruction_pointer << std::dec << " ";
+        for (size_t flag = 0; flag < 8; flag++)
+        {
+            out << static_cast<char>(flags[flag] ? std::toupper(names[flag]) : names[flag]);
+        }
+        out << " cycles:" << state.cycles_available;
+    }
+
+    /** \brief Print the outcome of run(): how far the engines agreed, and if they didn't, the slices leading up to it
+     * and both states. */
+    void report(const Result &result, const Engine &candidate, std::ostream &out)
+    {
+        if (!result.diverged)
+        {
+            out << candidate.name << " matched the interpreter for " << result.slices << " slices, to "
+                << return_code_names[static_cast<size_t>(result.reference_code)] << std::endl;
+            return;
+        }
+        out << candidate.name << " diverged from the interpreter in slice " << result.slices << std::endl;
+        for (const Slice &slice : result.history)
+        {
+            const uint8_t opcode = slice.instruction[0];
+            out << "  " << std::hex << std::setfill('0');
+            for (int offset = 0; offset < 3; offset++)
+            {
+                if (offset < instruction_length(opcode))
+                {
+                    out << std::setw(2) << static_cast<int>(slice.instruction[static_cast<size_t>(offset)]) << " ";
+                }
+                else
+                {
+                    out << "   ";
+                }
+            }
+            out << std::dec << std::left << std::setfill(' ') << std::setw(10) << instruction_names[opcode] << std::right;
+            print_state(slice.state, out);
+            out << std::endl;
+        }
+        out << "  interpreter: ";
+        print_state(result.reference, out);
+        out << ", " << return_code_names[static_cast<size_t>(result.reference_code)] << std::endl;
+        out << "  " << candidate.name << ": ";
+        print_state(result.candidate, out);
+        out << ", " << return_code_names[static_cast<size_t>(result.candidate_code)] << std::endl;
+        if (result.address >= 0)
+        {
+            out << std::hex << std::setfill('0') << "  memory at $" << std::setw(4) << result.address << ": interpreter "
+                << std::setw(2) << static_cast<int>(result.reference_byte) << ", " << candidate.name << " " << std::setw(2)
+                << static_cast<int>(result.candidate_byte) << std::dec << std::setfill(' ') << std::endl;
+        }
+    }
+}
@@ -0,0 +1,552 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "explorer.hpp"
+#include "savestate.hpp"
+
+namespace Explorer
+{
+    /** Ways of ending each worker keeps. */
+    constexpr size_t max_endings = 32;
+    /** Entries in each worker's deque. Workers explore depth first, so a deque holds about as many snapshots as a path
+     * has decision points, times the choices. */
+    constexpr int64_t deque_size = 1 << 16;
+    /** Slots of the table of states seen tried before giving up on a crowded table. */
+    constexpr size_t max_probes = 64;
+    /** Deque entries are a snapshot's offset in the arena shifted left by 8, and the index of the choice to run it
+     * with. The first run of the target's own state has no input to give. */
+    constexpr uint8_t no_choice = 0xFF;
+
+    /** A snapshot in the arena. The pages that differ from the image follow it, and then their numbers. */
+    struct Snapshot
+    {
+        /** Offset of the snapshot this one was run on from. Not used by the first. */
+        uint64_t parent;
+        Cpu::State state;
+        /** Number of inputs read to get here. */
+        uint32_t depth;
+        /** The input read on the way from the parent, if there was one. */
+        uint8_t input;
+        bool has_input;
+        uint16_t page_count;
+    };
+
+    /** A Chase-Lev deque of snapshots to explore. Its worker pushes and pops at the bottom, others steal at the top. */
+    struct Deque
+    {
+        alignas(64) int64_t top;
+        alignas(64) int64_t bottom;
+        alignas(64) std::array<uint64_t, deque_size> entries;
+    };
+
+    /** What a worker hands back to the parent. Written only by that worker. */
+    struct WorkerArea
+    {
+        uint64_t states;
+        uint64_t duplicates;
+        uint64_t paths;
+        uint64_t dropped;
+        uint64_t steals;
+        uint32_t ending_count;
+        struct Slot
+        {
+            Outcome outcome;
+            uint16_t address;
+            uint32_t depth;
+            std::array<uint8_t, max_path> inputs;
+        } endings[max_endings];
+    };
+
+    /** Counters shared by all workers. */
+    struct Header
+    {
+        /** Snapshots pushed and not yet explored, including those being explored. Exploring is done when it is 0. */
+        alignas(64) int64_t pending;
+        alignas(64) uint64_t arena_used;
+    };
+
+    /** The memory shared by all workers, mapped before they are forked. */
+    struct Shared
+    {
+        Header *header;
+        Deque *deques;
+        WorkerArea *areas;
+        /** Hashes of the states seen, 0 for an empty slot. */
+        uint64_t *table;
+        size_t table_size;
+        uint8_t *arena;
+        size_t arena_size;
+        unsigned workers;
+    };
+
+    // The port, as seen by the worker in this process.
+
+    const Target *current = nullptr;
+    /** Input the next read of the port returns, or -1 if the next read is a decision point. */
+    int next_input = -1;
+    /** Set when a run reaches a decision point, with the state before the instruction that reads the port. */
+    bool decided = false;
+    Cpu::State decision;
+    /** Instruction pointer and cycles before the instruction being run, for decision. */
+    uint16_t instruction_start = 0;
+    int cycles_at_start = 0;
+
+    uint8_t read_port(const uint16_t address)
+    {
+        if (address != current->input_address)
+        {
+            return Memory::main_memory[address];
+        }
+        if (next_input >= 0)
+        {
+            const uint8_t input = static_cast<uint8_t>(next_input);
+            next_input = -1;
+            return input;
+        }
+        // Nothing the instruction has done so far shows but the instruction pointer and the cycles.
+        if (!decided)
+        {
+            decided = true;
+            decision = Cpu::save_state();
+            decision.instruction_pointer = instruction_start;
+            decision.cycles_available = cycles_at_start;
+        }
+        return 0;
+    }
+
+    void write_port(const uint16_t address, const uint8_t data)
+    {
+        if (address != current->input_address)
+        {
+            Memory::main_memory[address] = data;
+        }
+    }
+
+    const Memory::Device port{read_port, write_port, nullptr};
+
+    bool push(Deque &deque, const uint64_t entry)
+    {
+        std::atomic_ref<int64_t> bottom_ref{deque.bottom};
+        const int64_t bottom = bottom_ref.load(std::memory_order_relaxed);
+        if (bottom - std::atomic_ref<int64_t>{deque.top}.load(std::memory_order_acquire) >= deque_size)
+        {
+            return false;
+        }
+        std::atomic_ref<uint64_t>{deque.entries[static_cast<size_t>(bottom % deque_size)]}.store(entry, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_ref.store(bottom + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool pop(Deque &deque, uint64_t &entry)
+    {
+        std::atomic_ref<int64_t> bottom_ref{deque.bottom};
+        std::atomic_ref<int64_t> top_ref{deque.top};
+        const int64_t bottom = bottom_ref.load(std::memory_order_relaxed) - 1;
+        bottom_ref.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = top_ref.load(std::memory_order_relaxed);
+        if (top > bottom)
+        {
+            bottom_ref.store(bottom + 1, std::memory_order_relaxed);
+            return false;
+        }
+        entry = std::atomic_ref<uint64_t>{deque.entries[static_cast<size_t>(bottom % deque_size)]}.load(std::memory_order_relaxed);
+        if (top < bottom)
+        {
+            return true;
+        }
+        // The last entry: a thief may be taking it too.
+        const bool won = top_ref.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        bottom_ref.store(bottom + 1, std::memory_order_relaxed);
+        return won;
+    }
+
+    bool steal(Deque &deque, uint64_t &entry)
+    {
+        std::atomic_ref<int64_t> top_ref{deque.top};
+        int64_t top = top_ref.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (top >= std::atomic_ref<int64_t>{deque.bottom}.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        entry = std::atomic_ref<uint64_t>{deque.entries[static_cast<size_t>(top % deque_size)]}.load(std::memory_order_relaxed);
+        return top_ref.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    /** \brief Add a state's hash to the table of states seen.
+     * \return False if it was there already. A state that finds the table too crowded counts as new.
+     */
+    bool insert(const Shared &shared, uint64_t hash)
+    {
+        hash = hash != 0 ? hash : 1;
+        for (size_t probe = 0; probe < max_probes; probe++)
+        {
+            std::atomic_ref<uint64_t> slot{shared.table[(hash + probe) & (shared.table_size - 1)]};
+            uint64_t seen = slot.load(std::memory_order_relaxed);
+            if (seen == 0 && slot.compare_exchange_strong(seen, hash, std::memory_order_relaxed))
+            {
+                return true;
+            }
+            if (seen == hash)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /** \brief Hash the registers, but not the cycles left, and the pages that differ from the image. */
+    uint64_t hash_state(const Cpu::State &state, const std::array<uint8_t, 256> &numbers, const uint16_t page_count)
+    {
+        const std::array<uint8_t, 8> registers = {
+            static_cast<uint8_t>(state.C | state.Z << 1 | state.I << 2 | state.D << 3 | state.B << 4 | state.V << 6 | state.N << 7),
+            state.A, state.X, state.Y, static_cast<uint8_t>(state.stack_pointer), static_cast<uint8_t>(state.stack_pointer >> 8),
+            static_cast<uint8_t>(state.instruction_pointer), static_cast<uint8_t>(state.instruction_pointer >> 8)};
+        uint64_t result = Savestate::mix(0, registers.data(), registers.size());
+        for (size_t index = 0; index < page_count; index++)
+        {
+            result = Savestate::mix(result, &numbers[index], 1);
+            result = Savestate::mix(result, Memory::main_memory.data() + numbers[index] * 256, 256);
+        }
+        return result;
+    }
+
+    /** A worker's own state. */
+    struct Worker
+    {
+        unsigned index;
+        std::vector<uint8_t> image;
+        /** Pages that a snapshot loaded made differ from the image. */
+        std::array<bool, 256> changed{};
+        /** Memory::checkpoint() taken when the snapshot was loaded. Pages written since have a later generation. */
+        uint64_t loaded = 0;
+    };
+
+    const Snapshot &snapshot_at(const Shared &shared, const uint64_t offset)
+    {
+        return *reinterpret_cast<const Snapshot *>(shared.arena + offset);
+    }
+
+    /** \brief Put the machine in a snapshot's state, copying back from the image the pages the last run changed. */
+    void load(Worker &worker, const Snapshot &snapshot)
+    {
+        for (size_t page = 0; page < worker.changed.size(); page++)
+        {
+            if (worker.changed[page] || Memory::written_generation[page] > worker.loaded)
+            {
+                std::memcpy(Memory::main_memory.data() + page * 256, worker.image.data() + page * 256, 256);
+                Memory::written_generation[page] = Memory::generation;
+                worker.changed[page] = false;
+            }
+        }
+        const uint8_t *pages = reinterpret_cast<const uint8_t *>(&snapshot + 1);
+        const uint8_t *numbers = pages + snapshot.page_count * 256;
+        for (size_t index = 0; index < snapshot.page_count; index++)
+        {
+            std::memcpy(Memory::main_memory.data() + numbers[index] * 256, pages + index * 256, 256);
+            worker.changed[numbers[index]] = true;
+            Memory::written_generation[numbers[index]] = Memory::generation;
+        }
+        worker.loaded = Memory::checkpoint();
+        Cpu::load_state(snapshot.state);
+    }
+
+    /** \brief Note a way the program ended, unless the worker knows a shorter path to it already.
+     * \param from The snapshot the path was run from.
+     * \param input The input read on the way from it, or -1.
+     */
+    void end(const Shared &shared, WorkerArea &area, const Snapshot &from, const int input, const Outcome outcome, const uint16_t address)
+    {
+        area.paths++;
+        const uint32_t depth = from.depth + (input >= 0);
+        WorkerArea::Slot *const end = area.endings + area.ending_count;
+        WorkerArea::Slot *slot = std::find_if(area.endings, end, [&](const WorkerArea::Slot &known)
+                                              { return known.outcome == outcome && known.address == address; });
+        if (slot == end ? area.ending_count == max_endings : slot->depth <= depth)
+        {
+            return;
+        }
+        area.ending_count += slot == end;
+        slot->outcome = outcome;
+        slot->address = address;
+        slot->depth = depth;
+        // The inputs are found from the last back.
+        uint32_t index = depth;
+        if (input >= 0 && --index < max_path)
+        {
+            slot->inputs[index] = static_cast<uint8_t>(input);
+        }
+        for (const Snapshot *snapshot = &from; snapshot->has_input; snapshot = &snapshot_at(shared, snapshot->parent))
+        {
+            if (--index < max_path)
+            {
+                slot->inputs[index] = snapshot->input;
+            }
+        }
+    }
+
+    /** \brief Run a snapshot with one of the choices of input, to the next decision point or the end of the path. A
+     * decision point not seen before is snapshotted and its choices pushed to the worker's deque. */
+    void explore(const Shared &shared, Worker &worker, const uint64_t entry)
+    {
+        WorkerArea &area = shared.areas[worker.index];
+        const uint64_t from_offset = entry >> 8;
+        const Snapshot &from = snapshot_at(shared, from_offset);
+        const uint8_t choice = static_cast<uint8_t>(entry);
+        const int input = choice != no_choice ? current->choices[choice] : -1;
+
+        load(worker, from);
+        next_input = input;
+        decided = false;
+        ReturnCode code = ReturnCode::CONTINUE;
+        while (Cpu::cycles_available > 0 && code == ReturnCode::CONTINUE && !decided)
+        {
+            instruction_start = Cpu::instruction_pointer;
+            cycles_at_start = Cpu::cycles_available;
+            code = Cpu::step();
+        }
+        if (!decided)
+        {
+            const uint16_t address = code == ReturnCode::CONTINUE ? 0 : static_cast<uint16_t>(Cpu::instruction_pointer - 1);
+            end(shared, area, from, input,
+                code == ReturnCode::BREAK                 ? Outcome::EXIT
+                : code == ReturnCode::UNKNOWN_INSTRUCTION ? Outcome::UNKNOWN_INSTRUCTION
+                                                          : Outcome::CUTOFF,
+                address);
+            return;
+        }
+
+        // Only the pages the snapshot loaded and the run wrote can differ from the image.
+        std::array<uint8_t, 256> numbers;
+        uint16_t page_count = 0;
+        for (size_t page = 0; page < worker.changed.size(); page++)
+        {
+            if ((worker.changed[page] || Memory::written_generation[page] > worker.loaded) &&
+                std::memcmp(Memory::main_memory.data() + page * 256, worker.image.data() + page * 256, 256) != 0)
+            {
+                numbers[page_count++] = static_cast<uint8_t>(page);
+            }
+        }
+        if (!insert(shared, hash_state(decision, numbers, page_count)))
+        {
+            area.duplicates++;
+            return;
+        }
+
+        const uint64_t size = (sizeof(Snapshot) + page_count * 257u + 7) & ~uint64_t{7};
+        const uint64_t offset = std::atomic_ref<uint64_t>{shared.header->arena_used}.fetch_add(size, std::memory_order_relaxed);
+        if (offset + size > shared.arena_size)
+        {
+            area.dropped++;
+            return;
+        }
+        Snapshot &snapshot = *reinterpret_cast<Snapshot *>(shared.arena + offset);
+        snapshot = Snapshot{from_offset, decision, from.depth + (input >= 0), static_cast<uint8_t>(input), input >= 0, page_count};
+        uint8_t *pages = reinterpret_cast<uint8_t *>(&snapshot + 1);
+        for (size_t index = 0; index < page_count; index++)
+        {
+            std::memcpy(pages + index * 256, Memory::main_memory.data() + numbers[index] * 256, 256);
+        }
+        std::memcpy(pages + page_count * 256, numbers.data(), page_count);
+        area.states++;
+
+        // Pushed last first, so that the first choice is explored first.
+        std::atomic_ref<int64_t> pending{shared.header->pending};
+        pending.fetch_add(static_cast<int64_t>(current->choices.size()), std::memory_order_relaxed);
+        for (size_t index = current->choices.size(); index-- > 0;)
+        {
+            if (!push(shared.deques[worker.index], offset << 8 | index))
+            {
+                area.dropped++;
+                pending.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /** \brief Explore snapshots from the worker's own deque, or stolen from others, until there are none left anywhere. */
+    void work(const Target &explored, const Shared &shared, const unsigned index)
+    {
+        Worker worker{index, explored.image, {}, 0};
+        worker.image.resize(Memory::main_memory.size());
+        std::copy(worker.image.begin(), worker.image.end(), Memory::main_memory.begin());
+        Memory::map(Memory::main_memory.data());
+        const uint8_t port_page = static_cast<uint8_t>(explored.input_address >> 8);
+        Memory::attach(port_page, port_page, &port);
+        Memory::mark_written(0x00, 0xFF);
+        worker.loaded = Memory::checkpoint();
+        current = &explored;
+
+        std::atomic_ref<int64_t> pending{shared.header->pending};
+        std::minstd_rand random{index + 1};
+        while (true)
+        {
+            uint64_t entry = 0;
+            bool found = pop(shared.deques[index], entry);
+            const unsigned first_victim = static_cast<unsigned>(random() % shared.workers);
+            for (unsigned attempt = 0; !found && attempt < shared.workers; attempt++)
+            {
+                const unsigned victim = (first_victim + attempt) % shared.workers;
+                found = victim != index && steal(shared.deques[victim], entry);
+                shared.areas[index].steals += found;
+            }
+            if (!found)
+            {
+                if (pending.load(std::memory_order_acquire) == 0)
+                {
+                    break;
+                }
+                std::this_thread::yield();
+                continue;
+            }
+            explore(shared, worker, entry);
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+        }
+
+        Memory::attach(port_page, port_page, nullptr);
+        current = nullptr;
+    }
+
+    /** \brief Explore the paths a target can take under its choices of input.
+     * \param target The target.
+     * \param options How many workers, and how much memory for snapshots.
+     * \param result Receives the counts and the ways the program ended, with the inputs for each.
+     * \return False if the target has no choices or too many, there is a device on the port's page, or the shared
+     * memory couldn't be mapped.
+     */
+    bool run(const Target &target, const Options &options, Result &result)
+    {
+        if (target.choices.empty() || target.choices.size() > max_choices || Memory::devices[target.input_address >> 8] != nullptr ||
+            options.memory < sizeof(Snapshot))
+        {
+            return false;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const unsigned workers = options.workers != 0 ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+
+        // A slot in the table for every 256 bytes of snapshots, about one for each snapshot of a page.
+        size_t table_size = 1024;
+        while (table_size < options.memory / 256)
+        {
+            table_size *= 2;
+        }
+        const auto align = [](const size_t size)
+        { return (size + 63) & ~size_t{63}; };
+        const size_t deques_at = align(sizeof(Header));
+        const size_t areas_at = deques_at + align(workers * sizeof(Deque));
+        const size_t table_at = areas_at + align(workers * sizeof(WorkerArea));
+        const size_t arena_at = table_at + align(table_size * sizeof(uint64_t));
+        const size_t size = arena_at + options.memory;
+        void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+        uint8_t *base = static_cast<uint8_t *>(memory);
+        const Shared shared{reinterpret_cast<Header *>(base), reinterpret_cast<Deque *>(base + deques_at),
+                            reinterpret_cast<WorkerArea *>(base + areas_at), reinterpret_cast<uint64_t *>(base + table_at),
+                            table_size, base + arena_at, options.memory, workers};
+
+        // The first snapshot is the target's own state, with nothing changed from the image.
+        Snapshot &first = *reinterpret_cast<Snapshot *>(shared.arena);
+        first = Snapshot{0, target.state, 0, 0, false, 0};
+        first.state.cycles_available = target.max_cycles;
+        shared.header->arena_used = sizeof(Snapshot);
+        shared.header->pending = 1;
+        push(shared.deques[0], no_choice);
+
+        std::cout.flush();
+        std::vector<pid_t> children;
+        for (unsigned index = 1; index < workers; index++)
+        {
+            const pid_t child = fork();
+            if (child == 0)
+            {
+                work(target, shared, index);
+                _exit(0);
+            }
+            if (child > 0)
+            {
+                children.push_back(child);
+            }
+        }
+        work(target, shared, 0);
+        for (const pid_t child : children)
+        {
+            waitpid(child, nullptr, 0);
+        }
+
+        result = Result{};
+        result.workers = static_cast<unsigned>(children.size() + 1);
+        result.memory_used = std::min<uint64_t>(shared.header->arena_used, options.memory);
+        for (unsigned index = 0; index < workers; index++)
+        {
+            const WorkerArea &area = shared.areas[index];
+            result.states += area.states;
+            result.duplicates += area.duplicates;
+            result.paths += area.paths;
+            result.dropped += area.dropped;
+            result.steals += area.steals;
+            for (uint32_t ending = 0; ending < area.ending_count; ending++)
+            {
+                const WorkerArea::Slot &slot = area.endings[ending];
+                const auto known = std::find_if(result.endings.begin(), result.endings.end(), [&](const Ending &other)
+                                                { return other.outcome == slot.outcome && other.address == slot.address; });
+                const Ending found{slot.outcome, slot.address,
+                                   std::vector<uint8_t>(slot.inputs.begin(), slot.inputs.begin() + std::min<size_t>(slot.depth, max_path)),
+                                   slot.depth};
+                if (known == result.endings.end())
+                {
+                    result.endings.push_back(found);
+                }
+                else if (slot.depth < known->depth)
+                {
+                    *known = found;
+                }
+            }
+        }
+        std::sort(result.endings.begin(), result.endings.end(), [](const Ending &a, const Ending &b)
+                  { return a.outcome != b.outcome ? a.outcome < b.outcome : a.address < b.address; });
+        munmap(memory, size);
+        result.nanoseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        return true;
+    }
+
+    /** \brief Print the counts and every way the program ended with its inputs. */
+    void report(const Result &result, std::ostream &out)
+    {
+        const double seconds = static_cast<double>(result.nanoseconds) / 1e9;
+        out << "Exploring: " << result.states << " states on " << result.workers << " workers in " << seconds << " s, "
+            << static_cast<uint64_t>(static_cast<double>(result.states) / seconds) << " per second" << std::endl;
+        out << "States: " << result.duplicates << " reached again, " << result.dropped << " dropped, " << result.paths
+            << " paths ended, " << result.steals << " stolen, " << result.memory_used / 1024 << " KB of snapshots" << std::endl;
+        for (const Ending &ending : result.endings)
+        {
+            const char *what = ending.outcome == Outcome::EXIT                  ? "BRK"
+                               : ending.outcome == Outcome::UNKNOWN_INSTRUCTION ? "unknown instruction"
+                                                                                : "cut off";
+            out << "  " << what << std::hex << std::setfill('0');
+            if (ending.outcome != Outcome::CUTOFF)
+            {
+                out << " at $" << std::setw(4) << ending.address;
+            }
+            out << std::dec << " after " << ending.depth << " inputs:" << std::hex;
+            for (const uint8_t input : ending.inputs)
+            {
+                out << " " << std::setw(2) << static_cast<int>(input);
+            }
+            out << std::dec << std::setfill(' ') << std::endl;
+        }
+    }
+}
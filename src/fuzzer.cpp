@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fuzzer.hpp"
+
+namespace Fuzzer
+{
+    /** Failures each worker keeps. */
+    constexpr size_t max_crashes = 32;
+
+    /** What a worker hands back to the parent, in memory shared with it. Written only by that worker. */
+    struct WorkerArea
+    {
+        uint64_t executions;
+        uint64_t corpus;
+        uint64_t failures;
+        uint32_t crash_count;
+        struct Slot
+        {
+            Outcome outcome;
+            uint16_t address;
+            std::array<uint8_t, max_input_size> input;
+        } crashes[max_crashes];
+    };
+
+    /** AFL's buckets for edge counts: 1, 2, 3, 4-7, 8-15, 16-31, 32-127 and 128-255 each get a bit, so that a loop
+     * running a few more times isn't new coverage but running many more times is. */
+    constexpr std::array<uint8_t, 256> buckets = []()
+    {
+        std::array<uint8_t, 256> table{};
+        for (size_t count = 1; count < table.size(); count++)
+        {
+            table[count] = count == 1   ? 1
+                           : count == 2 ? 2
+                           : count == 3 ? 4
+                           : count < 8  ? 8
+                           : count < 16 ? 16
+                           : count < 32 ? 32
+                           : count < 128 ? 64
+                                         : 128;
+        }
+        return table;
+    }();
+
+    /** \brief Run the target once on an input.
+     * \param target The target.
+     * \param image The target's image, padded to 64KB. Pages written by the last execution are copied back from it.
+     * \param input The input, input_size bytes.
+     * \param trace Receives the edge counts. Must be all zeros.
+     * \param reset Memory::checkpoint() taken when memory was last reset to the image, 0 to reset all of it. Updated.
+     * \return How the execution ended. Cpu::instruction_pointer is where.
+     */
+    Outcome execute(const Target &target, const std::vector<uint8_t> &image, const std::vector<uint8_t> &input, std::vector<uint8_t> &trace,
+                    uint64_t &reset)
+    {
+        for (size_t page = 0; page < Memory::written_generation.size(); page++)
+        {
+            if (Memory::written_generation[page] > reset)
+            {
+                std::memcpy(Memory::main_memory.data() + page * 256, image.data() + page * 256, 256);
+                Memory::written_generation[page] = Memory::generation;
+            }
+        }
+        // Every execution overwrites the whole input, so its pages needn't be reset.
+        for (uint16_t offset = 0; offset < target.input_size; offset++)
+        {
+            const uint16_t address = static_cast<uint16_t>(target.input_address + offset);
+            Memory::main_memory[address] = input[offset];
+            Memory::written_generation[address >> 8] = Memory::generation;
+        }
+        reset = Memory::checkpoint();
+
+        Cpu::load_state(target.state);
+        Cpu::cycles_available = 0;
+        Cpu::nmi_pending = false;
+        Cpu::irq_lines = 0;
+        // merge() left the trace all zeros.
+        Cpu::coverage = trace.data();
+        Cpu::previous_location = 0;
+        const ReturnCode code = Cpu::tick(target.max_cycles);
+        Cpu::coverage = nullptr;
+
+        switch (code)
+        {
+        case ReturnCode::CONTINUE:
+            return Outcome::HANG;
+        case ReturnCode::UNKNOWN_INSTRUCTION:
+            return Outcome::UNKNOWN_INSTRUCTION;
+        default:
+        {
+            const uint16_t address = static_cast<uint16_t>(Cpu::instruction_pointer - 1);
+            return address >= target.code_first && address <= target.code_last ? Outcome::EXIT : Outcome::RUNAWAY;
+        }
+        }
+    }
+
+    /** \brief Merge an execution's edge counts into the map shared by all workers, and zero them for the next.
+     * \return True if any edge reached a count bucket no execution had reached before.
+     */
+    bool merge(std::vector<uint8_t> &trace, uint8_t *seen)
+    {
+        bool found = false;
+        for (size_t index = 0; index < map_size; index += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, trace.data() + index, sizeof(word));
+            if (word == 0) [[likely]]
+            {
+                continue;
+            }
+            for (size_t edge = index; edge < index + 8; edge++)
+            {
+                const uint8_t bits = buckets[trace[edge]];
+                std::atomic_ref<uint8_t> shared{seen[edge]};
+                if ((shared.load(std::memory_order_relaxed) & bits) != bits)
+                {
+                    shared.fetch_or(bits, std::memory_order_relaxed);
+                    found = true;
+                }
+            }
+            std::memset(trace.data() + index, 0, sizeof(word));
+        }
+        return found;
+    }
+
+    /** \brief Change an input in 1 to 8 places: flip a bit, set a byte to an interesting or random value, add to it
+     * or subtract from it, or copy a run of bytes from another input in the corpus. */
+    void mutate(std::vector<uint8_t> &input, std::mt19937_64 &random, const std::vector<std::vector<uint8_t>> &corpus)
+    {
+        constexpr std::array<uint8_t, 9> interesting = {0x00, 0x01, 0x10, 0x20, 0x40, 0x7F, 0x80, 0xFE, 0xFF};
+        const int changes = 1 << (random() % 4);
+        for (int change = 0; change < changes; change++)
+        {
+            const size_t at = random() % input.size();
+            switch (random() % 6)
+            {
+            case 0:
+                input[at] ^= static_cast<uint8_t>(1 << (random() % 8));
+                break;
+            case 1:
+                input[at] = interesting[random() % interesting.size()];
+                break;
+            case 2:
+                input[at] = static_cast<uint8_t>(input[at] + 1 + random() % 16);
+                break;
+            case 3:
+                input[at] = static_cast<uint8_t>(input[at] - 1 - random() % 16);
+                break;
+            case 4:
+                input[at] = static_cast<uint8_t>(random());
+                break;
+            default:
+            {
+                const std::vector<uint8_t> &other = corpus[random() % corpus.size()];
+                const size_t length = 1 + random() % (input.size() - at);
+                std::copy(other.begin() + static_cast<long>(at), other.begin() + static_cast<long>(at + length), input.begin() + static_cast<long>(at));
+                break;
+            }
+            }
+        }
+    }
+
+    /** \brief Fuzz the target for one worker's share of the executions. */
+    void work(const Target &target, const Options &options, const unsigned index, uint8_t *seen, WorkerArea &area)
+    {
+        std::vector<uint8_t> image = target.image;
+        image.resize(Memory::main_memory.size());
+        Memory::map(Memory::main_memory.data());
+        uint64_t reset = 0;
+
+        std::vector<uint8_t> trace(map_size);
+        std::mt19937_64 random{options.seed + index};
+        std::vector<std::vector<uint8_t>> corpus;
+
+        auto try_input = [&](const std::vector<uint8_t> &input, const bool initial)
+        {
+            const Outcome outcome = execute(target, image, input, trace, reset);
+            area.executions++;
+            // Initial inputs are kept even if another worker covered the same edges first, to have something to mutate.
+            if (merge(trace, seen) || initial)
+            {
+                corpus.push_back(input);
+                area.corpus++;
+            }
+            if (outcome == Outcome::EXIT)
+            {
+                return;
+            }
+            area.failures++;
+            const uint16_t address = outcome == Outcome::HANG ? 0 : static_cast<uint16_t>(Cpu::instruction_pointer - 1);
+            const auto end = area.crashes + area.crash_count;
+            if (area.crash_count < max_crashes && std::none_of(area.crashes, end, [&](const WorkerArea::Slot &slot)
+                                                               { return slot.outcome == outcome && slot.address == address; }))
+            {
+                WorkerArea::Slot &slot = area.crashes[area.crash_count++];
+                slot.outcome = outcome;
+                slot.address = address;
+                std::copy(input.begin(), input.end(), slot.input.begin());
+            }
+        };
+
+        try_input(std::vector<uint8_t>(target.input_size, 0), true);
+        for (std::vector<uint8_t> input : options.seeds)
+        {
+            input.resize(target.input_size);
+            try_input(input, true);
+        }
+        std::vector<uint8_t> input;
+        while (area.executions < options.executions)
+        {
+            input = corpus[random() % corpus.size()];
+            mutate(input, random, corpus);
+            try_input(input, false);
+        }
+    }
+
+    /** \brief Fuzz a target.
+     * \param target The target.
+     * \param options How many workers, executions and which seeds.
+     * \param result Receives the counts and the failures found, with one input for each.
+     * \return False if the target's input doesn't fit, or the workers couldn't be started.
+     */
+    bool run(const Target &target, const Options &options, Result &result)
+    {
+        if (target.input_size == 0 || target.input_size > max_input_size)
+        {
+            return false;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const unsigned workers = options.workers != 0 ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+
+        // The coverage map and the workers' areas, shared with the worker processes.
+        const size_t size = map_size + workers * sizeof(WorkerArea);
+        void *shared = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared == MAP_FAILED)
+        {
+            return false;
+        }
+        uint8_t *seen = static_cast<uint8_t *>(shared);
+        WorkerArea *areas = reinterpret_cast<WorkerArea *>(seen + map_size);
+
+        std::cout.flush();
+        std::vector<pid_t> children;
+        for (unsigned index = 1; index < workers; index++)
+        {
+            const pid_t child = fork();
+            if (child == 0)
+            {
+                work(target, options, index, seen, areas[index]);
+                _exit(0);
+            }
+            if (child > 0)
+            {
+                children.push_back(child);
+            }
+        }
+        work(target, options, 0, seen, areas[0]);
+        for (const pid_t child : children)
+        {
+            waitpid(child, nullptr, 0);
+        }
+
+        result = Result{};
+        result.workers = static_cast<unsigned>(children.size() + 1);
+        // Workers that couldn't be started left their areas zeroed.
+        for (unsigned index = 0; index < workers; index++)
+        {
+            const WorkerArea &area = areas[index];
+            result.executions += area.executions;
+            result.corpus += area.corpus;
+            result.failures += area.failures;
+            for (uint32_t crash = 0; crash < area.crash_count; crash++)
+            {
+                const WorkerArea::Slot &slot = area.crashes[crash];
+                if (std::none_of(result.crashes.begin(), result.crashes.end(), [&](const Crash &known)
+                                 { return known.outcome == slot.outcome && known.address == slot.address; }))
+                {
+                    result.crashes.push_back(Crash{slot.outcome, slot.address,
+                                                   std::vector<uint8_t>(slot.input.begin(), slot.input.begin() + target.input_size)});
+                }
+            }
+        }
+        for (size_t edge = 0; edge < map_size; edge++)
+        {
+            result.coverage += static_cast<uint64_t>(std::popcount(seen[edge]));
+        }
+        munmap(shared, size);
+        result.nanoseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        return true;
+    }
+
+    /** \brief Print the counts and every distinct failure with its input. */
+    void report(const Result &result, std::ostream &out)
+    {
+        const double seconds = static_cast<double>(result.nanoseconds) / 1e9;
+        out << "Fuzzing: " << result.executions << " executions on " << result.workers << " workers in " << seconds << " s, "
+            << static_cast<uint64_t>(static_cast<double>(result.executions) / seconds / result.workers) << " per second per worker" << std::endl;
+        out << "Corpus: " << result.corpus << " inputs, " << result.coverage << " edge buckets, " << result.failures << " failing executions" << std::endl;
+        for (const Crash &crash : result.crashes)
+        {
+            const char *what = crash.outcome == Outcome::UNKNOWN_INSTRUCTION ? "unknown instruction"
+                               : crash.outcome == Outcome::RUNAWAY           ? "runaway, BRK"
+                                                                             : "hang";
+            out << "  " << what;
+            out << std::hex << std::setfill('0');
+            if (crash.outcome != Outcome::HANG)
+            {
+                out << " at $" << std::setw(4) << crash.address;
+            }
+            out << ", input:";
+            for (const uint8_t byte : crash.input)
+            {
+                out << " " << std::setw(2) << static_cast<int>(byte);
+            }
+            out << std::dec << std::setfill(' ') << std::endl;
+        }
+    }
+}
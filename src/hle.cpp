@@ -0,0 +1,166 @@
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "hle.hpp"
+#include "rewrite.hpp"
+
+namespace Hle
+{
+    std::unordered_map<uint16_t, Hook> hooks;
+    std::vector<Mismatch> mismatch_log;
+
+    /** \brief Bind a guest subroutine to a native implementation, replacing any existing hook at that address.
+     * \param address Address of the first instruction of the guest subroutine.
+     * \param routine The native implementation.
+     * \param cycles Cycles charged for the whole call, from the JSR up to and including the RTS.
+     */
+    void register_hook(const uint16_t address, const Routine routine, const int cycles)
+    {
+        hooks[address] = Hook{routine, cycles};
+        hook_count = static_cast<int>(hooks.size());
+    }
+
+    /** \brief Remove the hook at an address, if there is one.
+     * \param address Address of the hooked guest subroutine.
+     */
+    void unregister_hook(const uint16_t address)
+    {
+        hooks.erase(address);
+        hook_count = static_cast<int>(hooks.size());
+    }
+
+    /** \brief Remove all hooks and forget all recorded mismatches. */
+    void clear()
+    {
+        hooks.clear();
+        mismatch_log.clear();
+        hook_count = 0;
+    }
+
+    /** \brief Get the mismatches recorded in verification mode.
+     * \return All mismatches since the last call to clear().
+     */
+    const std::vector<Mismatch> &mismatches()
+    {
+        return mismatch_log;
+    }
+
+    /** \brief Run the native routine for a hook, with the semantics of a JSR immediately followed by an RTS.
+     * \param hook The hook to run.
+     *
+     * The instruction pointer must point at the operand of the JSR.
+     */
+    void run_native(const Hook &hook)
+    {
+        Cpu::instruction_pointer += 2;
+        hook.routine();
+        Cpu::cycles_available -= hook.cycles;
+    }
+
+    /** \brief Run the guest subroutine as an ordinary JSR, up to the point where it returns to the caller.
+     * \param target_address Address of the guest subroutine.
+     * \return True if the subroutine returned within the instruction limit.
+     */
+    bool run_guest(const uint16_t target_address)
+    {
+        uint16_t return_address = static_cast<uint16_t>(Cpu::instruction_pointer + 2);
+        uint16_t stack_pointer = Cpu::stack_pointer;
+
+        // Same as the JSR handler.
+        Cpu::instruction_pointer++;
+        Bus::write(static_cast<uint8_t>(Cpu::instruction_pointer >> 8), Cpu::stack_pointer);
+        Cpu::stack_pointer--;
+        Bus::write(static_cast<uint8_t>(Cpu::instruction_pointer & 0xFF), Cpu::stack_pointer);
+        Cpu::stack_pointer--;
+        Cpu::instruction_pointer = target_address;
+        Cpu::cycles_available -= 6;
+
+        for (int i = 0; i < verify_instruction_limit; i++)
+        {
+            if (Cpu::instruction_pointer == return_address && Cpu::stack_pointer == stack_pointer)
+            {
+                return true;
+            }
+            if (Cpu::step() != ReturnCode::CONTINUE)
+            {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    /** \brief Check whether an address is in the dead part of the stack, which the guest may scribble on.
+     * \param address The address to check.
+     * \param stack_pointer The stack pointer after the call.
+     * \return True if the address is in the stack page at or below the stack pointer, where pushes were popped from.
+     */
+    bool is_dead_stack(const uint16_t address, const uint16_t stack_pointer)
+    {
+        return address >= 0x0100 && address <= stack_pointer;
+    }
+
+    /** \brief Run both implementations of a hooked call, keep the guest result and record any differences.
+     * \param target_address Address of the hooked subroutine.
+     * \param hook The hook for that address.
+     */
+    void run_verified(const uint16_t target_address, const Hook &hook)
+    {
+        const Cpu::State before = Cpu::save_state();
+        const std::array<uint8_t, 256 * 256> memory_before = Memory::snapshot();
+
+        run_native(hook);
+        const Cpu::State native = Cpu::save_state();
+        const std::array<uint8_t, 256 * 256> memory_native = Memory::snapshot();
+
+        Cpu::load_state(before);
+        Memory::restore(memory_before);
+        bool returned = run_guest(target_address);
+        Cpu::State guest = Cpu::save_state();
+
+        Mismatch mismatch{target_address, native, guest, hook.cycles, before.cycles_available - guest.cycles_available, {}, returned};
+        const std::array<uint8_t, 256 * 256> memory_guest = Memory::snapshot();
+        for (uint32_t address = 0; address < memory_native.size(); address++)
+        {
+            uint16_t address16 = static_cast<uint16_t>(address);
+            if (memory_native[address] != memory_guest[address] && !is_dead_stack(address16, guest.stack_pointer))
+            {
+                mismatch.memory_differences.push_back(address16);
+            }
+        }
+
+        // Cycle counts are expected to differ; everything else must match.
+        guest.cycles_available = native.cycles_available;
+        if (!returned || guest != native || !mismatch.memory_differences.empty())
+        {
+            mismatch_log.push_back(mismatch);
+        }
+    }
+
+    /** \brief Handle a JSR to a hooked subroutine. Called by the JSR handler when any hooks are registered.
+     * \param target_address The JSR target.
+     * \return True if a hook handled the call, false if the JSR should proceed as normal.
+     *
+     * The instruction pointer must point at the operand of the JSR. When this returns true the call has completed:
+     * the instruction pointer is after the JSR and the cycles for the call have been charged.
+     */
+    bool call(const uint16_t target_address)
+    {
+        auto hook = hooks.find(target_address);
+        if (hook == hooks.end())
+        {
+            return false;
+        }
+
+        if (verify)
+        {
+            run_verified(target_address, hook->second);
+        }
+        else
+        {
+            run_native(hook->second);
+        }
+        return true;
+    }
+}
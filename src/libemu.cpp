@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "cow_memory.hpp"
+#include "debugger.hpp"
+#include "libemu.h"
+#include "libemu.hpp"
+#include "rewrite.hpp"
+
+namespace Emu
+{
+    /** A machine that isn't running keeps its registers here. The active machine's registers live in Cpu, and its
+     * memory is mapped into Memory. */
+    struct Machine
+    {
+        Cpu::State cpu{};
+        CowMemory::Space memory;
+        uint64_t cycles = 0;
+        /** Marked in Debugger's bitmaps while the machine is active. */
+        std::vector<uint16_t> breakpoints;
+        std::vector<uint16_t> watchpoints;
+        Debugger::Hit last_hit;
+        int resume_address = -1;
+    };
+
+    /** The machine whose state is currently in Cpu and Memory, if any. */
+    Machine *active = nullptr;
+
+    /** Largest number of cycles handed to Cpu::tick() at once, leaving room for overshoot. */
+    constexpr int max_slice = std::numeric_limits<int>::max() / 2;
+
+    /** \brief Make a machine the active one, saving the state of the previously active machine.
+     * \param machine The machine to activate.
+     */
+    void activate(Machine &machine)
+    {
+        if (active == &machine)
+        {
+            return;
+        }
+        if (active != nullptr)
+        {
+            active->cpu = Cpu::save_state();
+            active->last_hit = Debugger::last_hit;
+            active->resume_address = Debugger::resume_address;
+        }
+        Cpu::load_state(machine.cpu);
+        CowMemory::map(machine.memory);
+        Debugger::clear();
+        for (const uint16_t address : machine.breakpoints)
+        {
+            Debugger::set_breakpoint(address);
+        }
+        for (const uint16_t address : machine.watchpoints)
+        {
+            Debugger::set_watchpoint(address);
+        }
+        Debugger::last_hit = machine.last_hit;
+        Debugger::resume_address = machine.resume_address;
+        active = &machine;
+    }
+
+    /** \brief Convert a code returned by the CPU into a stop reason.
+     * \param code A code other than ReturnCode::CONTINUE.
+     * \return The matching stop reason.
+     */
+    StopReason stop_reason(const ReturnCode code)
+    {
+        switch (code)
+        {
+        case ReturnCode::BREAK:
+            return StopReason::BREAK;
+        case ReturnCode::BREAKPOINT:
+            return StopReason::BREAKPOINT;
+        case ReturnCode::WATCHPOINT:
+            return StopReason::WATCHPOINT;
+        default:
+            return StopReason::UNKNOWN_INSTRUCTION;
+        }
+    }
+
+    /** \brief Run a machine one instruction at a time until a condition holds after an instruction.
+     * \param machine The machine to run.
+     * \param max_cycles Stop with StopReason::CYCLE_LIMIT once this many cycles have been used.
+     * \param done Called after each instruction; returns true to stop.
+     * \param reason Stop reason to return when done() returns true.
+     * \return The reason the run stopped.
+     *
+     * Cycles used here are counted, but do not draw on the cycle credit left over by run_cycles(). Breakpoints and
+     * watchpoints stop the run as they stop run_cycles().
+     */
+    template <typename Done>
+    StopReason run_stepping(Machine &machine, const uint64_t max_cycles, Done done, const StopReason reason)
+    {
+        activate(machine);
+
+        const int credit = Cpu::cycles_available;
+        uint64_t used = 0;
+        StopReason result = StopReason::CYCLE_LIMIT;
+        Debugger::start_run();
+        while (used < max_cycles)
+        {
+            ReturnCode code = Debugger::step();
+            if (Debugger::watch_hit) [[unlikely]]
+            {
+                code = Debugger::finish(code);
+            }
+            used += static_cast<uint64_t>(credit - Cpu::cycles_available);
+            Cpu::cycles_available = credit;
+
+            if (code != ReturnCode::CONTINUE)
+            {
+                result = stop_reason(code);
+                break;
+            }
+            if (done())
+            {
+                result = reason;
+                break;
+            }
+        }
+
+        machine.cycles += used;
+        return result;
+    }
+
+    /** \brief Add an address to a machine's list of breakpoints or watchpoints, or take it out. */
+    void mark(std::vector<uint16_t> &addresses, const uint16_t address, const bool set)
+    {
+        const auto at = std::find(addresses.begin(), addresses.end(), address);
+        if (set && at == addresses.end())
+        {
+            addresses.push_back(address);
+        }
+        else if (!set && at != addresses.end())
+        {
+            addresses.erase(at);
+        }
+    }
+
+    /** \brief Create a machine with cleared memory and registers.
+     * \return The new machine, to be released with destroy().
+     */
+    Machine *create()
+    {
+        return new Machine;
+    }
+
+    /** \brief Make a copy of a machine that shares its memory until either of them writes to it.
+     * \param machine The machine to copy.
+     * \return The new machine, to be released with destroy().
+     */
+    Machine *fork(Machine &machine)
+    {
+        Cpu::State state = active == &machine ? Cpu::save_state() : machine.cpu;
+        return new Machine{state, CowMemory::fork(machine.memory), machine.cycles, machine.breakpoints, machine.watchpoints, {}, -1};
+    }
+
+    /** \brief Release a machine.
+     * \param machine A machine returned by create() or fork().
+     */
+    void destroy(Machine *machine)
+    {
+        if (active == machine)
+        {
+            CowMemory::unmap();
+            Debugger::clear();
+            active = nullptr;
+        }
+        delete machine;
+    }
+
+    /** \brief Copy a program or data image into a machine's memory.
+     * \param machine The machine to load.
+     * \param data The image.
+     * \param size Size of the image in bytes.
+     * \param address Address of the first byte of the image.
+     * \return False if the image doesn't fit in memory at that address.
+     */
+    bool load_image(Machine &machine, const uint8_t *data, const size_t size, const uint16_t address)
+    {
+        if (address + size > 0x10000)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < size; i++)
+        {
+            CowMemory::write(machine.memory, static_cast<uint16_t>(address + i), data[i]);
+        }
+        return true;
+    }
+
+    /** \brief Get a machine's registers and flags. */
+    Cpu::State get_state(Machine &machine)
+    {
+        return active == &machine ? Cpu::save_state() : machine.cpu;
+    }
+
+    /** \brief Set a machine's registers and flags. */
+    void set_state(Machine &machine, const Cpu::State &state)
+    {
+        if (active == &machine)
+        {
+            Cpu::load_state(state);
+        }
+        else
+        {
+            machine.cpu = state;
+        }
+    }
+
+    /** \brief Read a byte of a machine's memory. */
+    uint8_t peek(Machine &machine, const uint16_t address)
+    {
+        return CowMemory::read(machine.memory, address);
+    }
+
+    /** \brief Write a byte of a machine's memory. */
+    void poke(Machine &machine, const uint16_t address, const uint8_t data)
+    {
+        CowMemory::write(machine.memory, address, data);
+    }
+
+    /** \brief Measure the memory a machine uses, not counting pages it shares with other machines. */
+    MemoryUsage memory_usage(const Machine &machine)
+    {
+        CowMemory::Usage usage = CowMemory::usage(machine.memory);
+        return MemoryUsage{usage.private_pages, usage.shared_pages, sizeof(Machine) - sizeof(CowMemory::Space) + usage.bytes};
+    }
+
+    /** \brief Get the total number of cycles a machine has run. */
+    uint64_t cycles(const Machine &machine)
+    {
+        return machine.cycles;
+    }
+
+    /** \brief Run a machine for a number of cycles, exactly as Cpu::tick() would.
+     * \param machine The machine to run.
+     * \param cycles Number of cycles to run. The last instruction may overshoot; the overshoot is deducted from the
+     * next call.
+     * \return StopReason::CYCLES, or the reason the CPU stopped early.
+     */
+    StopReason run_cycles(Machine &machine, const uint64_t cycles)
+    {
+        activate(machine);
+
+        uint64_t remaining = cycles;
+        while (remaining > 0)
+        {
+            int slice = static_cast<int>(std::min<uint64_t>(remaining, max_slice));
+            int before = Cpu::cycles_available;
+            ReturnCode code = Cpu::tick(slice);
+            machine.cycles += static_cast<uint64_t>(before + slice - Cpu::cycles_available);
+            remaining -= static_cast<uint64_t>(slice);
+
+            if (code != ReturnCode::CONTINUE)
+            {
+                return stop_reason(code);
+            }
+        }
+        return StopReason::CYCLES;
+    }
+
+    /** \brief Run a machine for a number of instructions.
+     * \param machine The machine to run.
+     * \param count Number of instructions to execute.
+     * \return StopReason::INSTRUCTIONS, or the reason the CPU stopped early.
+     */
+    StopReason run_instructions(Machine &machine, const uint64_t count)
+    {
+        if (count == 0)
+        {
+            return StopReason::INSTRUCTIONS;
+        }
+
+        uint64_t executed = 0;
+        return run_stepping(
+            machine, std::numeric_limits<uint64_t>::max(), [&]()
+            { return ++executed == count; },
+            StopReason::INSTRUCTIONS);
+    }
+
+    /** \brief Run a machine until the instruction pointer reaches an address. At least one instruction is executed.
+     * \param machine The machine to run.
+     * \param address The address to stop at, before the instruction there is executed.
+     * \param max_cycles Maximum number of cycles to run.
+     * \return StopReason::PC_REACHED, StopReason::CYCLE_LIMIT, or the reason the CPU stopped early.
+     */
+    StopReason run_until_pc(Machine &machine, const uint16_t address, const uint64_t max_cycles)
+    {
+        return run_stepping(
+            machine, max_cycles, [&]()
+            { return Cpu::instruction_pointer == address; },
+            StopReason::PC_REACHED);
+    }
+
+    /** \brief Run a machine until an instruction writes to an address.
+     * \param machine The machine to run.
+     * \param address The address to watch.
+     * \param max_cycles Maximum number of cycles to run.
+     * \return StopReason::WRITE_REACHED, StopReason::CYCLE_LIMIT, or the reason the CPU stopped early.
+     */
+    StopReason run_until_write(Machine &machine, const uint16_t address, const uint64_t max_cycles)
+    {
+        activate(machine);
+        const bool watched = Debugger::set_watchpoint(address);
+        StopReason reason = run_stepping(
+            machine, max_cycles, []()
+            { return false; },
+            StopReason::WRITE_REACHED);
+        Debugger::set_watchpoint(address, watched);
+        return reason == StopReason::WATCHPOINT && Debugger::last_hit.address == address ? StopReason::WRITE_REACHED : reason;
+    }
+
+    /** \brief Set or clear a breakpoint. Runs stop with StopReason::BREAKPOINT before the instruction at it, unless
+     * they start there.
+     * \param machine The machine.
+     * \param address Address of the instruction.
+     * \param set True to set the breakpoint, false to clear it.
+     */
+    void set_breakpoint(Machine &machine, const uint16_t address, const bool set)
+    {
+        mark(machine.breakpoints, address, set);
+        if (active == &machine)
+        {
+            Debugger::set_breakpoint(address, set);
+        }
+    }
+
+    /** \brief Set or clear a watchpoint. Runs stop with StopReason::WATCHPOINT after an instruction writes to it.
+     * \param machine The machine.
+     * \param address The address to watch.
+     * \param set True to set the watchpoint, false to clear it.
+     */
+    void set_watchpoint(Machine &machine, const uint16_t address, const bool set)
+    {
+        mark(machine.watchpoints, address, set);
+        if (active == &machine)
+        {
+            Debugger::set_watchpoint(address, set);
+        }
+    }
+
+    /** \brief Get the breakpoint the last run to stop at one stopped at, or the address written and the byte written
+     * by the last run to stop at a watchpoint. */
+    Debugger::Hit last_hit(const Machine &machine)
+    {
+        return active == &machine ? Debugger::last_hit : machine.last_hit;
+    }
+}
+
+namespace
+{
+    Emu::Machine *unwrap(emu_machine *machine)
+    {
+        return reinterpret_cast<Emu::Machine *>(machine);
+    }
+
+    emu_stop_reason wrap(const Emu::StopReason reason)
+    {
+        return static_cast<emu_stop_reason>(reason);
+    }
+}
+
+extern "C"
+{
+    emu_machine *emu_create(void)
+    {
+        return reinterpret_cast<emu_machine *>(Emu::create());
+    }
+
+    emu_machine *emu_fork(emu_machine *machine)
+    {
+        return reinterpret_cast<emu_machine *>(Emu::fork(*unwrap(machine)));
+    }
+
+    void emu_destroy(emu_machine *machine)
+    {
+        Emu::destroy(unwrap(machine));
+    }
+
+    int emu_load_image(emu_machine *machine, const uint8_t *data, size_t size, uint16_t address)
+    {
+        return Emu::load_image(*unwrap(machine), data, size, address) ? 1 : 0;
+    }
+
+    void emu_get_registers(emu_machine *machine, emu_registers *registers)
+    {
+        Cpu::State state = Emu::get_state(*unwrap(machine));
+        *registers = emu_registers{state.A, state.X, state.Y, state.stack_pointer, state.instruction_pointer,
+                                   state.C, state.Z, state.I, state.D, state.B, state.V, state.N};
+    }
+
+    void emu_set_registers(emu_machine *machine, const emu_registers *registers)
+    {
+        Cpu::State state = Emu::get_state(*unwrap(machine));
+        state.A = registers->a;
+        state.X = registers->x;
+        state.Y = registers->y;
+        state.stack_pointer = registers->sp;
+        state.instruction_pointer = registers->pc;
+        state.C = registers->c;
+        state.Z = registers->z;
+        state.I = registers->i;
+        state.D = registers->d;
+        state.B = registers->b;
+        state.V = registers->v;
+        state.N = registers->n;
+        Emu::set_state(*unwrap(machine), state);
+    }
+
+    uint8_t emu_peek(emu_machine *machine, uint16_t address)
+    {
+        return Emu::peek(*unwrap(machine), address);
+    }
+
+    void emu_poke(emu_machine *machine, uint16_t address, uint8_t data)
+    {
+        Emu::poke(*unwrap(machine), address, data);
+    }
+
+    uint64_t emu_cycles(const emu_machine *machine)
+    {
+        return Emu::cycles(*reinterpret_cast<const Emu::Machine *>(machine));
+    }
+
+    void emu_memory_usage(const emu_machine *machine, emu_memory_usage_info *usage)
+    {
+        Emu::MemoryUsage result = Emu::memory_usage(*reinterpret_cast<const Emu::Machine *>(machine));
+        *usage = emu_memory_usage_info{result.private_pages, result.shared_pages, result.bytes};
+    }
+
+    emu_stop_reason emu_run_cycles(emu_machine *machine, uint64_t cycles)
+    {
+        return wrap(Emu::run_cycles(*unwrap(machine), cycles));
+    }
+
+    emu_stop_reason emu_run_instructions(emu_machine *machine, uint64_t count)
+    {
+        return wrap(Emu::run_instructions(*unwrap(machine), count));
+    }
+
+    emu_stop_reason emu_run_until_pc(emu_machine *machine, uint16_t address, uint64_t max_cycles)
+    {
+        return wrap(Emu::run_until_pc(*unwrap(machine), address, max_cycles));
+    }
+
+    emu_stop_reason emu_run_until_write(emu_machine *machine, uint16_t address, uint64_t max_cycles)
+    {
+        return wrap(Emu::run_until_write(*unwrap(machine), address, max_cycles));
+    }
+
+    void emu_set_breakpoint(emu_machine *machine, uint16_t address, int set)
+    {
+        Emu::set_breakpoint(*unwrap(machine), address, set != 0);
+    }
+
+    void emu_set_watchpoint(emu_machine *machine, uint16_t address, int set)
+    {
+        Emu::set_watchpoint(*unwrap(machine), address, set != 0);
+    }
+
+    void emu_last_hit(const emu_machine *machine, uint16_t *address, uint8_t *data)
+    {
+        Debugger::Hit hit = Emu::last_hit(*reinterpret_cast<const Emu::Machine *>(machine));
+        *address = hit.address;
+        *data = hit.data;
+    }
+}
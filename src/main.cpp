@@ -1,8 +1,24 @@
+#include <algorithm>
+#include <iomanip>
 #include <sstream>
 #include <iostream>
 
-#include "rewrite.hpp"
+#include "apu.hpp"
+#include "cartridge.hpp"
+#include "clock.hpp"
+#include "coverage.hpp"
+#include "debugger.hpp"
+#include "differential.hpp"
+#include "explorer.hpp"
+#include "fuzzer.hpp"
 #include "input_parser.hpp"
+#include "movie.hpp"
+#include "pacer.hpp"
+#include "ppu.hpp"
+#include "rewrite.hpp"
+#include "run_ahead.hpp"
+#include "video_writer.hpp"
+#include "wav_writer.hpp"
 
 /** \brief Application entry point. Creates a NES system and executes a loaded program. */
 int main(int argc, char *argv[])
@@ -12,17 +28,56 @@ int main(int argc, char *argv[])
     {
         // TODO Add proper help text, then quit.
         std::cout << "Usage:" << std::endl;
-        std::cout << "  -r    Path to ROM file" << std::endl;
+        std::cout << "  -r    Path to ROM file: a 64KB memory image, or an iNES / NES 2.0 cartridge (mappers 0-4)" << std::endl;
         std::cout << "  -ip   Specify the starting instruction pointer (in hex)" << std::endl;
         std::cout << "  -sp   Specify the starting stack pointer (in hex)" << std::endl;
+        std::cout << "  -reset  Start at the address in the reset vector at $FFFC" << std::endl;
+        std::cout << "  -brk  What BRK does: halt (default) or vector" << std::endl;
+        std::cout << "  -clock  Clock profile: ntsc (default), pal or custom" << std::endl;
+        std::cout << "  -cpu-hz  CPU frequency in Hz for -clock custom, e.g. 1789772.727" << std::endl;
+        std::cout << "  -fps  Frame rate for -clock custom, e.g. 60.0988" << std::endl;
+        std::cout << "  -spin-us  Microseconds before each frame deadline to spin instead of sleep (default 2000)" << std::endl;
+        std::cout << "  -pacer-stats  Print frame timing statistics on exit" << std::endl;
+        std::cout << "  -ppu  Attach the PPU at $2000-$3FFF (rendered headless), and the APU for sprite DMA" << std::endl;
+        std::cout << "  -ppu-thread  Attach the PPU and render on a separate thread" << std::endl;
+        std::cout << "  -wav  Attach the APU at $4000-$4017 and write its output to this WAV file" << std::endl;
+        std::cout << "  -video  Record the PPU's frames to this file: YUV4MPEG2 if it ends in .y4m, raw RGB24 otherwise" << std::endl;
+        std::cout << "  -video-region  Record a region of memory instead, one colour index per byte, e.g. 0200:16x16" << std::endl;
+        std::cout << "  -run-ahead  Frames to run ahead of each frame shown, to hide input lag (not with -ppu-thread)" << std::endl;
+        std::cout << "  -record  Record controller input and a hash of every frame to this movie file" << std::endl;
+        std::cout << "  -play  Play back a movie as fast as possible, checking every frame, with the options it was recorded with" << std::endl;
+        std::cout << "  -fuzz  Instead of running normally, fuzz the input buffer at this address and size, e.g. 0200:16, and report inputs that crash" << std::endl;
+        std::cout << "  -fuzz-code  Address range of the code being fuzzed, e.g. 8000-80FF; BRK outside it is a runaway" << std::endl;
+        std::cout << "  -fuzz-runs  Executions per worker (default 1000000)" << std::endl;
+        std::cout << "  -fuzz-workers  Worker processes (default one per core)" << std::endl;
+        std::cout << "  -explore  Instead of running normally, explore every path the program takes when this input port returns each of the -explore-inputs" << std::endl;
+        std::cout << "  -explore-inputs  Values the port can return, e.g. 00,01,80 (default 00,01)" << std::endl;
+        std::cout << "  -explore-cycles  Cycles each path may run (default 100000)" << std::endl;
+        std::cout << "  -explore-workers  Worker processes (default one per core)" << std::endl;
+        std::cout << "  -explore-memory  Megabytes of snapshots to keep (default 64)" << std::endl;
+        std::cout << "  -break  Stop before running the instruction at any of these addresses, e.g. 8000,8010" << std::endl;
+        std::cout << "  -watch  Stop after an instruction writes to any of these addresses, e.g. 0200,4014" << std::endl;
+        std::cout << "  -coverage  Merge which instructions ran and which ways branches went into this file, creating it if needed" << std::endl;
+        std::cout << "  -coverage-report  Instead of running, print the ROM's disassembly annotated with the coverage in this file" << std::endl;
+        std::cout << "  -differential  Instead of running normally, run this many instructions on the interpreter and the SoA engine in lockstep and report where they first differ" << std::endl;
         return 0;
     }
 
+    if (!Clock::from_options(input, Clock::active))
+    {
+        std::cout << "Invalid clock options" << std::endl;
+        return 1;
+    }
+
     // Get ROM file name from arguments.
     if (input.contains("-r"))
     {
         std::string rom_file_name = input.get_command_option("-r");
-        Bus::load_rom(rom_file_name);
+        if (!Bus::load_rom(rom_file_name))
+        {
+            std::cout << "Could not load ROM " << rom_file_name << std::endl;
+            return 1;
+        }
     }
     else
     {
@@ -46,8 +101,255 @@ int main(int argc, char *argv[])
         Cpu::instruction_pointer = instruction_pointer;
     }
 
+    // Run the reset sequence instead, as a cartridge expects.
+    if (input.contains("-reset"))
+    {
+        Cpu::reset();
+    }
+
+    if (input.get_command_option("-brk") == "vector")
+    {
+        Cpu::brk_policy = Cpu::BrkPolicy::VECTOR;
+    }
+
+    // The SoA engine, the fuzzer and the explorer only know plain memory, so not a cartridge's.
+    const bool plain_memory = std::none_of(Memory::devices.begin(), Memory::devices.end(), [](const Memory::Device *device)
+                                           { return device != nullptr; });
+    if (input.contains("-differential"))
+    {
+        if (!plain_memory)
+        {
+            std::cout << "Differential testing needs a 64KB memory image" << std::endl;
+            return 1;
+        }
+        const std::vector<uint8_t> image(Memory::main_memory.begin(), Memory::main_memory.end());
+        const Differential::Result result = Differential::run(Differential::soa_engine, image, Cpu::save_state(),
+                                                              std::stoull(input.get_command_option("-differential")));
+        Differential::report(result, Differential::soa_engine, std::cout);
+        return result.diverged ? 1 : 0;
+    }
+
+    if (input.contains("-fuzz"))
+    {
+        Fuzzer::Target target;
+        target.image.assign(Memory::main_memory.begin(), Memory::main_memory.end());
+        target.state = Cpu::save_state();
+        unsigned address = 0, size = 0, first = 0, last = 0xFFFF;
+        char separator = 0;
+        std::istringstream(input.get_command_option("-fuzz")) >> std::hex >> address >> separator >> std::dec >> size;
+        if (input.contains("-fuzz-code"))
+        {
+            std::istringstream(input.get_command_option("-fuzz-code")) >> std::hex >> first >> separator >> last;
+        }
+        target.input_address = static_cast<uint16_t>(address);
+        target.input_size = static_cast<uint16_t>(std::min<unsigned>(size, 0xFFFF));
+        target.code_first = static_cast<uint16_t>(first);
+        target.code_last = static_cast<uint16_t>(last);
+
+        Fuzzer::Options options;
+        options.executions = input.contains("-fuzz-runs") ? std::stoull(input.get_command_option("-fuzz-runs")) : 1000000;
+        options.workers = input.contains("-fuzz-workers") ? static_cast<unsigned>(std::stoul(input.get_command_option("-fuzz-workers"))) : 0;
+        Fuzzer::Result result;
+        if (!plain_memory || !Fuzzer::run(target, options, result))
+        {
+            std::cout << "Fuzzing needs a 64KB memory image and an input of 1 to " << Fuzzer::max_input_size << " bytes" << std::endl;
+            return 1;
+        }
+        Fuzzer::report(result, std::cout);
+        return result.crashes.empty() ? 0 : 1;
+    }
+
+    if (input.contains("-explore"))
+    {
+        Explorer::Target target;
+        target.image.assign(Memory::main_memory.begin(), Memory::main_memory.end());
+        target.state = Cpu::save_state();
+        unsigned address = 0;
+        std::istringstream(input.get_command_option("-explore")) >> std::hex >> address;
+        target.input_address = static_cast<uint16_t>(address);
+        std::istringstream choices(input.contains("-explore-inputs") ? input.get_command_option("-explore-inputs") : "00,01");
+        for (std::string choice; std::getline(choices, choice, ',');)
+        {
+            target.choices.push_back(static_cast<uint8_t>(std::stoul(choice, nullptr, 16)));
+        }
+        if (input.contains("-explore-cycles"))
+        {
+            target.max_cycles = std::stoi(input.get_command_option("-explore-cycles"));
+        }
+
+        Explorer::Options options;
+        options.workers = input.contains("-explore-workers") ? static_cast<unsigned>(std::stoul(input.get_command_option("-explore-workers"))) : 0;
+        if (input.contains("-explore-memory"))
+        {
+            options.memory = std::stoull(input.get_command_option("-explore-memory")) << 20;
+        }
+        Explorer::Result result;
+        if (!plain_memory || !Explorer::run(target, options, result))
+        {
+            std::cout << "Exploring needs a 64KB memory image and 1 to " << Explorer::max_choices << " input values" << std::endl;
+            return 1;
+        }
+        Explorer::report(result, std::cout);
+        return 0;
+    }
+
+    if (input.contains("-coverage-report"))
+    {
+        Coverage::Map map;
+        if (!Coverage::read_file(input.get_command_option("-coverage-report"), map))
+        {
+            std::cout << "Can't read " << input.get_command_option("-coverage-report") << std::endl;
+            return 1;
+        }
+        Coverage::report(map, Memory::snapshot(), std::cout);
+        return 0;
+    }
+    Coverage::Map coverage;
+    if (input.contains("-coverage"))
+    {
+        Cpu::code_coverage = &coverage;
+    }
+
+    // Breakpoints and watchpoints, e.g. -break 8000,8010.
+    for (const auto &[option, set] : {std::pair{"-break", &Debugger::set_breakpoint}, std::pair{"-watch", &Debugger::set_watchpoint}})
+    {
+        std::istringstream addresses(input.contains(option) ? input.get_command_option(option) : "");
+        for (std::string address; std::getline(addresses, address, ',');)
+        {
+            set(static_cast<uint16_t>(std::stoul(address, nullptr, 16)), true);
+        }
+    }
+
+    if (input.contains("-spin-us"))
+    {
+        Pacer::spin_budget = std::chrono::microseconds{std::stoll(input.get_command_option("-spin-us"))};
+    }
+
+    if (input.contains("-run-ahead"))
+    {
+        RunAhead::frames = std::stoi(input.get_command_option("-run-ahead"));
+        if (RunAhead::frames < 0 || input.contains("-ppu-thread"))
+        {
+            std::cout << "Run-ahead needs a number of frames, and the PPU on the emulation thread" << std::endl;
+            return 1;
+        }
+    }
+
+    const bool ppu = input.contains("-ppu") || input.contains("-ppu-thread");
+    if (ppu)
+    {
+        Ppu::attach();
+    }
+    if (input.contains("-ppu-thread"))
+    {
+        Ppu::start_render_thread();
+    }
+    // The APU's page also holds the sprite DMA register, $4014.
+    if (ppu || input.contains("-wav"))
+    {
+        Apu::attach();
+    }
+    if (input.contains("-wav"))
+    {
+        if (!WavWriter::start(input.get_command_option("-wav")))
+        {
+            std::cout << "Can't write " << input.get_command_option("-wav") << std::endl;
+            return 1;
+        }
+    }
+
+    if (input.contains("-video"))
+    {
+        VideoWriter::Options options;
+        options.filename = input.get_command_option("-video");
+        options.format = options.filename.ends_with(".y4m") ? VideoWriter::Format::Y4M : VideoWriter::Format::RAW;
+        if (input.contains("-video-region") && !VideoWriter::parse_region(input.get_command_option("-video-region"), options.region))
+        {
+            std::cout << "Invalid video region" << std::endl;
+            return 1;
+        }
+        if (!VideoWriter::start(options))
+        {
+            std::cout << "Can't write " << options.filename << std::endl;
+            return 1;
+        }
+    }
+
+    if (input.contains("-record") && !Movie::record(input.get_command_option("-record")))
+    {
+        std::cout << "Can't write " << input.get_command_option("-record") << std::endl;
+        return 1;
+    }
+    if (input.contains("-play"))
+    {
+        if (!Movie::play(input.get_command_option("-play")))
+        {
+            std::cout << "Can't play " << input.get_command_option("-play") << " with these options" << std::endl;
+            return 1;
+        }
+        Pacer::unthrottled = true;
+        // Nothing looks at the frames unless they are recorded.
+        Ppu::drawing = input.contains("-video");
+    }
+
     std::cout << "SP:" << (int)Cpu::stack_pointer << std::endl;
-    Bus::run();
+    const ReturnCode code = Bus::run();
+    std::cout << std::hex << std::setfill('0');
+    switch (code)
+    {
+    case ReturnCode::BREAK:
+        std::cout << "BRK reached" << std::endl;
+        break;
+    case ReturnCode::UNKNOWN_INSTRUCTION:
+        std::cout << "Unknown instruction: 0x" << std::setw(2) << (int)Bus::read(static_cast<uint16_t>(Cpu::instruction_pointer - 1)) << "\n";
+        break;
+    case ReturnCode::BREAKPOINT:
+        std::cout << "Breakpoint at $" << std::setw(4) << Debugger::last_hit.address << std::endl;
+        break;
+    case ReturnCode::WATCHPOINT:
+        std::cout << "Watchpoint: $" << std::setw(4) << Debugger::last_hit.address << " written with $" << std::setw(2)
+                  << (int)Debugger::last_hit.data << ", PC at $" << std::setw(4) << Cpu::instruction_pointer << std::endl;
+        break;
+    default:
+        break;
+    }
+    std::cout << std::dec << std::setfill(' ');
+    Movie::stop();
+
+    if (ppu)
+    {
+        Ppu::detach();
+        std::cout << "PPU frames: " << Ppu::frame_count << std::endl;
+    }
+    if (ppu || input.contains("-wav"))
+    {
+        Apu::detach();
+    }
+    if (input.contains("-wav"))
+    {
+        WavWriter::stop();
+    }
+    if (input.contains("-video"))
+    {
+        VideoWriter::stop();
+        std::cout << "Video frames: " << VideoWriter::frames_written << " written, " << VideoWriter::frames_dropped
+                  << " dropped" << std::endl;
+    }
+
+    if (input.contains("-pacer-stats"))
+    {
+        Pacer::report(std::cout);
+    }
+    if (input.contains("-coverage") && !Coverage::merge_file(input.get_command_option("-coverage"), coverage))
+    {
+        std::cout << "Can't write " << input.get_command_option("-coverage") << std::endl;
+    }
+    Cpu::code_coverage = nullptr;
+        RunAhead::report(std::cout);
+    Movie::report(std::cout);
+
+    // Saves battery-backed RAM.
+    Cartridge::unload();
 
-    return 0;
+    return Movie::diverged_frame != 0 ? 1 : 0;
 }
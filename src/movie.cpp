@@ -0,0 +1,293 @@
+#include <array>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <vector>
+
+#include "clock.hpp"
+#include "controller.hpp"
+#include "movie.hpp"
+#include "savestate.hpp"
+#include "scheduler.hpp"
+
+namespace Movie
+{
+    constexpr std::array<char, 8> magic = {'E', 'M', 'U', 'M', 'O', 'V', 'I', 'E'};
+    constexpr uint32_t version = 2;
+
+    /** What follows each tag byte after the header and state. */
+    enum class Tag : uint8_t
+    {
+        /** The number of frames: the movie is over. */
+        END,
+        /** A change of buttons: frame, cycle, port and buttons. */
+        INPUT,
+        /** The hash after the next frame, as 8 bytes. */
+        HASH
+    };
+
+    struct Input
+    {
+        uint64_t frame;
+        uint64_t cycle;
+        uint8_t port;
+        uint8_t buttons;
+    };
+
+    std::string filename;
+    /** Whether the last movie was played back rather than recorded. */
+    bool played = false;
+    std::ofstream file;
+    /** Buttons as last recorded. */
+    std::array<uint8_t, 2> recorded{};
+
+    /** What is played back. */
+    std::vector<Input> inputs;
+    std::vector<uint64_t> hashes;
+    size_t next_input = 0;
+
+    /** \brief Write a number in as few bytes as it needs: seven bits per byte, low bits first, with the top bit set on
+     * every byte but the last. */
+    void write_number(std::ostream &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.put(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.put(static_cast<char>(value));
+    }
+
+    bool read_number(std::istream &in, uint64_t &value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            const int byte = in.get();
+            if (byte == std::char_traits<char>::eof())
+            {
+                return false;
+            }
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void write_rational(std::ostream &out, const Clock::Rational &rational)
+    {
+        write_number(out, rational.numerator);
+        write_number(out, rational.denominator);
+    }
+
+    bool read_rational(std::istream &in, Clock::Rational &rational)
+    {
+        return read_number(in, rational.numerator) && read_number(in, rational.denominator);
+    }
+
+    /** \brief Start recording from the machine as it is now, replacing the file if it exists. The machine is reloaded
+     * from the state just written, so the recording runs on from exactly what playback will start from.
+     * \return False if the file couldn't be opened.
+     */
+    bool record(const std::string &name)
+    {
+        stop();
+        file.open(name, std::ios::binary | std::ios::trunc);
+        if (!file)
+        {
+            return false;
+        }
+        std::stringstream state;
+        Savestate::write(state);
+        Savestate::read(state);
+
+        file.write(magic.data(), magic.size());
+        write_number(file, version);
+        write_rational(file, Clock::active.cpu_frequency);
+        write_rational(file, Clock::active.frame_rate);
+        const std::string bytes = state.str();
+        write_number(file, bytes.size());
+        file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+
+        filename = name;
+        played = false;
+        recorded = Controller::buttons;
+        frames = 0;
+        diverged_frame = 0;
+        mode = Mode::RECORDING;
+        return true;
+    }
+
+    /** \brief Load a movie and the state it starts from, to play it back. The machine must be set up as it was when the
+     * movie was recorded: the same cartridge, the same devices and the same clock profile.
+     * \return False if the file isn't a movie, doesn't fit the machine, or has no frames to play.
+     */
+    bool play(const std::string &name)
+    {
+        stop();
+        std::ifstream input(name, std::ios::binary);
+        uint64_t size = 0;
+        std::array<char, 8> header;
+        Clock::Rational cpu_frequency;
+        Clock::Rational frame_rate;
+        uint64_t number;
+        if (!input.read(header.data(), header.size()) || header != magic || !read_number(input, number) ||
+            number != version || !read_rational(input, cpu_frequency) ||
+            !read_rational(input, frame_rate) || cpu_frequency != Clock::active.cpu_frequency ||
+            frame_rate != Clock::active.frame_rate || !read_number(input, size))
+        {
+            return false;
+        }
+        std::string bytes(size, '\0');
+        if (!input.read(bytes.data(), static_cast<std::streamsize>(size)))
+        {
+            return false;
+        }
+
+        std::vector<Input> loaded_inputs;
+        std::vector<uint64_t> loaded_hashes;
+        while (true)
+        {
+            const int tag = input.get();
+            Input entry{};
+            uint64_t hash;
+            if (tag == static_cast<int>(Tag::INPUT) && read_number(input, entry.frame) && read_number(input, entry.cycle) &&
+                input.read(reinterpret_cast<char *>(&entry.port), 1) && input.read(reinterpret_cast<char *>(&entry.buttons), 1))
+            {
+                loaded_inputs.push_back(entry);
+            }
+            else if (tag == static_cast<int>(Tag::HASH) && input.read(reinterpret_cast<char *>(&hash), sizeof(hash)))
+            {
+                loaded_hashes.push_back(hash);
+            }
+            else if ((tag == static_cast<int>(Tag::END) && read_number(input, number) && number == loaded_hashes.size()) ||
+                     tag == std::char_traits<char>::eof())
+            {
+                // A recording that was cut short is good up to where it stops.
+                break;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        std::istringstream state(bytes);
+        if (loaded_hashes.empty() || !Savestate::read(state))
+        {
+            return false;
+        }
+        filename = name;
+        played = true;
+        inputs = std::move(loaded_inputs);
+        hashes = std::move(loaded_hashes);
+        next_input = 0;
+        frames = 0;
+        diverged_frame = 0;
+        mode = Mode::PLAYING;
+        return true;
+    }
+
+    /** \brief Take in the controllers' input for the frame about to run: live input, recorded if recording, or the
+     * movie's if playing back. */
+    void start_frame()
+    {
+        if (mode != Mode::PLAYING)
+        {
+            Controller::sample();
+        }
+        if (mode == Mode::RECORDING)
+        {
+            for (uint8_t port = 0; port < 2; port++)
+            {
+                if (Controller::buttons[port] != recorded[port])
+                {
+                    recorded[port] = Controller::buttons[port];
+                    file.put(static_cast<char>(Tag::INPUT));
+                    write_number(file, frames + 1);
+                    write_number(file, Scheduler::now());
+                    file.put(static_cast<char>(port));
+                    file.put(static_cast<char>(recorded[port]));
+                }
+            }
+        }
+        else if (mode == Mode::PLAYING)
+        {
+            Controller::Event ignored;
+            while (Controller::events.try_pop(ignored))
+            {
+            }
+            for (; next_input < inputs.size() && inputs[next_input].frame == frames + 1; next_input++)
+            {
+                Controller::buttons[inputs[next_input].port & 1] = inputs[next_input].buttons;
+            }
+        }
+    }
+
+    /** \brief Record or check the hash of the machine after a frame.
+     * \return False when playback should stop: the frame didn't match the recording, or it was the movie's last.
+     */
+    bool end_frame()
+    {
+        if (mode == Mode::OFF)
+        {
+            return true;
+        }
+        const uint64_t hash = Savestate::hash();
+        frames++;
+        if (mode == Mode::RECORDING)
+        {
+            file.put(static_cast<char>(Tag::HASH));
+            file.write(reinterpret_cast<const char *>(&hash), sizeof(hash));
+            return true;
+        }
+        if (hash != hashes[frames - 1])
+        {
+            diverged_frame = frames;
+            frames--;
+            return false;
+        }
+        return frames < hashes.size();
+    }
+
+    /** \brief Finish recording or playing back. */
+    void stop()
+    {
+        if (mode == Mode::RECORDING)
+        {
+            file.put(static_cast<char>(Tag::END));
+            write_number(file, frames);
+            file.close();
+        }
+        mode = Mode::OFF;
+    }
+
+    /** \brief Print how recording or playback went. */
+    void report(std::ostream &out)
+    {
+        if (filename.empty())
+        {
+            return;
+        }
+        if (!played)
+        {
+            out << "Movie " << filename << ": " << frames << " frames recorded" << std::endl;
+        }
+        else if (diverged_frame != 0)
+        {
+            out << "Movie " << filename << " diverged at frame " << diverged_frame << std::endl;
+        }
+        else
+        {
+            out << "Movie " << filename << ": " << frames << " of " << hashes.size() << " frames matched" << std::endl;
+        }
+        if (frames > 0)
+        {
+            out << "Hashing: " << Savestate::stats.hash_nanoseconds / frames << " ns and "
+                << Savestate::stats.pages_hashed / frames << " pages per frame" << std::endl;
+        }
+    }
+}
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <bit>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "pacer.hpp"
+
+namespace Pacer
+{
+    /** \brief Get the histogram bucket for a duration. Values below 16 ns get a bucket each; above that each power of
+     * two is split into eight buckets. */
+    size_t bucket_of(const uint64_t nanoseconds)
+    {
+        if (nanoseconds < 16)
+        {
+            return nanoseconds;
+        }
+        const int exponent = static_cast<int>(std::bit_width(nanoseconds)) - 1;
+        const uint64_t step = (nanoseconds >> (exponent - 3)) & 7;
+        return 16 + static_cast<size_t>(exponent - 4) * 8 + step;
+    }
+
+    /** \brief Get the largest duration that falls in a bucket. */
+    uint64_t bucket_limit(const size_t bucket)
+    {
+        if (bucket < 16)
+        {
+            return bucket;
+        }
+        const int exponent = static_cast<int>((bucket - 16) / 8) + 4;
+        const uint64_t step = (bucket - 16) % 8;
+        return ((8 + step + 1) << (exponent - 3)) - 1;
+    }
+
+    /** \brief Add a duration to a histogram. Safe to call from several threads at once. */
+    void record(Histogram &histogram, const uint64_t nanoseconds)
+    {
+        histogram.buckets[bucket_of(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+        histogram.count.fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t max = histogram.max.load(std::memory_order_relaxed);
+        while (nanoseconds > max && !histogram.max.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    /** \brief Estimate a percentile of a histogram.
+     * \param histogram The histogram. It may be updated concurrently, in which case the result is approximate.
+     * \param fraction The percentile as a fraction, e.g. 0.99.
+     * \return The upper limit of the bucket holding the percentile, capped at the maximum recorded value, or 0 if the
+     * histogram is empty.
+     */
+    uint64_t percentile(const Histogram &histogram, const double fraction)
+    {
+        const uint64_t count = histogram.count.load(std::memory_order_relaxed);
+        if (count == 0)
+        {
+            return 0;
+        }
+
+        const uint64_t rank = static_cast<uint64_t>(fraction * static_cast<double>(count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < histogram.buckets.size(); bucket++)
+        {
+            seen += histogram.buckets[bucket].load(std::memory_order_relaxed);
+            if (seen >= rank)
+            {
+                return std::min(bucket_limit(bucket), histogram.max.load(std::memory_order_relaxed));
+            }
+        }
+        return histogram.max.load(std::memory_order_relaxed);
+    }
+
+    /** \brief Empty a histogram. Not safe against concurrent record() calls. */
+    void reset(Histogram &histogram)
+    {
+        for (std::atomic<uint64_t> &bucket : histogram.buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        histogram.count.store(0, std::memory_order_relaxed);
+        histogram.max.store(0, std::memory_order_relaxed);
+    }
+
+    /** \brief Wait for a deadline: sleep until spin_budget before it, then spin. */
+    void wait_until(const Clock::time_point deadline)
+    {
+        if (deadline - Clock::now() > spin_budget)
+        {
+            std::this_thread::sleep_until(deadline - spin_budget);
+        }
+        while (Clock::now() < deadline)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#endif
+        }
+    }
+
+    /** \brief Record a finished frame and wait for its deadline, unless it has already passed.
+     * \param frame_start When emulation of the frame began.
+     * \param deadline When the frame is due to be released.
+     * \param frame_period The time between deadlines.
+     * \return How far the caller must move its schedule forward: zero, unless the frame was more than max_lag_frames
+     * late, in which case it is the whole frame periods missed.
+     */
+    Clock::duration end_frame(const Clock::time_point frame_start, const Clock::time_point deadline, const Clock::duration frame_period)
+    {
+        const Clock::time_point finished = Clock::now();
+        record(telemetry.emulation, static_cast<uint64_t>(std::chrono::nanoseconds{finished - frame_start}.count()));
+        telemetry.frames.fetch_add(1, std::memory_order_relaxed);
+        if (unthrottled)
+        {
+            return Clock::duration::zero();
+        }
+
+        Clock::duration shift = Clock::duration::zero();
+        if (finished > deadline)
+        {
+            telemetry.missed.fetch_add(1, std::memory_order_relaxed);
+            const Clock::duration lag = finished - deadline;
+            if (frame_period > Clock::duration::zero() && lag > frame_period * static_cast<int64_t>(max_lag_frames))
+            {
+                const int64_t skipped = lag / frame_period;
+                telemetry.skipped.fetch_add(static_cast<uint64_t>(skipped), std::memory_order_relaxed);
+                shift = frame_period * skipped;
+            }
+        }
+        else
+        {
+            wait_until(deadline);
+        }
+        record(telemetry.lateness, static_cast<uint64_t>(std::chrono::nanoseconds{Clock::now() - deadline}.count()));
+        return shift;
+    }
+
+    /** \brief Write a summary of the telemetry. */
+    void report(std::ostream &out)
+    {
+        auto microseconds = [](const uint64_t nanoseconds)
+        { return static_cast<double>(nanoseconds) / 1000.0; };
+        auto line = [&](const char *name, const Histogram &histogram)
+        {
+            out << name << " p50 " << microseconds(percentile(histogram, 0.5)) << " us, p99 " << microseconds(percentile(histogram, 0.99))
+                << " us, max " << microseconds(histogram.max.load(std::memory_order_relaxed)) << " us" << std::endl;
+        };
+        out << "Frames: " << telemetry.frames.load(std::memory_order_relaxed) << ", missed "
+            << telemetry.missed.load(std::memory_order_relaxed) << ", skipped " << telemetry.skipped.load(std::memory_order_relaxed)
+            << std::endl;
+        line("Emulation:", telemetry.emulation);
+        line("Lateness: ", telemetry.lateness);
+    }
+}
@@ -0,0 +1,568 @@
+#include <algorithm>
+
+#include "ppu.hpp"
+#include "rewrite.hpp"
+#include "scheduler.hpp"
+
+namespace Ppu
+{
+    const std::array<uint32_t, 64> rgb_palette = {
+        0x666666, 0x002A88, 0x1412A7, 0x3B00A4, 0x5C007E, 0x6E0040, 0x6C0600, 0x561D00,
+        0x333500, 0x0B4800, 0x005200, 0x004F08, 0x00404D, 0x000000, 0x000000, 0x000000,
+        0xADADAD, 0x155FD9, 0x4240FF, 0x7527FE, 0xA01ACC, 0xB71E7B, 0xB53120, 0x994E00,
+        0x6B6D00, 0x388700, 0x0C9300, 0x008F32, 0x007C8D, 0x000000, 0x000000, 0x000000,
+        0xFFFEFF, 0x64B0FF, 0x9290FF, 0xC676FF, 0xF36AFF, 0xFE6ECC, 0xFE8170, 0xEA9E22,
+        0xBCBE00, 0x88D800, 0x5CE430, 0x45E082, 0x48CDDE, 0x4F4F4F, 0x000000, 0x000000,
+        0xFFFEFF, 0xC0DFFF, 0xD3D2FF, 0xE8C8FF, 0xFBC2FF, 0xFEC4EA, 0xFECCC5, 0xF7D8A5,
+        0xE4E594, 0xCFEF96, 0xBDF4AB, 0xB3F3CC, 0xB5EBF2, 0xB8B8B8, 0x000000, 0x000000};
+
+    /** \brief Choose which nametable memory each of the four nametables uses. */
+    void set_mirroring(State &ppu, const Mirroring mirroring)
+    {
+        switch (mirroring)
+        {
+        case Mirroring::HORIZONTAL:
+            ppu.nametable_banks = {0, 0, 1, 1};
+            break;
+        case Mirroring::VERTICAL:
+            ppu.nametable_banks = {0, 1, 0, 1};
+            break;
+        case Mirroring::SINGLE_LOW:
+            ppu.nametable_banks = {0, 0, 0, 0};
+            break;
+        case Mirroring::SINGLE_HIGH:
+            ppu.nametable_banks = {1, 1, 1, 1};
+            break;
+        case Mirroring::FOUR_SCREEN:
+            ppu.nametable_banks = {0, 1, 2, 3};
+            break;
+        }
+    }
+
+    /** \brief Get the palette memory index for a PPU address. The backdrop entries of the sprite palettes mirror those
+     * of the background palettes. */
+    uint8_t palette_index(const uint16_t address)
+    {
+        uint8_t index = address & 0x1F;
+        return (index & 0x13) == 0x10 ? static_cast<uint8_t>(index & 0x0F) : index;
+    }
+
+    /** \brief Read a byte of the PPU's own 14-bit address space. */
+    uint8_t read_vram(const State &ppu, const uint16_t address)
+    {
+        const uint16_t a = address & 0x3FFF;
+        if (a < 0x2000)
+        {
+            return ppu.chr[ppu.chr_banks[a >> 10] + (a & 0x3FF)];
+        }
+        if (a < 0x3F00)
+        {
+            return ppu.vram[ppu.nametable_banks[(a >> 10) & 3] * 0x400 + (a & 0x3FF)];
+        }
+        return ppu.palette[palette_index(a)];
+    }
+
+    /** \brief Write a byte of the PPU's own 14-bit address space. Writes to pattern ROM are ignored. */
+    void write_vram(State &ppu, const uint16_t address, const uint8_t data)
+    {
+        const uint16_t a = address & 0x3FFF;
+        if (a < 0x2000)
+        {
+            if (ppu.chr_writable)
+            {
+                ppu.chr[ppu.chr_banks[a >> 10] + (a & 0x3FF)] = data;
+            }
+        }
+        else if (a < 0x3F00)
+        {
+            ppu.vram[ppu.nametable_banks[(a >> 10) & 3] * 0x400 + (a & 0x3FF)] = data;
+        }
+        else
+        {
+            ppu.palette[palette_index(a)] = data & 0x3F;
+        }
+    }
+
+    /** \brief Step the VRAM address after a $2007 access, by 1 or 32 depending on PPUCTRL. */
+    void increment_address(State &ppu)
+    {
+        ppu.v = static_cast<uint16_t>((ppu.v + ((ppu.control & 0x04) ? 32 : 1)) & 0x7FFF);
+    }
+
+    /** \brief Read a PPU register as the CPU would, with all of its side effects.
+     * \param ppu The PPU.
+     * \param address Any address in $2000-$3FFF.
+     * \return The value read.
+     */
+    uint8_t read_register(State &ppu, const uint16_t address)
+    {
+        switch (address & 7)
+        {
+        case 2:
+        {
+            uint8_t result = static_cast<uint8_t>((ppu.status & 0xE0) | (ppu.open_bus & 0x1F));
+            ppu.status &= 0x7F;
+            ppu.w = false;
+            return result;
+        }
+        case 4:
+            return ppu.oam[ppu.oam_address];
+        case 7:
+        {
+            uint8_t result;
+            if ((ppu.v & 0x3FFF) < 0x3F00)
+            {
+                result = ppu.read_buffer;
+                ppu.read_buffer = read_vram(ppu, ppu.v);
+            }
+            else
+            {
+                // Palette reads aren't buffered, but the buffer is filled from the nametable underneath.
+                result = static_cast<uint8_t>((read_vram(ppu, ppu.v) & 0x3F) | (ppu.open_bus & 0xC0));
+                ppu.read_buffer = read_vram(ppu, static_cast<uint16_t>(ppu.v - 0x1000));
+            }
+            increment_address(ppu);
+            return result;
+        }
+        default:
+            return ppu.open_bus;
+        }
+    }
+
+    /** \brief Write a PPU register as the CPU would.
+     * \param ppu The PPU.
+     * \param address Any address in $2000-$3FFF.
+     * \param data The value written.
+     */
+    void write_register(State &ppu, const uint16_t address, const uint8_t data)
+    {
+        ppu.open_bus = data;
+        switch (address & 7)
+        {
+        case 0:
+            ppu.control = data;
+            ppu.t = static_cast<uint16_t>((ppu.t & 0xF3FF) | ((data & 0x03) << 10));
+            break;
+        case 1:
+            ppu.mask = data;
+            break;
+        case 3:
+            ppu.oam_address = data;
+            break;
+        case 4:
+            ppu.oam[ppu.oam_address++] = data;
+            break;
+        case 5:
+            if (!ppu.w)
+            {
+                ppu.t = static_cast<uint16_t>((ppu.t & 0xFFE0) | (data >> 3));
+                ppu.fine_x = data & 7;
+            }
+            else
+            {
+                ppu.t = static_cast<uint16_t>((ppu.t & 0x8C1F) | ((data & 0x07) << 12) | ((data & 0xF8) << 2));
+            }
+            ppu.w = !ppu.w;
+            break;
+        case 6:
+            if (!ppu.w)
+            {
+                ppu.t = static_cast<uint16_t>((ppu.t & 0x00FF) | ((data & 0x3F) << 8));
+            }
+            else
+            {
+                ppu.t = static_cast<uint16_t>((ppu.t & 0xFF00) | data);
+                ppu.v = ppu.t;
+            }
+            ppu.w = !ppu.w;
+            break;
+        case 7:
+            write_vram(ppu, ppu.v, data);
+            increment_address(ppu);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /** \brief End of the pre-render scanline: reload the whole scroll position if rendering is enabled. */
+    void start_frame(State &ppu)
+    {
+        if (ppu.mask & 0x18)
+        {
+            ppu.v = ppu.t;
+        }
+    }
+
+    /** Something that happens at a fixed dot of every frame. */
+    struct FrameEvent
+    {
+        int scanline;
+        int dot;
+        void (*action)(const int scanline, const uint64_t cycle);
+        /** Whether the event has effects outside the PPU, so it must run on time rather than when the PPU is next
+         * accessed. */
+        bool external;
+    };
+
+    void render_event(const int scanline, const uint64_t cycle)
+    {
+        if (threaded)
+        {
+            advance_scanline(state, scanline);
+            record(cycle, Command::Kind::SCANLINE, static_cast<uint16_t>(scanline));
+        }
+        else if (drawing)
+        {
+            render_scanline(state, scanline);
+        }
+        else
+        {
+            advance_scanline(state, scanline);
+        }
+    }
+
+    void vblank_start_event(const int, const uint64_t cycle)
+    {
+        state.status |= 0x80;
+        frame_count++;
+        if (threaded)
+        {
+            record(cycle, Command::Kind::END_FRAME);
+        }
+        else if (frame_ready != nullptr)
+        {
+            frame_ready(state);
+        }
+        if (state.control & 0x80)
+        {
+            Cpu::nmi();
+        }
+    }
+
+    void vblank_end_event(const int, const uint64_t)
+    {
+        // Clear vertical blank, sprite 0 hit and sprite overflow.
+        state.status &= 0x1F;
+    }
+
+    void start_frame_event(const int, const uint64_t cycle)
+    {
+        start_frame(state);
+        if (threaded)
+        {
+            record(cycle, Command::Kind::START_FRAME);
+        }
+    }
+
+    void scanline_hook_event(const int, const uint64_t cycle)
+    {
+        if (scanline_hook != nullptr && (state.mask & 0x18))
+        {
+            scanline_hook(cycle);
+        }
+    }
+
+    /** Every event of a frame, in order. Visible scanlines are rendered when they reach horizontal blank. */
+    const std::vector<FrameEvent> frame_events = []()
+    {
+        std::vector<FrameEvent> events;
+        for (int scanline = 0; scanline < height; scanline++)
+        {
+            events.push_back(FrameEvent{scanline, 256, render_event, false});
+            events.push_back(FrameEvent{scanline, 260, scanline_hook_event, false});
+        }
+        events.push_back(FrameEvent{241, 1, vblank_start_event, true});
+        events.push_back(FrameEvent{261, 1, vblank_end_event, false});
+        events.push_back(FrameEvent{261, 260, scanline_hook_event, false});
+        events.push_back(FrameEvent{261, 304, start_frame_event, false});
+        return events;
+    }();
+
+    /** Whether the scanline hook has effects outside the PPU, such as an IRQ, so it must be called on time. */
+    bool scanline_hook_on_time = false;
+
+    /** \brief Check whether a frame event must run on time rather than when the PPU is next accessed. */
+    bool on_time(const FrameEvent &event)
+    {
+        return event.external || (event.action == scanline_hook_event && scanline_hook_on_time);
+    }
+
+    /** PPU dot, counted from attach(), at which the current frame's scanline 0 starts. PPU dots run at three times
+     * the CPU clock. */
+    uint64_t frame_origin = 0;
+    /** Index into frame_events of the next event. */
+    size_t next_event = 0;
+    /** Id of the pending scheduler event. */
+    uint64_t pending = 0;
+    bool attached = false;
+
+    /** \brief Get the first CPU cycle at or after the dot of a frame event.
+     * \param index Index into frame_events of an event at or after next_event.
+     * \param origin Dot at which the event's frame starts.
+     */
+    uint64_t event_cycle(const size_t index, const uint64_t origin)
+    {
+        const FrameEvent &event = frame_events[index];
+        return (origin + static_cast<uint64_t>(event.scanline * dots_per_scanline + event.dot) + 2) / 3;
+    }
+
+    /** \brief Run every frame event due at or before a CPU cycle, in order.
+     * \param cycle The cycle. During an instruction Scheduler::now() is the cycle the instruction started on, which
+     * is also when an event would have run had it been scheduled: after the instruction during which it fell due.
+     */
+    void catch_up(const uint64_t cycle)
+    {
+        uint64_t due;
+        while ((due = event_cycle(next_event, frame_origin)) <= cycle)
+        {
+            const FrameEvent &event = frame_events[next_event];
+            event.action(event.scanline, due);
+
+            next_event++;
+            if (next_event == frame_events.size())
+            {
+                next_event = 0;
+                frame_origin += static_cast<uint64_t>(dots_per_scanline) * scanlines_per_frame;
+            }
+        }
+    }
+
+    void schedule_next();
+
+    /** \brief Scheduler callback: bring the PPU up to date and schedule the next wake-up. */
+    void on_event()
+    {
+        catch_up(Scheduler::now());
+        schedule_next();
+    }
+
+    /** \brief Schedule a wake-up for the next frame event that has to run on time, or for the very next event if
+     * catch-up is off. */
+    void schedule_next()
+    {
+        size_t index = next_event;
+        uint64_t origin = frame_origin;
+        while (lazy && !on_time(frame_events[index]))
+        {
+            if (++index == frame_events.size())
+            {
+                index = 0;
+                origin += static_cast<uint64_t>(dots_per_scanline) * scanlines_per_frame;
+            }
+        }
+        pending = Scheduler::schedule(event_cycle(index, origin), on_event);
+    }
+
+    /** \brief Bring the PPU up to date before the CPU accesses one of its registers. */
+    void device_catch_up(const uint64_t cycle)
+    {
+        catch_up(cycle);
+    }
+
+    uint8_t device_read(const uint16_t address)
+    {
+        // Only $2002 and $2007 reads change anything.
+        if (threaded && ((address & 7) == 2 || (address & 7) == 7))
+        {
+            record(Scheduler::now(), Command::Kind::READ, address);
+        }
+        return read_register(state, address);
+    }
+
+    void device_write(const uint16_t address, const uint8_t data)
+    {
+        const bool nmi_enabled = state.control & 0x80;
+        write_register(state, address, data);
+        if (threaded)
+        {
+            record(Scheduler::now(), Command::Kind::WRITE, address, data);
+        }
+
+        // Enabling NMI during vertical blank raises one straight away.
+        if (!nmi_enabled && (state.control & 0x80) && (state.status & 0x80))
+        {
+            Cpu::nmi();
+        }
+    }
+
+    const Memory::Device device{device_read, device_write, device_catch_up};
+
+    /** \brief Write 256 bytes through $2004, as sprite DMA does: all of OAM, starting at the OAM address.
+     * \param data The bytes, in the order they are written.
+     */
+    void write_oam(const std::array<uint8_t, 256> &data)
+    {
+        if (attached)
+        {
+            catch_up(Scheduler::now());
+        }
+        const size_t start = state.oam_address;
+        std::copy(data.begin(), data.end() - static_cast<std::ptrdiff_t>(start), state.oam.begin() + static_cast<std::ptrdiff_t>(start));
+        std::copy(data.end() - static_cast<std::ptrdiff_t>(start), data.end(), state.oam.begin());
+        state.open_bus = data.back();
+        if (threaded)
+        {
+            for (const uint8_t byte : data)
+            {
+                record(Scheduler::now(), Command::Kind::WRITE, 0x2004, byte);
+            }
+        }
+    }
+
+    /** \brief Point a 1KB window of pattern memory at another bank, as a cartridge's mapper does.
+     * \param window Window number, 0-7 for $0000-$1FFF.
+     * \param offset Offset of the bank in chr. Taken modulo the size of chr.
+     */
+    void switch_chr_bank(const int window, const uint32_t offset)
+    {
+        if (attached)
+        {
+            catch_up(Scheduler::now());
+        }
+        const uint32_t bank = static_cast<uint32_t>(offset % state.chr.size());
+        state.chr_banks[static_cast<size_t>(window)] = bank;
+        if (threaded)
+        {
+            record(Scheduler::now(), Command::Kind::CHR_BANK, static_cast<uint16_t>(bank / 0x400), static_cast<uint8_t>(window));
+        }
+    }
+
+    /** \brief Change how the nametables are mirrored, as a cartridge's mapper does. */
+    void switch_mirroring(const Mirroring mirroring)
+    {
+        if (attached)
+        {
+            catch_up(Scheduler::now());
+        }
+        set_mirroring(state, mirroring);
+        if (threaded)
+        {
+            record(Scheduler::now(), Command::Kind::MIRRORING, 0, static_cast<uint8_t>(mirroring));
+        }
+    }
+
+    /** \brief Set or clear the scanline hook.
+     * \param hook The hook, or nullptr.
+     * \param on_time Whether it has to be called on time, which costs a Scheduler event per scanline, or may wait
+     * until the PPU is next caught up.
+     */
+    void set_scanline_hook(void (*hook)(const uint64_t cycle), const bool on_time)
+    {
+        if (attached)
+        {
+            catch_up(Scheduler::now());
+        }
+        const bool reschedule = attached && on_time != scanline_hook_on_time;
+        scanline_hook = hook;
+        scanline_hook_on_time = on_time;
+        if (reschedule)
+        {
+            Scheduler::cancel(pending);
+            schedule_next();
+        }
+    }
+
+    /** \brief Copy everything about a PPU except its framebuffer, and its pattern memory unless that is RAM. */
+    void copy_state(const State &from, State &to)
+    {
+        to.control = from.control;
+        to.mask = from.mask;
+        to.status = from.status;
+        to.oam_address = from.oam_address;
+        to.v = from.v;
+        to.t = from.t;
+        to.fine_x = from.fine_x;
+        to.w = from.w;
+        to.read_buffer = from.read_buffer;
+        to.open_bus = from.open_bus;
+        if (from.chr_writable)
+        {
+            to.chr = from.chr;
+        }
+        to.chr_banks = from.chr_banks;
+        to.chr_writable = from.chr_writable;
+        to.vram = from.vram;
+        to.nametable_banks = from.nametable_banks;
+        to.palette = from.palette;
+        to.oam = from.oam;
+    }
+
+    /** \brief Save the bus-side PPU, for restore(). The framebuffer isn't saved: after a restore it keeps whatever was
+     * drawn last, which is drawn over before the next frame is complete. Not for use with the render thread running.
+     * \param into Where to save it. Storage it already has is reused.
+     */
+    void snapshot(Snapshot &into)
+    {
+        copy_state(state, into.state);
+        into.frame_origin = frame_origin;
+        into.next_event = next_event;
+        into.pending = pending;
+        into.frame_count = frame_count;
+    }
+
+    /** \brief Check that a snapshot from elsewhere, such as a file, is one restore() can take: every index in it is
+     * in range, and its pattern banks lie within this PPU's pattern memory.
+     */
+    bool valid(const Snapshot &snapshot)
+    {
+        const State &ppu = snapshot.state;
+        return ppu.fine_x < 8 && ppu.v < 0x8000 && ppu.t < 0x8000 &&
+               std::all_of(ppu.chr_banks.begin(), ppu.chr_banks.end(), [](const uint32_t bank)
+                           { return bank <= state.chr.size() - 0x400; }) &&
+               std::all_of(ppu.nametable_banks.begin(), ppu.nametable_banks.end(), [&](const uint8_t bank)
+                           { return bank * size_t{0x400} < ppu.vram.size(); }) &&
+               std::all_of(ppu.palette.begin(), ppu.palette.end(), [](const uint8_t colour)
+                           { return colour < 0x40; }) &&
+               snapshot.next_event < frame_events.size();
+    }
+
+    /** \brief Put the bus-side PPU back as it was when a snapshot was taken. */
+    void restore(const Snapshot &snapshot)
+    {
+        copy_state(snapshot.state, state);
+        frame_origin = snapshot.frame_origin;
+        next_event = snapshot.next_event;
+        pending = snapshot.pending;
+        frame_count = snapshot.frame_count;
+    }
+
+    /** \brief Schedule the PPU's next event anew, after Scheduler::reset() dropped it, as when a saved state is
+     * loaded. Does nothing unless the PPU is attached. */
+    void reschedule()
+    {
+        if (attached)
+        {
+            schedule_next();
+        }
+    }
+
+    /** \brief Put the PPU on the bus at $2000-$3FFF and start its frame timing at the current cycle. */
+    void attach()
+    {
+        detach();
+        Memory::attach(0x20, 0x3F, &device);
+        frame_origin = Scheduler::now() * 3;
+        next_event = 0;
+        frame_count = 0;
+        attached = true;
+        schedule_next();
+    }
+
+    /** \brief Take the PPU off the bus and stop its frame timing and render thread. Its state is brought up to date
+     * and kept. */
+    void detach()
+    {
+        if (attached)
+        {
+            catch_up(Scheduler::now());
+        }
+        stop_render_thread();
+        if (attached)
+        {
+            Scheduler::cancel(pending);
+            Memory::attach(0x20, 0x3F, nullptr);
+            attached = false;
+        }
+    }
+}
@@ -0,0 +1,404 @@
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "ppu.hpp"
+
+namespace Ppu
+{
+    namespace
+    {
+        /** Number of background tiles decoded per scanline: 33 are needed to cover 256 pixels at any fine X scroll,
+         * rounded up to a whole number of decode steps. */
+        constexpr int tiles_per_line = 36;
+
+        /** The pattern bits of one background tile row, and the palette it uses. */
+        struct TileRow
+        {
+            uint8_t low;
+            uint8_t high;
+            /** Palette number times four, i.e. the index of the palette's first entry. */
+            uint8_t palette;
+        };
+
+        uint8_t read_chr(const State &ppu, const uint16_t address)
+        {
+            return ppu.chr[ppu.chr_banks[address >> 10] + (address & 0x3FF)];
+        }
+
+        uint8_t reverse_bits(uint8_t byte)
+        {
+            byte = static_cast<uint8_t>((byte & 0xF0) >> 4 | (byte & 0x0F) << 4);
+            byte = static_cast<uint8_t>((byte & 0xCC) >> 2 | (byte & 0x33) << 2);
+            return static_cast<uint8_t>((byte & 0xAA) >> 1 | (byte & 0x55) << 1);
+        }
+
+        uint8_t read_nametable(const State &ppu, const uint16_t address)
+        {
+            return ppu.vram[ppu.nametable_banks[(address >> 10) & 3] * 0x400 + (address & 0x3FF)];
+        }
+
+        /** \brief Fetch the background tile rows of a scanline, starting at the coarse X position in v. */
+        void fetch_tiles(const State &ppu, std::array<TileRow, tiles_per_line> &tiles)
+        {
+            uint16_t v = ppu.v;
+            const uint16_t fine_y = (v >> 12) & 7;
+            const uint16_t pattern_base = (ppu.control & 0x10) ? 0x1000 : 0x0000;
+
+            for (TileRow &tile : tiles)
+            {
+                const uint8_t index = read_nametable(ppu, static_cast<uint16_t>(0x2000 | (v & 0x0FFF)));
+                const uint8_t attribute = read_nametable(ppu, static_cast<uint16_t>(0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07)));
+                const int shift = ((v >> 4) & 4) | (v & 2);
+                const uint16_t address = static_cast<uint16_t>(pattern_base + index * 16 + fine_y);
+
+                tile.low = read_chr(ppu, address);
+                tile.high = read_chr(ppu, static_cast<uint16_t>(address + 8));
+                tile.palette = static_cast<uint8_t>(((attribute >> shift) & 3) << 2);
+
+                // Next tile to the right, wrapping into the horizontally adjacent nametable.
+                if ((v & 0x001F) == 31)
+                {
+                    v = static_cast<uint16_t>((v & ~0x001F) ^ 0x0400);
+                }
+                else
+                {
+                    v++;
+                }
+            }
+        }
+
+        /** Each byte of a tile's eight pixels selects one bit of its pattern byte, leftmost pixel first. */
+        constexpr uint64_t pixel_bits = 0x0102040810204080;
+        constexpr uint64_t every_byte = 0x0101010101010101;
+
+        /** \brief Decode fetched tile rows into background palette indices (0-15), 0 meaning transparent.
+         *
+         * Each pixel's colour comes from one bit of each of the two pattern bytes. With SIMD, every byte lane holds a
+         * copy of its tile's pattern byte, ANDs it with the bit for that pixel and compares, decoding 16 (SSE2) or 32
+         * (AVX2) pixels at once.
+         */
+        void decode_tiles(const std::array<TileRow, tiles_per_line> &tiles, uint8_t *indices)
+        {
+#if defined(__AVX2__)
+            const __m256i bits = _mm256_set1_epi64x(static_cast<long long>(pixel_bits));
+            const __m256i one = _mm256_set1_epi8(1);
+            const __m256i two = _mm256_set1_epi8(2);
+            for (int tile = 0; tile < tiles_per_line; tile += 4)
+            {
+                auto spread = [&](uint8_t TileRow::*field, const int k)
+                { return static_cast<long long>(every_byte * (tiles[static_cast<size_t>(tile + k)].*field)); };
+                const __m256i low = _mm256_set_epi64x(spread(&TileRow::low, 3), spread(&TileRow::low, 2), spread(&TileRow::low, 1), spread(&TileRow::low, 0));
+                const __m256i high = _mm256_set_epi64x(spread(&TileRow::high, 3), spread(&TileRow::high, 2), spread(&TileRow::high, 1), spread(&TileRow::high, 0));
+                const __m256i palette = _mm256_set_epi64x(spread(&TileRow::palette, 3), spread(&TileRow::palette, 2), spread(&TileRow::palette, 1), spread(&TileRow::palette, 0));
+
+                const __m256i pixel = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(low, bits), bits), one),
+                                                      _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(high, bits), bits), two));
+                const __m256i transparent = _mm256_cmpeq_epi8(pixel, _mm256_setzero_si256());
+                const __m256i index = _mm256_andnot_si256(transparent, _mm256_or_si256(pixel, palette));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(indices + tile * 8), index);
+            }
+#elif defined(__SSE2__)
+            const __m128i bits = _mm_set1_epi64x(static_cast<long long>(pixel_bits));
+            const __m128i one = _mm_set1_epi8(1);
+            const __m128i two = _mm_set1_epi8(2);
+            for (int tile = 0; tile < tiles_per_line; tile += 2)
+            {
+                const TileRow &first = tiles[static_cast<size_t>(tile)];
+                const TileRow &second = tiles[static_cast<size_t>(tile + 1)];
+                const __m128i low = _mm_set_epi64x(static_cast<long long>(every_byte * second.low), static_cast<long long>(every_byte * first.low));
+                const __m128i high = _mm_set_epi64x(static_cast<long long>(every_byte * second.high), static_cast<long long>(every_byte * first.high));
+                const __m128i palette = _mm_set_epi64x(static_cast<long long>(every_byte * second.palette), static_cast<long long>(every_byte * first.palette));
+
+                const __m128i pixel = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(low, bits), bits), one),
+                                                   _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(high, bits), bits), two));
+                const __m128i transparent = _mm_cmpeq_epi8(pixel, _mm_setzero_si128());
+                const __m128i index = _mm_andnot_si128(transparent, _mm_or_si128(pixel, palette));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(indices + tile * 8), index);
+            }
+#else
+            for (int tile = 0; tile < tiles_per_line; tile++)
+            {
+                const TileRow &row = tiles[static_cast<size_t>(tile)];
+                for (int x = 0; x < 8; x++)
+                {
+                    const int pixel = ((row.low >> (7 - x)) & 1) | (((row.high >> (7 - x)) & 1) << 1);
+                    indices[tile * 8 + x] = static_cast<uint8_t>(pixel == 0 ? 0 : (pixel | row.palette));
+                }
+            }
+#endif
+        }
+
+        /** \brief Look background palette indices up in palette memory, giving NES colours.
+         * \param palette Palette memory.
+         * \param indices Background palette indices (0-15), one per output pixel.
+         * \param colours Receives width colours.
+         *
+         * With AVX2 the 16 background palette entries fit in one register and a byte shuffle looks up 32 pixels at
+         * once.
+         */
+        void lookup_colours(const std::array<uint8_t, 32> &palette, const uint8_t *indices, uint8_t *colours)
+        {
+#if defined(__AVX2__)
+            const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(palette.data())));
+            for (int x = 0; x < width; x += 32)
+            {
+                const __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(indices + x));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(colours + x), _mm256_shuffle_epi8(table, index));
+            }
+#else
+            for (int x = 0; x < width; x++)
+            {
+                colours[x] = palette[indices[x]];
+            }
+#endif
+        }
+
+        /** \brief Find the row of a sprite that falls on a scanline.
+         * \param ppu The PPU.
+         * \param sprite Index of the sprite in OAM.
+         * \param line The scanline.
+         * \return The row, counting from the top of the sprite as stored, or -1 if the sprite isn't on the line.
+         */
+        int sprite_row(const State &ppu, const int sprite, const int line)
+        {
+            const int sprite_height = (ppu.control & 0x20) ? 16 : 8;
+            const int row = line - ppu.oam[static_cast<size_t>(sprite * 4)] - 1;
+            if (row < 0 || row >= sprite_height)
+            {
+                return -1;
+            }
+            return (ppu.oam[static_cast<size_t>(sprite * 4 + 2)] & 0x80) ? sprite_height - 1 - row : row;
+        }
+
+        /** \brief Get a sprite's pattern for a row as two bit planes, the low plane in the low byte, already mirrored
+         * so that bit 7 is the leftmost pixel. */
+        uint16_t sprite_pattern(const State &ppu, const int sprite, const int row)
+        {
+            const uint8_t tile = ppu.oam[static_cast<size_t>(sprite * 4 + 1)];
+            uint16_t address;
+            if (ppu.control & 0x20)
+            {
+                address = static_cast<uint16_t>(((tile & 1) << 12) + (tile & 0xFE) * 16 + (row >= 8 ? 16 : 0) + (row & 7));
+            }
+            else
+            {
+                address = static_cast<uint16_t>(((ppu.control & 0x08) ? 0x1000 : 0) + tile * 16 + row);
+            }
+            uint8_t low = read_chr(ppu, address);
+            uint8_t high = read_chr(ppu, static_cast<uint16_t>(address + 8));
+            if (ppu.oam[static_cast<size_t>(sprite * 4 + 2)] & 0x40)
+            {
+                low = reverse_bits(low);
+                high = reverse_bits(high);
+            }
+            return static_cast<uint16_t>(low | (high << 8));
+        }
+
+        /** \brief Get the colour (0-3) of one pixel of a sprite pattern row. */
+        int pattern_pixel(const uint16_t pattern, const int column)
+        {
+            return ((pattern >> (7 - column)) & 1) | (((pattern >> (15 - column)) & 1) << 1);
+        }
+
+        /** \brief Set the sprite overflow and sprite 0 hit flags for a scanline.
+         * \param ppu The PPU.
+         * \param line The scanline.
+         * \param background Background palette indices for the line, 0 where transparent, or nullptr if the background
+         * isn't shown.
+         */
+        void update_sprite_flags(State &ppu, const int line, const uint8_t *background)
+        {
+            int found = 0;
+            for (int sprite = 0; sprite < 64 && found <= 8; sprite++)
+            {
+                found += sprite_row(ppu, sprite, line) >= 0;
+            }
+            if (found > 8)
+            {
+                ppu.status |= 0x20;
+            }
+
+            const int row = sprite_row(ppu, 0, line);
+            if (background == nullptr || row < 0)
+            {
+                return;
+            }
+            const uint16_t pattern = sprite_pattern(ppu, 0, row);
+            for (int column = 0; column < 8; column++)
+            {
+                const int x = ppu.oam[3] + column;
+                if (x < width - 1 && (x >= 8 || (ppu.mask & 0x04)) && pattern_pixel(pattern, column) != 0 && background[x] != 0)
+                {
+                    ppu.status |= 0x40;
+                    return;
+                }
+            }
+        }
+
+        /** \brief Draw the sprites that cover a scanline over the background.
+         * \param ppu The PPU.
+         * \param line The scanline.
+         * \param background Background palette indices for the line, 0 where transparent.
+         * \param colours The line's colours, with the background already drawn.
+         */
+        void draw_sprites(const State &ppu, const int line, const uint8_t *background, uint8_t *colours)
+        {
+            std::array<bool, width> covered{};
+            int found = 0;
+
+            for (int sprite = 0; sprite < 64 && found < 8; sprite++)
+            {
+                const int row = sprite_row(ppu, sprite, line);
+                if (row < 0)
+                {
+                    continue;
+                }
+                found++;
+
+                const uint16_t pattern = sprite_pattern(ppu, sprite, row);
+                const uint8_t attributes = ppu.oam[static_cast<size_t>(sprite * 4 + 2)];
+                for (int column = 0; column < 8; column++)
+                {
+                    const int x = ppu.oam[static_cast<size_t>(sprite * 4 + 3)] + column;
+                    const int pixel = pattern_pixel(pattern, column);
+                    if (x >= width || pixel == 0 || covered[static_cast<size_t>(x)])
+                    {
+                        continue;
+                    }
+                    // The first opaque sprite pixel at each position wins, even if it ends up behind the background.
+                    covered[static_cast<size_t>(x)] = true;
+                    if ((x < 8 && !(ppu.mask & 0x04)) || ((attributes & 0x20) && background[x] != 0))
+                    {
+                        continue;
+                    }
+                    colours[x] = ppu.palette[static_cast<size_t>(0x10 + ((attributes & 3) << 2) + pixel)];
+                }
+            }
+        }
+
+        /** \brief Decode the background of a scanline.
+         * \param ppu The PPU.
+         * \param decoded Receives palette indices for every decoded tile. The line starts at fine X.
+         */
+        void decode_background(const State &ppu, uint8_t *decoded)
+        {
+            std::array<TileRow, tiles_per_line> tiles;
+            fetch_tiles(ppu, tiles);
+            decode_tiles(tiles, decoded);
+            if (!(ppu.mask & 0x02))
+            {
+                std::memset(decoded + ppu.fine_x, 0, 8);
+            }
+        }
+
+        /** \brief Move v to the start of the next pixel row: down one row, wrapping into the vertically adjacent
+         * nametable after row 29, and back to the horizontal scroll position in t. */
+        void next_line(State &ppu)
+        {
+            if ((ppu.v & 0x7000) != 0x7000)
+            {
+                ppu.v = static_cast<uint16_t>(ppu.v + 0x1000);
+            }
+            else
+            {
+                ppu.v &= 0x0FFF;
+                int coarse_y = (ppu.v & 0x03E0) >> 5;
+                if (coarse_y == 29)
+                {
+                    coarse_y = 0;
+                    ppu.v ^= 0x0800;
+                }
+                else if (coarse_y == 31)
+                {
+                    coarse_y = 0;
+                }
+                else
+                {
+                    coarse_y++;
+                }
+                ppu.v = static_cast<uint16_t>((ppu.v & ~0x03E0) | (coarse_y << 5));
+            }
+            ppu.v = static_cast<uint16_t>((ppu.v & ~0x041F) | (ppu.t & 0x041F));
+        }
+    }
+
+    /** \brief Render one visible scanline into the framebuffer, then advance the scroll position to the next line.
+     * \param ppu The PPU.
+     * \param line The scanline, 0-239.
+     *
+     * The whole line is drawn with the registers as they are at the start of horizontal blank, so writes made part
+     * way across a line take effect from the next line.
+     */
+    void render_scanline(State &ppu, const int line)
+    {
+        uint8_t *colours = &ppu.framebuffer[static_cast<size_t>(line * width)];
+        const bool show_background = ppu.mask & 0x08;
+        const bool show_sprites = ppu.mask & 0x10;
+
+        if (!show_background && !show_sprites)
+        {
+            std::memset(colours, ppu.palette[0], width);
+            return;
+        }
+
+        // Room for every decoded tile, of which the 256 pixels starting at fine X are shown.
+        alignas(32) uint8_t decoded[tiles_per_line * 8];
+        if (show_background)
+        {
+            decode_background(ppu, decoded);
+        }
+        else
+        {
+            std::memset(decoded, 0, sizeof(decoded));
+        }
+        const uint8_t *background = decoded + ppu.fine_x;
+        lookup_colours(ppu.palette, background, colours);
+
+        if (show_sprites)
+        {
+            draw_sprites(ppu, line, background, colours);
+            update_sprite_flags(ppu, line, show_background ? background : nullptr);
+        }
+
+        if (ppu.mask & 0x01)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                colours[x] &= 0x30;
+            }
+        }
+
+        next_line(ppu);
+    }
+
+    /** \brief Do everything render_scanline() does except drawing: set the sprite flags and advance the scroll
+     * position. The background is only decoded on lines where sprite 0 could hit it.
+     * \param ppu The PPU.
+     * \param line The scanline, 0-239.
+     */
+    void advance_scanline(State &ppu, const int line)
+    {
+        const bool show_background = ppu.mask & 0x08;
+        const bool show_sprites = ppu.mask & 0x10;
+        if (!show_background && !show_sprites)
+        {
+            return;
+        }
+
+        if (show_sprites)
+        {
+            alignas(32) uint8_t decoded[tiles_per_line * 8];
+            const bool decode = show_background && sprite_row(ppu, 0, line) >= 0;
+            if (decode)
+            {
+                decode_background(ppu, decoded);
+            }
+            update_sprite_flags(ppu, line, decode ? decoded + ppu.fine_x : nullptr);
+        }
+
+        next_line(ppu);
+    }
+}
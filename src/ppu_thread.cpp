@@ -0,0 +1,153 @@
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "ppu.hpp"
+#include "spsc_queue.hpp"
+#include "triple_buffer.hpp"
+
+namespace Ppu
+{
+    /** Commands the render thread hasn't replayed yet. A frame typically needs a few hundred, so the CPU can run
+     * many frames ahead before it has to wait. */
+    using CommandQueue = SpscQueue<Command, 1 << 16>;
+    std::unique_ptr<CommandQueue> commands;
+
+    /** The render thread's copy of the PPU. */
+    State replica;
+    TripleBuffer<Frame> frames;
+    std::thread render_thread;
+    std::atomic<bool> stopping = false;
+    /** Frames finished since the render thread started. */
+    uint64_t rendered = 0;
+
+    /** \brief Replay one command into the render thread's copy of the PPU. */
+    void replay(const Command &command)
+    {
+        switch (command.kind)
+        {
+        case Command::Kind::WRITE:
+            write_register(replica, command.address, command.data);
+            break;
+        case Command::Kind::READ:
+            read_register(replica, command.address);
+            break;
+        case Command::Kind::SCANLINE:
+            render_scanline(replica, command.address);
+            break;
+        case Command::Kind::START_FRAME:
+            start_frame(replica);
+            break;
+        case Command::Kind::CHR_BANK:
+            replica.chr_banks[command.data] = static_cast<uint32_t>(command.address) * 0x400;
+            break;
+        case Command::Kind::MIRRORING:
+            set_mirroring(replica, static_cast<Mirroring>(command.data));
+            break;
+        case Command::Kind::END_FRAME:
+        {
+            Frame &frame = frames.write_buffer();
+            frame.number = ++rendered;
+            frame.pixels = replica.framebuffer;
+            frames.publish();
+            if (frame_ready != nullptr)
+            {
+                frame_ready(replica);
+            }
+            break;
+        }
+        }
+    }
+
+    /** \brief Body of the render thread: replay commands until stopped, spinning briefly and then sleeping when there
+     * are none. */
+    void render_loop()
+    {
+        Command command;
+        int idle = 0;
+        while (true)
+        {
+            if (commands->try_pop(command))
+            {
+                replay(command);
+                idle = 0;
+            }
+            else if (stopping.load(std::memory_order_acquire))
+            {
+                // Everything pushed before stop_render_thread() is visible now.
+                while (commands->try_pop(command))
+                {
+                    replay(command);
+                }
+                return;
+            }
+            else if (++idle < 4096)
+            {
+#if defined(__x86_64__) || defined(__i386__)
+                _mm_pause();
+#endif
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds{50});
+            }
+        }
+    }
+
+    /** \brief Queue a command for the render thread. Waits if the render thread is too far behind.
+     * \param cycle CPU cycle at which it happened.
+     * \param kind What happened.
+     * \param address Register address or scanline.
+     * \param data Value written.
+     */
+    void record(const uint64_t cycle, const Command::Kind kind, const uint16_t address, const uint8_t data)
+    {
+        commands->push(Command{cycle, kind, address, data});
+    }
+
+    /** \brief Start drawing frames on a render thread, from a copy of the PPU as it is now. Does nothing if it is
+     * already running. */
+    void start_render_thread()
+    {
+        if (threaded)
+        {
+            return;
+        }
+        if (commands == nullptr)
+        {
+            commands = std::make_unique<CommandQueue>();
+        }
+        replica = state;
+        rendered = 0;
+        stopping = false;
+        threaded = true;
+        render_thread = std::thread(render_loop);
+    }
+
+    /** \brief Finish replaying everything queued and stop the render thread. The last frame it drew is copied back
+     * into state's framebuffer. */
+    void stop_render_thread()
+    {
+        if (!threaded)
+        {
+            return;
+        }
+        stopping.store(true, std::memory_order_release);
+        render_thread.join();
+        threaded = false;
+        state.framebuffer = replica.framebuffer;
+    }
+
+    /** \brief Get the most recent frame the render thread has finished. Only one thread may call it.
+     * \return The frame. Its number is 0 if no frame has been finished yet. It stays valid until the next call.
+     */
+    const Frame &latest_frame()
+    {
+        frames.update();
+        return frames.read_buffer();
+    }
+}
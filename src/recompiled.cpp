@@ -0,0 +1,28 @@
+#include "debugger.hpp"
+#include "recompiled.hpp"
+#include "rewrite.hpp"
+
+namespace Recompiled
+{
+    /** \brief Run recompiled code until the supply of cycles is exhausted, exactly as Cpu::tick() would.
+     * \param cycles_to_add Number of cycles to add to the CPU's supply.
+     * \return ReturnCode::CONTINUE, or the reason execution stopped.
+     */
+    ReturnCode tick(const int cycles_to_add)
+    {
+        Cpu::cycles_available += cycles_to_add;
+
+        // Interrupts are looked at once per slice, as Cpu::tick() does.
+        if (Cpu::nmi_pending || (Cpu::irq_lines != 0 && !Cpu::I)) [[unlikely]]
+        {
+            Cpu::service_interrupts();
+        }
+
+        Debugger::start_run();
+        ReturnCode code = ReturnCode::CONTINUE;
+        while (Cpu::cycles_available > 0 && (code = run_block()) == ReturnCode::CONTINUE)
+        {
+        }
+        return Debugger::finish(code);
+    }
+}
@@ -0,0 +1,43 @@
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+#include "clock.hpp"
+#include "input_parser.hpp"
+#include "recompiled.hpp"
+#include "rewrite.hpp"
+
+/** \brief Application entry point. Runs a statically recompiled ROM as fast as possible. */
+int main(int argc, char *argv[])
+{
+    InputParser input{argc, argv};
+    if (input.contains("-h") || input.contains("-help"))
+    {
+        std::cout << "Usage:" << std::endl;
+        std::cout << "  -sp   Specify the starting stack pointer (in hex)" << std::endl;
+        return 0;
+    }
+
+    Recompiled::load();
+
+    // Check for and set stack pointer.
+    if (input.contains("-sp"))
+    {
+        uint16_t stack_pointer;
+        std::istringstream(input.get_command_option("-sp")) >> std::hex >> stack_pointer;
+        Cpu::stack_pointer = stack_pointer;
+    }
+
+    // Run unthrottled, one NTSC frame's worth of cycles at a time.
+    auto start = std::chrono::steady_clock::now();
+    uint64_t frames = 1;
+    while (Recompiled::tick(static_cast<int>(Clock::frame_end(Clock::ntsc, frames) - Clock::frame_end(Clock::ntsc, frames - 1))) == ReturnCode::CONTINUE)
+    {
+        frames++;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    long long cycles = static_cast<long long>(Clock::frame_end(Clock::ntsc, frames)) - Cpu::cycles_available;
+    std::cout << "Ran " << cycles << " cycles in " << elapsed.count() << " s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "recompiler.hpp"
+#include "rewrite.hpp"
+
+namespace Recompiler
+{
+    /** How an instruction affects the flow of control. */
+    enum class Flow
+    {
+        /** Execution continues with the next instruction. */
+        NEXT,
+        /** Conditional branch to a relative target, or fall through to the next instruction. */
+        BRANCH,
+        /** Unconditional jump to an absolute target. */
+        JUMP,
+        /** Subroutine call to an absolute target, which is expected to return to the next instruction. */
+        CALL,
+        /** Control goes somewhere that can't be known statically, or execution stops. */
+        STOP
+    };
+
+    /** \brief Classify an instruction by its effect on control flow.
+     * \param opcode The opcode of the instruction.
+     * \return The control flow class of the instruction.
+     */
+    Flow flow_of(const uint8_t opcode)
+    {
+        std::string_view name = instruction_names[opcode];
+        if (name.size() < 4)
+        {
+            return Flow::STOP;
+        }
+
+        std::string_view mnemonic = name.substr(0, 3);
+        if (name.ends_with("rel"))
+        {
+            return Flow::BRANCH;
+        }
+        if (mnemonic == "JSR")
+        {
+            return Flow::CALL;
+        }
+        if (mnemonic == "JMP")
+        {
+            // An indirect jump target depends on memory contents at run time.
+            return name == "JMP abs" ? Flow::JUMP : Flow::STOP;
+        }
+        if (mnemonic == "RTS" || mnemonic == "RTI" || mnemonic == "BRK")
+        {
+            return Flow::STOP;
+        }
+        return Flow::NEXT;
+    }
+
+    /** \brief Get the address of the instruction following the one at address, if it lies within the image.
+     * \param address Address of an instruction.
+     * \param opcode The opcode at address.
+     * \return Address of the next instruction, or -1 if the instruction runs off the end of memory.
+     */
+    int next_address(const uint16_t address, const uint8_t opcode)
+    {
+        int next = address + instruction_length(opcode);
+        return next > 0xFFFF ? -1 : next;
+    }
+
+    /** \brief Get the static target of a branch, jump or call.
+     * \param image The program image.
+     * \param address Address of the instruction.
+     * \param flow Control flow class of the instruction.
+     * \return The target address.
+     */
+    uint16_t target_address(const std::vector<uint8_t> &image, const uint16_t address, const Flow flow)
+    {
+        if (flow == Flow::BRANCH)
+        {
+            // Branch distances are relative to the address after the two byte instruction.
+            int8_t distance = static_cast<int8_t>(image[(address + 1) & 0xFFFF]);
+            return static_cast<uint16_t>(address + 2 + distance);
+        }
+        return static_cast<uint16_t>(image[(address + 1) & 0xFFFF] | (image[(address + 2) & 0xFFFF] << 8));
+    }
+
+    /** \brief Find the basic blocks reachable from an entry point by static traversal.
+     * \param image The program image as it will appear in memory from address 0. Bytes beyond the end of the image are
+     * treated as zero.
+     * \param entry Address at which execution starts.
+     * \return All discovered blocks, keyed by start address.
+     *
+     * Only control flow with statically known targets is followed. Code reached through indirect jumps, RTS/RTI or
+     * computed addresses is left to the interpreter.
+     */
+    std::map<uint16_t, Block> discover_blocks(const std::vector<uint8_t> &image, const uint16_t entry)
+    {
+        std::vector<uint8_t> memory(0x10000, 0);
+        std::copy(image.begin(), image.begin() + static_cast<long>(std::min<size_t>(image.size(), memory.size())), memory.begin());
+
+        // First find every address that starts a block: the entry point and every branch, jump and call target or
+        // fall through address.
+        std::set<uint16_t> leaders{entry};
+        std::set<uint16_t> visited;
+        std::vector<uint16_t> work{entry};
+
+        auto add_leader = [&](const uint16_t address)
+        {
+            leaders.insert(address);
+            if (!visited.contains(address))
+            {
+                work.push_back(address);
+            }
+        };
+
+        while (!work.empty())
+        {
+            int address = work.back();
+            work.pop_back();
+
+            while (address >= 0 && visited.insert(static_cast<uint16_t>(address)).second)
+            {
+                uint16_t here = static_cast<uint16_t>(address);
+                uint8_t opcode = memory[here];
+                Flow flow = flow_of(opcode);
+                int next = next_address(here, opcode);
+
+                if (flow == Flow::NEXT)
+                {
+                    address = next;
+                    continue;
+                }
+                if (flow != Flow::STOP)
+                {
+                    add_leader(target_address(memory, here, flow));
+                }
+                if ((flow == Flow::BRANCH || flow == Flow::CALL) && next >= 0)
+                {
+                    add_leader(static_cast<uint16_t>(next));
+                }
+                break;
+            }
+        }
+
+        // Then cut the code into blocks, each of which runs from a leader up to a control flow instruction or the next
+        // leader.
+        std::map<uint16_t, Block> blocks;
+        for (uint16_t leader : leaders)
+        {
+            Block block;
+            block.start = leader;
+
+            int address = leader;
+            while (address >= 0)
+            {
+                uint16_t here = static_cast<uint16_t>(address);
+                uint8_t opcode = memory[here];
+                int next = next_address(here, opcode);
+                if (next < 0)
+                {
+                    break;
+                }
+
+                block.instructions.push_back(here);
+                block.size = static_cast<uint16_t>(next - leader);
+
+                if (flow_of(opcode) != Flow::NEXT || leaders.contains(static_cast<uint16_t>(next)))
+                {
+                    break;
+                }
+                address = next;
+            }
+
+            if (!block.instructions.empty())
+            {
+                blocks.emplace(leader, block);
+            }
+        }
+
+        return blocks;
+    }
+
+    /** \brief Write a byte as a C++ hex literal. */
+    std::ostream &hex_byte(std::ostream &out, const uint8_t value)
+    {
+        return out << "0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(value) << std::dec;
+    }
+
+    /** \brief Write a word as a C++ hex literal. */
+    std::ostream &hex_word(std::ostream &out, const uint16_t value)
+    {
+        return out << "0x" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(value) << std::dec;
+    }
+
+    /** \brief Generate a C++ translation unit implementing the Recompiled interface for a program image.
+     * \param out Stream to write the generated code to.
+     * \param image The program image as it will appear in memory from address 0.
+     * \param entry Address at which execution starts.
+     * \param source_name Name of the image the code was generated from, for the file header.
+     *
+     * Every discovered block becomes a function that executes its instructions with constant opcodes through
+     * Cpu::execute(), so cycle accounting is exactly that of Cpu::tick(). A block stops early if the cycle budget runs
+     * out, and falls back to the interpreter if its bytes in memory no longer match the image, or if there is a
+     * breakpoint in it.
+     */
+    void generate(std::ostream &out, const std::vector<uint8_t> &image, const uint16_t entry, const std::string &source_name)
+    {
+        std::map<uint16_t, Block> blocks = discover_blocks(image, entry);
+
+        out << "// Generated by emu_recompile from " << source_name << ". Do not edit.\n\n";
+        out << "#include <algorithm>\n#include <array>\n#include <cstdint>\n#include <cstring>\n\n";
+        out << "#include \"debugger.hpp\"\n#include \"recompiled.hpp\"\n#include \"rewrite.hpp\"\n\n";
+        out << "namespace\n{\n";
+
+        out << "    constexpr std::array<uint8_t, " << image.size() << "> rom_image = {";
+        for (size_t i = 0; i < image.size(); i++)
+        {
+            out << (i % 16 == 0 ? "\n        " : " ");
+            hex_byte(out, image[i]) << ",";
+        }
+        out << "};\n";
+
+        for (const auto &[start, block] : blocks)
+        {
+            out << "\n    ReturnCode block_" << std::hex << std::setw(4) << std::setfill('0') << start << std::dec << "()\n    {\n";
+
+            // Blocks with a breakpoint in them are run an instruction at a time, each checked for one.
+            out << "        if (Debugger::breakpoint_count != 0 && Debugger::in_block(";
+            hex_word(out, start) << ", ";
+            hex_word(out, static_cast<uint16_t>(start + block.size - 1)) << ")) [[unlikely]]\n";
+            out << "        {\n            return Debugger::step();\n        }\n\n";
+
+            // Self-modifying code check.
+            out << "        static constexpr std::array<uint8_t, " << block.size << "> original = {";
+            for (uint16_t i = 0; i < block.size; i++)
+            {
+                out << (i == 0 ? "" : ", ");
+                hex_byte(out, image.size() > static_cast<size_t>(start + i) ? image[start + i] : 0);
+            }
+            out << "};\n";
+            out << "        if (std::memcmp(&Memory::main_memory[";
+            hex_word(out, start) << "], original.data(), original.size()) != 0)\n";
+            out << "        {\n            return Cpu::step();\n        }\n\n";
+
+            out << "        ReturnCode code = ReturnCode::CONTINUE;\n";
+            for (size_t i = 0; i < block.instructions.size(); i++)
+            {
+                uint16_t address = block.instructions[i];
+                uint8_t opcode = image.size() > address ? image[address] : 0;
+
+                out << "\n        // $" << std::hex << std::setw(4) << std::setfill('0') << address << std::dec << "  "
+                    << instruction_names[opcode] << "\n";
+                out << "        Cpu::instruction_pointer = ";
+                hex_word(out, static_cast<uint16_t>(address + 1)) << ";\n";
+                out << "        code = Cpu::execute(";
+                hex_byte(out, opcode) << ");\n";
+                if (i + 1 < block.instructions.size())
+                {
+                    out << "        if (code != ReturnCode::CONTINUE || Cpu::cycles_available <= 0)\n";
+                    out << "        {\n            return code;\n        }\n";
+                }
+            }
+            out << "        return code;\n    }\n";
+        }
+        out << "}\n\n";
+
+        out << "namespace Recompiled\n{\n";
+        out << "    const uint16_t entry_point = ";
+        hex_word(out, entry) << ";\n\n";
+
+        out << "    /** \\brief Copy the recompiled image into memory and point the CPU at its entry point. */\n";
+        out << "    void load()\n    {\n";
+        out << "        Memory::main_memory = {0};\n";
+        out << "        std::copy(rom_image.begin(), rom_image.end(), Memory::main_memory.begin());\n";
+        out << "        Cpu::instruction_pointer = entry_point;\n    }\n\n";
+
+        out << "    /** \\brief Run the block starting at the instruction pointer, or one interpreted instruction if there is none.\n";
+        out << "     * \\return ReturnCode::CONTINUE, or the reason execution should stop.\n     */\n";
+        out << "    ReturnCode run_block()\n    {\n";
+        out << "        switch (Cpu::instruction_pointer)\n        {\n";
+        for (const auto &[start, block] : blocks)
+        {
+            out << "        case ";
+            hex_word(out, start) << ":\n";
+            out << "            return block_" << std::hex << std::setw(4) << std::setfill('0') << start << std::dec << "();\n";
+        }
+        out << "        default:\n            return Debugger::step();\n        }\n    }\n}\n";
+    }
+}
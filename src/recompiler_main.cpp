@@ -0,0 +1,46 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <vector>
+
+#include "input_parser.hpp"
+#include "recompiler.hpp"
+
+/** \brief Tool entry point. Statically recompiles a raw ROM image into a C++ translation unit. */
+int main(int argc, char *argv[])
+{
+    InputParser input{argc, argv};
+    if (input.contains("-h") || input.contains("-help") || !input.contains("-r") || !input.contains("-o"))
+    {
+        std::cout << "Usage:" << std::endl;
+        std::cout << "  -r    Path to ROM file" << std::endl;
+        std::cout << "  -o    Path to generated C++ file" << std::endl;
+        std::cout << "  -ip   Specify the entry point (in hex)" << std::endl;
+        return 0;
+    }
+
+    std::string rom_file_name = input.get_command_option("-r");
+    std::ifstream rom_file(rom_file_name, std::ios::binary);
+    if (!rom_file)
+    {
+        std::cerr << "Could not open ROM file " << rom_file_name << std::endl;
+        return 1;
+    }
+    std::vector<uint8_t> image{std::istreambuf_iterator<char>(rom_file), std::istreambuf_iterator<char>()};
+    if (image.size() > 0xFFFF)
+    {
+        // Bus::load_rom() only loads this much of a ROM file.
+        image.resize(0xFFFF);
+    }
+
+    uint16_t entry = 0;
+    if (input.contains("-ip"))
+    {
+        std::istringstream(input.get_command_option("-ip")) >> std::hex >> entry;
+    }
+
+    std::ofstream output_file(input.get_command_option("-o"));
+    Recompiler::generate(output_file, image, entry, rom_file_name);
+    return output_file ? 0 : 1;
+}
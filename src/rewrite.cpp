@@ -1,4 +1,5 @@
 #include <cstdint>
+#include <algorithm>
 #include <array>
 #include <exception>
 #include <iostream>
@@ -10,10 +11,21 @@
 #include <thread>
 #include <cstdint>
 
+#include "cartridge.hpp"
+#include "clock.hpp"
+#include "coverage.hpp"
+#include "debugger.hpp"
+#include "hle.hpp"
 #include "input_parser.hpp"
+#include "movie.hpp"
+#include "pacer.hpp"
 #include "rewrite.hpp"
+#include "run_ahead.hpp"
+#include "scheduler.hpp"
 
+#ifndef DEBUG
 #define DEBUG 1
+#endif
 
 #if DEBUG
 #define LOG(x) std::cout << x << std::endl
@@ -32,24 +44,6 @@
 
 constexpr uint32_t ROM_BUFFER_SIZE = 0xFFFF;
 
-constexpr std::array<std::string_view, 256> instruction_names = {
-    "BRK impl", "ORA X,ind", "---", "---", "---", "ORA zpg", "ASL zpg", "---", "PHP impl", "ORA #", "ASL A", "---", "---", "ORA abs", "ASL abs", "---",
-    "BPL rel", "ORA ind,Y", "---", "---", "---", "ORA zpg,X", "ASL zpg,X", "---", "CLC impl", "ORA abs,Y", "---", "---", "---", "ORA abs,X", "ASL abs,X", "---",
-    "JSR abs ", "AND X,ind", "---", "---", "BIT zpg", "AND zpg", "ROL zpg", "---", "PLP impl", "AND #", "ROL A", "---", "BIT abs", "AND abs", "ROL abs", "---",
-    "BMI rel", "AND ind,Y", "---", "---", "---", "AND zpg,X", "ROL zpg,X", "---", "SEC impl", "AND abs,Y", "---", "---", "---", "AND abs,X", "ROL abs,X", "---",
-    "RTI impl", "EOR X,ind", "---", "---", "---", "EOR zpg", "LSR zpg", "---", "PHA impl", "EOR #", "LSR A", "---", "JMP abs", "EOR abs", "LSR abs", "---",
-    "BVC rel", "EOR ind,Y", "---", "---", "---", "EOR zpg,X", "LSR zpg,X", "---", "CLI impl", "EOR abs,Y", "---", "---", "---", "EOR abs,X", "LSR abs,X", "---",
-    "RTS impl", "ADC X,ind", "---", "---", "---", "ADC zpg", "ROR zpg", "---", "PLA impl", "ADC #", "ROR A", "---", "JMP ind", "ADC abs", "ROR abs", "---",
-    "BVS rel", "ADC ind,Y", "---", "---", "---", "ADC zpg,X", "ROR zpg,X", "---", "SEI impl", "ADC abs,Y", "---", "---", "---", "ADC abs,X", "ROR abs,X", "---",
-    "---", "STA X,ind", "---", "---", "STY zpg", "STA zpg", "STX zpg", "---", "DEY impl", "---", "TXA impl", "---", "STY abs", "STA abs", "STX abs", "---",
-    "BCC rel", "STA ind,Y", "---", "---", "STY zpg,X", "STA zpg,X", "STX zpg,Y", "---", "TYA impl", "STA abs,Y", "TXS impl", "---", "---", "STA abs,X", "---", "---",
-    "LDY #", "LDA X,ind", "LDX #", "---", "LDY zpg", "LDA zpg", "LDX zpg", "---", "TAY impl", "LDA #", "TAX impl", "---", "LDY abs", "LDA abs", "LDX abs", "---",
-    "BCS rel", "LDA ind,Y", "---", "---", "LDY zpg,X", "LDA zpg,X", "LDX zpg,Y", "---", "CLV impl", "LDA abs,Y", "TSX impl", "---", "LDY abs,X", "LDA abs,X", "LDX abs,Y", "---",
-    "CPY #", "CMP X,ind", "---", "---", "CPY zpg", "CMP zpg", "DEC zpg", "---", "INY impl", "CMP #", "DEX impl", "---", "CPY abs", "CMP abs", "DEC abs", "---",
-    "BNE rel", "CMP ind,Y", "---", "---", "---", "CMP zpg,X", "DEC zpg,X", "---", "CLD impl", "CMP abs,Y", "---", "---", "---", "CMP abs,X", "DEC abs,X", "---",
-    "CPX #", "SBC X,ind", "---", "---", "CPX zpg", "SBC zpg", "INC zpg", "---", "INX impl", "SBC #", "NOP impl", "---", "CPX abs", "SBC abs", "INC abs", "---",
-    "BEQ rel", "SBC ind,Y", "---", "---", "---", "SBC zpg,X", "INC zpg,X", "---", "SED impl", "SBC abs,Y", "---", "---", "---", "SBC abs,X", "INC abs,X", "---"};
-
 /********** 6502 opcodes **************************************/
 
 // LDA - LoaD Accumulator
@@ -287,6 +281,9 @@ constexpr static uint8_t INSTR_6502_JSR_ABSOLUTE = 0x20;
 // RTS - ReTurn from Subroutine
 constexpr static uint8_t INSTR_6502_RTS = 0x60; // 6
 
+// RTI - ReTurn from Interrupt
+constexpr static uint8_t INSTR_6502_RTI = 0x40; // 6
+
 // JMP - JuMP to address
 constexpr static uint8_t INSTR_6502_JMP_ABSOLUTE = 0x4c; // 3
 constexpr static uint8_t INSTR_6502_JMP_INDIRECT = 0x6c; // 5
@@ -318,42 +315,237 @@ namespace Memory
     void clear()
     {
         main_memory = {0};
+        mark_written(0x00, 0xFF);
+    }
+
+    /** \brief Back the whole address space with a contiguous block of host memory.
+     * \param memory 64KB of host memory. Pass main_memory.data() to restore the default mapping.
+     */
+    void map(uint8_t *memory)
+    {
+        for (size_t page = 0; page < pages.size(); page++)
+        {
+            if (devices[page] == nullptr)
+            {
+                pages[page] = memory + page * 256;
+                write_pages[page] = pages[page];
+            }
+        }
+    }
+
+    /** \brief Attach a device to a range of pages, or detach whatever is there.
+     * \param first_page First page of the range.
+     * \param last_page Last page of the range, inclusive.
+     * \param device The device, or nullptr to map the pages back to main_memory.
+     */
+    void attach(const uint8_t first_page, const uint8_t last_page, const Device *device)
+    {
+        for (size_t page = first_page; page <= last_page; page++)
+        {
+            devices[page] = device;
+            pages[page] = device != nullptr ? nullptr : main_memory.data() + page * 256;
+            write_pages[page] = pages[page];
+        }
+    }
+
+    /** \brief Get host memory that a page can be written through, raising a write fault if necessary.
+     * \param page Number of the page.
+     * \return Host address of the writable page.
+     */
+    uint8_t *writable_page(const uint8_t page)
+    {
+        uint8_t *memory = write_pages[page];
+        if (memory == nullptr) [[unlikely]]
+        {
+            memory = write_fault(page);
+        }
+        written_generation[page] = generation;
+        return memory;
+    }
+
+    /** \brief Start a new write generation.
+     * \return A checkpoint: the pages written after this call are those whose written_generation is greater than it.
+     */
+    uint64_t checkpoint()
+    {
+        return generation++;
+    }
+
+    /** \brief Note that a range of pages was written, for host memory written directly rather than through the bus.
+     * \param first_page First page of the range.
+     * \param last_page Last page of the range, inclusive.
+     */
+    void mark_written(const uint8_t first_page, const uint8_t last_page)
+    {
+        std::fill(written_generation.begin() + first_page, written_generation.begin() + last_page + 1, generation);
+    }
+
+    /** \brief Copy the whole address space as currently mapped. Device pages read as zero, since reading device
+     * registers can have side effects. */
+    std::array<uint8_t, 256 * 256> snapshot()
+    {
+        std::array<uint8_t, 256 * 256> memory;
+        for (size_t page = 0; page < pages.size(); page++)
+        {
+            if (pages[page] != nullptr)
+            {
+                std::memcpy(memory.data() + page * 256, pages[page], 256);
+            }
+            else
+            {
+                std::memset(memory.data() + page * 256, 0, 256);
+            }
+        }
+        return memory;
+    }
+
+    /** \brief Write a copy of the address space back. Only pages that differ are written, so pages that weren't changed
+     * since snapshot() stay shared. Device pages are skipped. */
+    void restore(const std::array<uint8_t, 256 * 256> &memory)
+    {
+        for (size_t page = 0; page < pages.size(); page++)
+        {
+            const uint8_t *source = memory.data() + page * 256;
+            if (devices[page] == nullptr && pages[page] != nullptr && std::memcmp(pages[page], source, 256) != 0)
+            {
+                std::memcpy(writable_page(static_cast<uint8_t>(page)), source, 256);
+            }
+        }
     }
 }
 
 namespace Bus
 {
 
-    /** \brief Run the loaded program until it exits. */
-    void run()
+    /** \brief Run the loaded program until it exits, paced to the active clock profile unless Pacer::unthrottled is
+     * set, running ahead of every frame if RunAhead::frames is set. Controller input is taken between frames, through
+     * Movie, which also stops the run when a movie being played back ends or stops matching.
+     * \return Why the program stopped: BRK, an unknown opcode, a breakpoint or watchpoint, or CONTINUE if a movie did.
+     */
+    ReturnCode run()
     {
-        auto time = std::chrono::high_resolution_clock::now();
-        auto interval = std::chrono::microseconds{Cpu::microseconds_per_frame};
-
-        while (Cpu::tick(Cpu::cycles_per_frame) != ReturnCode::BREAK)
+        const Clock::Profile profile = Clock::active;
+        auto start_time = std::chrono::steady_clock::now();
+        const uint64_t start_cycle = Scheduler::now();
+        const auto frame_period = Clock::frame_time(profile, 1);
+
+        // Frame ends in both cycles and wall time are worked out from the frame number, so nothing accumulates
+        // rounding error, and an instruction that overshoots one frame is paid for by the next. After a stall the
+        // pacer moves the wall-clock schedule forward.
+        ReturnCode code;
+        uint64_t frame = 1;
+        auto frame_start = start_time;
+        while (true)
+        {
+            Movie::start_frame();
+            if ((code = RunAhead::run_frame(profile, start_cycle, frame)) != ReturnCode::CONTINUE)
+            {
+                break;
+            }
+            // Run-ahead has called frame_end already, for the frame it showed.
+            if (frame_end != nullptr && RunAhead::frames == 0)
+            {
+                frame_end();
+            }
+            if (!Movie::end_frame())
+            {
+                break;
+            }
+            start_time += Pacer::end_frame(frame_start, start_time + Clock::frame_time(profile, frame), frame_period);
+            frame_start = std::chrono::steady_clock::now();
+            frame++;
+        }
+        if (frame_end != nullptr)
         {
-            time += interval;
-            std::this_thread::sleep_until(time);
+            frame_end();
         }
+        return code;
     }
 
     void write(const uint8_t data, const uint16_t address)
     {
-        Memory::main_memory[address] = data;
+        const uint8_t page = static_cast<uint8_t>(address >> 8);
+        uint8_t *memory = Memory::write_pages[page];
+        Memory::written_generation[page] = Memory::generation;
+        if (memory == nullptr) [[unlikely]]
+        {
+            if (const Memory::Device *device = Memory::devices[page]; device != nullptr)
+            {
+                if (device->catch_up != nullptr)
+                {
+                    device->catch_up(Scheduler::now());
+                }
+                device->write(address, data);
+            }
+            else
+            {
+                Memory::write_fault(page)[address & 0xFF] = data;
+            }
+        }
+        else
+        {
+            memory[address & 0xFF] = data;
+        }
+        if (Debugger::watched_pages[page] != 0) [[unlikely]]
+        {
+            Debugger::written(address, data);
+        }
     }
 
     uint8_t read(const uint16_t address)
     {
-        return Memory::main_memory[address];
+        const uint8_t *memory = Memory::pages[address >> 8];
+        if (memory == nullptr) [[unlikely]]
+        {
+            const Memory::Device *device = Memory::devices[address >> 8];
+            if (device->catch_up != nullptr)
+            {
+                device->catch_up(Scheduler::now());
+            }
+            return device->read(address);
+        }
+        return memory[address & 0xFF];
+    }
+
+    /** \brief Read a whole page, as a DMA transfer does. A page of memory is copied in one go; a device page is read
+     * byte by byte, with all the side effects of the CPU reading it.
+     * \param page The page.
+     * \param destination Receives the 256 bytes of the page.
+     */
+    void read_page(const uint8_t page, uint8_t *destination)
+    {
+        if (const uint8_t *memory = Memory::pages[page]; memory != nullptr) [[likely]]
+        {
+            std::memcpy(destination, memory, 256);
+            return;
+        }
+        for (int offset = 0; offset < 256; offset++)
+        {
+            destination[offset] = read(static_cast<uint16_t>(page << 8 | offset));
+        }
     }
 
     bool load_rom(const std::string &filename)
     {
         std::ifstream input_file(filename, std::ios::binary);
-        char buf[ROM_BUFFER_SIZE];
+        if (!input_file.is_open())
+        {
+            return false;
+        }
+        char magic[4] = {};
+        input_file.read(magic, sizeof(magic));
+        if (std::memcmp(magic, "NES\x1A", sizeof(magic)) == 0)
+        {
+            return Cartridge::load_file(filename);
+        }
+        input_file.clear();
+        input_file.seekg(0);
+
+        char buf[ROM_BUFFER_SIZE] = {};
         input_file.read(buf, ROM_BUFFER_SIZE);
         uint8_t *buf2 = (uint8_t *)buf;
         std::memcpy(Memory::main_memory.data(), buf2, ROM_BUFFER_SIZE);
+        Memory::mark_written(0x00, 0xFF);
         return true;
     }
 }
@@ -565,7 +757,7 @@ namespace Cpu
     uint8_t get_data_absolute()
     {
         // get address from next two bytes and add index
-        uint16_t address = Bus::read(instruction_pointer);
+        uint16_t address = get_word(instruction_pointer);
         // return data at address
         return Bus::read(address);
     }
@@ -639,6 +831,34 @@ namespace Cpu
         return add_with_carry(~data);
     }
 
+    /** \brief Copy the CPU registers and flags.
+     * \return The current CPU state.
+     */
+    State save_state()
+    {
+        return State{C, Z, I, D, B, V, N, cycles_available, stack_pointer, instruction_pointer, A, X, Y};
+    }
+
+    /** \brief Overwrite the CPU registers and flags.
+     * \param state A state previously returned by save_state().
+     */
+    void load_state(const State &state)
+    {
+        C = state.C;
+        Z = state.Z;
+        I = state.I;
+        D = state.D;
+        B = state.B;
+        V = state.V;
+        N = state.N;
+        cycles_available = state.cycles_available;
+        stack_pointer = state.stack_pointer;
+        instruction_pointer = state.instruction_pointer;
+        A = state.A;
+        X = state.X;
+        Y = state.Y;
+    }
+
     /** \brief Encode all CPU flags into a single byte.
      * \return 8-bit value containing all CPU flags.
      */
@@ -648,6 +868,34 @@ namespace Cpu
             (N << 7) | (V << 6) | (true << 5) | (B << 4) | (D << 3) | (I << 2) | (Z << 1) | (C << 0));
     }
 
+    /** \brief Set all CPU flags from a byte encoded by flags_as_byte().
+     * \param flags The encoded flags.
+     */
+    void set_flags_from_byte(const uint8_t flags)
+    {
+        N = (flags >> 7) & BIT1;
+        V = (flags >> 6) & BIT1;
+        B = (flags >> 4) & BIT1;
+        D = (flags >> 3) & BIT1;
+        I = (flags >> 2) & BIT1;
+        Z = (flags >> 1) & BIT1;
+        C = (flags >> 0) & BIT1;
+    }
+
+    /** \brief Push a return address and flags, as BRK and the hardware interrupts do.
+     * \param return_address Address RTI returns to.
+     * \param flags Encoded flags to push.
+     */
+    void push_interrupt_frame(const uint16_t return_address, const uint8_t flags)
+    {
+        Bus::write(static_cast<uint8_t>(return_address >> 8), stack_pointer);
+        stack_pointer--;
+        Bus::write(static_cast<uint8_t>(return_address & 0xFF), stack_pointer);
+        stack_pointer--;
+        Bus::write(flags, stack_pointer);
+        stack_pointer--;
+    }
+
     /** \brief Performs addition of accumulator and data, setting the carry bit as required.
      * \param data A byte of data to be added to the accumulator.
      * \return A byte to be stored in the accumulator.
@@ -703,6 +951,18 @@ namespace Cpu
         }
     }
 
+    /** \brief Count the edge that ends at the instruction pointer in the coverage map, if there is one. Called after
+     * every branch, taken or not, and every jump, call and return.
+     */
+    inline void cover()
+    {
+        if (coverage != nullptr) [[unlikely]]
+        {
+            coverage[previous_location ^ instruction_pointer]++;
+            previous_location = static_cast<uint16_t>(instruction_pointer >> 1);
+        }
+    }
+
     /** \brief Fetches a byte using relative addressing mode.
      * \param memory A reference to a memory array object.
      * \return A uint8_t from memory.
@@ -839,1916 +1099,2087 @@ namespace Cpu
         Bus::write(data, address);
     }
 
-    ReturnCode tick(const int cycles_to_add)
+    /** \brief Decode and execute a single instruction whose opcode has already been fetched.
+     * \param instruction The opcode to execute. The instruction pointer must point at the byte after the opcode.
+     * \return ReturnCode::CONTINUE, or the reason execution should stop.
+     *
+     * This is the body of the interpreter, shared by tick() and by statically recompiled code, which calls it with a
+     * constant opcode so that the switch can be folded away.
+     */
+    ReturnCode execute(const uint8_t instruction)
     {
-        cycles_available += cycles_to_add;
+        // Reset the page crossing flag in case it was left on from the last instruction.
+        page_crossed = false;
 
-        while (cycles_available > 0)
+        switch (instruction)
         {
-            // Reset the page crossing flag in case it was left on from the last iteration.
-            page_crossed = false;
+        case INSTR_6502_LDA_IMMEDIATE:
+            A = Bus::read(instruction_pointer);
+            instruction_pointer++;
+            LDA_set_CPU_flags();
+            cycles_available -= 2;
+            break;
 
-            // TODO Interrupt handler should go here.
+        case INSTR_6502_LDA_ZEROPAGE:
+            A = get_data_zeropage();
+            instruction_pointer++;
+            LDA_set_CPU_flags();
+            cycles_available -= 3;
+            break;
 
-            // Grab an instruction from RAM.
-            uint8_t instruction = Bus::read(instruction_pointer);
+        case INSTR_6502_LDA_ZEROPAGE_X:
+            A = get_data_zeropage(X);
+            instruction_pointer++;
+            LDA_set_CPU_flags();
+            cycles_available -= 4;
+            break;
 
-            // We increment the instruction pointer to point to the next byte in memory.
+        case INSTR_6502_LDA_ABSOLUTE:
+            A = get_data_absolute();
+            instruction_pointer++;
             instruction_pointer++;
+            LDA_set_CPU_flags();
+            cycles_available -= 4;
+            break;
 
-            LOG(
-                "N" << N << " " << "V" << V << " " << "B" << B << " " << "D" << D << " " << "I" << I << " " << "Z" << Z
-                    << " " << "C" << C << "    " << std::hex << "IP:" << std::setw(4) << (int)instruction_pointer << "   " << "SP:"
-                    << std::setw(4) << (int)stack_pointer << "   " << "A:" << std::setw(2) << (int)A << "   " << "X:" << std::setw(2)
-                    << (int)X << "   " << "Y:" << std::setw(2) << (int)Y << "   " << instruction_names[instruction]);
+        case INSTR_6502_LDA_ABSOLUTE_X:
+            A = get_data_absolute(X);
+            instruction_pointer++;
+            instruction_pointer++;
+            LDA_set_CPU_flags();
+            cycles_available -= 4;
 
-            switch (instruction)
+            if (page_crossed)
             {
-            case INSTR_6502_LDA_IMMEDIATE:
-                A = Bus::read(instruction_pointer);
-                instruction_pointer++;
-                LDA_set_CPU_flags();
-                cycles_available -= 2;
-                break;
-
-            case INSTR_6502_LDA_ZEROPAGE:
-                A = get_data_zeropage();
-                instruction_pointer++;
-                LDA_set_CPU_flags();
-                cycles_available -= 3;
-                break;
+                cycles_available--;
+            }
+            break;
 
-            case INSTR_6502_LDA_ZEROPAGE_X:
-                A = get_data_zeropage(X);
-                instruction_pointer++;
-                LDA_set_CPU_flags();
-                cycles_available -= 4;
-                break;
+        case INSTR_6502_LDA_ABSOLUTE_Y:
+            A = get_data_absolute(Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            LDA_set_CPU_flags();
+            cycles_available -= 4;
+            if (page_crossed)
+            {
+                cycles_available--;
+            }
+            break;
 
-            case INSTR_6502_LDA_ABSOLUTE:
-                A = get_data_absolute();
-                instruction_pointer++;
-                instruction_pointer++;
-                LDA_set_CPU_flags();
-                cycles_available -= 4;
-                break;
+        case INSTR_6502_LDA_INDIRECT_X:
+            A = get_data_indexed_indirect(X);
+            instruction_pointer++;
+            LDA_set_CPU_flags();
+            cycles_available -= 6;
+            break;
 
-            case INSTR_6502_LDA_ABSOLUTE_X:
-                A = get_data_absolute(X);
-                instruction_pointer++;
-                instruction_pointer++;
-                LDA_set_CPU_flags();
-                cycles_available -= 4;
+        case INSTR_6502_LDA_INDIRECT_Y:
+            A = get_data_indirect_indexed(Y);
+            instruction_pointer++;
+            LDA_set_CPU_flags();
+            cycles_available -= 5;
 
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+            if (page_crossed)
+            {
+                cycles_available--;
+            }
+            break;
 
-            case INSTR_6502_LDA_ABSOLUTE_Y:
-                A = get_data_absolute(Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                LDA_set_CPU_flags();
-                cycles_available -= 4;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+        case INSTR_6502_LDY_IMMEDIATE:
+            Y = Bus::read(instruction_pointer);
+            instruction_pointer++;
+            LDY_set_CPU_flags();
+            cycles_available -= 2;
+            break;
 
-            case INSTR_6502_LDA_INDIRECT_X:
-                A = get_data_indexed_indirect(X);
-                instruction_pointer++;
-                LDA_set_CPU_flags();
-                cycles_available -= 6;
-                break;
+        case INSTR_6502_LDY_ZEROPAGE:
+            Y = get_data_zeropage();
+            instruction_pointer++;
+            LDY_set_CPU_flags();
+            cycles_available -= 3;
+            break;
 
-            case INSTR_6502_LDA_INDIRECT_Y:
-                A = get_data_indirect_indexed(Y);
-                instruction_pointer++;
-                LDA_set_CPU_flags();
-                cycles_available -= 5;
+        case INSTR_6502_LDY_ZEROPAGE_X:
+            Y = get_data_zeropage(X);
+            instruction_pointer++;
+            LDY_set_CPU_flags();
+            cycles_available -= 4;
+            break;
 
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+        case INSTR_6502_LDY_ABSOLUTE:
+            Y = get_data_absolute();
+            instruction_pointer++;
+            instruction_pointer++;
+            LDY_set_CPU_flags();
+            cycles_available -= 4;
+            break;
 
-            case INSTR_6502_LDY_IMMEDIATE:
-                Y = Bus::read(instruction_pointer);
-                instruction_pointer++;
-                LDY_set_CPU_flags();
-                cycles_available -= 2;
-                break;
+        case INSTR_6502_LDY_ABSOLUTE_X:
+            Y = get_data_absolute(X);
+            instruction_pointer++;
+            instruction_pointer++;
+            LDY_set_CPU_flags();
+            cycles_available -= 4;
+            if (page_crossed)
+            {
+                cycles_available--;
+            }
+            break;
 
-            case INSTR_6502_LDY_ZEROPAGE:
-                Y = get_data_zeropage();
-                instruction_pointer++;
-                LDY_set_CPU_flags();
-                cycles_available -= 3;
-                break;
+        case INSTR_6502_CMP_IMMEDIATE:
+        {
+            uint8_t data = get_data_immediate();
+            instruction_pointer++;
+            CMP_set_CPU_flags(data);
+            cycles_available -= 2;
+        }
+        break;
 
-            case INSTR_6502_LDY_ZEROPAGE_X:
-                Y = get_data_zeropage(X);
-                instruction_pointer++;
-                LDY_set_CPU_flags();
-                cycles_available -= 4;
-                break;
+        case INSTR_6502_CMP_ZEROPAGE:
+        {
+            uint8_t data = get_data_zeropage();
+            instruction_pointer++;
+            CMP_set_CPU_flags(data);
+            cycles_available -= 3;
+        }
+        break;
 
-            case INSTR_6502_LDY_ABSOLUTE:
-                Y = get_data_absolute();
-                instruction_pointer++;
-                instruction_pointer++;
-                LDY_set_CPU_flags();
-                cycles_available -= 4;
-                break;
+        case INSTR_6502_CMP_ZEROPAGE_X:
+        {
+            uint8_t data = get_data_zeropage(X);
+            instruction_pointer++;
+            CMP_set_CPU_flags(data);
+            cycles_available -= 4;
+        }
+        break;
 
-            case INSTR_6502_LDY_ABSOLUTE_X:
-                Y = get_data_absolute(X);
-                instruction_pointer++;
-                instruction_pointer++;
-                LDY_set_CPU_flags();
-                cycles_available -= 4;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+        case INSTR_6502_CMP_ABSOLUTE:
+        {
+            uint8_t data = get_data_absolute();
+            instruction_pointer++;
+            instruction_pointer++;
+            CMP_set_CPU_flags(data);
+            cycles_available -= 4;
+        }
+        break;
 
-            case INSTR_6502_CMP_IMMEDIATE:
+        case INSTR_6502_CMP_ABSOLUTE_X:
+        {
+            uint8_t data = get_data_absolute(X);
+            instruction_pointer++;
+            instruction_pointer++;
+            CMP_set_CPU_flags(data);
+            cycles_available -= 4;
+            if (page_crossed)
             {
-                uint8_t data = get_data_immediate();
-                instruction_pointer++;
-                CMP_set_CPU_flags(data);
-                cycles_available -= 2;
+                cycles_available--;
             }
-            break;
+        }
+        break;
 
-            case INSTR_6502_CMP_ZEROPAGE:
+        case INSTR_6502_CMP_ABSOLUTE_Y:
+        {
+            uint8_t data = get_data_absolute(Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            CMP_set_CPU_flags(data);
+            cycles_available -= 4;
+            if (page_crossed)
             {
-                uint8_t data = get_data_zeropage();
-                instruction_pointer++;
-                CMP_set_CPU_flags(data);
-                cycles_available -= 3;
+                cycles_available--;
             }
-            break;
+        }
+        break;
+
+        case INSTR_6502_CMP_INDIRECT_X:
+        {
+            uint8_t data = get_data_indexed_indirect(X);
+            instruction_pointer++;
+            CMP_set_CPU_flags(data);
+            cycles_available -= 6;
+        }
+        break;
 
-            case INSTR_6502_CMP_ZEROPAGE_X:
+        case INSTR_6502_CMP_INDIRECT_Y:
+        {
+            uint8_t data = get_data_indirect_indexed(Y);
+            instruction_pointer++;
+            CMP_set_CPU_flags(data);
+            cycles_available -= 5;
+            if (page_crossed)
             {
-                uint8_t data = get_data_zeropage(X);
-                instruction_pointer++;
-                CMP_set_CPU_flags(data);
-                cycles_available -= 4;
+                cycles_available--;
             }
+        }
+        break;
+
+        case INSTR_6502_EOR_IMMEDIATE:
+            A = A ^ get_data_immediate();
+            instruction_pointer++;
+            EOR_set_CPU_flags();
+            cycles_available -= 2;
             break;
 
-            case INSTR_6502_CMP_ABSOLUTE:
-            {
-                uint8_t data = get_data_absolute();
-                instruction_pointer++;
-                instruction_pointer++;
-                CMP_set_CPU_flags(data);
-                cycles_available -= 4;
-            }
+        case INSTR_6502_EOR_ZEROPAGE:
+            A = A ^ get_data_zeropage();
+            instruction_pointer++;
+            EOR_set_CPU_flags();
+            cycles_available -= 3;
             break;
 
-            case INSTR_6502_CMP_ABSOLUTE_X:
-            {
-                uint8_t data = get_data_absolute(X);
-                instruction_pointer++;
-                instruction_pointer++;
-                CMP_set_CPU_flags(data);
-                cycles_available -= 4;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-            }
+        case INSTR_6502_EOR_ZEROPAGE_X:
+            A = A ^ get_data_zeropage(X);
+            instruction_pointer++;
+            EOR_set_CPU_flags();
+            cycles_available -= 4;
+            break;
+
+        case INSTR_6502_EOR_ABSOLUTE:
+            A = A ^ get_data_absolute();
+            instruction_pointer++;
+            instruction_pointer++;
+            EOR_set_CPU_flags();
+            cycles_available -= 4;
             break;
 
-            case INSTR_6502_CMP_ABSOLUTE_Y:
+        case INSTR_6502_EOR_ABSOLUTE_X:
+            A = A ^ get_data_absolute(X);
+            instruction_pointer++;
+            instruction_pointer++;
+            EOR_set_CPU_flags();
+            cycles_available -= 4;
+            if (page_crossed)
             {
-                uint8_t data = get_data_absolute(Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                CMP_set_CPU_flags(data);
-                cycles_available -= 4;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
+                cycles_available--;
             }
             break;
 
-            case INSTR_6502_CMP_INDIRECT_X:
+        case INSTR_6502_EOR_ABSOLUTE_Y:
+            A = A ^ get_data_absolute(Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            EOR_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t data = get_data_indexed_indirect(X);
-                instruction_pointer++;
-                CMP_set_CPU_flags(data);
-                cycles_available -= 6;
+                cycles_available--;
             }
             break;
 
-            case INSTR_6502_CMP_INDIRECT_Y:
+        case INSTR_6502_EOR_INDIRECT_X:
+        {
+            A = A ^ get_data_indexed_indirect(X);
+            instruction_pointer++;
+            EOR_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_EOR_INDIRECT_Y:
+            A = A ^ get_data_indirect_indexed(Y);
+            instruction_pointer++;
+            EOR_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t data = get_data_indirect_indexed(Y);
-                instruction_pointer++;
-                CMP_set_CPU_flags(data);
-                cycles_available -= 5;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
+                cycles_available--;
             }
             break;
 
-            case INSTR_6502_EOR_IMMEDIATE:
-                A = A ^ get_data_immediate();
-                instruction_pointer++;
-                EOR_set_CPU_flags();
-                cycles_available -= 2;
-                break;
-
-            case INSTR_6502_EOR_ZEROPAGE:
-                A = A ^ get_data_zeropage();
-                instruction_pointer++;
-                EOR_set_CPU_flags();
-                cycles_available -= 3;
-                break;
+        case INSTR_6502_STA_ZEROPAGE:
+            set_data_zeropage(A);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_EOR_ZEROPAGE_X:
-                A = A ^ get_data_zeropage(X);
-                instruction_pointer++;
-                EOR_set_CPU_flags();
-                cycles_available -= 4;
-                break;
+        case INSTR_6502_STA_ZEROPAGE_X:
+            set_data_zeropage(A, X);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_EOR_ABSOLUTE:
-                A = A ^ get_data_absolute();
-                instruction_pointer++;
-                instruction_pointer++;
-                EOR_set_CPU_flags();
-                cycles_available -= 4;
-                break;
+        case INSTR_6502_STA_ABSOLUTE:
+            set_data_absolute(A);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_EOR_ABSOLUTE_X:
-                A = A ^ get_data_absolute(X);
-                instruction_pointer++;
-                instruction_pointer++;
-                EOR_set_CPU_flags();
-                cycles_available -= 4;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+        case INSTR_6502_STA_ABSOLUTE_X:
+            set_data_absolute(A, X);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_EOR_ABSOLUTE_Y:
-                A = A ^ get_data_absolute(Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                EOR_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+        case INSTR_6502_STA_ABSOLUTE_Y:
+            set_data_absolute(A, Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_EOR_INDIRECT_X:
-            {
-                A = A ^ get_data_indexed_indirect(X);
-                instruction_pointer++;
-                EOR_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_STA_INDIRECT_X:
+            set_data_indexed_indirect(A, X);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_EOR_INDIRECT_Y:
-                A = A ^ get_data_indirect_indexed(Y);
-                instruction_pointer++;
-                EOR_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+        case INSTR_6502_STA_INDIRECT_Y:
+            set_data_indirect_indexed(A, Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STA_ZEROPAGE:
-                set_data_zeropage(A);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_TXS:
+            stack_pointer = static_cast<uint16_t>(0x0100 | X);
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STA_ZEROPAGE_X:
-                set_data_zeropage(A, X);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_TSX:
+            X = static_cast<uint8_t>(stack_pointer & 0x00FF);
+            Z = (X == 0);
+            N = (X & BIT7);
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STA_ABSOLUTE:
-                set_data_absolute(A);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_TYA:
+            A = Y;
+            Z = (A == 0);
+            N = (A & BIT7);
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STA_ABSOLUTE_X:
-                set_data_absolute(A, X);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_STX_ZEROPAGE:
+            set_data_zeropage(X);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STA_ABSOLUTE_Y:
-                set_data_absolute(A, Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_STX_ZEROPAGE_Y:
+            set_data_absolute(X, Y);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STA_INDIRECT_X:
-                set_data_indexed_indirect(A, X);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_STX_ABSOLUTE:
+            set_data_absolute(X);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STA_INDIRECT_Y:
-                set_data_indirect_indexed(A, Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_STY_ZEROPAGE:
+            set_data_zeropage(Y);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_TXS:
-                stack_pointer = static_cast<uint16_t>(0x0100 | X);
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_STY_ZEROPAGE_X:
+            set_data_zeropage(Y, X);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_TSX:
-                X = static_cast<uint8_t>(stack_pointer & 0x00FF);
-                Z = (X == 0);
-                N = (X & BIT7);
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_STY_ABSOLUTE:
+            set_data_absolute(Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_TYA:
-                A = Y;
-                Z = (A == 0);
-                N = (A & BIT7);
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_TAX:
+            X = A;
+            TAX_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STX_ZEROPAGE:
-                set_data_zeropage(X);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_TAY:
+            Y = A;
+            Z = (Y == 0);
+            N = (Y & BIT7);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STX_ZEROPAGE_Y:
-                set_data_absolute(X, Y);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_TXA:
+            A = X;
+            TXA_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STX_ABSOLUTE:
-                set_data_absolute(X);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_INX:
+            X++;
+            INX_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STY_ZEROPAGE:
-                set_data_zeropage(Y);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_INY:
+            Y++;
+            INY_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STY_ZEROPAGE_X:
-                set_data_zeropage(Y, X);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_LDX_IMMEDIATE:
+            X = get_data_immediate();
+            instruction_pointer++;
+            LDX_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_STY_ABSOLUTE:
-                set_data_absolute(Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_LDX_ZEROPAGE:
+            X = get_data_zeropage();
+            instruction_pointer++;
+            LDX_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_TAX:
-                X = A;
-                TAX_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_LDX_ZEROPAGE_Y:
+            X = get_data_zeropage(Y);
+            instruction_pointer++;
+            LDX_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_TAY:
-                Y = A;
-                Z = (Y == 0);
-                N = (Y & BIT7);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_LDX_ABSOLUTE:
+            X = get_data_absolute();
+            instruction_pointer++;
+            instruction_pointer++;
+            LDX_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_TXA:
-                A = X;
-                TXA_set_CPU_flags();
-                cycles_available--;
+        case INSTR_6502_LDX_ABSOLUTE_Y:
+            X = get_data_absolute(Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            LDX_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
+            {
                 cycles_available--;
-                break;
+            }
+            break;
 
-            case INSTR_6502_INX:
-                X++;
-                INX_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_DEX:
+            X--;
+            DEX_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_INY:
-                Y++;
-                INY_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_DEY:
+            Y--;
+            DEY_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_LDX_IMMEDIATE:
-                X = get_data_immediate();
-                instruction_pointer++;
-                LDX_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_CPX_IMMEDIATE:
+        {
+            int result = X - get_data_immediate();
+            instruction_pointer++;
+            CPX_set_CPU_flags(result);
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_LDX_ZEROPAGE:
-                X = get_data_zeropage();
-                instruction_pointer++;
-                LDX_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_CPX_ZEROPAGE:
+        {
+            int result = X - get_data_zeropage();
+            instruction_pointer++;
+            CPX_set_CPU_flags(result);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_LDX_ZEROPAGE_Y:
-                X = get_data_zeropage(Y);
-                instruction_pointer++;
-                LDX_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_CPX_ABSOLUTE:
+        {
+            int result = X - get_data_absolute();
+            instruction_pointer++;
+            CPX_set_CPU_flags(result);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_LDX_ABSOLUTE:
-                X = get_data_absolute();
-                instruction_pointer++;
-                instruction_pointer++;
-                LDX_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_CPY_IMMEDIATE:
+        {
+            int result = Y - get_data_immediate();
+            CPY_set_CPU_flags(result);
+            cycles_available--;
+            cycles_available--;
+            instruction_pointer++;
+        }
+        break;
 
-            case INSTR_6502_LDX_ABSOLUTE_Y:
-                X = get_data_absolute(Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                LDX_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+        case INSTR_6502_CPY_ZEROPAGE:
+        {
+            int result = Y - get_data_zeropage();
+            CPY_set_CPU_flags(result);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            instruction_pointer++;
+        }
+        break;
 
-            case INSTR_6502_DEX:
-                X--;
-                DEX_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_CPY_ABSOLUTE:
+        {
+            int result = Y - get_data_absolute();
+            CPY_set_CPU_flags(result);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            instruction_pointer++;
+        }
+        break;
 
-            case INSTR_6502_DEY:
-                Y--;
-                DEY_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_BNE_RELATIVE:
+        {
+            // Remember the starting page so we know if we've moved to a new page.
+            uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            cycles_available--;
+            cycles_available--;
 
-            case INSTR_6502_CPX_IMMEDIATE:
+            if (!Z)
             {
-                int result = X - get_data_immediate();
-                instruction_pointer++;
-                CPX_set_CPU_flags(result);
-                cycles_available--;
+                uint8_t distance = get_data_relative();
+                branch_relative(distance);
                 cycles_available--;
             }
-            break;
+            instruction_pointer++;
 
-            case INSTR_6502_CPX_ZEROPAGE:
+            // This should take two additional clock cycles if the branch leads to a new page.
+            uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            if (current_page != new_page)
             {
-                int result = X - get_data_zeropage();
-                instruction_pointer++;
-                CPX_set_CPU_flags(result);
-                cycles_available--;
                 cycles_available--;
                 cycles_available--;
             }
-            break;
+            cover();
+        }
+        break;
+
+        case INSTR_6502_BEQ_RELATIVE:
+        {
+            // Remember the starting page so we know if we've moved to a new page.
+            uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            cycles_available--;
+            cycles_available--;
 
-            case INSTR_6502_CPX_ABSOLUTE:
+            if (Z)
             {
-                int result = X - get_data_absolute();
-                instruction_pointer++;
-                CPX_set_CPU_flags(result);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
+                uint8_t dist = get_data_relative();
+                branch_relative(dist);
                 cycles_available--;
             }
-            break;
+            instruction_pointer++;
 
-            case INSTR_6502_CPY_IMMEDIATE:
+            // This should take two additional clock cycles if the branch leads to a new page.
+            uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            if (current_page != new_page)
             {
-                int result = Y - get_data_immediate();
-                CPY_set_CPU_flags(result);
                 cycles_available--;
                 cycles_available--;
-                instruction_pointer++;
             }
-            break;
+            cover();
+        }
+        break;
+
+        case INSTR_6502_BMI_RELATIVE:
+        {
+            uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            cycles_available--;
+            cycles_available--;
 
-            case INSTR_6502_CPY_ZEROPAGE:
+            if (N)
             {
-                int result = Y - get_data_zeropage();
-                CPY_set_CPU_flags(result);
-                cycles_available--;
+                uint8_t dist = get_data_relative();
+                branch_relative(dist);
                 cycles_available--;
-                cycles_available--;
-                instruction_pointer++;
             }
-            break;
+            instruction_pointer++;
 
-            case INSTR_6502_CPY_ABSOLUTE:
+            uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            if (current_page != new_page)
             {
-                int result = Y - get_data_absolute();
-                CPY_set_CPU_flags(result);
-                cycles_available--;
                 cycles_available--;
                 cycles_available--;
-                cycles_available--;
-                instruction_pointer++;
             }
-            break;
+            cover();
+        }
+        break;
+
+        case INSTR_6502_BPL_RELATIVE:
+        {
+            uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            cycles_available--;
+            cycles_available--;
 
-            case INSTR_6502_BNE_RELATIVE:
+            if (!N)
             {
-                // Remember the starting page so we know if we've moved to a new page.
-                uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                cycles_available--;
+                uint8_t dist = get_data_relative();
+                branch_relative(dist);
                 cycles_available--;
-
-                if (!Z)
-                {
-                    uint8_t distance = get_data_relative();
-                    branch_relative(distance);
-                    cycles_available--;
-                }
-                instruction_pointer++;
-
-                // This should take two additional clock cycles if the branch leads to a new page.
-                uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                if (current_page != new_page)
-                {
-                    cycles_available--;
-                    cycles_available--;
-                }
             }
-            break;
+            instruction_pointer++;
 
-            case INSTR_6502_BEQ_RELATIVE:
+            uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            if (current_page != new_page)
             {
-                // Remember the starting page so we know if we've moved to a new page.
-                uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
                 cycles_available--;
                 cycles_available--;
+            }
+            cover();
+        }
+        break;
 
-                if (Z)
-                {
-                    uint8_t dist = get_data_relative();
-                    branch_relative(dist);
-                    cycles_available--;
-                }
-                instruction_pointer++;
-
-                // This should take two additional clock cycles if the branch leads to a new page.
-                uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                if (current_page != new_page)
-                {
-                    cycles_available--;
-                    cycles_available--;
-                }
-            }
-            break;
-
-            case INSTR_6502_BMI_RELATIVE:
-            {
-                uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                cycles_available--;
-                cycles_available--;
-
-                if (N)
-                {
-                    uint8_t dist = get_data_relative();
-                    branch_relative(dist);
-                    cycles_available--;
-                }
-                instruction_pointer++;
-
-                uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                if (current_page != new_page)
-                {
-                    cycles_available--;
-                    cycles_available--;
-                }
-            }
-            break;
+        case INSTR_6502_BVC_RELATIVE:
+        {
+            uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            cycles_available--;
+            cycles_available--;
 
-            case INSTR_6502_BPL_RELATIVE:
+            if (!V)
             {
-                uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
+                uint8_t dist = get_data_relative();
+                branch_relative(dist);
                 cycles_available--;
-                cycles_available--;
-
-                if (!N)
-                {
-                    uint8_t dist = get_data_relative();
-                    branch_relative(dist);
-                    cycles_available--;
-                }
-                instruction_pointer++;
-
-                uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                if (current_page != new_page)
-                {
-                    cycles_available--;
-                    cycles_available--;
-                }
             }
-            break;
+            instruction_pointer++;
 
-            case INSTR_6502_BVC_RELATIVE:
+            uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            if (current_page != new_page)
             {
-                uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
                 cycles_available--;
                 cycles_available--;
-
-                if (!V)
-                {
-                    uint8_t dist = get_data_relative();
-                    branch_relative(dist);
-                    cycles_available--;
-                }
-                instruction_pointer++;
-
-                uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                if (current_page != new_page)
-                {
-                    cycles_available--;
-                    cycles_available--;
-                }
             }
-            break;
-
-            case INSTR_6502_BVS_RELATIVE:
-            {
-                uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                cycles_available--;
-                cycles_available--;
-
-                if (V)
-                {
-                    uint8_t dist = get_data_relative();
-                    branch_relative(dist);
-                    cycles_available--;
-                }
-                instruction_pointer++;
+            cover();
+        }
+        break;
 
-                uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                if (current_page != new_page)
-                {
-                    cycles_available--;
-                    cycles_available--;
-                }
-            }
-            break;
+        case INSTR_6502_BVS_RELATIVE:
+        {
+            uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            cycles_available--;
+            cycles_available--;
 
-            case INSTR_6502_BCC_RELATIVE:
+            if (V)
             {
-                uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                cycles_available--;
+                uint8_t dist = get_data_relative();
+                branch_relative(dist);
                 cycles_available--;
-
-                if (!C)
-                {
-                    uint8_t dist = get_data_relative();
-                    branch_relative(dist);
-                    cycles_available--;
-                }
-                instruction_pointer++;
-
-                uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                if (current_page != new_page)
-                {
-                    cycles_available--;
-                    cycles_available--;
-                }
             }
-            break;
+            instruction_pointer++;
 
-            case INSTR_6502_BCS_RELATIVE:
+            uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            if (current_page != new_page)
             {
-                uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
                 cycles_available--;
                 cycles_available--;
-
-                if (C)
-                {
-                    uint8_t dist = get_data_relative();
-                    branch_relative(dist);
-                    cycles_available--;
-                }
-                instruction_pointer++;
-
-                uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
-                if (current_page != new_page)
-                {
-                    cycles_available--;
-                    cycles_available--;
-                }
             }
-            break;
-
-            case INSTR_6502_SED:
-                D = true;
-                cycles_available--;
-                cycles_available--;
-                break;
-
-            case INSTR_6502_ORA_IMMEDIATE:
-                A |= get_data_immediate();
-                instruction_pointer++;
-                ORA_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                break;
-
-            case INSTR_6502_ORA_ZEROPAGE:
-                A |= get_data_zeropage();
-                instruction_pointer++;
-                ORA_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
-
-            case INSTR_6502_ORA_ZEROPAGE_X:
-                A |= get_data_zeropage(X);
-                instruction_pointer++;
-                ORA_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
-
-            case INSTR_6502_ORA_ABSOLUTE:
-                A |= get_data_absolute();
-                instruction_pointer++;
-                instruction_pointer++;
-                ORA_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
-
-            case INSTR_6502_ORA_ABSOLUTE_X:
-                A |= get_data_absolute(X);
-                instruction_pointer++;
-                instruction_pointer++;
-                ORA_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
-
-            case INSTR_6502_ORA_ABSOLUTE_Y:
-                A |= get_data_absolute(Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                ORA_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
-
-            case INSTR_6502_ORA_INDIRECT_X:
-                A |= get_data_indexed_indirect(X);
-                instruction_pointer++;
-                ORA_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+            cover();
+        }
+        break;
 
-            case INSTR_6502_ORA_INDIRECT_Y:
-                A |= get_data_indirect_indexed(Y);
-                instruction_pointer++;
-                ORA_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+        case INSTR_6502_BCC_RELATIVE:
+        {
+            uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            cycles_available--;
+            cycles_available--;
 
-            case INSTR_6502_BIT_ZEROPAGE:
+            if (!C)
             {
-                uint8_t result = A & get_data_zeropage();
-                instruction_pointer++;
-                Z = (result == 0);
-                V = (result & BIT6);
-                N = (result & BIT7);
-                cycles_available--;
-                cycles_available--;
+                uint8_t dist = get_data_relative();
+                branch_relative(dist);
                 cycles_available--;
             }
-            break;
+            instruction_pointer++;
 
-            case INSTR_6502_BIT_ABSOLUTE:
+            uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            if (current_page != new_page)
             {
-                uint8_t result = A & get_data_absolute();
-                instruction_pointer++;
-                instruction_pointer++;
-                Z = (result == 0);
-                V = (result & BIT6);
-                N = (result & BIT7);
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
                 cycles_available--;
             }
-            break;
+            cover();
+        }
+        break;
 
-            case INSTR_6502_ASL_ACCUMULATOR:
-                C = (A & BIT7);
-                A = static_cast<uint8_t>(A << 1);
-                Z = (A == 0);
-                N = (A & BIT7);
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_BCS_RELATIVE:
+        {
+            uint8_t current_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            cycles_available--;
+            cycles_available--;
 
-            case INSTR_6502_ASL_ZEROPAGE:
+            if (C)
             {
-                uint8_t data = get_data_zeropage();
-                C = (data & BIT7);
-                data = static_cast<uint8_t>(data << 1);
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_zeropage(data);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
+                uint8_t dist = get_data_relative();
+                branch_relative(dist);
                 cycles_available--;
             }
-            break;
+            instruction_pointer++;
 
-            case INSTR_6502_ASL_ZEROPAGE_X:
+            uint8_t new_page = static_cast<uint8_t>(instruction_pointer >> 8);
+            if (current_page != new_page)
             {
-                uint8_t data = get_data_zeropage(X);
-                C = (data & BIT7);
-                data = static_cast<uint8_t>(data << 1);
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_zeropage(data, X);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
                 cycles_available--;
             }
-            break;
+            cover();
+        }
+        break;
 
-            case INSTR_6502_ASL_ABSOLUTE:
-            {
-                uint8_t data = get_data_absolute();
-                C = (data & BIT7);
-                data = static_cast<uint8_t>(data << 1);
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_absolute(data);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_SED:
+            D = true;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_ASL_ABSOLUTE_X:
-            {
-                uint8_t data = get_data_absolute(X);
-                C = (data & BIT7);
-                data = static_cast<uint8_t>(data << 1);
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_absolute(data, X);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_ORA_IMMEDIATE:
+            A |= get_data_immediate();
+            instruction_pointer++;
+            ORA_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_LSR_ACCUMULATOR:
-                C = (A & BIT7);
-                A = A >> 1;
-                Z = (A == 0);
-                N = (A & BIT7);
-                cycles_available--;
-                cycles_available--;
-                break;
-
-            case INSTR_6502_LSR_ZEROPAGE:
-            {
-                uint8_t data = get_data_zeropage();
-                C = (data & BIT7);
-                data = data >> 1;
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_zeropage(data);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_ORA_ZEROPAGE:
+            A |= get_data_zeropage();
+            instruction_pointer++;
+            ORA_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_LSR_ZEROPAGE_X:
-            {
-                uint8_t data = get_data_zeropage(X);
-                C = (data & BIT7);
-                data = data >> 1;
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_zeropage(data, X);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_ORA_ZEROPAGE_X:
+            A |= get_data_zeropage(X);
+            instruction_pointer++;
+            ORA_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_LSR_ABSOLUTE:
-            {
-                uint8_t data = get_data_absolute();
-                C = (data & BIT7);
-                data = data >> 1;
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_absolute(data);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_ORA_ABSOLUTE:
+            A |= get_data_absolute();
+            instruction_pointer++;
+            instruction_pointer++;
+            ORA_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_LSR_ABSOLUTE_X:
+        case INSTR_6502_ORA_ABSOLUTE_X:
+            A |= get_data_absolute(X);
+            instruction_pointer++;
+            instruction_pointer++;
+            ORA_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t data = get_data_absolute(X);
-                C = (data & BIT7);
-                data = data >> 1;
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_absolute(data, X);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
             }
             break;
 
-            case INSTR_6502_ROL_ACCUMULATOR:
+        case INSTR_6502_ORA_ABSOLUTE_Y:
+            A |= get_data_absolute(Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            ORA_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t tempC = static_cast<uint8_t>(C);
-                C = (A & BIT7);
-                A = static_cast<uint8_t>((A << 1) | tempC);
-                Z = (A == 0);
-                N = (A & BIT7);
-                cycles_available--;
                 cycles_available--;
             }
             break;
 
-            case INSTR_6502_ROL_ZEROPAGE:
-            {
-                uint8_t data = get_data_zeropage();
-                uint8_t tempC = static_cast<uint8_t>(C);
-                C = (data & BIT7);
-                data = static_cast<uint8_t>((data << 1) | tempC);
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_zeropage(data);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_ORA_INDIRECT_X:
+            A |= get_data_indexed_indirect(X);
+            instruction_pointer++;
+            ORA_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_ROL_ZEROPAGE_X:
+        case INSTR_6502_ORA_INDIRECT_Y:
+            A |= get_data_indirect_indexed(Y);
+            instruction_pointer++;
+            ORA_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t data = get_data_zeropage(X);
-                uint8_t tempC = static_cast<uint8_t>(C);
-                C = (data & BIT7);
-                data = static_cast<uint8_t>((data << 1) | tempC);
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_zeropage(data, X);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
             }
             break;
 
-            case INSTR_6502_ROL_ABSOLUTE:
-            {
-                uint8_t data = get_data_absolute();
-                uint8_t tempC = static_cast<uint8_t>(C);
-                C = (data & BIT7);
-                data = static_cast<uint8_t>((data << 1) | tempC);
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_absolute(data);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
-            break;
+        case INSTR_6502_BIT_ZEROPAGE:
+        {
+            uint8_t result = A & get_data_zeropage();
+            instruction_pointer++;
+            Z = (result == 0);
+            V = (result & BIT6);
+            N = (result & BIT7);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_ROL_ABSOLUTE_X:
-            {
-                uint8_t data = get_data_absolute(X);
-                uint8_t tempC = static_cast<uint8_t>(C);
-                C = (data & BIT7);
-                data = static_cast<uint8_t>((data << 1) | tempC);
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_absolute(data, X);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
-            break;
+        case INSTR_6502_BIT_ABSOLUTE:
+        {
+            uint8_t result = A & get_data_absolute();
+            instruction_pointer++;
+            instruction_pointer++;
+            Z = (result == 0);
+            V = (result & BIT6);
+            N = (result & BIT7);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_ROR_ACCUMULATOR:
-            {
-                uint8_t tempC = static_cast<uint8_t>(C << 7);
-                C = (A & BIT0);
-                A = (A >> 1) | tempC;
-                Z = (A == 0);
-                N = (A & BIT7);
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_ASL_ACCUMULATOR:
+            C = (A & BIT7);
+            A = static_cast<uint8_t>(A << 1);
+            Z = (A == 0);
+            N = (A & BIT7);
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_ROR_ZEROPAGE:
-            {
-                uint8_t data = get_data_zeropage();
-                uint8_t tempC = static_cast<uint8_t>(C << 7);
-                C = (data & BIT0);
-                data = (data >> 1) | tempC;
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_zeropage(data);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
-            break;
+        case INSTR_6502_ASL_ZEROPAGE:
+        {
+            uint8_t data = get_data_zeropage();
+            C = (data & BIT7);
+            data = static_cast<uint8_t>(data << 1);
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_zeropage(data);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_ROR_ZEROPAGE_X:
-            {
-                uint8_t data = get_data_zeropage(X);
-                uint8_t tempC = static_cast<uint8_t>(C << 7);
-                C = (data & BIT0);
-                data = (data >> 1) | tempC;
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_zeropage(data, X);
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_ASL_ZEROPAGE_X:
+        {
+            uint8_t data = get_data_zeropage(X);
+            C = (data & BIT7);
+            data = static_cast<uint8_t>(data << 1);
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_zeropage(data, X);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ASL_ABSOLUTE:
+        {
+            uint8_t data = get_data_absolute();
+            C = (data & BIT7);
+            data = static_cast<uint8_t>(data << 1);
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_absolute(data);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ASL_ABSOLUTE_X:
+        {
+            uint8_t data = get_data_absolute(X);
+            C = (data & BIT7);
+            data = static_cast<uint8_t>(data << 1);
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_absolute(data, X);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_LSR_ACCUMULATOR:
+            C = (A & BIT7);
+            A = A >> 1;
+            Z = (A == 0);
+            N = (A & BIT7);
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_ROR_ABSOLUTE:
+        case INSTR_6502_LSR_ZEROPAGE:
+        {
+            uint8_t data = get_data_zeropage();
+            C = (data & BIT7);
+            data = data >> 1;
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_zeropage(data);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_LSR_ZEROPAGE_X:
+        {
+            uint8_t data = get_data_zeropage(X);
+            C = (data & BIT7);
+            data = data >> 1;
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_zeropage(data, X);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_LSR_ABSOLUTE:
+        {
+            uint8_t data = get_data_absolute();
+            C = (data & BIT7);
+            data = data >> 1;
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_absolute(data);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_LSR_ABSOLUTE_X:
+        {
+            uint8_t data = get_data_absolute(X);
+            C = (data & BIT7);
+            data = data >> 1;
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_absolute(data, X);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ROL_ACCUMULATOR:
+        {
+            uint8_t tempC = static_cast<uint8_t>(C);
+            C = (A & BIT7);
+            A = static_cast<uint8_t>((A << 1) | tempC);
+            Z = (A == 0);
+            N = (A & BIT7);
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ROL_ZEROPAGE:
+        {
+            uint8_t data = get_data_zeropage();
+            uint8_t tempC = static_cast<uint8_t>(C);
+            C = (data & BIT7);
+            data = static_cast<uint8_t>((data << 1) | tempC);
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_zeropage(data);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ROL_ZEROPAGE_X:
+        {
+            uint8_t data = get_data_zeropage(X);
+            uint8_t tempC = static_cast<uint8_t>(C);
+            C = (data & BIT7);
+            data = static_cast<uint8_t>((data << 1) | tempC);
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_zeropage(data, X);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ROL_ABSOLUTE:
+        {
+            uint8_t data = get_data_absolute();
+            uint8_t tempC = static_cast<uint8_t>(C);
+            C = (data & BIT7);
+            data = static_cast<uint8_t>((data << 1) | tempC);
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_absolute(data);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ROL_ABSOLUTE_X:
+        {
+            uint8_t data = get_data_absolute(X);
+            uint8_t tempC = static_cast<uint8_t>(C);
+            C = (data & BIT7);
+            data = static_cast<uint8_t>((data << 1) | tempC);
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_absolute(data, X);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ROR_ACCUMULATOR:
+        {
+            uint8_t tempC = static_cast<uint8_t>(C << 7);
+            C = (A & BIT0);
+            A = (A >> 1) | tempC;
+            Z = (A == 0);
+            N = (A & BIT7);
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ROR_ZEROPAGE:
+        {
+            uint8_t data = get_data_zeropage();
+            uint8_t tempC = static_cast<uint8_t>(C << 7);
+            C = (data & BIT0);
+            data = (data >> 1) | tempC;
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_zeropage(data);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ROR_ZEROPAGE_X:
+        {
+            uint8_t data = get_data_zeropage(X);
+            uint8_t tempC = static_cast<uint8_t>(C << 7);
+            C = (data & BIT0);
+            data = (data >> 1) | tempC;
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_zeropage(data, X);
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ROR_ABSOLUTE:
+        {
+            uint8_t data = get_data_absolute();
+            uint8_t tempC = static_cast<uint8_t>(C << 7);
+            C = (data & BIT0);
+            data = (data >> 1) | tempC;
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_absolute(data);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ROR_ABSOLUTE_X:
+        {
+            uint8_t data = get_data_absolute(X);
+            uint8_t tempC = static_cast<uint8_t>(C << 7);
+            C = (data & BIT0);
+            data = (data >> 1) | tempC;
+            Z = (data == 0);
+            N = (data & BIT7);
+            set_data_absolute(data, X);
+            instruction_pointer++;
+            instruction_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_PLP:
+            set_flags_from_byte(pop_from_stack());
+            cycles_available--;
+            cycles_available--;
+            if (irq_lines != 0 && !I) [[unlikely]]
             {
-                uint8_t data = get_data_absolute();
-                uint8_t tempC = static_cast<uint8_t>(C << 7);
-                C = (data & BIT0);
-                data = (data >> 1) | tempC;
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_absolute(data);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
+                Scheduler::end_slice();
             }
             break;
 
-            case INSTR_6502_ROR_ABSOLUTE_X:
-            {
-                uint8_t data = get_data_absolute(X);
-                uint8_t tempC = static_cast<uint8_t>(C << 7);
-                C = (data & BIT0);
-                data = (data >> 1) | tempC;
-                Z = (data == 0);
-                N = (data & BIT7);
-                set_data_absolute(data, X);
-                instruction_pointer++;
-                instruction_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_SEC:
+            C = true;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_PLP:
-            {
-                uint8_t flags = pop_from_stack();
-                N = (flags >> 7) & BIT1;
-                V = (flags >> 6) & BIT1;
-                B = (flags >> 4) & BIT1;
-                D = (flags >> 3) & BIT1;
-                I = (flags >> 2) & BIT1;
-                Z = (flags >> 1) & BIT1;
-                C = (flags >> 0) & BIT1;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_SEI:
+            I = true;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_SEC:
-                C = true;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_ADC_IMMEDIATE:
+        {
+            // TODO: Explain this. What I've done is mostly based on
+            // http://www.righto.com/2012/12/the-6502-overflow-flag-explained.html
+            uint8_t data = get_data_immediate();
+            instruction_pointer++;
+            A = add_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_SEI:
-                I = true;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_ADC_ZEROPAGE:
+        {
+            uint8_t data = get_data_zeropage();
+            instruction_pointer++;
+            A = add_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ADC_ZEROPAGE_X:
+        {
+            uint8_t data = get_data_zeropage(X);
+            instruction_pointer++;
+            A = add_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_ADC_ABSOLUTE:
+        {
+            uint8_t data = get_data_absolute();
+            instruction_pointer++;
+            instruction_pointer++;
+            A = add_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_ADC_IMMEDIATE:
+        case INSTR_6502_ADC_ABSOLUTE_X:
+        {
+            uint8_t data = get_data_absolute(X);
+            instruction_pointer++;
+            instruction_pointer++;
+            A = add_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                // TODO: Explain this. What I've done is mostly based on
-                // http://www.righto.com/2012/12/the-6502-overflow-flag-explained.html
-                uint8_t data = get_data_immediate();
-                instruction_pointer++;
-                A = add_with_carry(data);
-                cycles_available--;
                 cycles_available--;
             }
-            break;
+        }
+        break;
 
-            case INSTR_6502_ADC_ZEROPAGE:
+        case INSTR_6502_ADC_ABSOLUTE_Y:
+        {
+            uint8_t data = get_data_absolute(Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            A = add_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t data = get_data_zeropage();
-                instruction_pointer++;
-                A = add_with_carry(data);
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
             }
-            break;
+        }
+        break;
+
+        case INSTR_6502_ADC_INDIRECT_X:
+        {
+            uint8_t data = get_data_indexed_indirect(X);
+            instruction_pointer++;
+            A = add_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_ADC_ZEROPAGE_X:
+        case INSTR_6502_ADC_INDIRECT_Y:
+        {
+            uint8_t data = get_data_indirect_indexed(Y);
+            instruction_pointer++;
+            A = add_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t data = get_data_zeropage(X);
-                instruction_pointer++;
-                A = add_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
             }
-            break;
+        }
+        break;
+
+        case INSTR_6502_SBC_IMMEDIATE:
+        {
+            uint8_t data = get_data_immediate();
+            instruction_pointer++;
+            A = sub_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_SBC_ZEROPAGE:
+        {
+            uint8_t data = get_data_zeropage();
+            instruction_pointer++;
+            A = sub_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_ADC_ABSOLUTE:
+        case INSTR_6502_SBC_ZEROPAGE_X:
+        {
+            uint8_t data = get_data_zeropage(X);
+            instruction_pointer++;
+            A = sub_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_SBC_ABSOLUTE:
+        {
+            uint8_t data = get_data_absolute();
+            instruction_pointer++;
+            instruction_pointer++;
+            A = sub_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
+
+        case INSTR_6502_SBC_ABSOLUTE_X:
+        {
+            uint8_t data = get_data_absolute(X);
+            instruction_pointer++;
+            instruction_pointer++;
+            A = sub_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t data = get_data_absolute();
-                instruction_pointer++;
-                instruction_pointer++;
-                A = add_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
             }
-            break;
+        }
+        break;
 
-            case INSTR_6502_ADC_ABSOLUTE_X:
+        case INSTR_6502_SBC_ABSOLUTE_Y:
+        {
+            uint8_t data = get_data_absolute(Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            A = sub_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t data = get_data_absolute(X);
-                instruction_pointer++;
-                instruction_pointer++;
-                A = add_with_carry(data);
                 cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
             }
-            break;
+        }
+        break;
+
+        case INSTR_6502_SBC_INDIRECT_X:
+        {
+            uint8_t data = get_data_indexed_indirect(X);
+            instruction_pointer++;
+            A = sub_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_ADC_ABSOLUTE_Y:
+        case INSTR_6502_SBC_INDIRECT_Y:
+        {
+            uint8_t data = get_data_indirect_indexed(Y);
+            instruction_pointer++;
+            A = sub_with_carry(data);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t data = get_data_absolute(Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                A = add_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
             }
+        }
+        break;
+
+        case INSTR_6502_CLD:
+            D = false;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_ADC_INDIRECT_X:
+        case INSTR_6502_CLI:
+            I = false;
+            cycles_available--;
+            cycles_available--;
+            if (irq_lines != 0) [[unlikely]]
             {
-                uint8_t data = get_data_indexed_indirect(X);
-                instruction_pointer++;
-                A = add_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
+                Scheduler::end_slice();
             }
             break;
 
-            case INSTR_6502_ADC_INDIRECT_Y:
-            {
-                uint8_t data = get_data_indirect_indexed(Y);
-                instruction_pointer++;
-                A = add_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-            }
+        case INSTR_6502_CLC:
+            C = false;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_SBC_IMMEDIATE:
-            {
-                uint8_t data = get_data_immediate();
-                instruction_pointer++;
-                A = sub_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_CLV:
+            V = false;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_SBC_ZEROPAGE:
-            {
-                uint8_t data = get_data_zeropage();
-                instruction_pointer++;
-                A = sub_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_PHA:
+            Bus::write(A, stack_pointer);
+            stack_pointer--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_SBC_ZEROPAGE_X:
-            {
-                uint8_t data = get_data_zeropage(X);
-                instruction_pointer++;
-                A = sub_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_PHP:
+            Bus::write(flags_as_byte(), stack_pointer);
+            stack_pointer--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_SBC_ABSOLUTE:
-            {
-                uint8_t data = get_data_absolute();
-                instruction_pointer++;
-                instruction_pointer++;
-                A = sub_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_PLA:
+            A = Bus::read(stack_pointer);
+            stack_pointer++;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            LDA_set_CPU_flags();
             break;
 
-            case INSTR_6502_SBC_ABSOLUTE_X:
-            {
-                uint8_t data = get_data_absolute(X);
-                instruction_pointer++;
-                instruction_pointer++;
-                A = sub_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-            }
+        case INSTR_6502_NOP:
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_SBC_ABSOLUTE_Y:
+        case INSTR_6502_BRK:
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            B = true;
+
+            if (brk_policy == BrkPolicy::VECTOR)
             {
-                uint8_t data = get_data_absolute(Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                A = sub_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
+                // BRK is two bytes long; the byte after the opcode is padding that RTI skips.
+                push_interrupt_frame(static_cast<uint16_t>(instruction_pointer + 1), flags_as_byte());
+                I = true;
+                instruction_pointer = get_word(irq_vector);
+                break;
             }
-            break;
 
-            case INSTR_6502_SBC_INDIRECT_X:
-            {
-                uint8_t data = get_data_indexed_indirect(X);
-                instruction_pointer++;
-                A = sub_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
-            break;
+            Bus::write(static_cast<uint8_t>(instruction_pointer >> 8), stack_pointer);
+            stack_pointer--;
+            Bus::write(static_cast<uint8_t>(instruction_pointer & 0xFF), stack_pointer);
+            stack_pointer--;
+            Bus::write(flags_as_byte(), stack_pointer);
+            stack_pointer--;
 
-            case INSTR_6502_SBC_INDIRECT_Y:
-            {
-                uint8_t data = get_data_indirect_indexed(Y);
-                instruction_pointer++;
-                A = sub_with_carry(data);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-            }
-            break;
+            return ReturnCode::BREAK;
 
-            case INSTR_6502_CLD:
-                D = false;
-                cycles_available--;
-                cycles_available--;
+        case INSTR_6502_JSR_ABSOLUTE:
+        {
+            uint16_t target_address = get_word(instruction_pointer);
+            if (Hle::hook_count != 0 && Hle::call(target_address)) [[unlikely]]
+            {
                 break;
+            }
 
-            case INSTR_6502_CLI:
-                I = false;
-                cycles_available--;
-                cycles_available--;
-                break;
+            instruction_pointer++;
+            Bus::write(static_cast<uint8_t>(instruction_pointer >> 8), stack_pointer);
+            stack_pointer--;
+            Bus::write(static_cast<uint8_t>(instruction_pointer & 0xFF), stack_pointer);
+            stack_pointer--;
+            instruction_pointer = target_address;
+            cover();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_CLC:
-                C = false;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_RTI:
+        {
+            set_flags_from_byte(pop_from_stack());
+            uint8_t low = pop_from_stack();
+            uint8_t high = pop_from_stack();
+            instruction_pointer = static_cast<uint16_t>(low | (high << 8));
+            cover();
 
-            case INSTR_6502_CLV:
-                V = false;
-                cycles_available--;
-                cycles_available--;
-                break;
+            cycles_available -= 6;
+            if (irq_lines != 0 && !I) [[unlikely]]
+            {
+                Scheduler::end_slice();
+            }
+        }
+        break;
+        case INSTR_6502_RTS:
+        {
+            stack_pointer++;
+            uint16_t pointer = get_word(stack_pointer);
+            stack_pointer++;
+
+            instruction_pointer = pointer + 1;
+            cover();
+
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_PHA:
-                Bus::write(A, stack_pointer);
-                stack_pointer--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_JMP_ABSOLUTE:
+            // TODO I don't know if I'm supposed to jump to the address in memory at the IP,
+            // or the address specified by that memory location.
+            instruction_pointer = get_word(instruction_pointer);
+            cover();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            break;
 
-            case INSTR_6502_PHP:
-                Bus::write(flags_as_byte(), stack_pointer);
-                stack_pointer--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_INC_ZEROPAGE:
+        {
+            uint8_t value = get_data_zeropage();
+            value++;
+            set_data_zeropage(value);
+            instruction_pointer++;
+            INC_set_CPU_flags(value);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_PLA:
-                A = Bus::read(stack_pointer);
-                stack_pointer++;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                LDA_set_CPU_flags();
-                break;
+        case INSTR_6502_INC_ZEROPAGE_X:
+        {
+            uint8_t value = get_data_zeropage(X);
+            value++;
+            set_data_zeropage(value, X);
+            instruction_pointer++;
+            INC_set_CPU_flags(value);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_NOP:
-                cycles_available--;
-                cycles_available--;
-                break;
+        case INSTR_6502_INC_ABSOLUTE:
+        {
+            uint8_t value = get_data_absolute();
+            value++;
+            set_data_absolute(value);
+            instruction_pointer++;
+            instruction_pointer++;
+            INC_set_CPU_flags(value);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_BRK:
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                B = true;
+        case INSTR_6502_INC_ABSOLUTE_X:
+        {
+            uint8_t value = get_data_absolute(X);
+            value++;
+            set_data_absolute(value, X);
+            instruction_pointer++;
+            instruction_pointer++;
+            INC_set_CPU_flags(value);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-                Bus::write(static_cast<uint8_t>(instruction_pointer >> 8), stack_pointer);
-                stack_pointer--;
-                Bus::write(static_cast<uint8_t>(instruction_pointer & 0xFF), stack_pointer);
-                stack_pointer--;
-                Bus::write(flags_as_byte(), stack_pointer);
-                stack_pointer--;
+        case INSTR_6502_DEC_ZEROPAGE:
+        {
+            uint8_t value = get_data_zeropage();
+            value--;
+            set_data_zeropage(value);
+            instruction_pointer++;
+            DEC_set_CPU_flags(value);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-                std::cout << "BRK reached" << std::endl;
-                return ReturnCode::BREAK;
+        case INSTR_6502_DEC_ZEROPAGE_X:
+        {
+            uint8_t value = get_data_zeropage(X);
+            value--;
+            set_data_zeropage(value, X);
+            instruction_pointer++;
+            DEC_set_CPU_flags(value);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_JSR_ABSOLUTE:
-            {
-                uint16_t target_address = get_word(instruction_pointer);
-                instruction_pointer++;
-                Bus::write(static_cast<uint8_t>(instruction_pointer >> 8), stack_pointer);
-                stack_pointer--;
-                Bus::write(static_cast<uint8_t>(instruction_pointer & 0xFF), stack_pointer);
-                stack_pointer--;
-                instruction_pointer = target_address;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
-            break;
+        case INSTR_6502_DEC_ABSOLUTE:
+        {
+            uint8_t value = get_data_absolute();
+            value--;
+            set_data_absolute(value);
+            instruction_pointer++;
+            instruction_pointer++;
+            DEC_set_CPU_flags(value);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-            case INSTR_6502_RTS:
-            {
-                stack_pointer++;
-                uint16_t pointer = get_word(stack_pointer);
-                stack_pointer++;
+        case INSTR_6502_DEC_ABSOLUTE_X:
+        {
+            uint8_t value = get_data_absolute(X);
+            value--;
+            set_data_absolute(value, X);
+            instruction_pointer++;
+            instruction_pointer++;
+            DEC_set_CPU_flags(value);
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-                instruction_pointer = pointer + 1;
+        case INSTR_6502_JMP_INDIRECT:
+        {
+            uint16_t lookup_address = get_word(instruction_pointer);
+            instruction_pointer = get_word(lookup_address);
+            cover();
+
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+        }
+        break;
 
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_AND_IMMEDIATE:
+            A &= get_data_immediate();
+            instruction_pointer++;
+            AND_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_JMP_ABSOLUTE:
-                // TODO I don't know if I'm supposed to jump to the address in memory at the IP,
-                // or the address specified by that memory location.
-                instruction_pointer = get_word(instruction_pointer);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
-
-            case INSTR_6502_INC_ZEROPAGE:
-            {
-                uint8_t value = get_data_zeropage();
-                value++;
-                set_data_zeropage(value);
-                instruction_pointer++;
-                INC_set_CPU_flags(value);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_AND_ZEROPAGE_X:
+            A &= get_data_zeropage(X);
+            instruction_pointer++;
+            AND_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_INC_ZEROPAGE_X:
-            {
-                uint8_t value = get_data_zeropage(X);
-                value++;
-                set_data_zeropage(value, X);
-                instruction_pointer++;
-                INC_set_CPU_flags(value);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_AND_ZEROPAGE:
+            A &= get_data_zeropage();
+            instruction_pointer++;
+            AND_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_INC_ABSOLUTE:
-            {
-                uint8_t value = get_data_absolute();
-                value++;
-                set_data_absolute(value);
-                instruction_pointer++;
-                instruction_pointer++;
-                INC_set_CPU_flags(value);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_AND_ABSOLUTE:
+            A &= get_data_absolute();
+            instruction_pointer++;
+            instruction_pointer++;
+            AND_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_INC_ABSOLUTE_X:
+        case INSTR_6502_AND_ABSOLUTE_X:
+            A &= get_data_absolute(X);
+            instruction_pointer++;
+            instruction_pointer++;
+            AND_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t value = get_data_absolute(X);
-                value++;
-                set_data_absolute(value, X);
-                instruction_pointer++;
-                instruction_pointer++;
-                INC_set_CPU_flags(value);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
             }
             break;
 
-            case INSTR_6502_DEC_ZEROPAGE:
+        case INSTR_6502_AND_ABSOLUTE_Y:
+            A &= get_data_absolute(Y);
+            instruction_pointer++;
+            instruction_pointer++;
+            AND_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t value = get_data_zeropage();
-                value--;
-                set_data_zeropage(value);
-                instruction_pointer++;
-                DEC_set_CPU_flags(value);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
             }
             break;
 
-            case INSTR_6502_DEC_ZEROPAGE_X:
-            {
-                uint8_t value = get_data_zeropage(X);
-                value--;
-                set_data_zeropage(value, X);
-                instruction_pointer++;
-                DEC_set_CPU_flags(value);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
+        case INSTR_6502_AND_INDIRECT_X:
+            A &= get_data_indexed_indirect(X);
+            instruction_pointer++;
+            AND_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
             break;
 
-            case INSTR_6502_DEC_ABSOLUTE:
+        case INSTR_6502_AND_INDIRECT_Y:
+            A &= get_data_indirect_indexed(Y);
+            instruction_pointer++;
+            AND_set_CPU_flags();
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            cycles_available--;
+            if (page_crossed)
             {
-                uint8_t value = get_data_absolute();
-                value--;
-                set_data_absolute(value);
-                instruction_pointer++;
-                instruction_pointer++;
-                DEC_set_CPU_flags(value);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
                 cycles_available--;
             }
             break;
 
-            case INSTR_6502_DEC_ABSOLUTE_X:
-            {
-                uint8_t value = get_data_absolute(X);
-                value--;
-                set_data_absolute(value, X);
-                instruction_pointer++;
-                instruction_pointer++;
-                DEC_set_CPU_flags(value);
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
-            break;
+        default:
+            return ReturnCode::UNKNOWN_INSTRUCTION;
+        }
+        return ReturnCode::CONTINUE;
+    }
 
-            case INSTR_6502_JMP_INDIRECT:
-            {
-                uint16_t lookup_address = get_word(instruction_pointer);
-                instruction_pointer = get_word(lookup_address);
+    /** \brief Take a hardware interrupt through a vector. The pushed flags have B clear, which is how a handler shared
+     * with BRK tells the two apart.
+     * \param vector Address of the interrupt vector.
+     */
+    void take_interrupt(const uint16_t vector)
+    {
+        push_interrupt_frame(instruction_pointer, static_cast<uint8_t>(flags_as_byte() & ~BIT4));
+        I = true;
+        instruction_pointer = get_word(vector);
+        cycles_available -= 7;
+    }
 
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-            }
-            break;
+    /** \brief Run the reset sequence: interrupts are disabled, the stack pointer moves down three bytes without
+     * writing, and execution continues at the address in the reset vector. Pending interrupts are dropped.
+     */
+    void reset()
+    {
+        nmi_pending = false;
+        I = true;
+        stack_pointer = static_cast<uint16_t>(0x0100 | ((stack_pointer - 3) & 0xFF));
+        instruction_pointer = get_word(reset_vector);
+        cycles_available -= 7;
+    }
 
-            case INSTR_6502_AND_IMMEDIATE:
-                A &= get_data_immediate();
-                instruction_pointer++;
-                AND_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                break;
+    /** \brief Signal a non-maskable interrupt. It is taken before the next instruction of the next slice; when running
+     * under the scheduler, the current slice ends after the current instruction.
+     */
+    void nmi()
+    {
+        nmi_pending = true;
+        Scheduler::end_slice();
+    }
 
-            case INSTR_6502_AND_ZEROPAGE_X:
-                A &= get_data_zeropage(X);
-                instruction_pointer++;
-                AND_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+    /** \brief Assert or release a device's IRQ line. The IRQ is level triggered: it is taken at the start of every slice
+     * while any line is asserted and I is clear.
+     * \param line Bit identifying the device.
+     * \param asserted True to pull the line low, false to release it.
+     */
+    void set_irq(const uint32_t line, const bool asserted)
+    {
+        irq_lines = asserted ? (irq_lines | line) : (irq_lines & ~line);
+        if (asserted && !I)
+        {
+            Scheduler::end_slice();
+        }
+    }
 
-            case INSTR_6502_AND_ZEROPAGE:
-                A &= get_data_zeropage();
-                instruction_pointer++;
-                AND_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+    /** \brief Take a pending NMI, or an IRQ if one is asserted and not masked. */
+    void service_interrupts()
+    {
+        if (nmi_pending)
+        {
+            nmi_pending = false;
+            take_interrupt(nmi_vector);
+        }
+        else if (irq_lines != 0 && !I)
+        {
+            take_interrupt(irq_vector);
+        }
+    }
 
-            case INSTR_6502_AND_ABSOLUTE:
-                A &= get_data_absolute();
-                instruction_pointer++;
-                instruction_pointer++;
-                AND_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+    /** \brief Fetch and execute the instruction at the instruction pointer.
+     * \return ReturnCode::CONTINUE, or the reason execution should stop.
+     */
+    ReturnCode step()
+    {
+        // Grab an instruction from RAM.
+        uint8_t instruction = Bus::read(instruction_pointer);
 
-            case INSTR_6502_AND_ABSOLUTE_X:
-                A &= get_data_absolute(X);
-                instruction_pointer++;
-                instruction_pointer++;
-                AND_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+        // We increment the instruction pointer to point to the next byte in memory.
+        instruction_pointer++;
 
-            case INSTR_6502_AND_ABSOLUTE_Y:
-                A &= get_data_absolute(Y);
-                instruction_pointer++;
-                instruction_pointer++;
-                AND_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
-                {
-                    cycles_available--;
-                }
-                break;
+        LOG(
+            "N" << N << " " << "V" << V << " " << "B" << B << " " << "D" << D << " " << "I" << I << " " << "Z" << Z
+                << " " << "C" << C << "    " << std::hex << "IP:" << std::setw(4) << (int)instruction_pointer << "   " << "SP:"
+                << std::setw(4) << (int)stack_pointer << "   " << "A:" << std::setw(2) << (int)A << "   " << "X:" << std::setw(2)
+                << (int)X << "   " << "Y:" << std::setw(2) << (int)Y << "   " << instruction_names[instruction]);
 
-            case INSTR_6502_AND_INDIRECT_X:
-                A &= get_data_indexed_indirect(X);
-                instruction_pointer++;
-                AND_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                break;
+        return execute(instruction);
+    }
 
-            case INSTR_6502_AND_INDIRECT_Y:
-                A &= get_data_indirect_indexed(Y);
-                instruction_pointer++;
-                AND_set_CPU_flags();
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                cycles_available--;
-                if (page_crossed)
+    /** \brief Run until the supply of cycles is spent, as tick() does, stopping at breakpoints and noting every
+     * instruction in code_coverage if it is set. Only used while either is, so that tick() pays nothing for them. */
+    ReturnCode tick_instrumented()
+    {
+        Debugger::start_run();
+        while (cycles_available > 0)
+        {
+            const uint16_t address = instruction_pointer;
+            if (Debugger::breakpoint_pages[address >> 8] != 0 && Debugger::stop_at(address)) [[unlikely]]
+            {
+                return ReturnCode::BREAKPOINT;
+            }
+            if (code_coverage == nullptr)
+            {
+                if (ReturnCode code = step(); code != ReturnCode::CONTINUE)
                 {
-                    cycles_available--;
+                    return code;
                 }
-                break;
-
-            default:
-                std::cout << "Unknown instruction: 0x" << std::hex << std::setw(2) << std::setfill('0');
-                std::cout << (int)instruction << "\n";
-                return ReturnCode::BREAK;
+                continue;
+            }
+            // Peeked rather than read, so that a device page doesn't see the fetch twice.
+            const uint8_t *page = Memory::pages[address >> 8];
+            const uint8_t opcode = page != nullptr ? page[address & 0xFF] : 0;
+            ReturnCode code = step();
+            if (page != nullptr)
+            {
+                Coverage::record(*code_coverage, address, opcode, instruction_pointer);
+            }
+            if (code != ReturnCode::CONTINUE)
+            {
+                return code;
             }
         }
         return ReturnCode::CONTINUE;
     }
+
+    ReturnCode tick(const int cycles_to_add)
+    {
+        cycles_available += cycles_to_add;
+
+        // Interrupts are only looked at once per slice. Raising one while the CPU runs ends the slice early instead.
+        if (nmi_pending || (irq_lines != 0 && !I)) [[unlikely]]
+        {
+            service_interrupts();
+        }
+
+        ReturnCode code = ReturnCode::CONTINUE;
+        if (code_coverage != nullptr || Debugger::breakpoint_count != 0) [[unlikely]]
+        {
+            code = tick_instrumented();
+        }
+        else
+        {
+            while (cycles_available > 0 && (code = step()) == ReturnCode::CONTINUE)
+            {
+            }
+        }
+        // A watchpoint hit ends the slice early, by taking the cycles left.
+        if (Debugger::watch_hit) [[unlikely]]
+        {
+            return Debugger::finish(code);
+        }
+        return code;
+    }
 }
@@ -0,0 +1,93 @@
+#include <chrono>
+#include <iomanip>
+
+#include "apu.hpp"
+#include "ppu.hpp"
+#include "run_ahead.hpp"
+#include "savestate.hpp"
+#include "scheduler.hpp"
+
+namespace RunAhead
+{
+    /** \brief Nanoseconds since a time point. */
+    uint64_t elapsed(const std::chrono::steady_clock::time_point start)
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    /** \brief Run a frame, then run ahead of it and show the frame that far ahead instead. Bus::frame_end is called
+     * with the machine as it is after the last frame run ahead. Without run-ahead, only runs the frame.
+     * \param profile Clock profile the frames are timed by.
+     * \param start_cycle Cycle at which frame 1 started.
+     * \param frame Number of the frame to run, from 1.
+     * \return How the real frame ended. If it didn't end with CONTINUE, nothing was run ahead.
+     */
+    ReturnCode run_frame(const Clock::Profile &profile, const uint64_t start_cycle, const uint64_t frame)
+    {
+        if (frames <= 0)
+        {
+            return Scheduler::run_until(start_cycle + Clock::frame_end(profile, frame));
+        }
+        auto start = std::chrono::steady_clock::now();
+        // Only the last frame run ahead is shown, so it is the only one drawn.
+        auto *const frame_ready = Ppu::frame_ready;
+        Ppu::frame_ready = nullptr;
+        Ppu::drawing = false;
+        const ReturnCode code = Scheduler::run_until(start_cycle + Clock::frame_end(profile, frame));
+        stats.real_nanoseconds += elapsed(start);
+        if (code != ReturnCode::CONTINUE)
+        {
+            Ppu::frame_ready = frame_ready;
+            Ppu::drawing = true;
+            return code;
+        }
+
+        start = std::chrono::steady_clock::now();
+        Savestate::save();
+        Apu::muted = true;
+        for (uint64_t ahead = 1; ahead <= static_cast<uint64_t>(frames); ahead++)
+        {
+            if (ahead == static_cast<uint64_t>(frames))
+            {
+                Ppu::frame_ready = frame_ready;
+                Ppu::drawing = true;
+            }
+            // A program that stops while running ahead will stop again when it really gets there.
+            if (Scheduler::run_until(start_cycle + Clock::frame_end(profile, frame + ahead)) != ReturnCode::CONTINUE)
+            {
+                break;
+            }
+        }
+        Ppu::frame_ready = frame_ready;
+        Ppu::drawing = true;
+        if (Bus::frame_end != nullptr)
+        {
+            Bus::frame_end();
+        }
+        Apu::muted = false;
+        Savestate::restore();
+        stats.frames++;
+        stats.ahead_nanoseconds += elapsed(start);
+        return code;
+    }
+
+    /** \brief Print what run-ahead and its saved states have cost. */
+    void report(std::ostream &out)
+    {
+        if (stats.frames == 0)
+        {
+            return;
+        }
+        const double frames_run = static_cast<double>(stats.frames);
+        const double real = static_cast<double>(stats.real_nanoseconds) / frames_run / 1000.0;
+        const double ahead = static_cast<double>(stats.ahead_nanoseconds) / frames_run / 1000.0;
+        const double saves = static_cast<double>(std::max<uint64_t>(Savestate::stats.saves, 1));
+        out << std::fixed << std::setprecision(1);
+        out << "Run-ahead: " << frames << " frame(s) over " << stats.frames << " frames, " << real << " us/frame real + "
+            << ahead << " us/frame ahead" << std::endl;
+        out << "Snapshots: " << Savestate::stats.saves << ", " << static_cast<double>(Savestate::stats.pages_copied) / saves
+            << " pages copied and " << static_cast<double>(Savestate::stats.nanoseconds) / saves / 1000.0
+            << " us each" << std::endl;
+        out << std::defaultfloat;
+    }
+}
@@ -0,0 +1,477 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "apu.hpp"
+#include "cartridge.hpp"
+#include "controller.hpp"
+#include "ppu.hpp"
+#include "savestate.hpp"
+#include "scheduler.hpp"
+
+namespace Savestate
+{
+    /** Everything but memory. Kept from one save to the next, so that its buffers are only allocated once. */
+    struct Machine
+    {
+        Cpu::State cpu{};
+        bool nmi_pending = false;
+        uint32_t irq_lines = 0;
+        Scheduler::Snapshot scheduler;
+        Ppu::Snapshot ppu;
+        Apu::Snapshot apu;
+        Controller::Snapshot controller;
+        Cartridge::Snapshot cartridge;
+    };
+
+    Machine machine;
+    bool armed = false;
+
+    /** write_pages as they were at save(). */
+    std::array<uint8_t *, 256> saved_write_pages{};
+    /** Write fault handler installed before save(), called for pages that already faulted then. */
+    uint8_t *(*previous_write_fault)(const uint8_t page) = nullptr;
+
+    /** Contents at save() of each page written since. */
+    std::array<std::array<uint8_t, 256>, 256> originals;
+    std::array<bool, 256> dirty{};
+
+    /** \brief Nanoseconds since a time point. */
+    uint64_t elapsed(const std::chrono::steady_clock::time_point start)
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    /** \brief Write fault handler while a state is saved: keep the page's contents, then let the write through. */
+    uint8_t *handle_write_fault(const uint8_t page)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if (!dirty[page])
+        {
+            if (Memory::pages[page] != nullptr)
+            {
+                std::memcpy(originals[page].data(), Memory::pages[page], 256);
+            }
+            dirty[page] = true;
+            stats.pages_copied++;
+        }
+        uint8_t *memory = saved_write_pages[page];
+        if (memory != nullptr)
+        {
+            Memory::write_pages[page] = memory;
+        }
+        else
+        {
+            memory = previous_write_fault(page);
+        }
+        stats.nanoseconds += elapsed(start);
+        return memory;
+    }
+
+    /** \brief Stop watching for writes and put write_pages and the write fault handler back. */
+    void disarm()
+    {
+        for (size_t page = 0; page < Memory::write_pages.size(); page++)
+        {
+            if (Memory::devices[page] == nullptr && Memory::write_pages[page] == nullptr)
+            {
+                Memory::write_pages[page] = saved_write_pages[page];
+            }
+        }
+        Memory::write_fault = previous_write_fault;
+    }
+
+    /** \brief Save the machine, replacing the state saved before if it wasn't restored. */
+    void save()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if (armed)
+        {
+            disarm();
+        }
+        machine.cpu = Cpu::save_state();
+        machine.nmi_pending = Cpu::nmi_pending;
+        machine.irq_lines = Cpu::irq_lines;
+        Scheduler::snapshot(machine.scheduler);
+        Ppu::snapshot(machine.ppu);
+        Apu::snapshot(machine.apu);
+        Controller::snapshot(machine.controller);
+        Cartridge::snapshot(machine.cartridge);
+
+        saved_write_pages = Memory::write_pages;
+        previous_write_fault = Memory::write_fault;
+        dirty.fill(false);
+        for (size_t page = 0; page < Memory::write_pages.size(); page++)
+        {
+            if (Memory::devices[page] == nullptr)
+            {
+                Memory::write_pages[page] = nullptr;
+            }
+        }
+        Memory::write_fault = handle_write_fault;
+        armed = true;
+        stats.saves++;
+        stats.nanoseconds += elapsed(start);
+    }
+
+    /** \brief Put the machine back as it was at save(). The saved state is used up. */
+    void restore()
+    {
+        if (!armed)
+        {
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t page = 0; page < dirty.size(); page++)
+        {
+            if (dirty[page])
+            {
+                // The fault that marked the page left it writable.
+                std::memcpy(Memory::write_pages[page], originals[page].data(), 256);
+                Memory::mark_written(static_cast<uint8_t>(page), static_cast<uint8_t>(page));
+            }
+        }
+        disarm();
+
+        Cpu::load_state(machine.cpu);
+        Cpu::nmi_pending = machine.nmi_pending;
+        Cpu::irq_lines = machine.irq_lines;
+        Scheduler::restore(machine.scheduler);
+        Ppu::restore(machine.ppu);
+        Apu::restore(machine.apu);
+        Controller::restore(machine.controller);
+        Cartridge::restore(machine.cartridge);
+        armed = false;
+        stats.nanoseconds += elapsed(start);
+    }
+
+    /** \brief Check whether a state is saved and not yet restored. */
+    bool saved()
+    {
+        return armed;
+    }
+
+    /** Identifies a written state, and the version of its layout. */
+    constexpr std::array<char, 8> magic = {'E', 'M', 'U', 'S', 'T', 'A', 'T', 'E'};
+    constexpr uint32_t version = 1;
+
+    /** \brief Write a value as its bytes. Written states are only meant to be read by the same build. */
+    template <typename T>
+    void write_bytes(std::ostream &out, const T &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    /** \brief Read a value written by write_bytes().
+     * \param bools Offsets of the bool members of T. A bool may only hold 0 or 1, so every other byte a file has there
+     * is read as true.
+     */
+    template <typename T>
+    bool read_bytes(std::istream &in, T &value, const std::vector<size_t> &bools = {})
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        std::array<uint8_t, sizeof(T)> bytes;
+        if (!in.read(reinterpret_cast<char *>(bytes.data()), bytes.size()))
+        {
+            return false;
+        }
+        for (const size_t offset : bools)
+        {
+            bytes[offset] = bytes[offset] != 0;
+        }
+        std::memcpy(&value, bytes.data(), sizeof(T));
+        return true;
+    }
+
+    bool read_bytes(std::istream &in, bool &value)
+    {
+        return read_bytes(in, value, {0});
+    }
+
+    /** \brief Offsets of the bool members of the structs that are read whole. */
+    const std::vector<size_t> cpu_bools = {offsetof(Cpu::State, C), offsetof(Cpu::State, Z), offsetof(Cpu::State, I),
+                                           offsetof(Cpu::State, D), offsetof(Cpu::State, B), offsetof(Cpu::State, V),
+                                           offsetof(Cpu::State, N)};
+    const std::vector<size_t> controller_bools = {offsetof(Controller::Snapshot, strobe)};
+    const std::vector<size_t> cartridge_bools = {offsetof(Cartridge::Snapshot, registers) + offsetof(Cartridge::Registers, irq_reload),
+                                                 offsetof(Cartridge::Snapshot, registers) + offsetof(Cartridge::Registers, irq_enabled)};
+    const std::vector<size_t> apu_bools = []()
+    {
+        using namespace Apu;
+        std::vector<size_t> offsets;
+        const auto add = [&](const size_t base, const std::initializer_list<size_t> members)
+        {
+            for (const size_t member : members)
+            {
+                offsets.push_back(base + member);
+            }
+        };
+        const auto add_envelope = [&](const size_t base)
+        {
+            add(base, {offsetof(Envelope, start), offsetof(Envelope, loop), offsetof(Envelope, constant)});
+        };
+        for (size_t channel = 0; channel < 2; channel++)
+        {
+            const size_t pulse = offsetof(State, pulse) + channel * sizeof(Pulse);
+            add_envelope(pulse + offsetof(Pulse, envelope));
+            add(pulse, {offsetof(Pulse, halt), offsetof(Pulse, sweep_enabled), offsetof(Pulse, sweep_negate), offsetof(Pulse, sweep_reload)});
+        }
+        add(offsetof(State, triangle), {offsetof(Triangle, halt), offsetof(Triangle, linear_reload_flag)});
+        add_envelope(offsetof(State, noise) + offsetof(Noise, envelope));
+        add(offsetof(State, noise), {offsetof(Noise, mode), offsetof(Noise, halt)});
+        add(offsetof(State, dmc), {offsetof(Dmc, irq_enabled), offsetof(Dmc, loop), offsetof(Dmc, buffer_full), offsetof(Dmc, silence)});
+        add(0, {offsetof(State, five_step), offsetof(State, irq_inhibit), offsetof(State, frame_irq), offsetof(State, dmc_irq)});
+        return offsets;
+    }();
+
+    /** \brief Mix a block of bytes into a 64-bit hash. Not cryptographic, but every bit of the input affects the result.
+     * \param hash Hash of what came before.
+     * \param data The bytes. Taken eight at a time, with any remainder zero-padded.
+     * \param size Number of bytes.
+     */
+    uint64_t mix(uint64_t hash, const uint8_t *data, const size_t size)
+    {
+        constexpr uint64_t multiplier = 0x9E3779B97F4A7C15;
+        for (size_t offset = 0; offset < size; offset += 8)
+        {
+            uint64_t word = 0;
+            std::memcpy(&word, data + offset, std::min<size_t>(8, size - offset));
+            hash = (hash ^ word) * multiplier;
+            hash ^= hash >> 29;
+        }
+        return hash;
+    }
+
+    /** \brief Hash what a state is only valid for: the cartridge's ROM and which pages have devices on them. */
+    uint64_t hardware_hash()
+    {
+        uint64_t result = mix(0, Cartridge::prg_rom.data(), Cartridge::prg_rom.size());
+        if (!Ppu::state.chr_writable)
+        {
+            result = mix(result, Ppu::state.chr.data(), Ppu::state.chr.size());
+        }
+        for (size_t page = 0; page < Memory::devices.size(); page++)
+        {
+            const uint8_t present = Memory::devices[page] != nullptr;
+            result = mix(result, &present, 1);
+        }
+        return result;
+    }
+
+    /** \brief Write the machine as it is now. Memory pages that are all zero take a bit each.
+     * \param out The stream, opened in binary mode.
+     */
+    void write(std::ostream &out)
+    {
+        out.write(magic.data(), magic.size());
+        write_bytes(out, version);
+        write_bytes(out, hardware_hash());
+
+        write_bytes(out, Cpu::save_state());
+        write_bytes(out, Cpu::nmi_pending);
+        write_bytes(out, Cpu::irq_lines);
+        write_bytes(out, Scheduler::slice_end);
+
+        std::array<uint8_t, 32> stored{};
+        for (size_t page = 0; page < Memory::pages.size(); page++)
+        {
+            const uint8_t *memory = Memory::pages[page];
+            if (Memory::devices[page] == nullptr && memory != nullptr &&
+                std::any_of(memory, memory + 256, [](const uint8_t byte)
+                            { return byte != 0; }))
+            {
+                stored[page / 8] |= static_cast<uint8_t>(1 << (page % 8));
+            }
+        }
+        write_bytes(out, stored);
+        for (size_t page = 0; page < Memory::pages.size(); page++)
+        {
+            if (stored[page / 8] & (1 << (page % 8)))
+            {
+                out.write(reinterpret_cast<const char *>(Memory::pages[page]), 256);
+            }
+        }
+
+        // Copied through a Machine of its own, since the one in use holds the state save() saved.
+        const auto current = std::make_unique<Machine>();
+        Ppu::snapshot(current->ppu);
+        const Ppu::State &ppu = current->ppu.state;
+        for (const uint8_t value : {ppu.control, ppu.mask, ppu.status, ppu.oam_address, ppu.fine_x, ppu.read_buffer, ppu.open_bus})
+        {
+            write_bytes(out, value);
+        }
+        write_bytes(out, ppu.v);
+        write_bytes(out, ppu.t);
+        write_bytes(out, ppu.w);
+        if (ppu.chr_writable)
+        {
+            out.write(reinterpret_cast<const char *>(ppu.chr.data()), static_cast<std::streamsize>(ppu.chr.size()));
+        }
+        write_bytes(out, ppu.chr_banks);
+        write_bytes(out, ppu.vram);
+        write_bytes(out, ppu.nametable_banks);
+        write_bytes(out, ppu.palette);
+        write_bytes(out, ppu.oam);
+        write_bytes(out, current->ppu.frame_origin);
+        write_bytes(out, current->ppu.next_event);
+        write_bytes(out, current->ppu.frame_count);
+
+        Apu::snapshot(current->apu);
+        write_bytes(out, current->apu.state);
+        write_bytes(out, current->apu.output);
+        const Apu::Synth::Snapshot &synth = current->apu.synth;
+        write_bytes(out, static_cast<uint64_t>(synth.buffer.size()));
+        out.write(reinterpret_cast<const char *>(synth.buffer.data()), static_cast<std::streamsize>(synth.buffer.size() * sizeof(float)));
+        for (const uint64_t value : {synth.origin_cycle, synth.origin_fraction})
+        {
+            write_bytes(out, value);
+        }
+        for (const float value : {synth.level, synth.highpass_input, synth.highpass_output})
+        {
+            write_bytes(out, value);
+        }
+
+        Controller::snapshot(current->controller);
+        write_bytes(out, current->controller);
+        Cartridge::snapshot(current->cartridge);
+        write_bytes(out, current->cartridge);
+    }
+
+    /** \brief Read a state written by write() and make it the machine's.
+     * \param in The stream, opened in binary mode.
+     * \return False if it isn't a state, was written with another cartridge or other devices attached, or holds
+     * something out of range. The machine is left unchanged unless the whole state could be read and checked.
+     */
+    bool read(std::istream &in)
+    {
+        std::array<char, 8> header;
+        uint32_t file_version;
+        uint64_t hardware;
+        if (!in.read(header.data(), header.size()) || header != magic || !read_bytes(in, file_version) ||
+            file_version != version || !read_bytes(in, hardware) || hardware != hardware_hash())
+        {
+            return false;
+        }
+
+        const auto loaded = std::make_unique<Machine>();
+        uint64_t slice_end;
+        std::array<uint8_t, 32> stored;
+        bool ok = read_bytes(in, loaded->cpu, cpu_bools) && read_bytes(in, loaded->nmi_pending) && read_bytes(in, loaded->irq_lines) &&
+                  read_bytes(in, slice_end) && read_bytes(in, stored);
+        std::vector<uint8_t> memory(256 * 256, 0);
+        for (size_t page = 0; ok && page < Memory::pages.size(); page++)
+        {
+            if (stored[page / 8] & (1 << (page % 8)))
+            {
+                ok = static_cast<bool>(in.read(reinterpret_cast<char *>(memory.data() + page * 256), 256));
+            }
+        }
+
+        Ppu::State &ppu = loaded->ppu.state;
+        for (uint8_t *value : {&ppu.control, &ppu.mask, &ppu.status, &ppu.oam_address, &ppu.fine_x, &ppu.read_buffer, &ppu.open_bus})
+        {
+            ok = ok && read_bytes(in, *value);
+        }
+        ok = ok && read_bytes(in, ppu.v) && read_bytes(in, ppu.t) && read_bytes(in, ppu.w);
+        ppu.chr_writable = Ppu::state.chr_writable;
+        if (ppu.chr_writable)
+        {
+            ppu.chr.resize(Ppu::state.chr.size());
+            ok = ok && in.read(reinterpret_cast<char *>(ppu.chr.data()), static_cast<std::streamsize>(ppu.chr.size()));
+        }
+        ok = ok && read_bytes(in, ppu.chr_banks) && read_bytes(in, ppu.vram) && read_bytes(in, ppu.nametable_banks) &&
+             read_bytes(in, ppu.palette) && read_bytes(in, ppu.oam) && read_bytes(in, loaded->ppu.frame_origin) &&
+             read_bytes(in, loaded->ppu.next_event) && read_bytes(in, loaded->ppu.frame_count);
+
+        Apu::Synth::Snapshot &synth = loaded->apu.synth;
+        uint64_t synth_size = 0;
+        ok = ok && read_bytes(in, loaded->apu.state, apu_bools) && read_bytes(in, loaded->apu.output) && read_bytes(in, synth_size);
+        Apu::Synth::snapshot(synth);
+        ok = ok && synth_size == synth.buffer.size();
+        if (ok)
+        {
+            ok = static_cast<bool>(in.read(reinterpret_cast<char *>(synth.buffer.data()), static_cast<std::streamsize>(synth_size * sizeof(float))));
+        }
+        ok = ok && read_bytes(in, synth.origin_cycle) && read_bytes(in, synth.origin_fraction) && read_bytes(in, synth.level) &&
+             read_bytes(in, synth.highpass_input) && read_bytes(in, synth.highpass_output) &&
+             read_bytes(in, loaded->controller, controller_bools) && read_bytes(in, loaded->cartridge, cartridge_bools) &&
+             Ppu::valid(loaded->ppu) && Apu::valid(loaded->apu) && Cartridge::valid(loaded->cartridge);
+        if (!ok)
+        {
+            return false;
+        }
+
+        // Every part is in; now replace the machine's.
+        if (armed)
+        {
+            disarm();
+            armed = false;
+        }
+        for (size_t page = 0; page < Memory::pages.size(); page++)
+        {
+            if (Memory::devices[page] == nullptr && Memory::pages[page] != nullptr)
+            {
+                std::memcpy(Memory::writable_page(static_cast<uint8_t>(page)), memory.data() + page * 256, 256);
+            }
+        }
+        Scheduler::reset();
+        Scheduler::slice_end = slice_end;
+        Cpu::load_state(loaded->cpu);
+        Cpu::nmi_pending = loaded->nmi_pending;
+        Cpu::irq_lines = loaded->irq_lines;
+        Ppu::restore(loaded->ppu);
+        Ppu::reschedule();
+        Apu::restore(loaded->apu);
+        Apu::reschedule();
+        Controller::restore(loaded->controller);
+        Cartridge::restore(loaded->cartridge);
+        return true;
+    }
+
+    /** Hash of each page's contents as of the last hash(), and the host memory it was taken from. */
+    std::array<uint64_t, 256> page_hashes{};
+    std::array<const uint8_t *, 256> hashed_pages{};
+    /** Memory::checkpoint() taken by the last hash(). */
+    uint64_t hashed_generation = 0;
+
+    /** \brief Hash the CPU's registers and all memory but device pages, to tell quickly whether two runs are still the
+     * same. Only pages written or remapped since the last call are hashed again, so it costs about as much as the
+     * pages a frame changes. */
+    uint64_t hash()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const uint64_t now = Scheduler::now();
+        const std::array<uint8_t, 16> registers = {
+            static_cast<uint8_t>(now), static_cast<uint8_t>(now >> 8), static_cast<uint8_t>(now >> 16), static_cast<uint8_t>(now >> 24),
+            static_cast<uint8_t>(now >> 32), static_cast<uint8_t>(now >> 40), static_cast<uint8_t>(now >> 48), static_cast<uint8_t>(now >> 56),
+            static_cast<uint8_t>(Cpu::C | Cpu::Z << 1 | Cpu::I << 2 | Cpu::D << 3 | Cpu::B << 4 | Cpu::V << 6 | Cpu::N << 7), Cpu::A, Cpu::X, Cpu::Y, static_cast<uint8_t>(Cpu::stack_pointer), static_cast<uint8_t>(Cpu::stack_pointer >> 8),
+            static_cast<uint8_t>(Cpu::instruction_pointer), static_cast<uint8_t>(Cpu::instruction_pointer >> 8)};
+        uint64_t result = mix(0, registers.data(), registers.size());
+        const uint64_t since = hashed_generation;
+        hashed_generation = Memory::checkpoint();
+        for (size_t page = 0; page < Memory::pages.size(); page++)
+        {
+            const uint8_t *memory = Memory::pages[page];
+            if (Memory::devices[page] != nullptr || memory == nullptr)
+            {
+                continue;
+            }
+            // A bank switch or remap changes the page's host memory without writing it.
+            if (Memory::written_generation[page] > since || hashed_pages[page] != memory)
+            {
+                page_hashes[page] = mix(page, memory, 256);
+                hashed_pages[page] = memory;
+                stats.pages_hashed++;
+            }
+            result = mix(result, reinterpret_cast<const uint8_t *>(&page_hashes[page]), sizeof(uint64_t));
+        }
+        stats.hash_nanoseconds += elapsed(start);
+        return result;
+    }
+}
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "scheduler.hpp"
+
+namespace Scheduler
+{
+    /** Largest number of cycles handed to the CPU in one slice, leaving room in an int for overshoot. */
+    constexpr uint64_t max_slice = std::numeric_limits<int>::max() / 2;
+
+    EventQueue events;
+
+    /** Ids of events in the heap that haven't been cancelled. */
+    std::unordered_set<uint64_t> live;
+
+    /** Ids of events that were cancelled but are still in the heap. They are dropped when they reach the top. */
+    std::unordered_set<uint64_t> cancelled;
+
+    /** Ids start at 1, so devices can keep 0 for no event: cancelling it does nothing. */
+    uint64_t next_id = 1;
+
+    /** \brief Drop cancelled events from the top of the heap. */
+    void drop_cancelled()
+    {
+        while (!events.empty() && !cancelled.empty() && cancelled.erase(events.top().id) != 0)
+        {
+            events.pop();
+        }
+    }
+
+    /** \brief Get the current master cycle count: the cycle at which the next instruction starts. */
+    uint64_t now()
+    {
+        return slice_end - static_cast<uint64_t>(static_cast<int64_t>(Cpu::cycles_available));
+    }
+
+    /** \brief Schedule a callback at an absolute cycle time.
+     * \param time Master cycle count at which the callback is due. Times in the past are due immediately.
+     * \param callback The callback.
+     * \return An id that can be passed to cancel(). Never 0.
+     *
+     * When called while the CPU is running, for example from a device register access, a deadline earlier than the end
+     * of the current slice ends the slice early.
+     */
+    uint64_t schedule(const uint64_t time, Callback callback)
+    {
+        const uint64_t id = next_id++;
+        events.push(Event{time, id, std::move(callback)});
+        live.insert(id);
+
+        if (running && time < slice_end)
+        {
+            const uint64_t shorten = slice_end - std::max(time, now());
+            Cpu::cycles_available -= static_cast<int>(shorten);
+            slice_end -= shorten;
+        }
+        return id;
+    }
+
+    /** \brief Schedule a callback a number of cycles from now. */
+    uint64_t schedule_in(const uint64_t delay, Callback callback)
+    {
+        return schedule(now() + delay, std::move(callback));
+    }
+
+    /** \brief Cancel a pending event. Cancelling an event that has already run, or was cancelled already, does nothing
+     * and leaves nothing behind. */
+    void cancel(const uint64_t id)
+    {
+        if (live.erase(id) != 0)
+        {
+            cancelled.insert(id);
+            drop_cancelled();
+        }
+    }
+
+    /** \brief Get the time of the earliest pending event, or the largest possible time if there is none. */
+    uint64_t next_event_time()
+    {
+        drop_cancelled();
+        return events.empty() ? std::numeric_limits<uint64_t>::max() : events.top().time;
+    }
+
+    /** \brief End the current slice after the instruction that is executing, without changing now(). Does nothing
+     * unless run_until() is running the CPU.
+     */
+    void end_slice()
+    {
+        if (running && Cpu::cycles_available > 0)
+        {
+            slice_end -= static_cast<uint64_t>(Cpu::cycles_available);
+            Cpu::cycles_available = 0;
+        }
+    }
+
+    /** \brief Run every event that is due at or before now(), including any they schedule in turn. */
+    void dispatch()
+    {
+        while (next_event_time() <= now())
+        {
+            Event event = events.top();
+            events.pop();
+            live.erase(event.id);
+            event.callback();
+        }
+    }
+
+    /** \brief Run the CPU and due events until the master cycle count reaches a time.
+     * \param time Master cycle count to run to. The last instruction may overshoot it.
+     * \return ReturnCode::CONTINUE, or the reason the CPU stopped early.
+     */
+    ReturnCode run_until(const uint64_t time)
+    {
+        while (true)
+        {
+            dispatch();
+
+            const uint64_t current = now();
+            if (current >= time)
+            {
+                return ReturnCode::CONTINUE;
+            }
+
+            slice_end = std::min({time, next_event_time(), current + max_slice});
+            Cpu::cycles_available = static_cast<int>(slice_end - current);
+            slices++;
+
+            running = true;
+            ReturnCode code = Cpu::tick(0);
+            running = false;
+
+            if (code != ReturnCode::CONTINUE)
+            {
+                return code;
+            }
+        }
+    }
+
+    /** \brief Run the CPU and due events for a number of cycles from now. */
+    ReturnCode run_for(const uint64_t cycles)
+    {
+        return run_until(now() + cycles);
+    }
+
+    /** \brief Drop all pending events and set the master cycle count and the CPU's cycle supply to zero. */
+    void reset()
+    {
+        events = {};
+        live.clear();
+        cancelled.clear();
+        slice_end = 0;
+        slices = 0;
+        running = false;
+        Cpu::cycles_available = 0;
+    }
+
+    /** \brief Copy every pending event and the master cycle count. Callbacks are copied, so they must not hold
+     * pointers to anything that the snapshot is meant to outlive.
+     * \param into Where to save them. Storage it already has is reused.
+     */
+    void snapshot(Snapshot &into)
+    {
+        into.events = events;
+        into.live = live;
+        into.cancelled = cancelled;
+        into.next_id = next_id;
+        into.slice_end = slice_end;
+    }
+
+    /** \brief Put back pending events and the master cycle count from a snapshot. Cpu::cycles_available must be
+     * restored along with it, since now() depends on both. */
+    void restore(const Snapshot &snapshot)
+    {
+        events = snapshot.events;
+        live = snapshot.live;
+        cancelled = snapshot.cancelled;
+        next_id = snapshot.next_id;
+        slice_end = snapshot.slice_end;
+    }
+}
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#define SDL_MAIN_HANDLED
+#include <SDL.h>
+
+#include "apu.hpp"
+#include "cartridge.hpp"
+#include "clock.hpp"
+#include "controller.hpp"
+#include "input_parser.hpp"
+#include "pacer.hpp"
+#include "ppu.hpp"
+#include "rewrite.hpp"
+#include "scheduler.hpp"
+
+/* The SDL2 frontend. SDL owns the main thread: it presents frames and reads the keyboard. The emulation runs on a
+ * thread of its own, and the PPU draws on a third. Frames come from the PPU's triple buffer and key presses go to the
+ * emulation through Controller's queue, so none of them ever waits for another. */
+
+std::atomic<bool> quitting = false;
+/** Set by the emulation thread when the program stops. */
+std::atomic<bool> stopped = false;
+
+/** \brief Body of the emulation thread: run frame after frame, paced to the clock, taking controller input between
+ * frames, until the program stops or the window is closed. */
+void emulate()
+{
+    const Clock::Profile profile = Clock::active;
+    auto start_time = std::chrono::steady_clock::now();
+    const uint64_t start_cycle = Scheduler::now();
+    const auto frame_period = Clock::frame_time(profile, 1);
+    auto frame_start = start_time;
+    for (uint64_t frame = 1; !quitting.load(std::memory_order_relaxed); frame++)
+    {
+        Controller::sample();
+        const ReturnCode code = Scheduler::run_until(start_cycle + Clock::frame_end(profile, frame));
+        if (code != ReturnCode::CONTINUE)
+        {
+            std::cout << "Stopped: " << return_code_names[static_cast<size_t>(code)] << std::endl;
+            stopped = true;
+            return;
+        }
+        start_time += Pacer::end_frame(frame_start, start_time + Clock::frame_time(profile, frame), frame_period);
+        frame_start = std::chrono::steady_clock::now();
+    }
+}
+
+/** \brief Controller button for a key, or 0. */
+uint8_t button_for(const SDL_Keycode key)
+{
+    switch (key)
+    {
+    case SDLK_x:
+        return Controller::button_a;
+    case SDLK_z:
+        return Controller::button_b;
+    case SDLK_RSHIFT:
+        return Controller::button_select;
+    case SDLK_RETURN:
+        return Controller::button_start;
+    case SDLK_UP:
+        return Controller::button_up;
+    case SDLK_DOWN:
+        return Controller::button_down;
+    case SDLK_LEFT:
+        return Controller::button_left;
+    case SDLK_RIGHT:
+        return Controller::button_right;
+    default:
+        return 0;
+    }
+}
+
+/** \brief SDL audio callback: play the APU's samples, or silence when there aren't enough. */
+void play_samples(void *, Uint8 *stream, const int length)
+{
+    int16_t *samples = reinterpret_cast<int16_t *>(stream);
+    const size_t count = static_cast<size_t>(length) / sizeof(int16_t);
+    const size_t taken = Apu::samples.try_pop(samples, count);
+    std::fill(samples + taken, samples + count, int16_t{0});
+}
+
+/** \brief Application entry point. */
+int main(int argc, char *argv[])
+{
+    InputParser input{argc, argv};
+    if (input.contains("-h") || input.contains("-help") || !input.contains("-r"))
+    {
+        std::cout << "Usage:" << std::endl;
+        std::cout << "  -r    Path to ROM file: a 64KB memory image, or an iNES / NES 2.0 cartridge" << std::endl;
+        std::cout << "  -scale  Window size as a multiple of 256x240 (default 3)" << std::endl;
+        std::cout << "  -frames  Quit after presenting this many frames, e.g. for a test run. Exits with 1 if the program stops first" << std::endl;
+        std::cout << "Keys: arrows, X (A), Z (B), right shift (select), return (start). Runs from the reset vector." << std::endl;
+        std::cout << "Set SDL_VIDEODRIVER=dummy and SDL_AUDIODRIVER=dummy to run without a display." << std::endl;
+        return 0;
+    }
+    if (!Clock::from_options(input, Clock::active))
+    {
+        std::cout << "Invalid clock options" << std::endl;
+        return 1;
+    }
+    if (!Bus::load_rom(input.get_command_option("-r")))
+    {
+        std::cout << "Can't load " << input.get_command_option("-r") << std::endl;
+        return 1;
+    }
+    const int scale = input.contains("-scale") ? std::stoi(input.get_command_option("-scale")) : 3;
+    const long frame_limit = input.contains("-frames") ? std::stol(input.get_command_option("-frames")) : -1;
+
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0)
+    {
+        std::cout << "SDL_Init failed: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    SDL_Window *window = SDL_CreateWindow("emu", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, Ppu::width * scale,
+                                          Ppu::height * scale, 0);
+    SDL_Renderer *renderer = window != nullptr ? SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC) : nullptr;
+    if (renderer == nullptr && window != nullptr)
+    {
+        // Drivers without acceleration, such as the dummy one, still have the software renderer.
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+    }
+    SDL_Texture *texture = renderer != nullptr ? SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                                                   Ppu::width, Ppu::height)
+                                               : nullptr;
+    if (texture == nullptr)
+    {
+        std::cout << "Can't create a window: " << SDL_GetError() << std::endl;
+        SDL_Quit();
+        return 1;
+    }
+
+    // Audio is optional: without a device the APU's samples are simply dropped.
+    SDL_AudioSpec wanted{};
+    wanted.freq = Apu::sample_rate;
+    wanted.format = AUDIO_S16SYS;
+    wanted.channels = 1;
+    wanted.samples = 1024;
+    wanted.callback = play_samples;
+    const SDL_AudioDeviceID audio = SDL_OpenAudioDevice(nullptr, 0, &wanted, nullptr, 0);
+
+    Ppu::attach();
+    Ppu::start_render_thread();
+    Apu::attach();
+    Cpu::reset();
+    Cpu::brk_policy = Cpu::BrkPolicy::VECTOR;
+    if (audio != 0)
+    {
+        SDL_PauseAudioDevice(audio, 0);
+    }
+    std::thread emulation(emulate);
+
+    uint8_t buttons = 0;
+    uint64_t shown = 0;
+    long presented = 0;
+    while (frame_limit < 0 || presented < frame_limit)
+    {
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+        {
+            if (event.type == SDL_QUIT)
+            {
+                quitting = true;
+            }
+            else if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && event.key.repeat == 0)
+            {
+                const uint8_t button = button_for(event.key.keysym.sym);
+                const uint8_t changed = event.type == SDL_KEYDOWN ? static_cast<uint8_t>(buttons | button)
+                                                                  : static_cast<uint8_t>(buttons & ~button);
+                if (changed != buttons)
+                {
+                    buttons = changed;
+                    Controller::events.try_push(Controller::Event{0, buttons});
+                }
+            }
+        }
+        if (quitting)
+        {
+            break;
+        }
+
+        // The emulation thread paces frames, so there is only something to present when the PPU has finished one.
+        // Without one, wait a little rather than spin, whether or not presenting waits for vertical sync.
+        const Ppu::Frame &frame = Ppu::latest_frame();
+        if (frame.number == shown)
+        {
+            if (stopped)
+            {
+                break;
+            }
+            SDL_Delay(1);
+            continue;
+        }
+        shown = frame.number;
+        void *pixels;
+        int pitch;
+        if (SDL_LockTexture(texture, nullptr, &pixels, &pitch) == 0)
+        {
+            for (int y = 0; y < Ppu::height; y++)
+            {
+                Uint32 *row = reinterpret_cast<Uint32 *>(static_cast<Uint8 *>(pixels) + y * pitch);
+                for (int x = 0; x < Ppu::width; x++)
+                {
+                    row[x] = 0xFF000000 | Ppu::rgb_palette[frame.pixels[static_cast<size_t>(y * Ppu::width + x)] & 0x3F];
+                }
+            }
+            SDL_UnlockTexture(texture);
+        }
+        SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+        SDL_RenderPresent(renderer);
+        presented++;
+    }
+
+    quitting = true;
+    emulation.join();
+    if (audio != 0)
+    {
+        SDL_CloseAudioDevice(audio);
+    }
+    Apu::detach();
+    Ppu::detach();
+    Cartridge::unload();
+    std::cout << "PPU frames: " << Ppu::frame_count << ", presented: " << presented << std::endl;
+
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    return frame_limit >= 0 && presented < frame_limit ? 1 : 0;
+}
@@ -0,0 +1,516 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "rewrite.hpp"
+#include "soa_engine.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    /* A minimal vector layer over whole registers of byte lanes. Masks have every bit of a lane set or clear. */
+#if defined(__AVX2__)
+    using Vector = __m256i;
+    constexpr size_t vector_width = 32;
+
+    Vector load(const uint8_t *data) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data)); }
+    void store(uint8_t *data, const Vector value) { _mm256_storeu_si256(reinterpret_cast<__m256i *>(data), value); }
+    Vector splat(const uint8_t value) { return _mm256_set1_epi8(static_cast<char>(value)); }
+    Vector select(const Vector mask, const Vector a, const Vector b) { return _mm256_blendv_epi8(b, a, mask); }
+    Vector bit_and(const Vector a, const Vector b) { return _mm256_and_si256(a, b); }
+    Vector bit_or(const Vector a, const Vector b) { return _mm256_or_si256(a, b); }
+    Vector bit_xor(const Vector a, const Vector b) { return _mm256_xor_si256(a, b); }
+    Vector add(const Vector a, const Vector b) { return _mm256_add_epi8(a, b); }
+    Vector sub(const Vector a, const Vector b) { return _mm256_sub_epi8(a, b); }
+    Vector equal(const Vector a, const Vector b) { return _mm256_cmpeq_epi8(a, b); }
+    Vector negative(const Vector a) { return _mm256_cmpgt_epi8(_mm256_setzero_si256(), a); }
+    Vector unsigned_max(const Vector a, const Vector b) { return _mm256_max_epu8(a, b); }
+#elif defined(__SSE2__)
+    using Vector = __m128i;
+    constexpr size_t vector_width = 16;
+
+    Vector load(const uint8_t *data) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(data)); }
+    void store(uint8_t *data, const Vector value) { _mm_storeu_si128(reinterpret_cast<__m128i *>(data), value); }
+    Vector splat(const uint8_t value) { return _mm_set1_epi8(static_cast<char>(value)); }
+    Vector select(const Vector mask, const Vector a, const Vector b) { return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+    Vector bit_and(const Vector a, const Vector b) { return _mm_and_si128(a, b); }
+    Vector bit_or(const Vector a, const Vector b) { return _mm_or_si128(a, b); }
+    Vector bit_xor(const Vector a, const Vector b) { return _mm_xor_si128(a, b); }
+    Vector add(const Vector a, const Vector b) { return _mm_add_epi8(a, b); }
+    Vector sub(const Vector a, const Vector b) { return _mm_sub_epi8(a, b); }
+    Vector equal(const Vector a, const Vector b) { return _mm_cmpeq_epi8(a, b); }
+    Vector negative(const Vector a) { return _mm_cmplt_epi8(a, _mm_setzero_si128()); }
+    Vector unsigned_max(const Vector a, const Vector b) { return _mm_max_epu8(a, b); }
+#else
+    using Vector = uint8_t;
+    constexpr size_t vector_width = 1;
+
+    Vector load(const uint8_t *data) { return *data; }
+    void store(uint8_t *data, const Vector value) { *data = value; }
+    Vector splat(const uint8_t value) { return value; }
+    Vector select(const Vector mask, const Vector a, const Vector b) { return static_cast<uint8_t>((mask & a) | (~mask & b)); }
+    Vector bit_and(const Vector a, const Vector b) { return static_cast<uint8_t>(a & b); }
+    Vector bit_or(const Vector a, const Vector b) { return static_cast<uint8_t>(a | b); }
+    Vector bit_xor(const Vector a, const Vector b) { return static_cast<uint8_t>(a ^ b); }
+    Vector add(const Vector a, const Vector b) { return static_cast<uint8_t>(a + b); }
+    Vector sub(const Vector a, const Vector b) { return static_cast<uint8_t>(a - b); }
+    Vector equal(const Vector a, const Vector b) { return a == b ? 0xFF : 0; }
+    Vector negative(const Vector a) { return (a & 0x80) ? 0xFF : 0; }
+    Vector unsigned_max(const Vector a, const Vector b) { return std::max(a, b); }
+#endif
+
+    /** Size of each lane's memory. */
+    constexpr size_t lane_memory_size = 256 * 256;
+}
+
+namespace SoaEngine
+{
+    /** Opcodes that have vector kernels. */
+    constexpr uint8_t LDA_IMMEDIATE = 0xA9, LDX_IMMEDIATE = 0xA2, LDY_IMMEDIATE = 0xA0;
+    constexpr uint8_t TAX = 0xAA, TAY = 0xA8, TXA = 0x8A, TYA = 0x98;
+    constexpr uint8_t INX = 0xE8, INY = 0xC8, DEX = 0xCA, DEY = 0x88;
+    constexpr uint8_t CLC = 0x18, SEC = 0x38, CLI = 0x58, SEI = 0x78, CLD = 0xD8, SED = 0xF8, CLV = 0xB8, NOP = 0xEA;
+    constexpr uint8_t AND_IMMEDIATE = 0x29, ORA_IMMEDIATE = 0x09, EOR_IMMEDIATE = 0x49;
+    constexpr uint8_t CMP_IMMEDIATE = 0xC9, CPX_IMMEDIATE = 0xE0, CPY_IMMEDIATE = 0xC0;
+    constexpr uint8_t ADC_IMMEDIATE = 0x69, SBC_IMMEDIATE = 0xE9;
+    constexpr uint8_t BPL = 0x10, BMI = 0x30, BVC = 0x50, BVS = 0x70, BCC = 0x90, BCS = 0xB0, BNE = 0xD0, BEQ = 0xF0;
+
+    /** \brief Number of lanes rounded up to a whole number of vectors. */
+    size_t padded_count(const size_t count)
+    {
+        return (count + vector_width - 1) / vector_width * vector_width;
+    }
+
+    /** \brief Set up a number of identical lanes.
+     * \param lanes The lanes to set up.
+     * \param count Number of lanes.
+     * \param image Program image copied into every lane's memory from address 0.
+     * \param state Initial CPU state of every lane.
+     */
+    void init(Lanes &lanes, const size_t count, const std::vector<uint8_t> &image, const Cpu::State &state)
+    {
+        size_t padded = padded_count(count);
+        lanes = Lanes{};
+        lanes.count = count;
+        for (std::vector<uint8_t> *bytes : {&lanes.A, &lanes.X, &lanes.Y, &lanes.C, &lanes.Z, &lanes.I, &lanes.D, &lanes.B, &lanes.V, &lanes.N, &lanes.running})
+        {
+            bytes->assign(padded, 0);
+        }
+        lanes.stack_pointer.assign(padded, 0);
+        lanes.instruction_pointer.assign(padded, 0);
+        lanes.cycles_available.assign(padded, 0);
+        lanes.result.assign(padded, ReturnCode::CONTINUE);
+        lanes.memory.assign(count * lane_memory_size, 0);
+
+        for (size_t lane = 0; lane < count; lane++)
+        {
+            std::copy(image.begin(), image.begin() + static_cast<long>(std::min(image.size(), lane_memory_size)), lane_memory(lanes, lane));
+            set_lane_state(lanes, lane, state);
+            lanes.running[lane] = 0xFF;
+        }
+    }
+
+    /** \brief Get the 64KB of memory belonging to a lane. */
+    uint8_t *lane_memory(Lanes &lanes, const size_t lane)
+    {
+        return lanes.memory.data() + lane * lane_memory_size;
+    }
+
+    /** \brief Gather the registers and flags of one lane. */
+    Cpu::State get_lane_state(const Lanes &lanes, const size_t lane)
+    {
+        return Cpu::State{
+            lanes.C[lane] != 0, lanes.Z[lane] != 0, lanes.I[lane] != 0, lanes.D[lane] != 0,
+            lanes.B[lane] != 0, lanes.V[lane] != 0, lanes.N[lane] != 0,
+            lanes.cycles_available[lane], lanes.stack_pointer[lane], lanes.instruction_pointer[lane],
+            lanes.A[lane], lanes.X[lane], lanes.Y[lane]};
+    }
+
+    /** \brief Scatter registers and flags into one lane. */
+    void set_lane_state(Lanes &lanes, const size_t lane, const Cpu::State &state)
+    {
+        lanes.C[lane] = state.C;
+        lanes.Z[lane] = state.Z;
+        lanes.I[lane] = state.I;
+        lanes.D[lane] = state.D;
+        lanes.B[lane] = state.B;
+        lanes.V[lane] = state.V;
+        lanes.N[lane] = state.N;
+        lanes.cycles_available[lane] = state.cycles_available;
+        lanes.stack_pointer[lane] = state.stack_pointer;
+        lanes.instruction_pointer[lane] = state.instruction_pointer;
+        lanes.A[lane] = state.A;
+        lanes.X[lane] = state.X;
+        lanes.Y[lane] = state.Y;
+    }
+
+    /** \brief Execute one instruction on one lane through the interpreter.
+     * \param lanes All lanes.
+     * \param lane The lane to step.
+     * \param mapped The lane whose memory is mapped into Memory, or lanes.count if none is. Memory is only remapped
+     * when it is another lane's, since lanes falling back one after another often step the same lane several times.
+     */
+    void step_lane(Lanes &lanes, const size_t lane, size_t &mapped)
+    {
+        if (mapped != lane)
+        {
+            Memory::map(lane_memory(lanes, lane));
+            mapped = lane;
+            lanes.stats.remaps++;
+        }
+        Cpu::load_state(get_lane_state(lanes, lane));
+        ReturnCode code = Cpu::step();
+        set_lane_state(lanes, lane, Cpu::save_state());
+
+        if (code != ReturnCode::CONTINUE)
+        {
+            lanes.running[lane] = 0;
+            lanes.result[lane] = code;
+        }
+        lanes.stats.scalar_instructions++;
+    }
+
+    /** \brief Set the N and Z flags of masked lanes from a register value.
+     * \param lanes All lanes.
+     * \param i Index of the first lane of the vector.
+     * \param mask Lanes to update.
+     * \param value The register value of each lane.
+     */
+    void set_NZ(Lanes &lanes, const size_t i, const Vector mask, const Vector value)
+    {
+        const Vector one = splat(1);
+        store(&lanes.Z[i], select(mask, bit_and(equal(value, splat(0)), one), load(&lanes.Z[i])));
+        store(&lanes.N[i], select(mask, bit_and(negative(value), one), load(&lanes.N[i])));
+    }
+
+    /** \brief Set a flag to a constant in masked lanes. */
+    void set_flag(std::vector<uint8_t> &flag, const size_t i, const Vector mask, const uint8_t value)
+    {
+        store(&flag[i], select(mask, splat(value), load(&flag[i])));
+    }
+
+    /** \brief Apply a register-only instruction to masked lanes with vector kernels.
+     * \param lanes All lanes.
+     * \param opcode The instruction.
+     * \param operand The immediate operand, if any.
+     * \param mask 0xFF for each lane to execute.
+     * \return Cycles taken by the instruction, or 0 if it has no kernel.
+     *
+     * The instruction pointer is left for the caller to advance.
+     */
+    int run_register_kernel(Lanes &lanes, const uint8_t opcode, const uint8_t operand, const std::vector<uint8_t> &mask)
+    {
+        int cycles = 2;
+        for (size_t i = 0; i < mask.size(); i += vector_width)
+        {
+            const Vector m = load(&mask[i]);
+            const Vector imm = splat(operand);
+            const Vector a = load(&lanes.A[i]);
+            const Vector x = load(&lanes.X[i]);
+            const Vector y = load(&lanes.Y[i]);
+
+            switch (opcode)
+            {
+            case LDA_IMMEDIATE:
+                store(&lanes.A[i], select(m, imm, a));
+                set_NZ(lanes, i, m, imm);
+                break;
+            case LDX_IMMEDIATE:
+                store(&lanes.X[i], select(m, imm, x));
+                set_NZ(lanes, i, m, imm);
+                break;
+            case LDY_IMMEDIATE:
+                store(&lanes.Y[i], select(m, imm, y));
+                set_NZ(lanes, i, m, imm);
+                break;
+            case TAX:
+                store(&lanes.X[i], select(m, a, x));
+                set_NZ(lanes, i, m, a);
+                break;
+            case TAY:
+                store(&lanes.Y[i], select(m, a, y));
+                set_NZ(lanes, i, m, a);
+                cycles = 4;
+                break;
+            case TXA:
+                store(&lanes.A[i], select(m, x, a));
+                set_NZ(lanes, i, m, x);
+                break;
+            case TYA:
+                store(&lanes.A[i], select(m, y, a));
+                set_NZ(lanes, i, m, y);
+                break;
+            case INX:
+            case DEX:
+            {
+                Vector result = opcode == INX ? add(x, splat(1)) : sub(x, splat(1));
+                store(&lanes.X[i], select(m, result, x));
+                set_NZ(lanes, i, m, result);
+            }
+            break;
+            case INY:
+            case DEY:
+            {
+                Vector result = opcode == INY ? add(y, splat(1)) : sub(y, splat(1));
+                store(&lanes.Y[i], select(m, result, y));
+                set_NZ(lanes, i, m, result);
+            }
+            break;
+            case AND_IMMEDIATE:
+            case ORA_IMMEDIATE:
+            case EOR_IMMEDIATE:
+            {
+                Vector result = opcode == AND_IMMEDIATE ? bit_and(a, imm) : opcode == ORA_IMMEDIATE ? bit_or(a, imm) : bit_xor(a, imm);
+                store(&lanes.A[i], select(m, result, a));
+                set_NZ(lanes, i, m, result);
+            }
+            break;
+            case CMP_IMMEDIATE:
+            case CPX_IMMEDIATE:
+            case CPY_IMMEDIATE:
+            {
+                // C if register >= operand, Z if equal, N from bit 7 of the difference.
+                Vector reg = opcode == CMP_IMMEDIATE ? a : opcode == CPX_IMMEDIATE ? x : y;
+                store(&lanes.C[i], select(m, bit_and(equal(unsigned_max(reg, imm), reg), splat(1)), load(&lanes.C[i])));
+                store(&lanes.Z[i], select(m, bit_and(equal(reg, imm), splat(1)), load(&lanes.Z[i])));
+                store(&lanes.N[i], select(m, bit_and(negative(sub(reg, imm)), splat(1)), load(&lanes.N[i])));
+            }
+            break;
+            case CLC:
+                set_flag(lanes.C, i, m, 0);
+                break;
+            case SEC:
+                set_flag(lanes.C, i, m, 1);
+                break;
+            case CLI:
+                set_flag(lanes.I, i, m, 0);
+                break;
+            case SEI:
+                set_flag(lanes.I, i, m, 1);
+                break;
+            case CLD:
+                set_flag(lanes.D, i, m, 0);
+                break;
+            case SED:
+                set_flag(lanes.D, i, m, 1);
+                break;
+            case CLV:
+                set_flag(lanes.V, i, m, 0);
+                break;
+            case NOP:
+                break;
+            default:
+                return 0;
+            }
+        }
+        return cycles;
+    }
+
+    /** \brief Apply ADC # or SBC # to masked lanes with vector kernels. The carry out of the 8-bit sum is found from
+     * the unsigned wrap-around of each of its two additions.
+     * \return Cycles taken by the instruction.
+     */
+    int run_add_kernel(Lanes &lanes, const uint8_t opcode, const uint8_t operand, const std::vector<uint8_t> &mask)
+    {
+        const Vector data = splat(opcode == ADC_IMMEDIATE ? operand : static_cast<uint8_t>(~operand));
+        const Vector zero = splat(0);
+        const Vector one = splat(1);
+        const Vector all = splat(0xFF);
+        // Masks of the lanes where an unsigned sum wrapped, being less than what was added to.
+        const auto wrapped = [&](const Vector sum, const Vector addend)
+        { return bit_xor(equal(unsigned_max(sum, addend), sum), all); };
+
+        for (size_t i = 0; i < mask.size(); i += vector_width)
+        {
+            const Vector m = load(&mask[i]);
+            const Vector a = load(&lanes.A[i]);
+            const Vector partial = add(a, data);
+            const Vector result = add(partial, load(&lanes.C[i]));
+            const Vector carry = bit_or(wrapped(partial, a), wrapped(result, partial));
+
+            // Same as Cpu::add_with_carry(), where Z is only set if the 9-bit sum is zero.
+            store(&lanes.Z[i], select(m, bit_and(bit_and(equal(result, zero), bit_xor(carry, all)), one), load(&lanes.Z[i])));
+            store(&lanes.C[i], select(m, bit_and(carry, one), load(&lanes.C[i])));
+            store(&lanes.N[i], select(m, bit_and(negative(result), one), load(&lanes.N[i])));
+            store(&lanes.V[i], select(m, bit_and(negative(bit_and(bit_xor(a, result), bit_xor(data, result))), one), load(&lanes.V[i])));
+            store(&lanes.A[i], select(m, result, a));
+        }
+        return 2;
+    }
+
+    /** \brief Apply a conditional branch to masked lanes, each of which may or may not take it. Runs lane by lane, since
+     * the instruction pointers and cycle counts it updates are wider than the vector layer's bytes.
+     * \param lanes All lanes.
+     * \param flag The flag tested by the branch.
+     * \param expected Value of the flag for which the branch is taken.
+     * \param distance The relative branch distance.
+     * \param mask 0xFF for each lane to execute.
+     */
+    void run_branch_kernel(Lanes &lanes, const std::vector<uint8_t> &flag, const uint8_t expected, const uint8_t distance, const std::vector<uint8_t> &mask)
+    {
+        for (size_t i = 0; i < lanes.count; i++)
+        {
+            if (mask[i])
+            {
+                // Same as the branch handlers: 2 cycles, 1 more if taken, 2 more if the operand and the next
+                // instruction are on different pages.
+                uint16_t operand_address = static_cast<uint16_t>(lanes.instruction_pointer[i] + 1);
+                bool taken = flag[i] == expected;
+                uint16_t next = static_cast<uint16_t>(operand_address + 1 + (taken ? static_cast<int8_t>(distance) : 0));
+                lanes.cycles_available[i] -= 2 + (taken ? 1 : 0) + ((operand_address >> 8) != (next >> 8) ? 2 : 0);
+                lanes.instruction_pointer[i] = next;
+            }
+        }
+    }
+
+    /** \brief Execute one instruction across a group of lanes that share an instruction pointer and instruction bytes.
+     * \param lanes All lanes.
+     * \param opcode The instruction.
+     * \param operand The first operand byte.
+     * \param mask 0xFF for each lane in the group.
+     * \return False if the instruction has no kernel.
+     */
+    bool run_vector(Lanes &lanes, const uint8_t opcode, const uint8_t operand, const std::vector<uint8_t> &mask)
+    {
+        switch (opcode)
+        {
+        case BPL:
+            run_branch_kernel(lanes, lanes.N, 0, operand, mask);
+            return true;
+        case BMI:
+            run_branch_kernel(lanes, lanes.N, 1, operand, mask);
+            return true;
+        case BVC:
+            run_branch_kernel(lanes, lanes.V, 0, operand, mask);
+            return true;
+        case BVS:
+            run_branch_kernel(lanes, lanes.V, 1, operand, mask);
+            return true;
+        case BCC:
+            run_branch_kernel(lanes, lanes.C, 0, operand, mask);
+            return true;
+        case BCS:
+            run_branch_kernel(lanes, lanes.C, 1, operand, mask);
+            return true;
+        case BNE:
+            run_branch_kernel(lanes, lanes.Z, 0, operand, mask);
+            return true;
+        case BEQ:
+            run_branch_kernel(lanes, lanes.Z, 1, operand, mask);
+            return true;
+        default:
+            break;
+        }
+
+        int cycles = (opcode == ADC_IMMEDIATE || opcode == SBC_IMMEDIATE) ? run_add_kernel(lanes, opcode, operand, mask)
+                                                                          : run_register_kernel(lanes, opcode, operand, mask);
+        if (cycles == 0)
+        {
+            return false;
+        }
+
+        const int length = instruction_length(opcode);
+        for (size_t i = 0; i < lanes.count; i++)
+        {
+            if (mask[i])
+            {
+                lanes.instruction_pointer[i] = static_cast<uint16_t>(lanes.instruction_pointer[i] + length);
+                lanes.cycles_available[i] -= cycles;
+            }
+        }
+        return true;
+    }
+
+    /** \brief Run every lane until it exhausts its supply of cycles, exactly as Cpu::tick() would for each lane.
+     * \param lanes The lanes to run.
+     * \param cycles_to_add Number of cycles to add to each running lane's supply.
+     * \return True if any lane is still running, false once every lane has stopped.
+     *
+     * Each round picks the runnable lane that has made the least progress and steps every runnable lane that is at
+     * the same instruction pointer with the same instruction bytes. Preferring the laggard lets diverged lanes catch up
+     * and rejoin the group, for example at the head of a loop.
+     */
+    bool tick(Lanes &lanes, const int cycles_to_add)
+    {
+        const Cpu::State saved_cpu = Cpu::save_state();
+        const std::array<uint8_t *, 256> saved_pages = Memory::pages;
+        const std::array<uint8_t *, 256> saved_write_pages = Memory::write_pages;
+
+        for (size_t lane = 0; lane < lanes.count; lane++)
+        {
+            if (lanes.running[lane])
+            {
+                lanes.cycles_available[lane] += cycles_to_add;
+            }
+        }
+
+        std::vector<uint8_t> mask(lanes.running.size(), 0);
+        size_t mapped = lanes.count;
+        while (true)
+        {
+            // Find the lane with the most cycles left.
+            size_t leader = lanes.count;
+            for (size_t lane = 0; lane < lanes.count; lane++)
+            {
+                if (lanes.running[lane] && lanes.cycles_available[lane] > 0 &&
+                    (leader == lanes.count || lanes.cycles_available[lane] > lanes.cycles_available[leader]))
+                {
+                    leader = lane;
+                }
+            }
+            if (leader == lanes.count)
+            {
+                break;
+            }
+
+            // Group every runnable lane that is about to execute the same instruction bytes.
+            const uint16_t address = lanes.instruction_pointer[leader];
+            const uint8_t *leader_memory = lane_memory(lanes, leader);
+            const uint8_t opcode = leader_memory[address];
+            const int length = instruction_length(opcode);
+
+            size_t group_size = 0;
+            for (size_t lane = 0; lane < lanes.count; lane++)
+            {
+                bool member = lanes.running[lane] && lanes.cycles_available[lane] > 0 && lanes.instruction_pointer[lane] == address;
+                const uint8_t *memory = lane_memory(lanes, lane);
+                for (int offset = 0; member && offset < length; offset++)
+                {
+                    uint16_t byte_address = static_cast<uint16_t>(address + offset);
+                    member = memory[byte_address] == leader_memory[byte_address];
+                }
+                mask[lane] = member ? 0xFF : 0;
+                group_size += member;
+            }
+
+            const uint8_t operand = leader_memory[static_cast<uint16_t>(address + 1)];
+            if (group_size > 1 && run_vector(lanes, opcode, operand, mask))
+            {
+                lanes.stats.vector_instructions += group_size;
+                lanes.stats.group_steps++;
+                continue;
+            }
+
+            for (size_t lane = 0; lane < lanes.count; lane++)
+            {
+                if (mask[lane])
+                {
+                    step_lane(lanes, lane, mapped);
+                }
+            }
+        }
+
+        Memory::pages = saved_pages;
+        Memory::write_pages = saved_write_pages;
+        Cpu::load_state(saved_cpu);
+
+        return std::any_of(lanes.running.begin(), lanes.running.end(), [](const uint8_t running)
+                           { return running != 0; });
+    }
+}
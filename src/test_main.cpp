@@ -1,6 +1,31 @@
 #include <gtest/gtest.h>
 
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#include "apu.hpp"
+#include "cartridge.hpp"
+#include "clock.hpp"
+#include "controller.hpp"
+#include "coverage.hpp"
+#include "differential.hpp"
+#include "explorer.hpp"
+#include "fuzzer.hpp"
+#include "hle.hpp"
+#include "libemu.h"
+#include "libemu.hpp"
+#include "movie.hpp"
+#include "pacer.hpp"
+#include "ppu.hpp"
+#include "recompiled.hpp"
+#include "recompiler.hpp"
 #include "rewrite.hpp"
+#include "run_ahead.hpp"
+#include "savestate.hpp"
+#include "scheduler.hpp"
+#include "soa_engine.hpp"
+#include "video_writer.hpp"
 
 TEST(Bus, testRom0)
 {
@@ -43,6 +68,1443 @@ TEST(Bus, testRom0)
     EXPECT_EQ(Cpu::B, 1);
 }
 
+TEST(Recompiler, discoverBlocksRom2)
+{
+    std::ifstream rom_file("../test/test2.bin", std::ios::binary);
+    std::vector<uint8_t> image{std::istreambuf_iterator<char>(rom_file), std::istreambuf_iterator<char>()};
+    ASSERT_EQ(image.size(), 14);
+
+    /* The loop body starting at 0x0002 is a branch target, so LDX #$08 is a block on its own. The loop body ends with
+    BNE, whose fall through starts the final block. */
+    auto blocks = Recompiler::discover_blocks(image, 0x0000);
+    ASSERT_EQ(blocks.size(), 3);
+    EXPECT_EQ(blocks.at(0x0000).instructions, std::vector<uint16_t>({0x0000}));
+    EXPECT_EQ(blocks.at(0x0002).instructions, std::vector<uint16_t>({0x0002, 0x0003, 0x0006, 0x0008}));
+    EXPECT_EQ(blocks.at(0x000A).instructions, std::vector<uint16_t>({0x000A, 0x000D}));
+    EXPECT_EQ(blocks.at(0x0002).size, 8);
+}
+
+/** \brief Reset the CPU and memory and load a program at address 0.
+ * \param program Bytes of the program.
+ */
+void load_program(const std::vector<uint8_t> &program)
+{
+    Memory::clear();
+    std::copy(program.begin(), program.end(), Memory::main_memory.begin());
+    Cpu::load_state(Cpu::State{});
+    Cpu::stack_pointer = 0x01FF;
+}
+
+TEST(Recompiled, nativeTickServicesNmi)
+{
+    /* test5.bin, recompiled at build time, copies X to $0200-$020F twice over, then breaks. An NMI raised before it
+     * runs is taken first: its handler at $0300 counts it in $80 and returns into the recompiled code. */
+    load_program({});
+    Recompiled::load();
+    const std::vector<uint8_t> handler = {0xe6, 0x80, 0x40}; // INC $80; RTI
+    std::copy(handler.begin(), handler.end(), Memory::main_memory.begin() + 0x0300);
+    Memory::main_memory[0xFFFA] = 0x00;
+    Memory::main_memory[0xFFFB] = 0x03;
+
+    Cpu::nmi();
+    ReturnCode code = ReturnCode::CONTINUE;
+    for (int slice = 0; slice < 100 && code == ReturnCode::CONTINUE; slice++)
+    {
+        code = Recompiled::tick(20);
+    }
+    EXPECT_EQ(code, ReturnCode::BREAK);
+    EXPECT_EQ(Memory::main_memory[0x80], 1);
+    EXPECT_FALSE(Cpu::nmi_pending);
+    for (uint8_t i = 0; i < 0x10; i++)
+    {
+        EXPECT_EQ(Memory::main_memory[0x0200 + i], i);
+    }
+}
+
+/* A subroutine at 0x0010 that stores 0x2A in 0x0300, leaving 0x2A in A and 7 in X, called from 0x0000. */
+const std::vector<uint8_t> hle_program = {
+    0x20, 0x10, 0x00,       // JSR $0010
+    0x00,                   // BRK
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0xa9, 0x2a,             // LDA #$2A
+    0x8d, 0x00, 0x03,       // STA $0300
+    0xa2, 0x07,             // LDX #$07
+    0x60                    // RTS
+};
+
+void hle_store_answer()
+{
+    Cpu::A = 0x2A;
+    Bus::write(Cpu::A, 0x0300);
+    Cpu::X = 7;
+    Cpu::N = false;
+    Cpu::Z = false;
+}
+
+void hle_store_answer_wrong_x()
+{
+    hle_store_answer();
+    Cpu::X = 8;
+}
+
+void hle_store_answer_wrong_zero_page()
+{
+    hle_store_answer();
+    Bus::write(0x55, 0x00FE);
+}
+
+TEST(Hle, nativeRoutineReplacesSubroutine)
+{
+    load_program(hle_program);
+    Hle::clear();
+    Hle::register_hook(0x0010, hle_store_answer, 20);
+
+    /* The whole call should cost the declared 20 cycles, leaving the CPU at the BRK. */
+    EXPECT_EQ(Cpu::tick(20), ReturnCode::CONTINUE);
+    EXPECT_EQ(Cpu::cycles_available, 0);
+    EXPECT_EQ(Cpu::instruction_pointer, 0x0003);
+    EXPECT_EQ(Cpu::stack_pointer, 0x01FF);
+    EXPECT_EQ(Cpu::X, 7);
+    EXPECT_EQ(Memory::main_memory[0x0300], 0x2A);
+    Hle::clear();
+}
+
+TEST(Hle, verificationRecordsMismatches)
+{
+    Hle::clear();
+    Hle::verify = true;
+
+    load_program(hle_program);
+    Hle::register_hook(0x0010, hle_store_answer, 20);
+    EXPECT_EQ(Cpu::tick(1), ReturnCode::CONTINUE);
+    EXPECT_TRUE(Hle::mismatches().empty());
+
+    /* The guest result is kept, and the guest took JSR + LDA + STA + LDX + RTS cycles. */
+    load_program(hle_program);
+    Hle::register_hook(0x0010, hle_store_answer_wrong_x, 20);
+    EXPECT_EQ(Cpu::tick(1), ReturnCode::CONTINUE);
+    EXPECT_EQ(Cpu::X, 7);
+    ASSERT_EQ(Hle::mismatches().size(), 1);
+    EXPECT_EQ(Hle::mismatches()[0].native.X, 8);
+    EXPECT_EQ(Hle::mismatches()[0].guest_cycles, 6 + 2 + 4 + 2 + 6);
+    EXPECT_TRUE(Hle::mismatches()[0].memory_differences.empty());
+
+    /* With the stack nearly full, the dead stack below it still stops at $0100: zero page is compared. */
+    load_program(hle_program);
+    Cpu::stack_pointer = 0x0110;
+    Hle::clear();
+    Hle::register_hook(0x0010, hle_store_answer_wrong_zero_page, 20);
+    EXPECT_EQ(Cpu::tick(1), ReturnCode::CONTINUE);
+    ASSERT_EQ(Hle::mismatches().size(), 1);
+    EXPECT_EQ(Hle::mismatches()[0].memory_differences, std::vector<uint16_t>{0x00FE});
+
+    Hle::verify = false;
+    Hle::clear();
+}
+
+TEST(Emu, runUntilApi)
+{
+    std::ifstream rom_file("../test/test2.bin", std::ios::binary);
+    std::vector<uint8_t> image{std::istreambuf_iterator<char>(rom_file), std::istreambuf_iterator<char>()};
+
+    Emu::Machine *machine = Emu::create();
+    Emu::Machine *other = Emu::create();
+    ASSERT_TRUE(Emu::load_image(*machine, image.data(), image.size()));
+    ASSERT_TRUE(Emu::load_image(*other, image.data(), image.size()));
+
+    /* LDX #$08, then DEX and STX $0200. */
+    EXPECT_EQ(Emu::run_instructions(*machine, 3), Emu::StopReason::INSTRUCTIONS);
+    EXPECT_EQ(Emu::peek(*machine, 0x0200), 7);
+    EXPECT_EQ(Emu::cycles(*machine), 2 + 2 + 4);
+
+    /* Running another machine must not disturb the first. */
+    EXPECT_EQ(Emu::run_until_write(*other, 0x0201), Emu::StopReason::WRITE_REACHED);
+    EXPECT_EQ(Emu::get_state(*other).X, 3);
+    EXPECT_EQ(Emu::get_state(*machine).X, 7);
+
+    EXPECT_EQ(Emu::run_until_pc(*machine, 0x000A), Emu::StopReason::PC_REACHED);
+    EXPECT_EQ(Emu::get_state(*machine).X, 3);
+    EXPECT_EQ(Emu::run_until_pc(*machine, 0x0100, 10), Emu::StopReason::BREAK);
+
+    /* The C binding drives the same machines. */
+    emu_machine *c_machine = reinterpret_cast<emu_machine *>(other);
+    emu_registers registers;
+    emu_get_registers(c_machine, &registers);
+    EXPECT_EQ(registers.x, 3);
+    registers.pc = 0x0002;
+    registers.x = 5;
+    emu_set_registers(c_machine, &registers);
+    EXPECT_EQ(emu_run_cycles(c_machine, 1000), EMU_STOP_BREAK);
+    EXPECT_EQ(emu_peek(c_machine, 0x0200), 3);
+
+    Emu::destroy(machine);
+    Emu::destroy(other);
+}
+
+TEST(Emu, breakpointsAndWatchpointsStopRuns)
+{
+    const std::vector<uint8_t> image = {
+        0xa2, 0x03,       // LDX #$03
+        0xca,             // loop: DEX
+        0x8e, 0x00, 0x02, // STX $0200
+        0xd0, 0xfa,       // BNE loop
+        0x00,             // BRK
+    };
+    Emu::Machine *machine = Emu::create();
+    Emu::Machine *other = Emu::create();
+    ASSERT_TRUE(Emu::load_image(*machine, image.data(), image.size()));
+    ASSERT_TRUE(Emu::load_image(*other, image.data(), image.size()));
+
+    /* Stops before the instruction, and a run resumed there gets past it. */
+    Emu::set_breakpoint(*machine, 0x0002);
+    EXPECT_EQ(Emu::run_cycles(*machine, 1000), Emu::StopReason::BREAKPOINT);
+    EXPECT_EQ(Emu::get_state(*machine).instruction_pointer, 0x0002);
+    EXPECT_EQ(Emu::get_state(*machine).X, 3);
+    EXPECT_EQ(Emu::run_cycles(*machine, 1000), Emu::StopReason::BREAKPOINT);
+    EXPECT_EQ(Emu::get_state(*machine).X, 2);
+    EXPECT_EQ(Emu::last_hit(*machine).address, 0x0002);
+
+    /* Breakpoints belong to their machine. */
+    EXPECT_EQ(Emu::run_cycles(*other, 1000), Emu::StopReason::BREAK);
+
+    /* Stops after the instruction that writes, with the cycles it took counted. */
+    Emu::set_breakpoint(*machine, 0x0002, false);
+    Emu::set_watchpoint(*machine, 0x0200);
+    const uint64_t cycles = Emu::cycles(*machine);
+    EXPECT_EQ(Emu::run_cycles(*machine, 1000), Emu::StopReason::WATCHPOINT);
+    EXPECT_EQ(Emu::cycles(*machine), cycles + 2 + 4);
+    EXPECT_EQ(Emu::get_state(*machine).instruction_pointer, 0x0006);
+    EXPECT_EQ(Emu::last_hit(*machine).address, 0x0200);
+    EXPECT_EQ(Emu::last_hit(*machine).data, 1);
+    EXPECT_EQ(Emu::run_instructions(*machine, 5), Emu::StopReason::WATCHPOINT);
+    EXPECT_EQ(Emu::peek(*machine, 0x0200), 0);
+
+    emu_machine *c_machine = reinterpret_cast<emu_machine *>(machine);
+    emu_set_watchpoint(c_machine, 0x0200, 0);
+    EXPECT_EQ(emu_run_cycles(c_machine, 1000), EMU_STOP_BREAK);
+    uint16_t address = 0;
+    uint8_t data = 0xFF;
+    emu_last_hit(c_machine, &address, &data);
+    EXPECT_EQ(address, 0x0200);
+    EXPECT_EQ(data, 0);
+
+    Emu::destroy(machine);
+    Emu::destroy(other);
+}
+
+TEST(Emu, forkSharesMemoryUntilWritten)
+{
+    std::ifstream rom_file("../test/test2.bin", std::ios::binary);
+    std::vector<uint8_t> image{std::istreambuf_iterator<char>(rom_file), std::istreambuf_iterator<char>()};
+
+    Emu::Machine *parent = Emu::create();
+    ASSERT_TRUE(Emu::load_image(*parent, image.data(), image.size()));
+    EXPECT_EQ(Emu::run_instructions(*parent, 1), Emu::StopReason::INSTRUCTIONS);
+
+    std::vector<Emu::Machine *> forks;
+    for (int i = 0; i < 10000; i++)
+    {
+        forks.push_back(Emu::fork(*parent));
+    }
+    Emu::MemoryUsage usage = Emu::memory_usage(*forks.back());
+    EXPECT_EQ(usage.private_pages, 0);
+    EXPECT_GT(usage.shared_pages, 0);
+    EXPECT_LT(usage.bytes, 256);
+
+    /* The first write to $0200 copies one page into the fork that made it. */
+    EXPECT_EQ(Emu::run_until_write(*forks[0], 0x0200), Emu::StopReason::WRITE_REACHED);
+    EXPECT_EQ(Emu::memory_usage(*forks[0]).private_pages, 1);
+    EXPECT_EQ(Emu::peek(*forks[0], 0x0200), 7);
+    EXPECT_EQ(Emu::peek(*forks[1], 0x0200), 0);
+    EXPECT_EQ(Emu::peek(*parent, 0x0200), 0);
+
+    /* The parent is as it was, and runs on to the same result. */
+    EXPECT_EQ(Emu::run_until_write(*parent, 0x0200), Emu::StopReason::WRITE_REACHED);
+    EXPECT_EQ(Emu::peek(*parent, 0x0200), 7);
+    EXPECT_EQ(Emu::peek(*forks[1], 0x0200), 0);
+
+    for (Emu::Machine *fork : forks)
+    {
+        Emu::destroy(fork);
+    }
+    Emu::destroy(parent);
+
+    /* Forks of a machine with all 64KB loaded share one page table, so each costs the same as with a small image. */
+    std::vector<uint8_t> full(0x10000);
+    for (size_t i = 0; i < full.size(); i++)
+    {
+        full[i] = static_cast<uint8_t>(i * 7 + 1);
+    }
+    parent = Emu::create();
+    ASSERT_TRUE(Emu::load_image(*parent, full.data(), full.size(), 0));
+    forks.clear();
+    for (int i = 0; i < 100000; i++)
+    {
+        forks.push_back(Emu::fork(*parent));
+    }
+    usage = Emu::memory_usage(*forks.back());
+    EXPECT_EQ(usage.private_pages, 0);
+    EXPECT_EQ(usage.shared_pages, 256);
+    EXPECT_LT(usage.bytes, 256);
+    EXPECT_EQ(Emu::memory_usage(*parent).bytes, usage.bytes);
+
+    Emu::poke(*forks[5], 0xfffe, 0x42);
+    EXPECT_EQ(Emu::peek(*forks[5], 0xfffe), 0x42);
+    EXPECT_EQ(Emu::peek(*forks[6], 0xfffe), full[0xfffe]);
+    EXPECT_EQ(Emu::peek(*forks[5], 0xfeff), full[0xfeff]);
+    EXPECT_EQ(Emu::memory_usage(*forks[5]).private_pages, 1);
+
+    for (Emu::Machine *fork : forks)
+    {
+        Emu::destroy(fork);
+    }
+    Emu::destroy(parent);
+}
+
+/* Loops a number of times that depends on an input byte at 0x00F0, storing a running sum at 0x0200,Y, then branches
+one of two ways depending on the sum. Lanes with different inputs diverge and rejoin. */
+const std::vector<uint8_t> soa_program = {
+    0xa5, 0xf0,       // LDA $F0
+    0x29, 0x0f,       // AND #$0F
+    0xaa,             // TAX
+    0xa0, 0x00,       // LDY #$00
+                      // loop:
+    0x18,             // CLC
+    0x69, 0x03,       // ADC #$03
+    0x99, 0x00, 0x02, // STA $0200,Y
+    0xc8,             // INY
+    0xca,             // DEX
+    0xd0, 0xf6,       // BNE loop
+    0xc9, 0x20,       // CMP #$20
+    0xb0, 0x04,       // BCS high
+    0xa9, 0x01,       // LDA #$01
+    0xd0, 0x02,       // BNE done
+                      // high:
+    0xa9, 0x02,       // LDA #$02
+                      // done:
+    0x85, 0xf1,       // STA $F1
+    0x38,             // SEC
+    0xe9, 0x05,       // SBC #$05
+    0x48,             // PHA
+    0x00              // BRK
+};
+
+TEST(SoaEngine, matchesInterpreter)
+{
+    const size_t count = 37;
+    Cpu::State initial{};
+    initial.stack_pointer = 0x01FF;
+
+    SoaEngine::Lanes lanes;
+    SoaEngine::init(lanes, count, soa_program, initial);
+    for (size_t lane = 0; lane < count; lane++)
+    {
+        SoaEngine::lane_memory(lanes, lane)[0x00F0] = static_cast<uint8_t>(lane * 7);
+    }
+    while (SoaEngine::tick(lanes, 50))
+    {
+    }
+    EXPECT_GT(lanes.stats.vector_instructions, lanes.stats.scalar_instructions);
+
+    /* Run each input through the interpreter in the same slices and compare. */
+    for (size_t lane = 0; lane < count; lane++)
+    {
+        load_program(soa_program);
+        Memory::main_memory[0x00F0] = static_cast<uint8_t>(lane * 7);
+        ReturnCode code;
+        while ((code = Cpu::tick(50)) == ReturnCode::CONTINUE)
+        {
+        }
+
+        EXPECT_EQ(lanes.result[lane], code);
+        EXPECT_EQ(SoaEngine::get_lane_state(lanes, lane), Cpu::save_state()) << "lane " << lane;
+        EXPECT_TRUE(std::equal(Memory::main_memory.begin(), Memory::main_memory.end(), SoaEngine::lane_memory(lanes, lane)))
+            << "lane " << lane;
+    }
+
+    /* A lane stepping on its own is mapped into Memory once, not once per instruction. */
+    SoaEngine::init(lanes, 1, soa_program, initial);
+    SoaEngine::lane_memory(lanes, 0)[0x00F0] = 0x0f;
+    EXPECT_FALSE(SoaEngine::tick(lanes, 10000));
+    EXPECT_GT(lanes.stats.scalar_instructions, 50);
+    EXPECT_EQ(lanes.stats.remaps, 1);
+}
+
+TEST(SoaEngine, addKernelMatchesInterpreter)
+{
+    /* One lane for every A and carry in, through ADC # and SBC # with operands at the edges of signed overflow. */
+    for (const uint8_t opcode : {uint8_t{0x69}, uint8_t{0xe9}})
+    {
+        for (const uint8_t operand : {uint8_t{0x00}, uint8_t{0x01}, uint8_t{0x7f}, uint8_t{0x80}, uint8_t{0xff}})
+        {
+            const std::vector<uint8_t> program = {opcode, operand, 0x00};
+            SoaEngine::Lanes lanes;
+            SoaEngine::init(lanes, 512, program, Cpu::State{});
+            for (size_t lane = 0; lane < 512; lane++)
+            {
+                Cpu::State state{};
+                state.A = static_cast<uint8_t>(lane);
+                state.C = lane >= 256;
+                SoaEngine::set_lane_state(lanes, lane, state);
+            }
+            SoaEngine::tick(lanes, 2);
+            EXPECT_EQ(lanes.stats.vector_instructions, 512u);
+
+            for (size_t lane = 0; lane < 512; lane++)
+            {
+                load_program(program);
+                Cpu::A = static_cast<uint8_t>(lane);
+                Cpu::C = lane >= 256;
+                Cpu::stack_pointer = 0;
+                EXPECT_EQ(Cpu::tick(2), ReturnCode::CONTINUE);
+                EXPECT_EQ(SoaEngine::get_lane_state(lanes, lane), Cpu::save_state()) << "opcode " << int{opcode} << " operand "
+                                                                                     << int{operand} << " lane " << lane;
+            }
+        }
+    }
+}
+
+/* SoaEngine, but it flips a byte of memory in its 40th slice. */
+SoaEngine::Lanes broken_lanes;
+uint64_t broken_ticks = 0;
+const Differential::Engine broken_engine{
+    "broken engine",
+    [](const std::vector<uint8_t> &image, const Cpu::State &state)
+    {
+        SoaEngine::init(broken_lanes, 1, image, state);
+        broken_ticks = 0;
+    },
+    [](const int cycles_to_add)
+    {
+        SoaEngine::tick(broken_lanes, cycles_to_add);
+        if (++broken_ticks == 40)
+        {
+            SoaEngine::lane_memory(broken_lanes, 0)[0x0201] ^= 1;
+            Memory::mark_written(0x02, 0x02);
+        }
+        return broken_lanes.result[0];
+    },
+    []()
+    { return SoaEngine::get_lane_state(broken_lanes, 0); },
+    []() -> const uint8_t *
+    { return SoaEngine::lane_memory(broken_lanes, 0); }};
+
+TEST(Differential, stopsAtFirstDivergence)
+{
+    Cpu::State initial{};
+    initial.stack_pointer = 0x01FF;
+    std::vector<uint8_t> image = soa_program;
+    image.resize(0x100);
+    image[0xF0] = 5;
+
+    Differential::Result result = Differential::run(Differential::soa_engine, image, initial, 100000);
+    EXPECT_FALSE(result.diverged);
+    EXPECT_EQ(result.reference_code, ReturnCode::BREAK);
+    EXPECT_EQ(Memory::main_memory[0x00F1], 1);
+
+    /* Caught in the slice it happens, with the instructions before it. */
+    result = Differential::run(broken_engine, image, initial, 100000);
+    EXPECT_TRUE(result.diverged);
+    EXPECT_EQ(result.slices, 40u);
+    EXPECT_EQ(result.address, 0x0201);
+    EXPECT_EQ(result.reference_byte ^ result.candidate_byte, 1);
+    ASSERT_FALSE(result.history.empty());
+    EXPECT_LE(result.history.size(), Differential::history_length);
+    EXPECT_EQ(result.history.front().state.instruction_pointer, 0);
+
+    std::ostringstream report;
+    Differential::report(result, broken_engine, report);
+    EXPECT_NE(report.str().find("memory at $0201"), std::string::npos);
+}
+
+TEST(Fuzzer, findsInputThatCrashes)
+{
+    /* Jumps to an unknown opcode at $0300 when the input starts with "FUZ". */
+    Fuzzer::Target target;
+    target.image = {
+        0xad, 0x00, 0x02, // LDA $0200
+        0xc9, 0x46,       // CMP #'F'
+        0xd0, 0x11,       // BNE exit
+        0xad, 0x01, 0x02, // LDA $0201
+        0xc9, 0x55,       // CMP #'U'
+        0xd0, 0x0a,       // BNE exit
+        0xad, 0x02, 0x02, // LDA $0202
+        0xc9, 0x5a,       // CMP #'Z'
+        0xd0, 0x03,       // BNE exit
+        0x4c, 0x00, 0x03, // JMP $0300
+        0x00,             // exit: BRK
+    };
+    target.image.resize(0x301);
+    target.image[0x300] = 0x02;
+    target.state.stack_pointer = 0x01FF;
+    target.input_address = 0x0200;
+    target.input_size = 4;
+    target.code_first = 0x0000;
+    target.code_last = 0x0018;
+
+    Fuzzer::Options options;
+    options.executions = 50000;
+    Fuzzer::Result result;
+    ASSERT_TRUE(Fuzzer::run(target, options, result));
+    EXPECT_EQ(result.executions, 50000u);
+    ASSERT_EQ(result.crashes.size(), 1u);
+    EXPECT_EQ(result.crashes[0].outcome, Fuzzer::Outcome::UNKNOWN_INSTRUCTION);
+    EXPECT_EQ(result.crashes[0].address, 0x0300);
+    EXPECT_EQ(std::string(result.crashes[0].input.begin(), result.crashes[0].input.begin() + 3), "FUZ");
+    EXPECT_EQ(Cpu::coverage, nullptr);
+
+    target.input_size = Fuzzer::max_input_size + 1;
+    EXPECT_FALSE(Fuzzer::run(target, options, result));
+}
+
+TEST(Coverage, recordsExecutedBytesAndBranchDirections)
+{
+    load_program({
+        0xa2, 0x03,       // LDX #$03
+        0xca,             // loop: DEX
+        0xd0, 0xfd,       // BNE loop
+        0xf0, 0x02,       // BEQ done
+        0xa9, 0x01,       // LDA #$01, never reached
+        0x00,             // done: BRK
+    });
+    Coverage::Map map;
+    Cpu::code_coverage = &map;
+    EXPECT_EQ(Cpu::tick(1000), ReturnCode::BREAK);
+    Cpu::code_coverage = nullptr;
+
+    EXPECT_TRUE(Coverage::test(map.opcodes, 0x0000));
+    EXPECT_TRUE(Coverage::test(map.operands, 0x0001));
+    EXPECT_FALSE(Coverage::test(map.opcodes, 0x0001));
+    EXPECT_FALSE(Coverage::test(map.opcodes, 0x0007));
+    EXPECT_TRUE(Coverage::test(map.opcodes, 0x0009));
+    EXPECT_TRUE(Coverage::test(map.taken, 0x0003));
+    EXPECT_TRUE(Coverage::test(map.not_taken, 0x0003));
+    EXPECT_TRUE(Coverage::test(map.taken, 0x0005));
+    EXPECT_FALSE(Coverage::test(map.not_taken, 0x0005));
+
+    /* Runs merged through a file add up. */
+    std::remove("coverage_test.cov");
+    Coverage::Map other;
+    Coverage::set(other.opcodes, 0x0007);
+    ASSERT_TRUE(Coverage::merge_file("coverage_test.cov", map));
+    ASSERT_TRUE(Coverage::merge_file("coverage_test.cov", other));
+    Coverage::Map merged;
+    ASSERT_TRUE(Coverage::read_file("coverage_test.cov", merged));
+    EXPECT_TRUE(Coverage::test(merged.opcodes, 0x0007));
+    EXPECT_TRUE(Coverage::test(merged.taken, 0x0005));
+
+    std::ostringstream report;
+    Coverage::report(map, Memory::main_memory, report);
+    EXPECT_NE(report.str().find("$0003 * d0 fd     BNE $0002    ; both ways"), std::string::npos) << report.str();
+    EXPECT_NE(report.str().find("$0007   a9 01     LDA #$01"), std::string::npos) << report.str();
+    EXPECT_NE(report.str().find("5 of 6 instructions ran, 1 of 2 branches went both ways"), std::string::npos) << report.str();
+}
+
+TEST(Explorer, findsEveryWayToEndWithTheShortestInputs)
+{
+    Explorer::Target target;
+    target.image = {
+        0xad, 0x00, 0x03, // LDA $0300
+        0xa9, 0x00,       // LDA #$00, so both inputs lead to the same state
+        0xad, 0x00, 0x03, // LDA $0300
+        0xc9, 0x01,       // CMP #$01
+        0xd0, 0x08,       // BNE exit
+        0xad, 0x00, 0x03, // LDA $0300
+        0xd0, 0x03,       // BNE exit
+        0x4c, 0x00, 0x04, // JMP $0400
+        0x00,             // exit: BRK
+    };
+    target.image.resize(0x401);
+    target.image[0x400] = 0x02;
+    target.state.stack_pointer = 0x01FF;
+    target.input_address = 0x0300;
+    target.choices = {0x00, 0x01};
+
+    Explorer::Options options;
+    options.workers = 2;
+    Explorer::Result result;
+    ASSERT_TRUE(Explorer::run(target, options, result));
+    EXPECT_EQ(result.states, 3u);
+    EXPECT_EQ(result.duplicates, 1u);
+    EXPECT_EQ(result.paths, 3u);
+    EXPECT_EQ(result.dropped, 0u);
+    ASSERT_EQ(result.endings.size(), 2u);
+    EXPECT_EQ(result.endings[0].outcome, Explorer::Outcome::EXIT);
+    EXPECT_EQ(result.endings[0].depth, 2u);
+    EXPECT_EQ(result.endings[0].inputs[1], 0x00);
+    EXPECT_EQ(result.endings[1].outcome, Explorer::Outcome::UNKNOWN_INSTRUCTION);
+    EXPECT_EQ(result.endings[1].address, 0x0400);
+    ASSERT_EQ(result.endings[1].inputs.size(), 3u);
+    EXPECT_EQ(result.endings[1].inputs[1], 0x01);
+    EXPECT_EQ(result.endings[1].inputs[2], 0x00);
+
+    // Only enough cycles for the first two instructions.
+    target.max_cycles = 6;
+    ASSERT_TRUE(Explorer::run(target, options, result));
+    ASSERT_EQ(result.endings.size(), 1u);
+    EXPECT_EQ(result.endings[0].outcome, Explorer::Outcome::CUTOFF);
+    EXPECT_EQ(result.endings[0].depth, 1u);
+
+    target.choices.clear();
+    EXPECT_FALSE(Explorer::run(target, options, result));
+}
+
+TEST(Scheduler, eventsRunAtTheirDeadlines)
+{
+    load_program({0x4c, 0x00, 0x00}); // JMP $0000
+    Scheduler::reset();
+
+    std::vector<std::pair<int, uint64_t>> log;
+    Scheduler::schedule(100, [&]()
+                        { log.emplace_back(100, Scheduler::now()); });
+    Scheduler::schedule(50, [&]()
+                        {
+                            log.emplace_back(50, Scheduler::now());
+                            Scheduler::schedule_in(25, [&]()
+                                                   { log.emplace_back(75, Scheduler::now()); });
+                        });
+    Scheduler::cancel(Scheduler::schedule(60, [&]()
+                                          { log.emplace_back(60, Scheduler::now()); }));
+    /* Devices keep 0 for having no event pending, so cancelling it never drops one. */
+    Scheduler::cancel(0);
+
+    EXPECT_EQ(Scheduler::run_until(200), ReturnCode::CONTINUE);
+
+    /* Each event runs at the end of the instruction during which it fell due, and the CPU runs one slice per gap. */
+    ASSERT_EQ(log.size(), 3);
+    EXPECT_EQ(log[0].first, 50);
+    EXPECT_EQ(log[1].first, 75);
+    EXPECT_EQ(log[2].first, 100);
+    for (const auto &[due, time] : log)
+    {
+        EXPECT_GE(time, static_cast<uint64_t>(due));
+        EXPECT_LT(time, static_cast<uint64_t>(due) + 7);
+    }
+    EXPECT_GE(Scheduler::now(), 200);
+    EXPECT_EQ(Scheduler::slices, 4);
+
+    /* Cancelling events that already ran, as a device replacing its own wake-up does, leaves nothing to snapshot. */
+    for (int i = 0; i < 100; i++)
+    {
+        const uint64_t id = Scheduler::schedule(Scheduler::now(), []() {});
+        EXPECT_EQ(Scheduler::run_for(1), ReturnCode::CONTINUE);
+        Scheduler::cancel(id);
+    }
+    Scheduler::Snapshot snapshot;
+    Scheduler::snapshot(snapshot);
+    EXPECT_TRUE(snapshot.live.empty());
+    EXPECT_TRUE(snapshot.cancelled.empty());
+    Scheduler::reset();
+}
+
+TEST(Cpu, interruptsAreVectored)
+{
+    std::vector<uint8_t> program(0x50, 0);
+    auto place = [&](const uint16_t address, const std::vector<uint8_t> &bytes)
+    { std::copy(bytes.begin(), bytes.end(), program.begin() + address); };
+    place(0x00, {0x58, 0x4c, 0x01, 0x00});                   // CLI, then JMP to itself
+    place(0x20, {0xee, 0xf0, 0x00, 0xea, 0xea, 0xea, 0x40}); // IRQ: INC $00F0, NOP x3, RTI
+    place(0x30, {0xee, 0xf1, 0x00, 0x40});                   // NMI: INC $00F1, RTI
+    place(0x40, {0x00, 0xea, 0x4c, 0x42, 0x00});             // BRK and its padding byte, then JMP to itself
+    load_program(program);
+    Memory::main_memory[Cpu::nmi_vector] = 0x30;
+    Memory::main_memory[Cpu::irq_vector] = 0x20;
+    Scheduler::reset();
+    Cpu::reset();
+    EXPECT_EQ(Cpu::instruction_pointer, 0x0000);
+    EXPECT_TRUE(Cpu::I);
+
+    /* A device raises IRQ every 100 cycles and releases it 10 cycles later, before the handler returns. */
+    for (uint64_t time = 100; time <= 1000; time += 100)
+    {
+        Scheduler::schedule(time, []()
+                            {
+                                Cpu::set_irq(1, true);
+                                Scheduler::schedule_in(10, []()
+                                                       { Cpu::set_irq(1, false); });
+                            });
+    }
+    Scheduler::schedule(550, []()
+                        { Cpu::nmi(); });
+    EXPECT_EQ(Scheduler::run_until(1100), ReturnCode::CONTINUE);
+    EXPECT_EQ(Memory::main_memory[0x00F0], 10);
+    EXPECT_EQ(Memory::main_memory[0x00F1], 1);
+    EXPECT_EQ(Cpu::stack_pointer, 0x01FC);
+
+    /* Under the vector policy BRK goes through the IRQ vector and RTI skips its padding byte. */
+    Cpu::brk_policy = Cpu::BrkPolicy::VECTOR;
+    Cpu::instruction_pointer = 0x0040;
+    EXPECT_EQ(Scheduler::run_for(100), ReturnCode::CONTINUE);
+    EXPECT_EQ(Memory::main_memory[0x00F0], 11);
+    EXPECT_EQ(Cpu::instruction_pointer, 0x0042);
+
+    Cpu::brk_policy = Cpu::BrkPolicy::HALT;
+    Scheduler::reset();
+}
+
+TEST(Clock, framePacingDoesNotDrift)
+{
+    /* NTSC frames alternate 29780 and 29781 cycles, and a million of them take exactly 29780.5 million cycles. */
+    EXPECT_EQ(Clock::cycles_per_frame(Clock::ntsc), (Clock::Rational{59561, 2}));
+    EXPECT_EQ(Clock::frame_end(Clock::ntsc, 1), 29780);
+    EXPECT_EQ(Clock::frame_end(Clock::ntsc, 2), 59561);
+    EXPECT_EQ(Clock::frame_end(Clock::ntsc, 1000000), 29780500000);
+    EXPECT_EQ(Clock::cycles_per_frame(Clock::pal), (Clock::Rational{66495, 2}));
+
+    /* 39375000 NTSC frames last exactly 655171 seconds. */
+    EXPECT_EQ(Clock::frame_time(Clock::ntsc, 39375000), std::chrono::seconds{655171});
+
+    auto custom = [](std::string cpu_hz, std::string fps, Clock::Profile &profile)
+    {
+        std::vector<std::string> arguments = {"emu", "-clock", "custom", "-cpu-hz", cpu_hz, "-fps", fps};
+        std::vector<char *> argv;
+        for (std::string &argument : arguments)
+        {
+            argv.push_back(argument.data());
+        }
+        int argc = static_cast<int>(argv.size());
+        return Clock::from_options(InputParser{argc, argv.data()}, profile);
+    };
+    Clock::Profile profile = Clock::ntsc;
+    ASSERT_TRUE(custom("1790000", "60", profile));
+    EXPECT_EQ(Clock::cycles_per_frame(profile), (Clock::Rational{89500, 3}));
+    EXPECT_EQ(Clock::frame_end(profile, 3), 89500);
+
+    /* Decimals with many places have products past 64 bits before they are cancelled down. */
+    ASSERT_TRUE(custom("1789772.727272", "60.098813897", profile));
+    EXPECT_EQ(Clock::frame_end(profile, 60), 1786830);
+    EXPECT_EQ(Clock::frame_time(profile, 60098813897), std::chrono::seconds{1000000000});
+
+    /* A profile whose cycles per frame can't be represented is refused. */
+    EXPECT_FALSE(custom("9999999999999", "0.000000001", profile));
+}
+
+TEST(Pacer, histogramAndDeadlines)
+{
+    Pacer::Histogram histogram;
+    for (uint64_t microseconds = 1; microseconds <= 1000; microseconds++)
+    {
+        Pacer::record(histogram, microseconds * 1000);
+    }
+    EXPECT_NEAR(static_cast<double>(Pacer::percentile(histogram, 0.5)), 500000.0, 500000.0 * 0.125);
+    EXPECT_NEAR(static_cast<double>(Pacer::percentile(histogram, 0.99)), 990000.0, 990000.0 * 0.125);
+    EXPECT_EQ(Pacer::percentile(histogram, 1.0), 1000000);
+    EXPECT_EQ(histogram.max, 1000000);
+
+    /* A frame that finishes early is held back to its deadline; one that finishes late counts as missed. */
+    Pacer::spin_budget = std::chrono::microseconds{500};
+    auto start = Pacer::Clock::now();
+    const std::chrono::milliseconds period{2};
+    EXPECT_EQ(Pacer::end_frame(start, start + period, period), Pacer::Clock::duration::zero());
+    EXPECT_GE(Pacer::Clock::now(), start + period);
+    EXPECT_EQ(Pacer::end_frame(start, start, period), Pacer::Clock::duration::zero());
+    EXPECT_EQ(Pacer::telemetry.frames, 2);
+    EXPECT_EQ(Pacer::telemetry.missed, 1);
+    EXPECT_EQ(Pacer::telemetry.skipped, 0);
+
+    /* A frame more than max_lag_frames late moves the schedule forward by the whole periods it missed, so the next
+     * deadline is ahead again rather than long past. */
+    const std::chrono::milliseconds frame{20};
+    start = Pacer::Clock::now();
+    const Pacer::Clock::time_point stalled = start - 10 * frame - frame / 2;
+    const Pacer::Clock::duration shift = Pacer::end_frame(start, stalled, frame);
+    EXPECT_GE(shift, 10 * frame);
+    EXPECT_EQ(Pacer::telemetry.skipped, static_cast<uint64_t>(shift / frame));
+    EXPECT_GT(stalled + shift + frame, Pacer::Clock::now());
+}
+
+TEST(Ppu, rendersAFrame)
+{
+    load_program({0x4c, 0x00, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                  0xee, 0xf1, 0x00, 0x40}); // JMP to itself; NMI at $0010: INC $00F1, RTI
+    Memory::main_memory[Cpu::nmi_vector] = 0x10;
+    Scheduler::reset();
+    Ppu::state = Ppu::State{};
+    Ppu::attach();
+
+    /* Everything goes through the registers: tile 1 is solid colour 1, the top left nametable entry uses it with
+     * palette 1, and sprite 0 uses it at (4, 4). */
+    auto set_address = [](const uint16_t address)
+    {
+        Bus::write(static_cast<uint8_t>(address >> 8), 0x2006);
+        Bus::write(static_cast<uint8_t>(address), 0x2006);
+    };
+    set_address(0x0010);
+    for (int row = 0; row < 16; row++)
+    {
+        Bus::write(static_cast<uint8_t>(row < 8 ? 0xff : 0x00), 0x2007);
+    }
+    set_address(0x2000);
+    Bus::write(0x01, 0x2007);
+    set_address(0x23c0);
+    Bus::write(0x01, 0x2007);
+    set_address(0x3f00);
+    Bus::write(0x0f, 0x2007);
+    set_address(0x3f05);
+    Bus::write(0x16, 0x2007);
+    set_address(0x3f11);
+    Bus::write(0x2a, 0x2007);
+    Bus::write(0x00, 0x2003);
+    for (const uint8_t data : std::array<uint8_t, 4>{0x03, 0x01, 0x00, 0x04}) // Y - 1, tile, attributes, X
+    {
+        Bus::write(data, 0x2004);
+    }
+    Bus::write(0x00, 0x2005);
+    Bus::write(0x00, 0x2005);
+    Bus::write(0x80, 0x2000);
+    Bus::write(0x1e, 0x2001);
+
+    /* The scroll position is loaded at the end of the first frame, so the second is the first one drawn from it. */
+    EXPECT_EQ(Scheduler::run_until((2 * Ppu::scanlines_per_frame - 20) * Ppu::dots_per_scanline / 3), ReturnCode::CONTINUE);
+    EXPECT_EQ(Ppu::frame_count, 2);
+    EXPECT_EQ(Memory::main_memory[0x00f1], 2);
+
+    auto pixel = [](const int x, const int y)
+    { return Ppu::state.framebuffer[static_cast<size_t>(y * Ppu::width + x)]; };
+    EXPECT_EQ(pixel(0, 0), 0x16);
+    EXPECT_EQ(pixel(3, 7), 0x16);
+    EXPECT_EQ(pixel(8, 0), 0x0f);
+    EXPECT_EQ(pixel(255, 239), 0x0f);
+    EXPECT_EQ(pixel(4, 4), 0x2a);
+    EXPECT_EQ(pixel(11, 11), 0x2a);
+    EXPECT_EQ(pixel(12, 11), 0x0f);
+    EXPECT_EQ(pixel(4, 12), 0x0f);
+
+    /* Vertical blank and sprite 0 hit are set; reading $2002 clears vertical blank only. */
+    EXPECT_EQ(Bus::read(0x2002) & 0xc0, 0xc0);
+    EXPECT_EQ(Bus::read(0x3ffa) & 0xc0, 0x40);
+
+    Ppu::detach();
+    Scheduler::reset();
+}
+
+/* Fill every part of the PPU with arbitrary non-zero data and turn rendering on. */
+void fill_ppu_state()
+{
+    Ppu::state = Ppu::State{};
+    for (size_t i = 0; i < Ppu::state.chr.size(); i++)
+    {
+        Ppu::state.chr[i] = static_cast<uint8_t>(i * 37 + (i >> 7));
+    }
+    for (size_t i = 0; i < Ppu::state.vram.size(); i++)
+    {
+        Ppu::state.vram[i] = static_cast<uint8_t>(i * 13);
+    }
+    for (size_t i = 0; i < Ppu::state.oam.size(); i++)
+    {
+        Ppu::state.oam[i] = static_cast<uint8_t>(i * 7);
+    }
+    for (size_t i = 0; i < Ppu::state.palette.size(); i++)
+    {
+        Ppu::state.palette[i] = static_cast<uint8_t>(i);
+    }
+    Ppu::state.mask = 0x1e;
+}
+
+TEST(Ppu, threadedRenderingMatchesSynchronous)
+{
+    /* The program changes the scroll position continuously, so every scanline depends on exactly when each write
+     * happened relative to the scanline events. */
+    const std::vector<uint8_t> program = {
+        0xa2, 0x00,       // LDX #$00
+        0x8e, 0x05, 0x20, // STX $2005
+        0x8e, 0x05, 0x20, // STX $2005
+        0xad, 0x02, 0x20, // LDA $2002
+        0xe8,             // INX
+        0x4c, 0x02, 0x00, // JMP $0002
+    };
+    auto run = [&](const bool threaded)
+    {
+        load_program(program);
+        Scheduler::reset();
+        fill_ppu_state();
+        Ppu::attach();
+        if (threaded)
+        {
+            Ppu::start_render_thread();
+        }
+        EXPECT_EQ(Scheduler::run_until(3 * 29781), ReturnCode::CONTINUE);
+        Ppu::detach();
+        return Ppu::state.framebuffer;
+    };
+
+    const auto synchronous = run(false);
+    const auto threaded = run(true);
+    EXPECT_EQ(Ppu::latest_frame().number, 3);
+    EXPECT_TRUE(synchronous == threaded);
+    EXPECT_TRUE(Ppu::latest_frame().pixels == synchronous);
+    Scheduler::reset();
+}
+
+TEST(Ppu, catchUpMatchesEagerStepping)
+{
+    /* The program changes the scroll position and logs $2002 every iteration, and takes an NMI every frame. */
+    std::vector<uint8_t> program = {
+        0xa2, 0x00,       // LDX #$00
+        0x8e, 0x05, 0x20, // STX $2005
+        0x8e, 0x05, 0x20, // STX $2005
+        0xad, 0x02, 0x20, // LDA $2002
+        0x9d, 0x00, 0x03, // STA $0300,X
+        0xe8,             // INX
+        0x4c, 0x02, 0x00, // JMP $0002
+    };
+    program.resize(0x20);
+    program.insert(program.end(), {0xee, 0xf1, 0x00, 0x40}); // NMI: INC $00F1, RTI
+    auto run = [&](const bool lazy)
+    {
+        load_program(program);
+        Memory::main_memory[Cpu::nmi_vector] = 0x20;
+        Scheduler::reset();
+        fill_ppu_state();
+        Ppu::state.control = 0x80;
+        Ppu::lazy = lazy;
+        Ppu::attach();
+        EXPECT_EQ(Scheduler::run_until(3 * 29781), ReturnCode::CONTINUE);
+        Ppu::detach();
+        return std::make_tuple(Memory::main_memory, Ppu::state.framebuffer, Cpu::save_state(), Scheduler::slices);
+    };
+
+    const auto [eager_memory, eager_frame, eager_cpu, eager_slices] = run(false);
+    const auto [lazy_memory, lazy_frame, lazy_cpu, lazy_slices] = run(true);
+    Ppu::lazy = true;
+    EXPECT_EQ(lazy_memory[0x00f1], 3);
+    EXPECT_TRUE(eager_memory == lazy_memory);
+    EXPECT_TRUE(eager_frame == lazy_frame);
+    EXPECT_EQ(eager_cpu.instruction_pointer, lazy_cpu.instruction_pointer);
+    EXPECT_EQ(eager_cpu.cycles_available, lazy_cpu.cycles_available);
+
+    /* One slice per frame instead of one per scanline. */
+    EXPECT_LT(lazy_slices * 50, eager_slices);
+    Scheduler::reset();
+}
+
+TEST(Apu, pulseToneAndFrameIrq)
+{
+    load_program({0x4c, 0x00, 0x00}); // JMP $0000
+    Cpu::I = true;
+    Scheduler::reset();
+    Apu::attach();
+    int16_t discard;
+    while (Apu::samples.try_pop(discard))
+    {
+    }
+
+    /* Pulse 1 at full constant volume, 50% duty, period 253: 1789773 / (16 * 254) = 440.4 Hz. */
+    Bus::write(0x01, 0x4015);
+    Bus::write(0xbf, 0x4000);
+    Bus::write(0xfd, 0x4002);
+    Bus::write(0x00, 0x4003);
+    Bus::write(0x00, 0x4017);
+    EXPECT_EQ(Scheduler::run_until(10 * 29781), ReturnCode::CONTINUE);
+    Apu::catch_up(Scheduler::now());
+
+    std::vector<int16_t> output(20000);
+    output.resize(Apu::samples.try_pop(output.data(), output.size()));
+    EXPECT_NEAR(static_cast<double>(output.size()), 10 * 29781 * 48000.0 / 1789773.0, 16.0);
+
+    /* Skip the high-pass filter settling, then count rising zero crossings. */
+    int crossings = 0;
+    int peak = 0;
+    for (size_t i = 2400; i < output.size(); i++)
+    {
+        crossings += output[i - 1] < 0 && output[i] >= 0;
+        peak = std::max(peak, std::abs(static_cast<int>(output[i])));
+    }
+    EXPECT_NEAR(crossings, static_cast<double>(output.size() - 2400) / 48000.0 * 440.4, 2.0);
+    EXPECT_GT(peak, 1500);
+    EXPECT_LT(peak, 4000);
+
+    /* The 4-step sequence raised the frame IRQ, and reading $4015 acknowledges it. */
+    EXPECT_TRUE(Cpu::irq_lines & Apu::frame_irq_line);
+    EXPECT_EQ(Bus::read(0x4015), 0x41);
+    EXPECT_EQ(Bus::read(0x4015), 0x01);
+    EXPECT_FALSE(Cpu::irq_lines & Apu::frame_irq_line);
+
+    Apu::detach();
+    Scheduler::reset();
+}
+
+TEST(Apu, oamDmaCopiesPageAndStalls)
+{
+    load_program({
+        0xa2, 0x05,       // LDX #$05
+        0x8e, 0x03, 0x20, // STX $2003
+        0xa9, 0x02,       // LDA #$02
+        0x8d, 0x14, 0x40, // STA $4014
+        0x00,             // BRK
+    });
+    for (int i = 0; i < 256; i++)
+    {
+        Memory::main_memory[static_cast<size_t>(0x200 + i)] = static_cast<uint8_t>(i ^ 0x5a);
+    }
+    Scheduler::reset();
+    Ppu::state = Ppu::State{};
+    Ppu::attach();
+    Apu::attach();
+    EXPECT_EQ(Scheduler::run_until(29781), ReturnCode::BREAK);
+    const uint64_t end = Scheduler::now();
+    Apu::detach();
+    Ppu::detach();
+
+    /* The copy starts at the OAM address and wraps around. */
+    for (int i = 0; i < 256; i++)
+    {
+        EXPECT_EQ(Ppu::state.oam[static_cast<size_t>((i + 5) & 0xff)], i ^ 0x5a);
+    }
+    EXPECT_EQ(Ppu::state.oam_address, 5);
+
+    /* 19 cycles of instructions, and 514 of DMA because STA writes on cycle 11. */
+    EXPECT_EQ(end, 19u + 514u);
+    Scheduler::reset();
+}
+
+/* An iNES or NES 2.0 image whose every 8KB PRG bank and 1KB CHR bank is filled with its own number. */
+std::vector<uint8_t> cartridge_image(const int mapper, const int prg_16k, const int chr_8k, const bool nes2)
+{
+    std::vector<uint8_t> image = {'N', 'E', 'S', 0x1a, static_cast<uint8_t>(prg_16k), static_cast<uint8_t>(chr_8k),
+                                  static_cast<uint8_t>((mapper & 0x0f) << 4 | 0x02), static_cast<uint8_t>((mapper & 0xf0) | (nes2 ? 0x08 : 0)),
+                                  0, 0, static_cast<uint8_t>(nes2 ? 0x70 : 0), static_cast<uint8_t>(nes2 && chr_8k == 0 ? 0x07 : 0), 0, 0, 0, 0};
+    for (int bank = 0; bank < prg_16k * 2; bank++)
+    {
+        image.insert(image.end(), 0x2000, static_cast<uint8_t>(bank));
+    }
+    for (int bank = 0; bank < chr_8k * 8; bank++)
+    {
+        image.insert(image.end(), 0x400, static_cast<uint8_t>(bank));
+    }
+    return image;
+}
+
+TEST(Cartridge, bankSwitchingSwapsPagePointers)
+{
+    load_program({});
+
+    /* UxROM from a NES 2.0 header: 16KB switchable at $8000, the last 16KB fixed at $C000, 8KB of battery RAM. */
+    ASSERT_TRUE(Cartridge::load(cartridge_image(2, 8, 0, true)));
+    EXPECT_TRUE(Cartridge::header.nes2);
+    EXPECT_TRUE(Cartridge::header.battery);
+    EXPECT_EQ(Cartridge::header.prg_ram_size, 0x2000u);
+    EXPECT_EQ(Bus::read(0xc000), 14);
+    EXPECT_EQ(Bus::read(0xffff), 15);
+    Bus::write(0x03, 0x8000);
+    EXPECT_EQ(Bus::read(0x8000), 6);
+    EXPECT_EQ(Bus::read(0xa000), 7);
+    EXPECT_EQ(Memory::pages[0x81], Cartridge::prg_rom.data() + 6 * 0x2000 + 0x100);
+    Bus::write(0x42, 0x6001);
+    EXPECT_EQ(Cartridge::prg_ram[1], 0x42);
+
+    /* MMC1: registers are written a bit at a time, and a write with bit 7 set resets the shift register. */
+    ASSERT_TRUE(Cartridge::load(cartridge_image(1, 8, 4, false)));
+    auto mmc1_write = [](const uint16_t address, const uint8_t value)
+    {
+        for (int bit = 0; bit < 5; bit++)
+        {
+            Bus::write(static_cast<uint8_t>((value >> bit) & 1), address);
+        }
+    };
+    Bus::write(0x01, 0xe000);
+    Bus::write(0x80, 0xe000);
+    mmc1_write(0xe000, 5);
+    EXPECT_EQ(Bus::read(0x8000), 10);
+    EXPECT_EQ(Bus::read(0xc000), 14);
+    mmc1_write(0x8000, 0x1e);
+    mmc1_write(0xa000, 3);
+    mmc1_write(0xc000, 6);
+    EXPECT_EQ(Ppu::read_vram(Ppu::state, 0x0000), 12);
+    EXPECT_EQ(Ppu::read_vram(Ppu::state, 0x1c00), 27);
+    EXPECT_EQ(Ppu::state.nametable_banks, (std::array<uint8_t, 4>{0, 1, 0, 1}));
+
+    /* CNROM switches all 8KB of CHR ROM at once. */
+    ASSERT_TRUE(Cartridge::load(cartridge_image(3, 2, 4, false)));
+    Bus::write(0x02, 0x8000);
+    EXPECT_EQ(Ppu::read_vram(Ppu::state, 0x0400), 17);
+    EXPECT_EQ(Bus::read(0xfffc), 3);
+
+    Cartridge::unload();
+    EXPECT_EQ(Memory::pages[0x80], Memory::main_memory.data() + 0x8000);
+    EXPECT_EQ(Memory::devices[0x80], nullptr);
+}
+
+TEST(Cartridge, mmc3ScanlineIrq)
+{
+    load_program({0x4c, 0x00, 0x00}); // JMP $0000
+    Cpu::I = true;
+    Scheduler::reset();
+    ASSERT_TRUE(Cartridge::load(cartridge_image(4, 8, 8, false)));
+    Ppu::state.mask = 0x18;
+    Ppu::attach();
+
+    /* R6 selects the bank at $8000; bit 6 of bank select moves it to $C000. */
+    Bus::write(0x06, 0x8000);
+    Bus::write(0x05, 0x8001);
+    EXPECT_EQ(Bus::read(0x8000), 5);
+    EXPECT_EQ(Bus::read(0xc000), 14);
+    Bus::write(0x46, 0x8000);
+    EXPECT_EQ(Bus::read(0x8000), 14);
+    EXPECT_EQ(Bus::read(0xc000), 5);
+
+    /* The counter is loaded from the latch on scanline 0 and reaches zero on scanline 10, at dot 260. */
+    Bus::write(10, 0xc000);
+    Bus::write(0, 0xc001);
+    Bus::write(0, 0xe001);
+    const uint64_t irq_cycle = (10 * 341 + 260 + 2) / 3;
+    EXPECT_EQ(Scheduler::run_until(irq_cycle - 10), ReturnCode::CONTINUE);
+    EXPECT_EQ(Cpu::irq_lines & Cartridge::irq_line, 0u);
+    EXPECT_EQ(Scheduler::run_until(irq_cycle + 10), ReturnCode::CONTINUE);
+    EXPECT_NE(Cpu::irq_lines & Cartridge::irq_line, 0u);
+
+    /* Acknowledging it releases the line. */
+    Bus::write(0, 0xe000);
+    EXPECT_EQ(Cpu::irq_lines & Cartridge::irq_line, 0u);
+
+    Ppu::detach();
+    Cartridge::unload();
+    Scheduler::reset();
+}
+
+TEST(Cartridge, loadsFromFile)
+{
+    load_program({});
+
+    /* NROM with 32KB of PRG ROM and 8KB of CHR ROM, through the same path as -r. */
+    {
+        const std::vector<uint8_t> image = cartridge_image(0, 2, 1, false);
+        std::ofstream file("cartridge_test.nes", std::ios::binary);
+        file.write(reinterpret_cast<const char *>(image.data()), static_cast<std::streamsize>(image.size()));
+    }
+    ASSERT_TRUE(Bus::load_rom("cartridge_test.nes"));
+    EXPECT_NE(Memory::devices[0x80], nullptr);
+    EXPECT_EQ(Bus::read(0x8000), 0);
+    EXPECT_EQ(Bus::read(0xffff), 3);
+    EXPECT_EQ(Ppu::read_vram(Ppu::state, 0x1c00), 7);
+    Cartridge::unload();
+
+    /* A NES 2.0 header asking for 128 bytes of PRG RAM gets a whole page, and room for its trainer at $7000. */
+    std::vector<uint8_t> small_ram = cartridge_image(0, 2, 1, true);
+    small_ram[6] |= 0x04;
+    small_ram[10] = 0x01;
+    small_ram.insert(small_ram.begin() + 16, 512, 0x77);
+    ASSERT_TRUE(Cartridge::load(small_ram));
+    EXPECT_EQ(Cartridge::header.prg_ram_size, 128u);
+    EXPECT_EQ(Cartridge::prg_ram.size(), 512u);
+    EXPECT_EQ(Bus::read(0x7000), 0x77);
+    EXPECT_EQ(Bus::read(0x61ff), 0x77);
+    EXPECT_EQ(Bus::read(0xffff), 3);
+    Cartridge::unload();
+
+    EXPECT_FALSE(Bus::load_rom("cartridge_test_missing.nes"));
+    EXPECT_FALSE(Cartridge::load_file("cartridge_test_missing.nes"));
+}
+
+TEST(VideoWriter, streamsMemoryRegionFrames)
+{
+    load_program({});
+    for (int i = 0; i < 32; i++)
+    {
+        Memory::main_memory[static_cast<size_t>(0x200 + i)] = static_cast<uint8_t>(i);
+    }
+
+    VideoWriter::Options options;
+    ASSERT_TRUE(VideoWriter::parse_region("0200:16x2", options.region));
+    EXPECT_FALSE(VideoWriter::parse_region("0200:300x1", options.region));
+    options.filename = "video_test.y4m";
+    ASSERT_TRUE(VideoWriter::start(options));
+    ASSERT_NE(Bus::frame_end, nullptr);
+    Bus::frame_end();
+    Memory::main_memory[0x200] = 0x30;
+    Bus::frame_end();
+    VideoWriter::stop();
+    EXPECT_EQ(Bus::frame_end, nullptr);
+    EXPECT_EQ(VideoWriter::frames_written + VideoWriter::frames_dropped, 2u);
+
+    std::ifstream file("video_test.y4m", std::ios::binary);
+    const std::string video{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    const size_t header = video.find('\n') + 1;
+    EXPECT_EQ(video.substr(0, header), "YUV4MPEG2 W16 H2 F39375000:655171 Ip A1:1 C444\n");
+    ASSERT_EQ(video.size(), header + VideoWriter::frames_written * (6 + 3 * 32));
+
+    /* Colour 0x0f is black, so Y is 16, the bottom of BT.601's range. 0x30 is (nearly) white, near the top at 235. */
+    EXPECT_EQ(video.substr(header, 6), "FRAME\n");
+    EXPECT_EQ(static_cast<uint8_t>(video[header + 6 + 0x0f]), 16);
+    EXPECT_EQ(static_cast<uint8_t>(video[header + 6 + 32 + 0x0f]), 128);
+    if (VideoWriter::frames_written == 2)
+    {
+        EXPECT_GE(static_cast<uint8_t>(video[header + 2 * 6 + 3 * 32]), 230);
+    }
+}
+
+TEST(Controller, buttonsChangeAtFrameBoundariesAndShiftOut)
+{
+    load_program({});
+    Scheduler::reset();
+    Apu::attach();
+    Controller::buttons = {};
+
+    /* Events wait in the queue until the emulation samples them. */
+    ASSERT_TRUE(Controller::events.try_push(Controller::Event{0, Controller::button_a}));
+    ASSERT_TRUE(Controller::events.try_push(Controller::Event{0, Controller::button_a | Controller::button_start | Controller::button_right}));
+    ASSERT_TRUE(Controller::events.try_push(Controller::Event{1, Controller::button_b}));
+    EXPECT_EQ(Controller::buttons[0], 0);
+    Controller::sample();
+    EXPECT_EQ(Controller::buttons[0], 0x89);
+    EXPECT_EQ(Controller::buttons[1], Controller::button_b);
+
+    /* Strobe, then read A, B, Select, Start, Up, Down, Left, Right, then 1s. */
+    Bus::write(1, 0x4016);
+    Bus::write(0, 0x4016);
+    std::vector<int> bits;
+    for (int i = 0; i < 10; i++)
+    {
+        bits.push_back(Bus::read(0x4016) & 1);
+    }
+    EXPECT_EQ(bits, (std::vector<int>{1, 0, 0, 1, 0, 0, 0, 1, 1, 1}));
+    EXPECT_EQ(Bus::read(0x4017), 0x40);
+    EXPECT_EQ(Bus::read(0x4017), 0x41);
+    Apu::detach();
+    Scheduler::reset();
+}
+
+TEST(RunAhead, undoesFramesRunAhead)
+{
+    /* The program scrolls, polls $2002 and the controller and logs both, and takes an NMI every frame, while pulse 1
+     * plays. */
+    std::vector<uint8_t> program = {
+        0xa2, 0x00,       // LDX #$00
+        0x8e, 0x05, 0x20, // STX $2005
+        0xad, 0x02, 0x20, // LDA $2002
+        0x9d, 0x00, 0x03, // STA $0300,X
+        0xa9, 0x01,       // LDA #$01
+        0x8d, 0x16, 0x40, // STA $4016
+        0xa9, 0x00,       // LDA #$00
+        0x8d, 0x16, 0x40, // STA $4016
+        0xad, 0x16, 0x40, // LDA $4016
+        0x9d, 0x00, 0x04, // STA $0400,X
+        0xe8,             // INX
+        0x4c, 0x02, 0x00, // JMP $0002
+    };
+    program.resize(0x30);
+    program.insert(program.end(), {0xee, 0xf1, 0x00, 0x40}); // NMI: INC $00F1, RTI
+    static std::vector<uint64_t> shown;
+    constexpr uint64_t frames = 6;
+    auto run = [&](const int ahead)
+    {
+        load_program(program);
+        Memory::main_memory[Cpu::nmi_vector] = 0x30;
+        Cpu::I = true;
+        Cpu::irq_lines = 0;
+        Scheduler::reset();
+        fill_ppu_state();
+        Ppu::state.control = 0x80;
+        Ppu::attach();
+        Apu::attach();
+        Bus::write(0x01, 0x4015);
+        Bus::write(0xbf, 0x4000);
+        Bus::write(0x40, 0x4002);
+        Bus::write(0x00, 0x4003);
+        Controller::buttons = {Controller::button_a, 0};
+        int16_t discard;
+        while (Apu::samples.try_pop(discard))
+        {
+        }
+        shown.clear();
+        Ppu::frame_ready = [](const Ppu::State &)
+        { shown.push_back(Ppu::frame_count); };
+
+        RunAhead::frames = ahead;
+        for (uint64_t frame = 1; frame <= frames; frame++)
+        {
+            EXPECT_EQ(RunAhead::run_frame(Clock::active, 0, frame), ReturnCode::CONTINUE);
+        }
+        RunAhead::frames = 0;
+        Ppu::frame_ready = nullptr;
+        Apu::detach();
+        Ppu::detach();
+        std::vector<int16_t> output(20000);
+        output.resize(Apu::samples.try_pop(output.data(), output.size()));
+        return std::make_tuple(Memory::main_memory, Cpu::save_state(), Ppu::state.v, Ppu::state.status, Apu::state.time, output);
+    };
+
+    const auto [plain_memory, plain_cpu, plain_v, plain_status, plain_apu_time, plain_output] = run(0);
+    EXPECT_EQ(shown, (std::vector<uint64_t>{1, 2, 3, 4, 5, 6}));
+    Savestate::stats = {};
+    const auto [ahead_memory, ahead_cpu, ahead_v, ahead_status, ahead_apu_time, ahead_output] = run(2);
+
+    /* The frames shown are two ahead, but what carries on is exactly what ran without run-ahead, audio included. */
+    EXPECT_EQ(shown, (std::vector<uint64_t>{3, 4, 5, 6, 7, 8}));
+    EXPECT_EQ(ahead_memory[0x00f1], frames);
+    EXPECT_TRUE(plain_memory == ahead_memory);
+    EXPECT_EQ(plain_cpu, ahead_cpu);
+    EXPECT_EQ(plain_v, ahead_v);
+    EXPECT_EQ(plain_status, ahead_status);
+    EXPECT_EQ(plain_apu_time, ahead_apu_time);
+    EXPECT_EQ(plain_output, ahead_output);
+
+    /* Only the pages the program writes are copied: zero page, stack and the two logs. */
+    EXPECT_EQ(Savestate::stats.saves, frames);
+    EXPECT_LE(Savestate::stats.pages_copied, 4 * frames);
+    EXPECT_FALSE(Savestate::saved());
+    Scheduler::reset();
+}
+
+TEST(Savestate, hashOnlyRehashesWrittenPages)
+{
+    load_program({0xea});
+    const uint64_t clean = Savestate::hash();
+    const uint64_t hashed = Savestate::stats.pages_hashed;
+    EXPECT_EQ(Savestate::hash(), clean);
+    EXPECT_EQ(Savestate::stats.pages_hashed, hashed);
+
+    /* A write changes the hash, and only its page is hashed again. Writing the byte back restores the hash. */
+    Bus::write(0x12, 0x0345);
+    const uint64_t changed = Savestate::hash();
+    EXPECT_NE(changed, clean);
+    EXPECT_EQ(Savestate::stats.pages_hashed, hashed + 1);
+    Bus::write(0x00, 0x0345);
+    EXPECT_EQ(Savestate::hash(), clean);
+
+    /* Remapping memory is noticed without any write, and the same contents hash the same. */
+    auto copy = Memory::main_memory;
+    copy[0x0345] = 0x12;
+    Memory::map(copy.data());
+    EXPECT_EQ(Savestate::hash(), changed);
+    Memory::map(Memory::main_memory.data());
+    Memory::mark_written(0x00, 0xFF);
+    EXPECT_EQ(Savestate::hash(), clean);
+
+    /* Checkpoints taken in between for something else neither hide writes from the hash nor make it hash everything
+     * again. */
+    const uint64_t before = Memory::checkpoint();
+    Bus::write(0x34, 0x0456);
+    Memory::checkpoint();
+    const uint64_t rehashed = Savestate::stats.pages_hashed;
+    EXPECT_NE(Savestate::hash(), clean);
+    EXPECT_EQ(Savestate::stats.pages_hashed, rehashed + 1);
+    EXPECT_GT(Memory::written_generation[0x04], before);
+}
+
+TEST(Savestate, readRejectsOutOfRangeStates)
+{
+    load_program({0xea});
+    Scheduler::reset();
+    Apu::attach();
+    std::ostringstream out;
+    Savestate::write(out);
+    const std::string state = out.str();
+    Apu::detach();
+
+    /* Offsets of the mapper's mirroring, the last thing written, and of the first pulse channel's duty. */
+    Apu::Snapshot apu;
+    Apu::snapshot(apu);
+    const size_t mirroring = state.size() - sizeof(Cartridge::Snapshot) + offsetof(Cartridge::Snapshot, mirroring);
+    const size_t apu_state = state.size() - sizeof(Cartridge::Snapshot) - sizeof(Controller::Snapshot) - 2 * sizeof(uint64_t) -
+                             3 * sizeof(float) - apu.synth.buffer.size() * sizeof(float) - sizeof(uint64_t) - sizeof(float) -
+                             sizeof(Apu::State);
+    const size_t duty = apu_state + offsetof(Apu::State, pulse) + offsetof(Apu::Pulse, duty);
+    const size_t carry = 8 + sizeof(uint32_t) + sizeof(uint64_t) + offsetof(Cpu::State, C);
+
+    auto read = [&](const size_t offset, const char value)
+    {
+        Apu::attach();
+        std::string corrupted = state;
+        corrupted[offset] = value;
+        std::istringstream in(corrupted);
+        const bool result = Savestate::read(in);
+        Apu::detach();
+        return result;
+    };
+
+    /* A bool holding anything but 0 or 1 is read as true. */
+    Cpu::C = false;
+    EXPECT_TRUE(read(carry, 0x42));
+    EXPECT_TRUE(Cpu::C);
+
+    /* Indexes out of range are refused, and leave the machine as it was. */
+    Cpu::A = 0x33;
+    EXPECT_FALSE(read(mirroring, 0x7F));
+    EXPECT_FALSE(read(duty, 4));
+    EXPECT_EQ(Cpu::A, 0x33);
+    EXPECT_TRUE(read(duty, 3));
+}
+
+TEST(Movie, replayMatchesRecordingAndFindsDivergence)
+{
+    /* The program counts the polls that see A held, and all polls. */
+    const std::vector<uint8_t> program = {
+        0xa9, 0x01,       // LDA #$01
+        0x8d, 0x16, 0x40, // STA $4016
+        0xa9, 0x00,       // LDA #$00
+        0x8d, 0x16, 0x40, // STA $4016
+        0xad, 0x16, 0x40, // LDA $4016
+        0x29, 0x01,       // AND #$01
+        0x18,             // CLC
+        0x65, 0x80,       // ADC $80
+        0x85, 0x80,       // STA $80
+        0xe6, 0x81,       // INC $81
+        0x4c, 0x00, 0x00, // JMP $0000
+    };
+    load_program(program);
+    Cpu::I = true;
+    Scheduler::reset();
+    Apu::attach();
+    Controller::buttons = {};
+
+    /* Run frames the way Bus::run() does. A is pressed from frame 4 to frame 6. */
+    auto run_frames = [](const uint64_t count, const int poke_frame)
+    {
+        const uint64_t start_cycle = Scheduler::now();
+        for (uint64_t frame = 1; frame <= count; frame++)
+        {
+            if (frame == 4 || frame == 7)
+            {
+                Controller::events.try_push(Controller::Event{0, frame == 4 ? Controller::button_a : uint8_t{0}});
+            }
+            Movie::start_frame();
+            EXPECT_EQ(Scheduler::run_until(start_cycle + Clock::frame_end(Clock::active, frame)), ReturnCode::CONTINUE);
+            if (static_cast<int>(frame) == poke_frame)
+            {
+                Bus::write(0x01, 0x0300);
+            }
+            if (!Movie::end_frame())
+            {
+                return frame;
+            }
+        }
+        return count + 1;
+    };
+
+    ASSERT_TRUE(Movie::record("movie_test.mov"));
+    EXPECT_EQ(run_frames(10, 0), 11u);
+    Movie::stop();
+    const auto recorded = Memory::main_memory;
+    EXPECT_GT(recorded[0x80], 0);
+
+    /* Playback starts from the recorded state, whatever the machine was doing, and ignores live input: the events
+     * pushed while it runs never reach the buttons. */
+    Memory::main_memory[0x80] = 0x55;
+    Cpu::instruction_pointer = 0x0100;
+    ASSERT_TRUE(Movie::play("movie_test.mov"));
+    EXPECT_EQ(Memory::main_memory[0x80], 0);
+    EXPECT_EQ(run_frames(20, 0), 10u);
+    EXPECT_EQ(Movie::frames, 10u);
+    EXPECT_EQ(Movie::diverged_frame, 0u);
+    EXPECT_TRUE(Memory::main_memory == recorded);
+
+    /* A write the recording didn't have is caught in the frame it happens. */
+    ASSERT_TRUE(Movie::play("movie_test.mov"));
+    EXPECT_EQ(run_frames(20, 6), 6u);
+    EXPECT_EQ(Movie::diverged_frame, 6u);
+    EXPECT_EQ(Movie::frames, 5u);
+    Movie::stop();
+
+    /* A movie stopped before its first frame has nothing to check against. */
+    ASSERT_TRUE(Movie::record("movie_test.mov"));
+    Movie::stop();
+    EXPECT_FALSE(Movie::play("movie_test.mov"));
+
+    Apu::detach();
+    Scheduler::reset();
+}
+
 int main(int argc, char **argv)
 {
     std::cout.rdbuf(nullptr);
@@ -0,0 +1,225 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "clock.hpp"
+#include "rewrite.hpp"
+#include "spsc_queue.hpp"
+#include "video_writer.hpp"
+
+namespace VideoWriter
+{
+    using FrameQueue = SpscQueue<Frame, queue_frames>;
+    std::unique_ptr<FrameQueue> queue;
+
+    Options active;
+    std::ofstream file;
+    std::thread writer;
+    std::atomic<bool> stopping = false;
+    /** The frame_ready callback that was set before start(), still called for every frame. */
+    void (*previous_frame_ready)(const Ppu::State &frame) = nullptr;
+
+    /** A colour index converted for each format. */
+    struct Colour
+    {
+        std::array<uint8_t, 3> rgb;
+        /** Y, Cb and Cr, in the limited range of BT.601. */
+        std::array<uint8_t, 3> yuv;
+    };
+
+    const std::array<Colour, 64> colours = []()
+    {
+        std::array<Colour, 64> table;
+        for (size_t index = 0; index < table.size(); index++)
+        {
+            const uint32_t rgb = Ppu::rgb_palette[index];
+            const double r = (rgb >> 16) & 0xFF;
+            const double g = (rgb >> 8) & 0xFF;
+            const double b = rgb & 0xFF;
+            auto byte = [](const double value)
+            { return static_cast<uint8_t>(std::lround(value)); };
+            table[index].rgb = {byte(r), byte(g), byte(b)};
+            table[index].yuv = {byte(16.0 + (65.481 * r + 128.553 * g + 24.966 * b) / 255.0),
+                                byte(128.0 + (-37.797 * r - 74.203 * g + 112.0 * b) / 255.0),
+                                byte(128.0 + (112.0 * r - 93.786 * g - 18.214 * b) / 255.0)};
+        }
+        return table;
+    }();
+
+    /** \brief Parse a memory region given as address:WIDTHxHEIGHT, with the address in hex, e.g. 0200:16x16.
+     * \return False if it isn't one, or is larger than a PPU frame.
+     */
+    bool parse_region(const std::string &text, Region &region)
+    {
+        std::istringstream input(text);
+        unsigned address;
+        char colon;
+        char times;
+        Region parsed;
+        if (!(input >> std::hex >> address >> colon >> std::dec >> parsed.width >> times >> parsed.height) ||
+            colon != ':' || times != 'x' || address > 0xFFFF || parsed.width <= 0 || parsed.height <= 0 ||
+            parsed.width > Ppu::width || parsed.width * parsed.height > Ppu::width * Ppu::height)
+        {
+            return false;
+        }
+        parsed.address = static_cast<uint16_t>(address);
+        region = parsed;
+        return true;
+    }
+
+    /** \brief Queue a frame for the writer, or drop it if the queue is full. Called by only one thread at a time. */
+    void submit(const Frame &frame)
+    {
+        if (!queue->try_push(frame))
+        {
+            frames_dropped++;
+        }
+    }
+
+    /** \brief Capture the PPU's frame. Installed as Ppu::frame_ready, so it runs on whichever thread draws frames. */
+    void on_ppu_frame(const Ppu::State &ppu)
+    {
+        Frame frame;
+        frame.width = Ppu::width;
+        frame.height = Ppu::height;
+        frame.pixels = ppu.framebuffer;
+        submit(frame);
+        if (previous_frame_ready != nullptr)
+        {
+            previous_frame_ready(ppu);
+        }
+    }
+
+    /** \brief Capture the memory region as a frame. Installed as Bus::frame_end. Device pages read as zero, so
+     * capturing has no side effects. */
+    void capture_region()
+    {
+        const Region &region = active.region;
+        Frame frame;
+        frame.width = region.width;
+        frame.height = region.height;
+        const size_t size = static_cast<size_t>(region.width * region.height);
+        for (size_t i = 0; i < size; i++)
+        {
+            const uint16_t address = static_cast<uint16_t>(region.address + i);
+            const uint8_t *memory = Memory::pages[address >> 8];
+            frame.pixels[i] = memory != nullptr ? memory[address & 0xFF] : 0;
+        }
+        submit(frame);
+    }
+
+    /** \brief Convert a frame and append it to the file. */
+    void write_frame(const Frame &frame)
+    {
+        const size_t size = static_cast<size_t>(frame.width * frame.height);
+        std::vector<uint8_t> data(size * 3);
+        if (active.format == Format::Y4M)
+        {
+            // Planar: all of Y, then Cb, then Cr.
+            for (size_t i = 0; i < size; i++)
+            {
+                const Colour &colour = colours[frame.pixels[i] & 0x3F];
+                data[i] = colour.yuv[0];
+                data[size + i] = colour.yuv[1];
+                data[2 * size + i] = colour.yuv[2];
+            }
+            file.write("FRAME\n", 6);
+        }
+        else
+        {
+            for (size_t i = 0; i < size; i++)
+            {
+                std::memcpy(&data[3 * i], colours[frame.pixels[i] & 0x3F].rgb.data(), 3);
+            }
+        }
+        file.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+        frames_written++;
+    }
+
+    /** \brief Write every queued frame. */
+    void drain()
+    {
+        auto frame = std::make_unique<Frame>();
+        while (queue->try_pop(*frame))
+        {
+            write_frame(*frame);
+        }
+    }
+
+    /** \brief Start recording, replacing the file if it exists. With the PPU as the source, frames are captured
+     * through Ppu::frame_ready; with a region, through Bus::frame_end, at the end of every frame Bus::run() runs.
+     * \return False if the file couldn't be opened.
+     */
+    bool start(const Options &options)
+    {
+        stop();
+        file.open(options.filename, std::ios::binary | std::ios::trunc);
+        if (!file)
+        {
+            return false;
+        }
+        active = options;
+        frames_written = 0;
+        frames_dropped = 0;
+        if (queue == nullptr)
+        {
+            queue = std::make_unique<FrameQueue>();
+        }
+
+        const bool ppu = active.region.width == 0;
+        if (active.format == Format::Y4M)
+        {
+            const Clock::Rational rate = Clock::reduce(Clock::active.frame_rate);
+            file << "YUV4MPEG2 W" << (ppu ? Ppu::width : active.region.width) << " H"
+                 << (ppu ? Ppu::height : active.region.height) << " F" << rate.numerator << ":" << rate.denominator
+                 << " Ip A1:1 C444\n";
+        }
+        if (ppu)
+        {
+            previous_frame_ready = Ppu::frame_ready;
+            Ppu::frame_ready = on_ppu_frame;
+        }
+        else
+        {
+            Bus::frame_end = capture_region;
+        }
+
+        stopping = false;
+        writer = std::thread([]()
+                             {
+                                 while (!stopping.load(std::memory_order_acquire))
+                                 {
+                                     drain();
+                                     std::this_thread::sleep_for(std::chrono::milliseconds{2});
+                                 }
+                                 drain(); });
+        return true;
+    }
+
+    /** \brief Stop capturing, write what is left in the queue and close the file. If the PPU is the source, its
+     * render thread must have been stopped first. */
+    void stop()
+    {
+        if (!writer.joinable())
+        {
+            return;
+        }
+        if (Ppu::frame_ready == on_ppu_frame)
+        {
+            Ppu::frame_ready = previous_frame_ready;
+        }
+        if (Bus::frame_end == capture_region)
+        {
+            Bus::frame_end = nullptr;
+        }
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+        file.close();
+    }
+}
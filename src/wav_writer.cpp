@@ -0,0 +1,98 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+#include "apu.hpp"
+#include "wav_writer.hpp"
+
+namespace WavWriter
+{
+    std::ofstream file;
+    std::thread writer;
+    std::atomic<bool> stopping = false;
+    uint32_t bytes_written = 0;
+
+    /** \brief Write a little-endian integer of the given size. */
+    void put(const uint32_t value, const int bytes)
+    {
+        for (int i = 0; i < bytes; i++)
+        {
+            file.put(static_cast<char>((value >> (8 * i)) & 0xFF));
+        }
+    }
+
+    /** \brief Write the RIFF header for 16-bit mono PCM, with the sizes of the data written so far. */
+    void write_header()
+    {
+        file.seekp(0);
+        file.write("RIFF", 4);
+        put(36 + bytes_written, 4);
+        file.write("WAVEfmt ", 8);
+        put(16, 4);
+        put(1, 2); // PCM
+        put(1, 2); // Mono
+        put(Apu::sample_rate, 4);
+        put(Apu::sample_rate * 2, 4);
+        put(2, 2);
+        put(16, 2);
+        file.write("data", 4);
+        put(bytes_written, 4);
+        file.seekp(0, std::ios::end);
+    }
+
+    /** \brief Append everything in the sample queue to the file. */
+    void drain()
+    {
+        std::array<int16_t, 4096> block;
+        size_t count;
+        while ((count = Apu::samples.try_pop(block.data(), block.size())) > 0)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                put(static_cast<uint16_t>(block[i]), 2);
+            }
+            bytes_written += static_cast<uint32_t>(count * 2);
+        }
+    }
+
+    /** \brief Start writing samples to a file, replacing it if it exists. The writer is the sample queue's only
+     * consumer while it runs.
+     * \return False if the file couldn't be opened.
+     */
+    bool start(const std::string &filename)
+    {
+        stop();
+        file.open(filename, std::ios::binary | std::ios::trunc);
+        if (!file)
+        {
+            return false;
+        }
+        bytes_written = 0;
+        write_header();
+        stopping = false;
+        writer = std::thread([]()
+                             {
+                                 while (!stopping.load(std::memory_order_acquire))
+                                 {
+                                     drain();
+                                     std::this_thread::sleep_for(std::chrono::milliseconds{10});
+                                 }
+                                 drain(); });
+        return true;
+    }
+
+    /** \brief Write what is left in the queue, finish the header and close the file. */
+    void stop()
+    {
+        if (!writer.joinable())
+        {
+            return;
+        }
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+        write_header();
+        file.close();
+    }
+}